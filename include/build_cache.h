@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+
+#include "checksum.h"
+
+/**
+ * Calculates the build cache key for a file.
+ *
+ * The key covers the canonical path, device, inode, size, modification and
+ * change time of the file, as well as the checksum type, so that any change
+ * to the file results in a different key.
+ *
+ * @param filename file to calculate the key for
+ * @param type checksum type the cached data is calculated with
+ * @param error return location for a GError, or NULL
+ *
+ * @return newly allocated key, or NULL on error
+ */
+gchar *r_build_cache_key(const gchar *filename, GChecksumType type, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Looks up data cached for a key.
+ *
+ * On success, the checksum is updated and, if indexpath is given, the cached
+ * block-hash-index is copied to indexpath.
+ *
+ * @param cachedir build cache directory
+ * @param key key from r_build_cache_key()
+ * @param checksum RaucChecksum to update
+ * @param indexpath path to copy the cached block-hash-index to, or NULL
+ *
+ * @return TRUE if all requested data was found in the cache, FALSE otherwise
+ */
+gboolean r_build_cache_lookup(const gchar *cachedir, const gchar *key, RaucChecksum *checksum, const gchar *indexpath);
+
+/**
+ * Stores data for a key in the cache.
+ *
+ * Failures are reported as warnings only, as the cache is an optimization.
+ *
+ * @param cachedir build cache directory
+ * @param key key from r_build_cache_key()
+ * @param checksum checksum to store
+ * @param indexpath block-hash-index file to store, or NULL
+ */
+void r_build_cache_store(const gchar *cachedir, const gchar *key, const RaucChecksum *checksum, const gchar *indexpath);
@@ -29,6 +29,9 @@ typedef struct {
 	gboolean tls_no_verify;
 	GStrv http_headers;
 	GStrv http_info_headers;
+	guint32 max_concurrency; /* 0 to use the system config */
+	guint64 bandwidth_limit; /* 0 to use the system config */
+	GStrv mirrors; /* alternative URLs of the same bundle */
 } RaucBundleAccessArgs;
 
 typedef struct {
@@ -45,6 +48,8 @@ typedef struct {
 	GBytes *enveloped_data;
 	GBytes *sigdata;
 	gchar *mount_point;
+	/* loop devices providing the aligned images while mounted */
+	GArray *aligned_loopfds;
 	RaucManifest *manifest;
 	gboolean verification_disabled;
 	gboolean signature_verified;
@@ -71,6 +76,11 @@ typedef enum {
 	                                          // will be made to protect against
 	                                          // concurrent modification of the
 	                                          // bundle.
+	CHECK_BUNDLE_USE_CACHE     = BIT(4),      // If set, the verified metadata
+	                                          // of a remote bundle is reused
+	                                          // from a previous check as long
+	                                          // as the server reports the
+	                                          // bundle as unchanged.
 } CheckBundleParams;
 
 /**
@@ -275,6 +285,15 @@ void free_bundle(RaucBundle *bundle);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucBundle, free_bundle);
 
+/**
+ * Drops the verified metadata of remote bundles kept for
+ * CHECK_BUNDLE_USE_CACHE.
+ *
+ * This is needed whenever the configuration or keyring is loaded again, as
+ * the metadata was verified against the previous one.
+ */
+void clear_remote_bundle_cache(void);
+
 /**
  * Frees the memory pointed to by the RaucBundleAccessArgs, but not the
  * structure itself.
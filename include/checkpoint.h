@@ -0,0 +1,80 @@
+#pragma once
+
+#include <glib.h>
+
+#include "manifest.h"
+#include "slot.h"
+
+/* Amount of data written between two durable checkpoints */
+#define R_CHECKPOINT_INTERVAL (64*1024*1024)
+
+/* Tracks the progress of writing an image to a slot, so that an interrupted
+ * installation of the same image can be resumed later. */
+typedef struct {
+	gchar *filename;
+	gchar *bundle_hash;
+	gchar *image_digest;
+	goffset image_size;
+	gchar *device;
+	/* number of bytes known to be written durably */
+	goffset offset;
+	/* hex encoded SHA256 for each completed R_CHECKPOINT_INTERVAL range */
+	GPtrArray *range_hashes;
+	/* state for the range currently being written */
+	GChecksum *range_checksum;
+	goffset range_fill;
+} RaucCheckpoint;
+
+/**
+ * Creates a checkpoint for writing an image to a slot.
+ *
+ * The checkpoint is stored in the slot's data directory.
+ *
+ * @param slot target slot
+ * @param image image to write
+ * @param bundle_hash hash of the bundle containing the image, or NULL
+ *
+ * @return a new RaucCheckpoint or NULL if the slot has no data directory
+ */
+RaucCheckpoint *r_checkpoint_new(const RaucSlot *slot, const RaucImage *image, const gchar *bundle_hash)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Loads a previously saved checkpoint and validates the already written data.
+ *
+ * If the checkpoint was created for the same bundle, image and device, the
+ * data written to the device is read back and compared against the range
+ * hashes stored in the checkpoint.
+ *
+ * @param checkpoint RaucCheckpoint to resume
+ *
+ * @return offset to resume writing from, 0 if no valid checkpoint was found
+ */
+goffset r_checkpoint_resume(RaucCheckpoint *checkpoint);
+
+/**
+ * Accounts data written sequentially to the device.
+ *
+ * Each time a full range was written, the device is synced and the checkpoint
+ * is saved.
+ *
+ * @param checkpoint RaucCheckpoint to update
+ * @param fd file descriptor of the device to sync
+ * @param data data written to the device
+ * @param size size of data
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_checkpoint_update(RaucCheckpoint *checkpoint, int fd, const guint8 *data, gsize size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Removes a saved checkpoint after the image was written completely.
+ *
+ * @param checkpoint RaucCheckpoint to remove
+ */
+void r_checkpoint_remove(RaucCheckpoint *checkpoint);
+
+void r_checkpoint_free(RaucCheckpoint *checkpoint);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucCheckpoint, r_checkpoint_free);
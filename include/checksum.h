@@ -30,6 +30,30 @@ typedef struct {
 gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Called with each chunk of data read by compute_checksum_full().
+ *
+ * @param data data read from the file
+ * @param len length of data
+ * @param user_data user data passed to compute_checksum_full()
+ */
+typedef void (*RChecksumDataFunc)(const guint8 *data, gsize len, gpointer user_data);
+
+/**
+ * Updates RaucChecksum by checksum calculated for given file and passes the
+ * file contents to a callback, so that other data can be derived from the
+ * same read.
+ *
+ * @param checksum RaucChecksum to update
+ * @param filename name of file to calculate checksum for
+ * @param func function to call for each chunk of data, or NULL
+ * @param user_data user data to pass to func
+ * @param error return location for a GError, or NULL
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean compute_checksum_full(RaucChecksum *checksum, const gchar *filename, RChecksumDataFunc func, gpointer user_data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Verifies provided file checksum.
  *
@@ -4,11 +4,27 @@
 
 #include "checksum.h"
 #include "manifest.h"
+#include "resources.h"
 #include "slot.h"
 
 /* Default maximum downloadable bundle size (8 MiB) */
 #define DEFAULT_MAX_BUNDLE_DOWNLOAD_SIZE 8*1024*1024
 
+/* Default block cache size of the streaming server (16 MiB) */
+#define DEFAULT_STREAMING_CACHE_SIZE 16*1024*1024
+/* Default maximum read-ahead window of the streaming server (2 MiB) */
+#define DEFAULT_STREAMING_READ_AHEAD 2*1024*1024
+/* Default number of retries for failed streaming requests */
+#define DEFAULT_STREAMING_MAX_RETRIES 5
+/* Default timeout for connecting to the streaming server (in seconds) */
+#define DEFAULT_STREAMING_CONNECT_TIMEOUT 20
+/* Default number of NBD connections between kernel and streaming server */
+#define DEFAULT_STREAMING_CONNECTIONS 1
+/* Default upper limit for parallel range requests of the streaming server */
+#define DEFAULT_STREAMING_MAX_CONCURRENCY 16
+/* Default size budget of the persistent streaming cache (256 MiB) */
+#define DEFAULT_STREAMING_DISK_CACHE_SIZE 256*1024*1024
+
 typedef enum {
 	R_CONFIG_ERROR_INVALID_FORMAT,
 	R_CONFIG_ERROR_BOOTLOADER,
@@ -54,6 +70,8 @@ typedef struct {
 	gchar *casync_install_args;
 	gboolean use_desync;
 	gboolean activate_installed;
+	/* install slots on distinct storage devices concurrently */
+	gboolean parallel_install;
 	gchar *data_directory;
 	gchar *statusfile_path;
 	gchar *keyring_path;
@@ -80,11 +98,28 @@ typedef struct {
 	gchar *streaming_tls_cert;
 	gchar *streaming_tls_key;
 	gchar *streaming_tls_ca;
+	guint64 streaming_cache_size;
+	guint64 streaming_read_ahead;
+	guint32 streaming_max_streams;
+	guint32 streaming_max_retries;
+	guint32 streaming_connect_timeout; /* seconds */
+	guint32 streaming_request_timeout; /* seconds, 0 for none */
+	guint32 streaming_connections;
+	guint64 streaming_device_max_request;
+	guint64 streaming_device_read_ahead;
+	guint32 streaming_max_concurrency;
+	guint64 streaming_bandwidth_limit; /* bytes/s, 0 for none */
+	gchar *streaming_lan_cache; /* URL prefix of a local cache */
+	gchar *streaming_disk_cache_directory; /* NULL disables the persistent cache */
+	guint64 streaming_disk_cache_size;
 
 	/* encryption */
 	gchar *encryption_key;
 	gchar *encryption_cert;
 
+	/* resource limits for installation */
+	RaucResourceLimits resources;
+
 	GHashTable *slots;
 	/* flag to ensure slot states were determined */
 	gboolean slot_states_determined;
@@ -47,6 +47,7 @@ typedef struct {
 	gchar *signing_keyringpath;
 	gchar *encryption_key;
 	gchar *mksquashfs_args;
+	gchar *build_cache_dir;
 	gchar *casync_args;
 	gchar **recipients;
 	gchar **intermediatepaths;
@@ -149,6 +150,17 @@ void r_context_end_step(const gchar *name, gboolean success);
  */
 void r_context_set_step_percentage(const gchar *name, gint percentage);
 
+/**
+ * Ignores progress updates from the calling thread.
+ *
+ * The progress step stack is not thread-safe, so threads running in parallel
+ * to the one owning the progress steps need to mute their updates and leave
+ * the accounting to the owning thread.
+ *
+ * @param mute TRUE to ignore progress updates from this thread
+ */
+void r_context_mute_progress(gboolean mute);
+
 /**
  * Frees the memory allocated by the RaucProgressStep.
  *
@@ -23,6 +23,25 @@ typedef enum {
  */
 gboolean r_crypt_encrypt(const gchar *in, const gchar *out, const guint8 *key, GError **error);
 
+/**
+ * Creates AES-encrypted image with appended dm-verity hash tree.
+ *
+ * Same as r_crypt_encrypt(), but the encrypted sectors are hashed for
+ * dm-verity as they are produced, so the output does not need to be read
+ * again. The hash tree is appended to the encrypted image.
+ *
+ * @param in input (source) filename
+ * @param out output (encrypted) filename
+ * @param key AES key to use for encryption
+ * @param salt verity salt (of size 32 bytes)
+ * @param root_hash return location for the verity root hash (of size 32 bytes)
+ * @param verity_size return location for the size of the appended hash tree
+ * @param error Return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on error
+ */
+gboolean r_crypt_encrypt_verity(const gchar *in, const gchar *out, const guint8 *key, const guint8 *salt, guint8 *root_hash, guint64 *verity_size, GError **error);
+
 /**
  * Decrypts AES-encrypted image.
  *
@@ -5,6 +5,7 @@
 #include "config_file.h"
 #include "slot.h"
 #include "stats.h"
+#include "zstd_seekable.h"
 
 #define R_HASH_INDEX_ERROR r_hash_index_error_quark()
 GQuark r_hash_index_error_quark(void);
@@ -30,6 +31,7 @@ typedef struct {
 	guint32 invalid_from; /* for new index of target */
 	RaucStats *match_stats; /* how many searches were successful */
 	gboolean skip_hash_check; /* whether to skip the hash check (for bundle payload protected by verity) */
+	RaucZstdSeekable *zstd; /* reader for a seekable zstd image, or NULL to read data_fd directly */
 } RaucHashIndex;
 
 /**
@@ -148,4 +150,51 @@ G_GNUC_WARN_UNUSED_RESULT;
 void r_hash_index_free(RaucHashIndex *idx);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucHashIndex, r_hash_index_free);
 
+/* Calculates chunk hashes for a hash index file from a stream of data */
+typedef struct _RaucHashIndexBuilder RaucHashIndexBuilder;
+
+/**
+ * Creates a builder for a hash index file.
+ *
+ * This allows creating the hash index while the data is read for another
+ * purpose, such as calculating the image checksum.
+ *
+ * @return a newly allocated RaucHashIndexBuilder
+ */
+RaucHashIndexBuilder *r_hash_index_builder_new(void);
+
+/**
+ * Adds data to the hash index builder.
+ *
+ * The data can be passed in pieces of any size.
+ *
+ * @param builder RaucHashIndexBuilder to update
+ * @param data next piece of the indexed data
+ * @param len length of data
+ */
+void r_hash_index_builder_update(RaucHashIndexBuilder *builder, const guint8 *data, gsize len);
+
+/**
+ * Exports the hashes of all data passed to the builder to a file.
+ *
+ * The resulting file is the same as when using r_hash_index_export() on an
+ * index created by r_hash_index_open().
+ *
+ * @param builder RaucHashIndexBuilder to export
+ * @param hashes_filename name of exported file
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_hash_index_builder_export(const RaucHashIndexBuilder *builder, const gchar *hashes_filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees the hash index builder.
+ *
+ * @param builder RaucHashIndexBuilder to free
+ */
+void r_hash_index_builder_free(RaucHashIndexBuilder *builder);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucHashIndexBuilder, r_hash_index_builder_free);
+
 #define R_HASH_INDEX_ZERO_CHUNK "\xad\x7f\xac\xb2\x58\x6f\xc6\xe9\x66\xc0\x4\xd7\xd1\xd1\x6b\x2\x4f\x58\x5\xff\x7c\xb4\x7c\x7a\x85\xda\xbd\x8b\x48\x89\x2c\xa7"
@@ -4,6 +4,7 @@
 
 #include "bundle.h"
 #include "manifest.h"
+#include "resources.h"
 #include "slot.h"
 #include "update_handler.h"
 
@@ -36,6 +37,8 @@ typedef struct {
 	gboolean ignore_compatible;
 	gchar *transaction;
 	RaucBundleAccessArgs access_args;
+	/* overrides for the resource limits from the system config */
+	RaucResourceLimits resources;
 } RaucInstallArgs;
 
 /**
@@ -135,6 +138,9 @@ typedef struct {
 
 	RaucSlot *target_slot;
 	img_to_slot_handler slot_handler;
+
+	/* thread discarding the target slot range before writing, or NULL */
+	GThread *discard_thread;
 } RImageInstallPlan;
 
 void r_image_install_plan_free(gpointer value);
@@ -157,6 +163,21 @@ void r_image_install_plan_free(gpointer value);
 GPtrArray* r_install_make_plans(const RaucManifest *manifest, GHashTable *target_group, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Starts discarding the target slots of all plans which allow it.
+ *
+ * The image writes wait for the discard of their slot, so that it overlaps
+ * with the checks and writes of preceding slots. Before a discard is started,
+ * the slot status is set to 'pending' and its checksum is cleared.
+ *
+ * @param install_plans GPtrArray of RImageInstallPlans
+ * @param error Return location for a GError
+ *
+ * @return TRUE on success, FALSE if a slot status could not be saved
+ */
+gboolean r_install_start_discards(GPtrArray *install_plans, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Checks if header is supported.
  *
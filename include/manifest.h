@@ -31,6 +31,16 @@ typedef struct {
 	gchar* filename;
 	SlotHooks hooks;
 	GStrv adaptive;
+	/* image is stored in sparse image format */
+	gboolean sparse;
+	/* image is stored as independent zstd frames with a seek table */
+	gboolean seekable_zstd;
+	/* image is stored uncompressed and 4 KiB aligned after the squashfs */
+	gboolean aligned;
+	/* offset of an aligned image in the bundle payload */
+	guint64 payload_offset;
+	/* block device providing an aligned image of a mounted bundle */
+	gchar *payload_dev;
 } RaucImage;
 
 typedef enum {
@@ -169,13 +179,21 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucManifest, free_manifest);
  * Checks presence of image and hook files (defined in manifest) in bundle
  * content directory and updates checksums.
  *
+ * For images using the 'block-hash-index' adaptive method, the
+ * <image>.block-hash-index file is created in the content directory while
+ * calculating the checksum.
+ *
+ * Image files present in stagingdir (such as converted images) are used
+ * instead of the ones in the content directory.
+ *
  * @param manifest pointer to the manifest
  * @param dir Directory with the bundle content
+ * @param stagingdir Directory with replacements for image files, or NULL
  * @param error return location for a GError, or NULL
  *
  * @return TRUE on success, FALSE if an error occurred
  */
-gboolean sync_manifest_with_contentdir(RaucManifest *manifest, const gchar *dir, GError **error)
+gboolean sync_manifest_with_contentdir(RaucManifest *manifest, const gchar *dir, const gchar *stagingdir, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
 /**
@@ -191,6 +209,18 @@ G_GNUC_WARN_UNUSED_RESULT;
 GVariant *r_manifest_to_dict(const RaucManifest *manifest)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Returns the path to read the image data from.
+ *
+ * For aligned images of a mounted bundle, this is the loop device providing
+ * the image from the payload, otherwise the image filename.
+ *
+ * @param image image to return the data path for
+ *
+ * @return path of the image data
+ */
+const gchar *r_image_get_data_path(const RaucImage *image);
+
 /**
  * Frees a rauc image
  */
@@ -66,6 +66,23 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset size, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Setup a loopback device for a part of a file.
+ *
+ * Like r_setup_loop(), but the loop device starts at the given offset.
+ *
+ * @param fd file descriptor of file to mount
+ * @param offset offset of the first byte accessible via the loop device
+ * @param loopfd_out file descriptor of the open loop device
+ * @param loopname_out device name of loop device
+ * @param size limit accessible size of file
+ * @param error return location for a GError, or NULL
+ *
+ * @return True if succeeded, False if failed
+ */
+gboolean r_setup_loop_offset(gint fd, goffset offset, gint *loopfd_out, gchar **loopname_out, goffset size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Unmount a slot or a file.
  *
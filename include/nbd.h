@@ -3,7 +3,8 @@
 #include <glib.h>
 #include <gio/gio.h>
 
-/* FD used to pass the open NBD socket to the server process */
+/* FD used to pass the open NBD socket to the server process, sockets for
+ * additional connections follow on the next FDs */
 #define RAUC_SOCKET_FD 3
 
 #define R_NBD_ERROR r_nbd_error_quark()
@@ -24,10 +25,14 @@ typedef struct {
 	gboolean index_valid;
 	gchar *dev;
 	guint64 data_size;
+	GArray *extra_socks; /* additional connections (gint) */
+	guint64 max_request; /* maximum request size in bytes, 0 for the default */
+	guint64 read_ahead; /* block device read-ahead in bytes, 0 for the default */
 } RaucNBDDevice;
 
 typedef struct {
 	gint sock; /* client side socket */
+	GArray *extra_socks; /* client side sockets of additional connections (gint) */
 	GSubprocess *sproc;
 
 	/* configuration */
@@ -38,12 +43,30 @@ typedef struct {
 	gboolean tls_no_verify;
 	GStrv headers; /* array of strings such as 'Foo: bar' */
 	GStrv info_headers; /* array of strings such as 'Foo: bar' */
+	guint64 cache_size; /* block cache budget in bytes, 0 disables caching */
+	guint64 read_ahead; /* maximum read-ahead window in bytes */
+	guint32 max_streams; /* maximum concurrent HTTP/2 streams, 0 for the default */
+	guint32 max_retries; /* retries for each failed request */
+	guint32 connect_timeout; /* seconds */
+	guint32 request_timeout; /* seconds, 0 for none */
+	guint32 connections; /* number of connections for the kernel */
+	guint32 max_concurrency; /* upper limit for parallel range requests */
+	guint64 bandwidth_limit; /* bytes/s, 0 for none */
+	GStrv mirrors; /* alternative URLs of the same bundle */
+	gchar *lan_cache; /* URL prefix of a local cache, tried first */
+	gchar *disk_cache_dir; /* persistent block cache, NULL to disable */
+	guint64 disk_cache_size; /* size budget of the persistent cache in bytes */
+	gchar *if_none_match; /* entity tag of a previously checked bundle */
+	guint64 if_modified_since; /* last-modified of a previously checked bundle */
+	guint64 cached_size; /* size of the previously checked bundle */
 
 	/* discovered information */
 	guint64 data_size; /* bundle size */
 	gchar *effective_url; /* url after redirects */
 	guint64 current_time; /* date header from server */
 	guint64 modified_time; /* last-modified header from server */
+	gchar *etag; /* entity tag header from server */
+	gboolean not_modified; /* bundle unchanged since the previous check */
 } RaucNBDServer;
 
 RaucNBDDevice *r_nbd_new_device(void);
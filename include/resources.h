@@ -0,0 +1,113 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_RESOURCES_ERROR r_resources_error_quark()
+GQuark r_resources_error_quark(void);
+
+typedef enum {
+	R_RESOURCES_ERROR_INVALID,
+	R_RESOURCES_ERROR_IOPRIO,
+	R_RESOURCES_ERROR_NICE,
+	R_RESOURCES_ERROR_AFFINITY,
+} RResourcesError;
+
+/* I/O scheduling classes, values match the kernel's IOPRIO_CLASS_* */
+typedef enum {
+	R_IO_CLASS_NONE = 0,
+	R_IO_CLASS_REALTIME = 1,
+	R_IO_CLASS_BEST_EFFORT = 2,
+	R_IO_CLASS_IDLE = 3,
+} RIOClass;
+
+/* Resource limits applied to an installation */
+typedef struct {
+	/* I/O scheduling class, R_IO_CLASS_NONE leaves it unchanged */
+	RIOClass io_class;
+	/* priority within the I/O class (0-7), -1 for the class default */
+	gint io_priority;
+	/* maximum write rate in bytes per second, 0 for unlimited */
+	guint64 write_bandwidth;
+	gboolean nice_set;
+	gint nice;
+	/* list of CPUs the installation may run on, NULL for no restriction */
+	gint *cpu_affinity;
+	gsize cpu_affinity_len;
+} RaucResourceLimits;
+
+/**
+ * Initializes resource limits to 'no limits'.
+ *
+ * @param limits RaucResourceLimits to initialize
+ */
+void r_resources_init(RaucResourceLimits *limits);
+
+/**
+ * Frees the content of resource limits and resets them to 'no limits'.
+ *
+ * @param limits RaucResourceLimits to clear
+ */
+void r_resources_clear(RaucResourceLimits *limits);
+
+/**
+ * Overrides the limits in dest with all limits set in src.
+ *
+ * @param dest RaucResourceLimits to update
+ * @param src RaucResourceLimits to take set values from
+ */
+void r_resources_merge(RaucResourceLimits *dest, const RaucResourceLimits *src);
+
+/**
+ * Parses an I/O scheduling class name.
+ *
+ * Supported are 'none', 'realtime', 'best-effort' and 'idle'.
+ *
+ * @param name class name to parse
+ * @param io_class return location for the parsed class
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the name is valid, FALSE otherwise
+ */
+gboolean r_resources_parse_io_class(const gchar *name, RIOClass *io_class, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Checks resource limits for valid ranges.
+ *
+ * @param limits RaucResourceLimits to check
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if all limits are valid, FALSE otherwise
+ */
+gboolean r_resources_check(const RaucResourceLimits *limits, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Applies resource limits to the calling thread and enables write throttling.
+ *
+ * I/O priority, nice value and CPU affinity are per-thread attributes on
+ * Linux, so this only affects the calling thread and any processes spawned
+ * from it afterwards (such as the streaming helper, casync or mkfs).
+ *
+ * @param limits RaucResourceLimits to apply
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if all limits were applied, FALSE otherwise
+ */
+gboolean r_resources_apply(const RaucResourceLimits *limits, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Disables write throttling enabled by r_resources_apply().
+ */
+void r_resources_reset(void);
+
+/**
+ * Accounts size bytes against the write bandwidth limit.
+ *
+ * Blocks as long as needed to keep the average write rate below the
+ * configured limit. Returns immediately if no limit is active.
+ *
+ * @param size number of bytes written (or about to be written)
+ */
+void r_resources_throttle_write(gsize size);
@@ -45,6 +45,13 @@ typedef enum {
 gboolean signature_init(GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Frees resources allocated for signature verification.
+ *
+ * Verification can be used again afterwards.
+ */
+void signature_cleanup(void);
+
 /**
  * Prepare an OpenSSL X509_STORE for signature verification.
  *
@@ -142,8 +149,7 @@ G_GNUC_WARN_UNUSED_RESULT;
 /**
  * Verify detached and inline signatures.
  *
- * This function is only used by the tests and internally for cms_verify_fd and
- * cms_verify_sig.
+ * This function is only used by the tests and internally for cms_verify_sig.
  *
  * @param content content to verify against signature, or NULL (for inline signature)
  * @param sig signature used to verify
@@ -160,6 +166,9 @@ G_GNUC_WARN_UNUSED_RESULT;
 /**
  * Verify detached signature for given file.
  *
+ * The content is read in chunks through a fixed size buffer, so memory usage
+ * does not depend on the file size.
+ *
  * @param fd file descriptor to verify against signature
  * @param sig signature used to verify
  * @param limit size of content to use, 0 if all should be included
@@ -49,6 +49,8 @@ typedef struct _RaucSlot {
 	gchar *extra_mount_opts;
 	/** flag indicating to resize after writing (only for ext4) */
 	gboolean resize;
+	/** flag indicating to discard the slot range covered by the image before writing */
+	gboolean pre_discard;
 	/** start address of first boot-partition (for boot-mbr-switch, boot-gpt-switch and boot-raw-fallback) */
 	guint64 region_start;
 	/** size of both partitions(for boot-mbr-switch, boot-gpt-switch and boot-raw-fallback) */
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_SPARSE_ERROR r_sparse_error_quark()
+GQuark r_sparse_error_quark(void);
+
+typedef enum {
+	R_SPARSE_ERROR_INVALID,
+	R_SPARSE_ERROR_FAILED,
+} RSparseError;
+
+/* Block size used when creating sparse images */
+#define R_SPARSE_DEFAULT_BLOCK_SIZE 4096
+
+/* Information from the header of an (Android) sparse image */
+typedef struct {
+	guint32 block_size;
+	guint32 total_blocks;
+	guint32 total_chunks;
+	guint16 file_header_size;
+	guint16 chunk_header_size;
+} RaucSparseHeader;
+
+/**
+ * Checks whether the file referred to by fd starts with a sparse image header.
+ *
+ * @param fd file descriptor to check
+ *
+ * @return TRUE if the file is a sparse image, FALSE otherwise
+ */
+gboolean r_sparse_is_sparse(int fd);
+
+/**
+ * Reads and validates the header of a sparse image.
+ *
+ * @param fd file descriptor of the sparse image
+ * @param header return location for the header information
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_sparse_read_header(int fd, RaucSparseHeader *header, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the size of the image described by a sparse image header.
+ *
+ * @param header sparse image header
+ *
+ * @return expanded size in bytes
+ */
+goffset r_sparse_get_size(const RaucSparseHeader *header);
+
+/**
+ * Writes a sparse image to a device or file.
+ *
+ * Data chunks are written at their offsets, fill chunks are written as
+ * pattern (zero fills are done with BLKZEROOUT if supported) and
+ * "don't care" chunks are skipped.
+ *
+ * Progress is reported on the 'copy_image' step.
+ *
+ * @param in_fd file descriptor of the sparse image, positioned at its start
+ * @param out_fd file descriptor of the target
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_sparse_write(int in_fd, int out_fd, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Creates a sparse image from a regular image.
+ *
+ * Blocks consisting of a repeated 32 bit pattern (such as zeros) are stored
+ * as fill chunks, all other blocks as data chunks.
+ *
+ * @param inpath path of the regular image, its size must be a multiple of
+ *        R_SPARSE_DEFAULT_BLOCK_SIZE
+ * @param outpath path of the sparse image to create
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_sparse_create(const gchar *inpath, const gchar *outpath, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
@@ -21,6 +21,36 @@ G_GNUC_WARN_UNUSED_RESULT;
 img_to_slot_handler get_update_handler(RaucImage *mfimage, RaucSlot  *dest_slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Checks whether the slot range to be written by an image may be discarded
+ * before the installation.
+ *
+ * This is only the case if the slot has 'pre-discard' enabled and the image
+ * is written completely by the given handler, without using the previous
+ * slot content.
+ *
+ * @param handler update handler selected for image and slot
+ * @param image image to install
+ * @param slot target slot
+ *
+ * @return TRUE if the slot may be discarded, FALSE otherwise
+ */
+gboolean r_update_handler_can_discard(img_to_slot_handler handler, const RaucImage *image, const RaucSlot *slot);
+
+/**
+ * Discards the range of the slot device which will be overwritten by the image.
+ *
+ * Devices which do not support discard are skipped silently.
+ *
+ * @param image image to install
+ * @param slot target slot
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_update_handler_discard_slot(const RaucImage *image, const RaucSlot *slot, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 struct boot_switch_partition {
 	guint64 start;          /* address in bytes */
 	guint64 size;           /* size in bytes */
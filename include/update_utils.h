@@ -3,6 +3,8 @@
 #include <gio/gio.h>
 #include <glib.h>
 
+#include "checkpoint.h"
+
 /* These functions can be used by slot and artifact update handlers. */
 
 /**
@@ -20,3 +22,22 @@
 gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
 		goffset size, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Copies data from an input stream to an output stream like
+ * r_copy_stream_with_progress(), while recording durable checkpoints.
+ *
+ * The streams must already be positioned at the checkpoint's offset.
+ *
+ * @param in_stream input stream
+ * @param out_stream output stream
+ * @param size expected total size of the data (including already written data)
+ * @param checkpoint RaucCheckpoint to update
+ * @param fd file descriptor underlying out_stream, used for syncing
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if copying was successful, FALSE otherwise
+ */
+gboolean r_copy_stream_with_checkpoint(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, RaucCheckpoint *checkpoint, int fd, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
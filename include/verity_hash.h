@@ -3,6 +3,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+/* Size of data and hash blocks */
+#define R_VERITY_BLOCK_SIZE 4096
+/* Size of a (SHA256) digest */
+#define R_VERITY_DIGEST_SIZE 32
+
 /**
  * Creates a dm-verity hash (tree)
  *
@@ -36,3 +41,44 @@ int r_verity_hash_verify(
 		uint64_t data_blocks,
 		uint8_t *root_hash,
 		const uint8_t *salt);
+
+/**
+ * Calculates the dm-verity digests of consecutive data blocks
+ *
+ * @param data data blocks (of size 4096 bytes) to hash
+ * @param count number of data blocks
+ * @param digests return location for count digests (of size 32 bytes)
+ * @param salt used for creation
+ *
+ * @return 0 on success, error code otherwise
+ */
+int r_verity_hash_data_blocks(
+		const uint8_t *data,
+		uint64_t count,
+		uint8_t *digests,
+		const uint8_t *salt);
+
+/**
+ * Creates a dm-verity hash (tree) from the digests of all data blocks
+ *
+ * This produces the same hash tree as r_verity_hash_create(), but without
+ * reading the data blocks again. The hash levels are built in memory and
+ * written after the data blocks.
+ *
+ * @param fd file descriptor (FD) of file to append the verity hash tree to
+ * @param data_blocks number of data blocks (of size 4096 bytes)
+ * @param digests digests of all data blocks, as calculated by
+ *        r_verity_hash_data_blocks()
+ * @param combined_blocks return location for number of combined blocks (data+hash) (of size 4096 bytes)
+ * @param root_hash return location for calculated root hash
+ * @param salt used for creation
+ *
+ * @return 0 on success, error code otherwise
+ */
+int r_verity_hash_create_from_digests(
+		int fd,
+		uint64_t data_blocks,
+		const uint8_t *digests,
+		uint64_t *combined_blocks,
+		uint8_t *root_hash,
+		const uint8_t *salt);
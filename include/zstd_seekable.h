@@ -0,0 +1,118 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_ZSTD_ERROR r_zstd_error_quark()
+GQuark r_zstd_error_quark(void);
+
+typedef enum {
+	R_ZSTD_ERROR_INVALID,
+	R_ZSTD_ERROR_FAILED,
+} RZstdError;
+
+/* Uncompressed size of the frames created by r_zstd_seekable_create() */
+#define R_ZSTD_FRAME_SIZE (1024*1024)
+
+/* Limit for the uncompressed size of a single frame when reading */
+#define R_ZSTD_MAX_FRAME_SIZE (64*1024*1024)
+
+/* An opened seekable zstd image (see r_zstd_seekable_open()) */
+typedef struct _RaucZstdSeekable RaucZstdSeekable;
+
+/**
+ * Checks whether the file referred to by fd is a valid seekable zstd image.
+ *
+ * The complete seek table is validated as done by r_zstd_seekable_open().
+ *
+ * @param fd file descriptor to check
+ *
+ * @return TRUE if the file is a seekable zstd image, FALSE otherwise
+ */
+gboolean r_zstd_is_seekable(int fd);
+
+/**
+ * Reads and validates the seek table of a seekable zstd image.
+ *
+ * The image consists of independent zstd frames followed by a skippable
+ * frame containing the compressed and uncompressed size of each frame, as
+ * described by the zstd 'seekable format'.
+ *
+ * The returned object is not thread-safe and does not take ownership of fd,
+ * which must stay open until the object is freed.
+ *
+ * @param fd file descriptor of the image
+ * @param error return location for a GError, or NULL
+ *
+ * @return a new RaucZstdSeekable or NULL on error
+ */
+RaucZstdSeekable *r_zstd_seekable_open(int fd, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the uncompressed size of a seekable zstd image.
+ *
+ * @param zs opened seekable zstd image
+ *
+ * @return uncompressed size in bytes
+ */
+guint64 r_zstd_seekable_get_size(const RaucZstdSeekable *zs);
+
+/**
+ * Reads uncompressed data from a seekable zstd image.
+ *
+ * Only the frames covering the requested range are decompressed. The last
+ * decompressed frame is cached, so sequential reads decompress each frame
+ * only once.
+ *
+ * @param zs opened seekable zstd image
+ * @param data buffer to fill
+ * @param size number of bytes to read
+ * @param offset uncompressed offset to read from
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_zstd_seekable_pread(RaucZstdSeekable *zs, guint8 *data, gsize size, guint64 offset, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Writes the uncompressed content of a seekable zstd image to a device or
+ * file.
+ *
+ * Frames are decompressed by one worker thread per CPU and written directly
+ * at their uncompressed offsets.
+ *
+ * Progress is reported on the 'copy_image' step.
+ *
+ * @param zs opened seekable zstd image
+ * @param out_fd file descriptor of the target
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_zstd_seekable_write(RaucZstdSeekable *zs, int out_fd, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees a RaucZstdSeekable. The file descriptor is not closed.
+ *
+ * @param zs RaucZstdSeekable to free
+ */
+void r_zstd_seekable_free(RaucZstdSeekable *zs);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucZstdSeekable, r_zstd_seekable_free);
+
+/**
+ * Creates a seekable zstd image from a regular image.
+ *
+ * The input is compressed in independent frames of R_ZSTD_FRAME_SIZE bytes,
+ * followed by the seek table.
+ *
+ * @param inpath path of the regular image
+ * @param outpath path of the seekable zstd image to create
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_zstd_seekable_create(const gchar *inpath, const gchar *outpath, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
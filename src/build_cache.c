@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <sys/stat.h>
+
+#include "build_cache.h"
+#include "utils.h"
+
+#define BUILD_CACHE_GROUP "checksum"
+
+gchar *r_build_cache_key(const gchar *filename, GChecksumType type, GError **error)
+{
+	g_autoptr(GChecksum) ctx = g_checksum_new(G_CHECKSUM_SHA256);
+	g_autofree gchar *canonical = NULL;
+	g_autofree gchar *id = NULL;
+	GStatBuf st;
+
+	g_return_val_if_fail(filename, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	canonical = r_realpath(filename);
+	if (!canonical) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to resolve %s: %s", filename, g_strerror(err));
+		return NULL;
+	}
+
+	if (g_stat(canonical, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", canonical, g_strerror(err));
+		return NULL;
+	}
+
+	/* the change time cannot be set from userspace, so it also catches
+	 * modifications which restore the modification time */
+	id = g_strdup_printf("%s\n%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT "\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT ".%09ld\n%" G_GINT64_FORMAT ".%09ld\n%d",
+			canonical, (guint64)st.st_dev, (guint64)st.st_ino, (gint64)st.st_size,
+			(gint64)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			(gint64)st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+			type);
+	g_checksum_update(ctx, (const guchar *)id, -1);
+
+	return g_strdup(g_checksum_get_string(ctx));
+}
+
+static gboolean copy_file(const gchar *src, const gchar *dest, GError **error)
+{
+	g_autoptr(GFile) srcfile = g_file_new_for_path(src);
+	g_autoptr(GFile) destfile = g_file_new_for_path(dest);
+
+	return g_file_copy(srcfile, destfile, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, error);
+}
+
+gboolean r_build_cache_lookup(const gchar *cachedir, const gchar *key, RaucChecksum *checksum, const gchar *indexpath)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *entrypath = NULL;
+	g_autofree gchar *cached_indexpath = NULL;
+	g_autofree gchar *digest = NULL;
+	gint64 size;
+	gint type = 0;
+
+	g_return_val_if_fail(cachedir, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
+
+	entrypath = g_strdup_printf("%s/%s.checksum", cachedir, key);
+	if (!g_key_file_load_from_file(key_file, entrypath, G_KEY_FILE_NONE, NULL))
+		return FALSE;
+
+	digest = g_key_file_get_string(key_file, BUILD_CACHE_GROUP, "digest", NULL);
+	size = g_key_file_get_int64(key_file, BUILD_CACHE_GROUP, "size", &ierror);
+	if (!ierror)
+		type = g_key_file_get_integer(key_file, BUILD_CACHE_GROUP, "type", &ierror);
+	if (!digest || ierror) {
+		g_message("Ignoring invalid build cache entry %s", entrypath);
+		return FALSE;
+	}
+
+	if (indexpath) {
+		cached_indexpath = g_strdup_printf("%s/%s.block-hash-index", cachedir, key);
+		if (!g_file_test(cached_indexpath, G_FILE_TEST_IS_REGULAR))
+			return FALSE;
+		if (!copy_file(cached_indexpath, indexpath, &ierror)) {
+			g_message("Failed to use cached block-hash-index: %s", ierror->message);
+			return FALSE;
+		}
+	}
+
+	g_clear_pointer(&checksum->digest, g_free);
+	checksum->digest = g_steal_pointer(&digest);
+	checksum->size = size;
+	checksum->type = type;
+
+	return TRUE;
+}
+
+void r_build_cache_store(const gchar *cachedir, const gchar *key, const RaucChecksum *checksum, const gchar *indexpath)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *entrypath = NULL;
+	g_autofree gchar *cached_indexpath = NULL;
+	g_autofree gchar *tmppath = NULL;
+
+	g_return_if_fail(cachedir);
+	g_return_if_fail(key);
+	g_return_if_fail(checksum);
+
+	if (g_mkdir_with_parents(cachedir, 0755) != 0) {
+		int err = errno;
+		g_warning("Failed to create build cache directory %s: %s", cachedir, g_strerror(err));
+		return;
+	}
+
+	/* store the index first, an entry is only used with its index */
+	if (indexpath) {
+		cached_indexpath = g_strdup_printf("%s/%s.block-hash-index", cachedir, key);
+		tmppath = g_strconcat(cached_indexpath, ".tmp", NULL);
+		if (!copy_file(indexpath, tmppath, &ierror)) {
+			g_warning("Failed to store block-hash-index in build cache: %s", ierror->message);
+			g_remove(tmppath);
+			return;
+		}
+		if (g_rename(tmppath, cached_indexpath) != 0) {
+			int err = errno;
+			g_warning("Failed to store block-hash-index in build cache: %s", g_strerror(err));
+			g_remove(tmppath);
+			return;
+		}
+	}
+
+	g_key_file_set_string(key_file, BUILD_CACHE_GROUP, "digest", checksum->digest);
+	g_key_file_set_int64(key_file, BUILD_CACHE_GROUP, "size", checksum->size);
+	g_key_file_set_integer(key_file, BUILD_CACHE_GROUP, "type", checksum->type);
+
+	entrypath = g_strdup_printf("%s/%s.checksum", cachedir, key);
+	if (!g_key_file_save_to_file(key_file, entrypath, &ierror))
+		g_warning("Failed to store checksum in build cache: %s", ierror->message);
+}
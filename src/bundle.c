@@ -2,9 +2,12 @@
 #include <gio/gio.h>
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gunixmounts.h>
+#include <glib-unix.h>
 #include <glib/gstdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/vfs.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -22,6 +25,8 @@
 #include "verity_hash.h"
 #include "nbd.h"
 #include "hash_index.h"
+#include "sparse.h"
+#include "zstd_seekable.h"
 
 /* from statfs(2) man page, as linux/magic.h may not have all of them */
 #ifndef AFS_SUPER_MAGIC
@@ -100,12 +105,124 @@ r_bundle_error_quark(void)
 	return g_quark_from_static_string("r-bundle-error-quark");
 }
 
-static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, GError **error)
+/* Files replacing their counterparts from the content directory in the
+ * payload, so that bundle creation does not modify the user's files. */
+typedef struct {
+	gchar *dir;
+	GPtrArray *files; /* paths relative to the content directory */
+} RBundleStaging;
+
+static void staging_free(RBundleStaging *staging)
+{
+	if (!staging)
+		return;
+
+	if (staging->dir && !rm_tree(staging->dir, NULL))
+		g_warning("Failed to remove staging directory %s", staging->dir);
+	g_free(staging->dir);
+	g_ptr_array_unref(staging->files);
+	g_free(staging);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RBundleStaging, staging_free);
+
+/* Creates the staging directory next to the bundle, as converted images can
+ * be too large for /tmp. */
+static RBundleStaging *staging_new(const gchar *bundlename, GError **error)
+{
+	g_autoptr(RBundleStaging) staging = g_new0(RBundleStaging, 1);
+	g_autofree gchar *dirname = g_path_get_dirname(bundlename);
+
+	staging->files = g_ptr_array_new_with_free_func(g_free);
+	staging->dir = g_build_filename(dirname, ".rauc-staging-XXXXXX", NULL);
+	if (!g_mkdtemp(staging->dir)) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create staging directory in %s: %s", dirname, g_strerror(err));
+		g_clear_pointer(&staging->dir, g_free);
+		return NULL;
+	}
+
+	return g_steal_pointer(&staging);
+}
+
+/* Returns the path to write the replacement for filename to. */
+static gchar *staging_add(RBundleStaging *staging, const gchar *filename, GError **error)
+{
+	g_autofree gchar *path = g_build_filename(staging->dir, filename, NULL);
+	g_autofree gchar *parent = g_path_get_dirname(path);
+
+	if (g_mkdir_with_parents(parent, 0755) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create staging directory %s: %s", parent, g_strerror(err));
+		return NULL;
+	}
+
+	if (!g_ptr_array_find_with_equal_func(staging->files, filename, g_str_equal, NULL))
+		g_ptr_array_add(staging->files, g_strdup(filename));
+
+	return g_steal_pointer(&path);
+}
+
+/* Returns the path of filename as it will be stored in the payload. */
+static gchar *staging_get_path(const RBundleStaging *staging, const gchar *contentdir, const gchar *filename)
+{
+	if (staging && g_ptr_array_find_with_equal_func(staging->files, filename, g_str_equal, NULL))
+		return g_build_filename(staging->dir, filename, NULL);
+
+	return g_build_filename(contentdir, filename, NULL);
+}
+
+/* Writes lines to a new temporary file for use as a mksquashfs argument. */
+static gchar *write_mksquashfs_list(const gchar *name, GString *list, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *template = g_strdup_printf("rauc-%s-XXXXXX", name);
+	g_autofree gchar *path = NULL;
+	gint fd;
+
+	fd = g_file_open_tmp(template, &path, &ierror);
+	if (fd < 0) {
+		g_propagate_prefixed_error(error, ierror,
+				"Failed to create mksquashfs %s file: ", name);
+		return NULL;
+	}
+	g_close(fd, NULL);
+
+	if (!g_file_set_contents(path, list->str, list->len, &ierror)) {
+		g_propagate_prefixed_error(error, ierror,
+				"Failed to write mksquashfs %s file: ", name);
+		g_unlink(path);
+		return NULL;
+	}
+
+	return g_steal_pointer(&path);
+}
+
+/*
+ * Runs mksquashfs to create the bundle payload.
+ *
+ * @param bundlename path of the payload to create
+ * @param contentdir directory to pack
+ * @param excludes paths relative to contentdir to leave out of the payload,
+ *        or NULL
+ * @param staging files to store instead of their counterparts in contentdir,
+ *        or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, GPtrArray *excludes, const RBundleStaging *staging, GError **error)
 {
 	g_autoptr(GSubprocess) sproc = NULL;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 	g_autoptr(GPtrArray) args = g_ptr_array_new_full(7, g_free);
+	g_autoptr(GString) exclude_list = g_string_new(NULL);
+	g_autoptr(GString) pseudo_list = g_string_new(NULL);
+	g_autofree gchar *excludefile = NULL;
+	g_autofree gchar *pseudofile = NULL;
 
 	g_return_val_if_fail(bundlename != NULL, FALSE);
 	g_return_val_if_fail(contentdir != NULL, FALSE);
@@ -126,6 +243,49 @@ static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, GEr
 	g_ptr_array_add(args, g_strdup("-no-progress"));
 	g_ptr_array_add(args, g_strdup("-no-xattrs"));
 
+	for (guint i = 0; excludes && i < excludes->len; i++)
+		g_string_append_printf(exclude_list, "%s\n", (gchar *)g_ptr_array_index(excludes, i));
+
+	/* staged files are added as pseudo files, which requires excluding the
+	 * original from the content directory */
+	for (guint i = 0; staging && i < staging->files->len; i++) {
+		const gchar *filename = g_ptr_array_index(staging->files, i);
+		g_autofree gchar *path = NULL;
+		g_autofree gchar *quoted = NULL;
+
+		if (excludes && g_ptr_array_find_with_equal_func(excludes, filename, g_str_equal, NULL))
+			continue;
+
+		path = g_build_filename(staging->dir, filename, NULL);
+		quoted = g_shell_quote(path);
+		g_string_append_printf(exclude_list, "%s\n", filename);
+		g_string_append_printf(pseudo_list, "%s f 644 0 0 cat %s\n", filename, quoted);
+	}
+
+	/* '-e' would consume all remaining arguments, so use an exclude file */
+	if (exclude_list->len) {
+		excludefile = write_mksquashfs_list("exclude", exclude_list, &ierror);
+		if (!excludefile) {
+			res = FALSE;
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		g_ptr_array_add(args, g_strdup("-ef"));
+		g_ptr_array_add(args, g_strdup(excludefile));
+	}
+
+	if (pseudo_list->len) {
+		pseudofile = write_mksquashfs_list("pseudo", pseudo_list, &ierror);
+		if (!pseudofile) {
+			res = FALSE;
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		g_ptr_array_add(args, g_strdup("-pf"));
+		g_ptr_array_add(args, g_strdup(pseudofile));
+	}
 
 	if (r_context()->mksquashfs_args != NULL) {
 		g_auto(GStrv) mksquashfs_argvp = NULL;
@@ -163,6 +323,10 @@ static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, GEr
 
 	res = TRUE;
 out:
+	if (excludefile)
+		g_unlink(excludefile);
+	if (pseudofile)
+		g_unlink(pseudofile);
 	r_context_end_step("mksquashfs", res);
 	return res;
 }
@@ -416,64 +580,25 @@ static gboolean image_is_archive(RaucImage* image)
 	return FALSE;
 }
 
-static gboolean generate_adaptive_data(RaucManifest *manifest, const gchar *dir, GError **error)
+/* Checks the adaptive methods of all images before the bundle is built.
+ * The block-hash-index files themselves are created by
+ * sync_manifest_with_contentdir() while calculating the image checksums. */
+static gboolean check_adaptive_methods(RaucManifest *manifest, GError **error)
 {
-	GError *ierror = NULL;
-
 	g_return_val_if_fail(manifest, FALSE);
-	g_return_val_if_fail(dir, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
 		RaucImage *image = elem->data;
-		g_autofree gchar *imagepath = g_build_filename(dir, image->filename, NULL);
 
 		if (!image->adaptive)
 			continue;
 
 		for (gchar **method = image->adaptive; *method != NULL; method++) {
 			if (g_str_equal(*method, "block-hash-index")) {
-				/* Use a filename of bundle/<image-name>.block-hash-index. */
-				g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
-				g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
-				g_autoptr(RaucHashIndex) index = NULL;
-				int fd = -1;
-
 				if (image_is_archive(image)) {
 					g_warning("Generating block hash index requires a block device image but %s looks like an archive", image->filename);
 				}
-
-				fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
-				if (fd < 0) {
-					int err = errno;
-					g_set_error(
-							error,
-							G_IO_ERROR,
-							g_io_error_from_errno(err),
-							"Failed to open image: %s", image->filename);
-					return FALSE;
-				}
-
-				index = r_hash_index_open("image", fd, NULL, &ierror);
-				if (!index) {
-					g_propagate_prefixed_error(
-							error,
-							ierror,
-							"Failed to generate hash index for %s: ", image->filename);
-					g_close(fd, NULL);
-					return FALSE;
-				}
-
-				if (!r_hash_index_export(index, indexpath, &ierror)) {
-					g_propagate_prefixed_error(
-							error,
-							ierror,
-							"Failed to write hash index for %s: ", image->filename);
-					g_close(fd, NULL);
-					return FALSE;
-				}
-
-				g_debug("Created block-hash-index for image %s", image->filename);
 			} else if (g_str_equal(*method, "adaptive-test-method")) {
 				g_debug("Ignoring adaptive-test-method for image %s", image->filename);
 			} else {
@@ -490,6 +615,405 @@ static gboolean generate_adaptive_data(RaucManifest *manifest, const gchar *dir,
 	return TRUE;
 }
 
+/* Returns the extension(s) of the image file, e.g. '.img' or '.tar.gz', which
+ * select the update handler during installation. */
+static const gchar *image_suffix(const gchar *filename)
+{
+	const gchar *base = strrchr(filename, '/');
+	const gchar *dot;
+
+	base = base ? base + 1 : filename;
+	dot = strchr(base, '.');
+
+	return dot ? dot : "";
+}
+
+/* Checks whether image b can share the stored file of image a.
+ *
+ * The update handler is selected by the filename suffix and slot hooks get
+ * the filename in RAUC_IMAGE_NAME, so only images with the same suffix and
+ * without slot hooks are merged. */
+static gboolean images_share_content(const RaucImage *a, const RaucImage *b)
+{
+	if (a->hooks.pre_install || a->hooks.install || a->hooks.post_install ||
+	    b->hooks.pre_install || b->hooks.install || b->hooks.post_install)
+		return FALSE;
+
+	if (!g_str_equal(image_suffix(a->filename), image_suffix(b->filename)))
+		return FALSE;
+
+	if (a->checksum.type != b->checksum.type ||
+	    a->checksum.size != b->checksum.size ||
+	    g_strcmp0(a->checksum.digest, b->checksum.digest) != 0)
+		return FALSE;
+
+	if (a->sparse != b->sparse || a->seekable_zstd != b->seekable_zstd || a->aligned != b->aligned)
+		return FALSE;
+
+	if (!a->adaptive || !b->adaptive)
+		return a->adaptive == b->adaptive;
+
+	if (g_strv_length(a->adaptive) != g_strv_length(b->adaptive))
+		return FALSE;
+	for (guint i = 0; a->adaptive[i] != NULL; i++) {
+		if (!g_str_equal(a->adaptive[i], b->adaptive[i]))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Lets images with identical content share a single file in the bundle.
+ *
+ * The filename of each duplicate image is rewritten to the file of the first
+ * image with the same content, so that all references resolve to the same
+ * file during installation. The files that are no longer referenced (and
+ * their block-hash-index) are added to excludes to leave them out of the
+ * payload. Only the in-memory manifest is changed, which is stored in the
+ * payload and signed. */
+static gboolean dedup_images(RaucManifest *manifest, GPtrArray *excludes, GError **error)
+{
+	g_autoptr(GHashTable) dropped = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GHashTableIter iter;
+	gchar *filename;
+	gpointer has_index;
+
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(excludes, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+
+		if (!image->filename || !image->checksum.digest)
+			continue;
+
+		for (GList *prev = manifest->images; prev != elem; prev = prev->next) {
+			RaucImage *first = prev->data;
+
+			if (!first->filename || !images_share_content(first, image))
+				continue;
+
+			if (!g_str_equal(first->filename, image->filename)) {
+				g_message("Storing %s only once as it is identical to %s", image->filename, first->filename);
+				g_hash_table_insert(dropped, g_strdup(image->filename),
+						GINT_TO_POINTER(image->adaptive &&
+						g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index")));
+				g_free(image->filename);
+				image->filename = g_strdup(first->filename);
+			}
+			break;
+		}
+	}
+
+	g_hash_table_iter_init(&iter, dropped);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&filename, &has_index)) {
+		gboolean referenced = FALSE;
+
+		/* may still be used by an image with different sparse or adaptive options */
+		for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+			RaucImage *image = elem->data;
+
+			if (g_strcmp0(image->filename, filename) == 0) {
+				referenced = TRUE;
+				break;
+			}
+		}
+		if (referenced)
+			continue;
+
+		g_ptr_array_add(excludes, g_strdup(filename));
+		if (GPOINTER_TO_INT(has_index))
+			g_ptr_array_add(excludes, g_strconcat(filename, ".block-hash-index", NULL));
+	}
+
+	return TRUE;
+}
+
+/* Checks the images to be stored aligned and excludes their files from the
+ * squashfs, they are appended to the payload by append_aligned_images(). */
+static gboolean prepare_aligned_images(RaucManifest *manifest, GPtrArray *excludes, gboolean *have_aligned, GError **error)
+{
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(excludes, FALSE);
+	g_return_val_if_fail(have_aligned, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	*have_aligned = FALSE;
+
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		gboolean shared = FALSE;
+		gboolean before = TRUE;
+
+		if (!image->aligned || !image->filename)
+			continue;
+
+		if (manifest->bundle_format == R_MANIFEST_FORMAT_PLAIN) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Aligned image %s requires the 'verity' or 'crypt' bundle format", image->filename);
+			return FALSE;
+		}
+		if (image_is_archive(image)) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Cannot store archive %s aligned", image->filename);
+			return FALSE;
+		}
+		if (image->checksum.size <= 0 || image->checksum.size % 4096 != 0) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Size of aligned image %s must be a non-zero multiple of 4096 bytes", image->filename);
+			return FALSE;
+		}
+
+		for (GList *other = manifest->images; other != NULL; other = other->next) {
+			RaucImage *o = other->data;
+
+			if (other == elem) {
+				before = FALSE;
+				continue;
+			}
+			if (g_strcmp0(o->filename, image->filename) != 0)
+				continue;
+			if (!o->aligned) {
+				g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+						"Image file %s is used both with and without 'aligned'", image->filename);
+				return FALSE;
+			}
+			/* excluded already for the first image using this file */
+			if (before)
+				shared = TRUE;
+		}
+
+		if (!shared)
+			g_ptr_array_add(excludes, g_strdup(image->filename));
+		*have_aligned = TRUE;
+	}
+
+	return TRUE;
+}
+
+/* Appends the files of aligned images to the payload at 4 KiB aligned offsets
+ * and records these in the manifest. */
+static gboolean append_aligned_images(const gchar *bundlename, RaucManifest *manifest, const gchar *contentdir, const RBundleStaging *staging, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *buf = NULL;
+	gboolean res = FALSE;
+	struct stat st;
+	goffset offset;
+	int out_fd;
+
+	g_return_val_if_fail(bundlename, FALSE);
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(contentdir, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	out_fd = g_open(bundlename, O_WRONLY | O_CLOEXEC, 0);
+	if (out_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open bundle %s: %s", bundlename, g_strerror(err));
+		return FALSE;
+	}
+
+	if (fstat(out_fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat bundle %s: %s", bundlename, g_strerror(err));
+		goto out;
+	}
+	/* mksquashfs pads to 4 KiB unless -nopad is given */
+	offset = (st.st_size + 4095) / 4096 * 4096;
+
+	buf = g_malloc(1024*1024);
+
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		g_autofree gchar *imagepath = NULL;
+		goffset done = 0;
+		int in_fd;
+
+		if (!image->aligned || !image->filename)
+			continue;
+
+		/* deduplicated images share the stored data */
+		for (GList *prev = manifest->images; prev != elem; prev = prev->next) {
+			RaucImage *first = prev->data;
+
+			if (first->payload_offset && g_strcmp0(first->filename, image->filename) == 0) {
+				image->payload_offset = first->payload_offset;
+				break;
+			}
+		}
+		if (image->payload_offset)
+			continue;
+
+		imagepath = staging_get_path(staging, contentdir, image->filename);
+		in_fd = g_open(imagepath, O_RDONLY | O_CLOEXEC, 0);
+		if (in_fd < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to open image %s: %s", image->filename, g_strerror(err));
+			goto out;
+		}
+
+		g_message("Storing %s aligned at payload offset %"G_GOFFSET_FORMAT, image->filename, offset);
+
+		while (done < image->checksum.size) {
+			gsize len = MIN((goffset)1024*1024, image->checksum.size - done);
+
+			if (!r_read_exact(in_fd, buf, len, &ierror) ||
+			    !r_pwrite_exact(out_fd, buf, len, offset + done, &ierror)) {
+				g_propagate_prefixed_error(error, ierror,
+						"Failed to append image %s: ", image->filename);
+				g_close(in_fd, NULL);
+				goto out;
+			}
+			done += len;
+		}
+		g_close(in_fd, NULL);
+
+		image->payload_offset = offset;
+		offset += image->checksum.size;
+	}
+
+	res = TRUE;
+out:
+	g_close(out_fd, NULL);
+	return res;
+}
+
+/* Converts images with 'sparse' into the staging directory, the files in the
+ * content directory are not modified. */
+static gboolean convert_sparse_images(RaucManifest *manifest, const gchar *dir, RBundleStaging *staging, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(staging, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		g_autofree gchar *imagepath = NULL;
+		g_autofree gchar *sparsepath = NULL;
+		gboolean is_sparse;
+		int fd;
+
+		if (!image->sparse || !image->filename)
+			continue;
+
+		imagepath = g_build_filename(dir, image->filename, NULL);
+		fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			int err = errno;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+					"Failed to open image: %s", image->filename);
+			return FALSE;
+		}
+		is_sparse = r_sparse_is_sparse(fd);
+		g_close(fd, NULL);
+
+		/* already converted, e.g. by an external tool */
+		if (is_sparse)
+			continue;
+
+		if (image_is_archive(image)) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Cannot convert archive %s to a sparse image", image->filename);
+			return FALSE;
+		}
+
+		sparsepath = staging_add(staging, image->filename, &ierror);
+		if (!sparsepath) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		/* converted already for a previous image using the same file */
+		if (g_file_test(sparsepath, G_FILE_TEST_EXISTS))
+			continue;
+
+		g_message("Converting %s to sparse image", image->filename);
+		if (!r_sparse_create(imagepath, sparsepath, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to create sparse image for %s: ", image->filename);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Compresses images with 'seekable-zstd' into the staging directory, the
+ * files in the content directory are not modified. */
+static gboolean convert_zstd_images(RaucManifest *manifest, const gchar *dir, RBundleStaging *staging, GError **error)
+{
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(staging, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+#if ENABLE_ZSTD == 1
+		GError *ierror = NULL;
+		g_autofree gchar *imagepath = NULL;
+		g_autofree gchar *zstdpath = NULL;
+		gboolean is_seekable;
+		int fd;
+#endif
+
+		if (!image->seekable_zstd || !image->filename)
+			continue;
+
+#if ENABLE_ZSTD == 1
+		imagepath = g_build_filename(dir, image->filename, NULL);
+		fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			int err = errno;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+					"Failed to open image: %s", image->filename);
+			return FALSE;
+		}
+		is_seekable = r_zstd_is_seekable(fd);
+		g_close(fd, NULL);
+
+		/* already converted by an external tool */
+		if (is_seekable)
+			continue;
+
+		if (image_is_archive(image)) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Cannot convert archive %s to a seekable zstd image", image->filename);
+			return FALSE;
+		}
+
+		zstdpath = staging_add(staging, image->filename, &ierror);
+		if (!zstdpath) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		/* converted already for a previous image using the same file */
+		if (g_file_test(zstdpath, G_FILE_TEST_EXISTS))
+			continue;
+
+		g_message("Converting %s to seekable zstd image", image->filename);
+		if (!r_zstd_seekable_create(imagepath, zstdpath, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to create seekable zstd image for %s: ", image->filename);
+			return FALSE;
+		}
+#else
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"Cannot create seekable zstd image %s: zstd support is not enabled", image->filename);
+		return FALSE;
+#endif
+	}
+
+	return TRUE;
+}
+
 static gboolean output_stream_write_uint64_all(GOutputStream *stream,
 		guint64 data,
 		GCancellable *cancellable,
@@ -628,9 +1152,16 @@ static gboolean sign_bundle(const gchar *bundlename, RaucManifest *manifest, GEr
 
 		g_print("Creating bundle in '%s' format\n", r_manifest_bundle_format_to_str(manifest->bundle_format));
 
+		/* the hash tree was already appended while creating or
+		 * encrypting the payload */
+		if (manifest->bundle_verity_hash) {
+			g_assert(manifest->bundle_verity_salt != NULL);
+			g_assert(offset > manifest->bundle_verity_size);
+			goto sign;
+		}
+
 		/* check we have a clean manifest */
 		g_assert(manifest->bundle_verity_salt == NULL);
-		g_assert(manifest->bundle_verity_hash == NULL);
 		g_assert(manifest->bundle_verity_size == 0);
 
 		/* dm-verity hash table generation */
@@ -671,6 +1202,7 @@ static gboolean sign_bundle(const gchar *bundlename, RaucManifest *manifest, GEr
 		manifest->bundle_verity_hash = r_hex_encode(hash, sizeof(hash));
 		manifest->bundle_verity_size = verity_size;
 
+sign:
 		if (!check_manifest_external(manifest, &ierror)) {
 			g_propagate_prefixed_error(
 					error,
@@ -715,19 +1247,386 @@ static gboolean sign_bundle(const gchar *bundlename, RaucManifest *manifest, GEr
 		return FALSE;
 	}
 
-	offset = g_seekable_tell(G_SEEKABLE(bundlestream)) - offset;
-	if (!output_stream_write_uint64_all(bundleoutstream, offset, NULL, &ierror)) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to append signature size to bundle: ");
-		return FALSE;
+	offset = g_seekable_tell(G_SEEKABLE(bundlestream)) - offset;
+	if (!output_stream_write_uint64_all(bundleoutstream, offset, NULL, &ierror)) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to append signature size to bundle: ");
+		return FALSE;
+	}
+
+	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
+	g_debug("Bundle size: %" G_GUINT64_FORMAT " bytes.", offset);
+
+	return TRUE;
+}
+
+/* Blocks hashed by the verity tail hasher at a time */
+#define VERITY_TAIL_CHUNK_BLOCKS 256
+
+/* Hashes the payload for dm-verity while mksquashfs writes it */
+typedef struct {
+	gchar *path;
+	guint8 salt[32];
+	GByteArray *digests; /* digests of data blocks */
+	guint64 blocks; /* number of hashed data blocks */
+	gboolean valid; /* FALSE if the digests cannot be used */
+	gint done; /* set when mksquashfs exited, accessed atomically */
+	int inotify_fd; /* watches the directory containing path */
+	int wakeup_fds[2]; /* written to after setting done */
+	GThread *thread;
+} RVerityTail;
+
+/*
+ * Follows the growing payload file and hashes each complete block.
+ *
+ * mksquashfs appends to its output, except for the superblock in the first
+ * block, which is written last, and for rewinding over duplicate files
+ * detected after writing them (which also truncates the output).
+ * A shrinking file invalidates the digests, duplicates are checked after
+ * mksquashfs exited.
+ *
+ * Between rounds, the thread blocks until the file is created or written to,
+ * or until mksquashfs exited.
+ */
+static gpointer verity_tail_thread(gpointer data)
+{
+	RVerityTail *tail = data;
+	g_autofree guint8 *buffer = g_malloc(VERITY_TAIL_CHUNK_BLOCKS * R_VERITY_BLOCK_SIZE);
+	goffset last_size = 0;
+	int fd = -1;
+
+	while (TRUE) {
+		/* check before stat, so the last round sees the final size */
+		gboolean done = g_atomic_int_get(&tail->done);
+		struct pollfd fds[2] = {
+			{.fd = tail->inotify_fd, .events = POLLIN},
+			{.fd = tail->wakeup_fds[0], .events = POLLIN},
+		};
+		GStatBuf st;
+		guint64 count = 0;
+
+		if (fd < 0)
+			fd = g_open(tail->path, O_RDONLY | O_CLOEXEC, 0);
+
+		if (fd >= 0) {
+			if (fstat(fd, &st) != 0 || st.st_size < last_size) {
+				tail->valid = FALSE;
+				break;
+			}
+			last_size = st.st_size;
+			count = st.st_size / R_VERITY_BLOCK_SIZE - tail->blocks;
+		}
+
+		if (!count) {
+			if (done)
+				break;
+
+			/* events queued since the last round wake up immediately */
+			if (poll(fds, G_N_ELEMENTS(fds), -1) < 0 && errno != EINTR) {
+				tail->valid = FALSE;
+				break;
+			}
+			if (fds[0].revents & POLLIN) {
+				guint8 events[4096];
+
+				while (read(tail->inotify_fd, events, sizeof(events)) > 0)
+					;
+			}
+			continue;
+		}
+		count = MIN(count, VERITY_TAIL_CHUNK_BLOCKS);
+
+		g_byte_array_set_size(tail->digests, (tail->blocks + count) * R_VERITY_DIGEST_SIZE);
+		if (!r_pread_exact(fd, buffer, count * R_VERITY_BLOCK_SIZE, tail->blocks * R_VERITY_BLOCK_SIZE, NULL) ||
+		    r_verity_hash_data_blocks(buffer, count, tail->digests->data + tail->blocks * R_VERITY_DIGEST_SIZE, tail->salt) != 0) {
+			tail->valid = FALSE;
+			break;
+		}
+		tail->blocks += count;
+	}
+
+	if (fd >= 0)
+		g_close(fd, NULL);
+
+	return NULL;
+}
+
+static RVerityTail *verity_tail_start(const gchar *path, GError **error)
+{
+	RVerityTail *tail = g_new0(RVerityTail, 1);
+	g_autofree gchar *dirname = g_path_get_dirname(path);
+
+	if (RAND_bytes((unsigned char *)&tail->salt, sizeof(tail->salt)) != 1) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity salt");
+		g_free(tail);
+		return NULL;
+	}
+
+	tail->path = g_strdup(path);
+	tail->digests = g_byte_array_new();
+	tail->wakeup_fds[0] = tail->wakeup_fds[1] = -1;
+
+	/* without a way to wait for writes, leave hashing to sign_bundle() */
+	tail->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (tail->inotify_fd < 0 ||
+	    inotify_add_watch(tail->inotify_fd, dirname, IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE) < 0 ||
+	    !g_unix_open_pipe(tail->wakeup_fds, FD_CLOEXEC, NULL)) {
+		g_debug("Failed to watch %s, hashing payload after mksquashfs", dirname);
+		return tail;
+	}
+
+	tail->valid = TRUE;
+	tail->thread = g_thread_new("verity-tail", verity_tail_thread, tail);
+
+	return tail;
+}
+
+static void verity_tail_stop(RVerityTail *tail)
+{
+	if (!tail->thread)
+		return;
+
+	g_atomic_int_set(&tail->done, 1);
+	if (write(tail->wakeup_fds[1], "", 1) != 1)
+		g_error("Failed to wake up verity tail thread: %s", g_strerror(errno));
+	g_thread_join(tail->thread);
+	tail->thread = NULL;
+}
+
+static void verity_tail_free(RVerityTail *tail)
+{
+	if (!tail)
+		return;
+
+	verity_tail_stop(tail);
+	if (tail->inotify_fd >= 0)
+		g_close(tail->inotify_fd, NULL);
+	for (guint i = 0; i < G_N_ELEMENTS(tail->wakeup_fds); i++) {
+		if (tail->wakeup_fds[i] >= 0)
+			g_close(tail->wakeup_fds[i], NULL);
+	}
+	g_free(tail->path);
+	g_byte_array_unref(tail->digests);
+	g_free(tail);
+}
+
+/*
+ * Collects the names (relative to contentdir) of the regular files mksquashfs
+ * stores from contentdir (recursing into subdir), leaving out excluded and
+ * staged files.
+ */
+static gboolean collect_payload_files(const gchar *contentdir, const gchar *subdir, GPtrArray *excludes, const RBundleStaging *staging, GPtrArray *names, GError **error)
+{
+	g_autofree gchar *dirpath = g_build_filename(contentdir, subdir, NULL);
+	g_autoptr(GDir) dir = NULL;
+	GError *ierror = NULL;
+	const gchar *name;
+
+	dir = g_dir_open(dirpath, 0, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		g_autofree gchar *relpath = subdir ? g_build_filename(subdir, name, NULL) : g_strdup(name);
+		g_autofree gchar *path = g_build_filename(contentdir, relpath, NULL);
+		GStatBuf st;
+
+		if (excludes && g_ptr_array_find_with_equal_func(excludes, relpath, g_str_equal, NULL))
+			continue;
+		if (staging && g_ptr_array_find_with_equal_func(staging->files, relpath, g_str_equal, NULL))
+			continue;
+
+		if (g_lstat(path, &st) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to stat %s: %s", path, g_strerror(err));
+			return FALSE;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (!collect_payload_files(contentdir, relpath, excludes, staging, names, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			g_ptr_array_add(names, g_steal_pointer(&relpath));
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Checks whether mksquashfs may detect duplicate files in the payload.
+ *
+ * As mksquashfs, this compares the content of non-empty files with the same
+ * size, so a positive result may be caused by hard links or identical files
+ * which mksquashfs did not need to rewind over. For image files, the
+ * checksums from the manifest are used, so only other files are read.
+ */
+static gboolean payload_has_duplicates(const RaucManifest *manifest, const gchar *contentdir, GPtrArray *excludes, const RBundleStaging *staging, gboolean *duplicates, GError **error)
+{
+	g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func(g_free);
+	g_autoptr(GHashTable) image_digests = g_hash_table_new(g_str_hash, g_str_equal);
+	g_autoptr(GHashTable) sizes = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+	g_autoptr(GHashTable) digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GError *ierror = NULL;
+	GHashTableIter iter;
+	GPtrArray *group;
+
+	g_return_val_if_fail(manifest != NULL, FALSE);
+	g_return_val_if_fail(duplicates != NULL, FALSE);
+
+	*duplicates = FALSE;
+
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (image->filename && image->checksum.digest)
+			g_hash_table_insert(image_digests, image->filename, image->checksum.digest);
+	}
+
+	for (guint i = 0; staging && i < staging->files->len; i++) {
+		const gchar *filename = g_ptr_array_index(staging->files, i);
+
+		if (excludes && g_ptr_array_find_with_equal_func(excludes, filename, g_str_equal, NULL))
+			continue;
+
+		g_ptr_array_add(names, g_strdup(filename));
+	}
+
+	if (!collect_payload_files(contentdir, NULL, excludes, staging, names, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < names->len; i++) {
+		const gchar *name = g_ptr_array_index(names, i);
+		g_autofree gchar *path = staging_get_path(staging, contentdir, name);
+		gint64 size;
+		GStatBuf st;
+
+		if (g_stat(path, &st) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to stat %s: %s", path, g_strerror(err));
+			return FALSE;
+		}
+		if (!st.st_size)
+			continue;
+
+		size = st.st_size;
+		group = g_hash_table_lookup(sizes, &size);
+		if (!group) {
+			gint64 *key = g_new(gint64, 1);
+
+			*key = size;
+			group = g_ptr_array_new();
+			g_hash_table_insert(sizes, key, group);
+		}
+		g_ptr_array_add(group, (gpointer)name);
+	}
+
+	g_hash_table_iter_init(&iter, sizes);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&group)) {
+		if (group->len < 2)
+			continue;
+
+		for (guint i = 0; i < group->len; i++) {
+			const gchar *name = g_ptr_array_index(group, i);
+			const gchar *digest = g_hash_table_lookup(image_digests, name);
+			RaucChecksum checksum = {0};
+
+			/* uses the default checksum type, as for the images */
+			if (digest) {
+				checksum.digest = g_strdup(digest);
+			} else {
+				g_autofree gchar *path = staging_get_path(staging, contentdir, name);
+
+				if (!compute_checksum(&checksum, path, &ierror)) {
+					g_propagate_error(error, ierror);
+					return FALSE;
+				}
+			}
+
+			if (!g_hash_table_add(digests, checksum.digest)) {
+				*duplicates = TRUE;
+				return TRUE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Completes the hash tree from the digests collected while mksquashfs ran
+ * and stores the verity parameters in the manifest.
+ *
+ * If the digests cannot be used, the manifest is left unchanged, so that
+ * sign_bundle() hashes the payload again.
+ */
+static gboolean verity_tail_finish(RVerityTail *tail, gboolean duplicates, RaucManifest *manifest, GError **error)
+{
+	g_autofree guint8 *block = g_malloc(R_VERITY_BLOCK_SIZE);
+	GError *ierror = NULL;
+	guint8 hash[32] = {0};
+	guint64 combined_size = 0;
+	gboolean res = FALSE;
+	GStatBuf st;
+	int fd = -1;
+
+	verity_tail_stop(tail);
+
+	if (!tail->valid || duplicates || tail->blocks <= 1) {
+		g_debug("Cannot use verity digests calculated during mksquashfs, hashing payload again");
+		return TRUE;
+	}
+
+	fd = g_open(tail->path, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", tail->path, g_strerror(err));
+		return FALSE;
+	}
+
+	/* the payload must consist of the hashed blocks only */
+	if (fstat(fd, &st) != 0 || (guint64)st.st_size != tail->blocks * R_VERITY_BLOCK_SIZE) {
+		g_debug("Payload size does not match verity digests calculated during mksquashfs, hashing payload again");
+		res = TRUE;
+		goto out;
 	}
 
-	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
-	g_debug("Bundle size: %" G_GUINT64_FORMAT " bytes.", offset);
+	/* the superblock was written last */
+	if (!r_pread_exact(fd, block, R_VERITY_BLOCK_SIZE, 0, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read superblock: ");
+		goto out;
+	}
+	if (r_verity_hash_data_blocks(block, 1, tail->digests->data, tail->salt) != 0 ||
+	    r_verity_hash_create_from_digests(fd, tail->blocks, tail->digests->data, &combined_size, hash, tail->salt) != 0) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity hash tree");
+		goto out;
+	}
 
-	return TRUE;
+	manifest->bundle_verity_salt = r_hex_encode(tail->salt, sizeof(tail->salt));
+	manifest->bundle_verity_hash = r_hex_encode(hash, sizeof(hash));
+	manifest->bundle_verity_size = (combined_size - tail->blocks) * R_VERITY_BLOCK_SIZE;
+
+	res = TRUE;
+out:
+	g_close(fd, NULL);
+	return res;
 }
 
 static gchar* get_random_file_name(void)
@@ -740,10 +1639,15 @@ static gchar* get_random_file_name(void)
 	return r_hex_encode(rand_bytes, sizeof(rand_bytes));
 }
 
+/* Encrypts the payload and appends the dm-verity hash tree over the encrypted
+ * payload in a single pass. */
 static gboolean encrypt_bundle_payload(const gchar *bundlepath, RaucManifest *manifest, GError **error)
 {
 	gboolean res = FALSE;
 	guint8 key[32] = {0};
+	guint8 salt[32] = {0};
+	guint8 hash[32] = {0};
+	guint64 verity_size = 0;
 	GError *ierror = NULL;
 	g_autofree gchar* dirname = NULL;
 	g_autofree gchar* tmpfilename = NULL;
@@ -761,6 +1665,9 @@ static gboolean encrypt_bundle_payload(const gchar *bundlepath, RaucManifest *ma
 
 	/* check we have a clean manifest */
 	g_assert(manifest->bundle_crypt_key == NULL);
+	g_assert(manifest->bundle_verity_salt == NULL);
+	g_assert(manifest->bundle_verity_hash == NULL);
+	g_assert(manifest->bundle_verity_size == 0);
 
 	if (RAND_bytes((unsigned char *)&key, sizeof(key)) != 1) {
 		g_set_error(error,
@@ -771,13 +1678,25 @@ static gboolean encrypt_bundle_payload(const gchar *bundlepath, RaucManifest *ma
 		goto out;
 	}
 
-	res = r_crypt_encrypt(bundlepath, encpath, key, &ierror);
+	if (RAND_bytes((unsigned char *)&salt, sizeof(salt)) != 1) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity salt");
+		res = FALSE;
+		goto out;
+	}
+
+	res = r_crypt_encrypt_verity(bundlepath, encpath, key, salt, hash, &verity_size, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
 	manifest->bundle_crypt_key = r_hex_encode(key, sizeof(key));
+	manifest->bundle_verity_salt = r_hex_encode(salt, sizeof(salt));
+	manifest->bundle_verity_hash = r_hex_encode(hash, sizeof(hash));
+	manifest->bundle_verity_size = verity_size;
 
 	/* Uncomment for debugging purpose */
 	//g_message("encrypted image saved as %s with key %s", encpath, manifest->bundle_crypt_key);
@@ -858,6 +1777,12 @@ gboolean create_bundle(const gchar *bundlename, const gchar *contentdir, GError
 	GError *ierror = NULL;
 	g_autofree gchar* manifestpath = g_build_filename(contentdir, "manifest.raucm", NULL);
 	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GPtrArray) excludes = g_ptr_array_new_with_free_func(g_free);
+	g_autoptr(RBundleStaging) staging = NULL;
+	g_autofree gchar *stagedmanifest = NULL;
+	RVerityTail *tail = NULL;
+	gboolean duplicates = TRUE;
+	gboolean have_aligned = FALSE;
 	gboolean res = FALSE;
 
 	g_return_val_if_fail(bundlename != NULL, FALSE);
@@ -880,30 +1805,109 @@ gboolean create_bundle(const gchar *bundlename, const gchar *contentdir, GError
 		g_print("%s\n", (gchar *)g_ptr_array_index(manifest->warnings, i));
 	}
 
-	res = sync_manifest_with_contentdir(manifest, contentdir, &ierror);
+	staging = staging_new(bundlename, &ierror);
+	if (!staging) {
+		g_propagate_error(error, ierror);
+		res = FALSE;
+		goto out;
+	}
+
+	res = convert_sparse_images(manifest, contentdir, staging, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	res = convert_zstd_images(manifest, contentdir, staging, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	res = check_adaptive_methods(manifest, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
-	res = generate_adaptive_data(manifest, contentdir, &ierror);
+	/* also creates the block-hash-index files */
+	res = sync_manifest_with_contentdir(manifest, contentdir, staging->dir, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
+	/* the manifest in the content directory only receives the checksums */
 	res = save_manifest_file(manifestpath, manifest, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
-	res = mksquashfs(bundlename, contentdir, &ierror);
+	res = dedup_images(manifest, excludes, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	res = prepare_aligned_images(manifest, excludes, &have_aligned, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* the payload contains the manifest with the shared filenames */
+	stagedmanifest = staging_add(staging, "manifest.raucm", &ierror);
+	if (!stagedmanifest) {
+		g_propagate_error(error, ierror);
+		res = FALSE;
+		goto out;
+	}
+	res = save_manifest_file(stagedmanifest, manifest, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* for 'verity' bundles, hash the payload while it is written (unless
+	 * aligned images are appended afterwards) */
+	if (manifest->bundle_format == R_MANIFEST_FORMAT_VERITY && !have_aligned) {
+		tail = verity_tail_start(bundlename, &ierror);
+		if (!tail) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+	}
+
+	res = mksquashfs(bundlename, contentdir, excludes, staging, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
+	if (tail) {
+		res = payload_has_duplicates(manifest, contentdir, excludes, staging, &duplicates, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		res = verity_tail_finish(tail, duplicates, manifest, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
+
+	if (have_aligned) {
+		res = append_aligned_images(bundlename, manifest, contentdir, staging, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
+
 	if (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT) {
 		res = encrypt_bundle_payload(bundlename, manifest, &ierror);
 		if (!res) {
@@ -921,6 +1925,7 @@ gboolean create_bundle(const gchar *bundlename, const gchar *contentdir, GError
 	res = TRUE;
 
 out:
+	verity_tail_free(tail);
 	/* Remove output file on error */
 	if (!res &&
 	    g_file_test(bundlename, G_FILE_TEST_IS_REGULAR))
@@ -1033,6 +2038,17 @@ gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
 	g_clear_pointer(&manifest->bundle_verity_hash, g_free);
 	manifest->bundle_verity_size = 0;
 
+	/* offsets of aligned images are only contained in the signed manifest */
+	if (bundle->manifest) {
+		for (GList *l = manifest->images, *o = bundle->manifest->images; l && o; l = l->next, o = o->next) {
+			RaucImage *image = l->data;
+			const RaucImage *signed_image = o->data;
+
+			if (g_strcmp0(image->filename, signed_image->filename) == 0)
+				image->payload_offset = signed_image->payload_offset;
+		}
+	}
+
 	res = truncate_bundle(bundle->path, outpath, squashfs_size, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
@@ -1064,6 +2080,9 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 	g_autofree gchar *mfpath = NULL;
 	g_autofree gchar *storepath = NULL;
 	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GHashTable) converted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	GHashTableIter iter;
+	const gchar *origfile;
 
 	g_return_val_if_fail(bundle, FALSE);
 	g_return_val_if_fail(outbundle, FALSE);
@@ -1110,12 +2129,21 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 	g_clear_pointer(&manifest->bundle_verity_hash, g_free);
 	manifest->bundle_verity_size = 0;
 
+	/* aligned images were extracted and are stored in the squashfs now */
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		image->aligned = FALSE;
+		image->payload_offset = 0;
+	}
+
 	/* Iterate over each image and convert */
 	for (GList *l = manifest->images; l != NULL; l = l->next) {
 		RaucImage *image = l->data;
 		g_autofree gchar *imgpath = NULL;
 		g_autofree gchar *idxfile = NULL;
 		g_autofree gchar *idxpath = NULL;
+		const gchar *converted_idx = NULL;
 
 		imgpath = g_build_filename(contentdir, image->filename, NULL);
 
@@ -1127,6 +2155,24 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 			continue;
 		}
 
+		if (image->sparse) {
+			g_message("Skipping conversion of sparse image %s", image->filename);
+			continue;
+		}
+
+		if (image->seekable_zstd) {
+			g_message("Skipping conversion of seekable zstd image %s", image->filename);
+			continue;
+		}
+
+		/* images can share a single file in deduplicated bundles */
+		converted_idx = g_hash_table_lookup(converted, image->filename);
+		if (converted_idx) {
+			g_free(image->filename);
+			image->filename = g_strdup(converted_idx);
+			continue;
+		}
+
 		if (image_is_archive(image)) {
 			idxfile = g_strconcat(image->filename, ".caidx", NULL);
 			idxpath = g_build_filename(contentdir, idxfile, NULL);
@@ -1152,11 +2198,31 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 			}
 		}
 
+		g_hash_table_insert(converted, g_strdup(image->filename), g_strdup(idxfile));
+
 		/* Rewrite manifest filename */
 		g_free(image->filename);
 		image->filename = g_steal_pointer(&idxfile);
+	}
+
+	/* Remove original files unless still used by a skipped image */
+	g_hash_table_iter_init(&iter, converted);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&origfile, NULL)) {
+		g_autofree gchar *imgpath = NULL;
+		gboolean referenced = FALSE;
+
+		for (GList *l = manifest->images; l != NULL; l = l->next) {
+			RaucImage *image = l->data;
+
+			if (g_strcmp0(image->filename, origfile) == 0) {
+				referenced = TRUE;
+				break;
+			}
+		}
+		if (referenced)
+			continue;
 
-		/* Remove original file */
+		imgpath = g_build_filename(contentdir, origfile, NULL);
 		if (g_remove(imgpath) != 0) {
 			g_warning("failed to remove %s", imgpath);
 		}
@@ -1169,7 +2235,7 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 		goto out;
 	}
 
-	res = mksquashfs(outbundle, contentdir, &ierror);
+	res = mksquashfs(outbundle, contentdir, NULL, NULL, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -1891,6 +2957,140 @@ static gboolean check_allowed_bundle_format(RaucManifest *manifest, GError **err
 	return TRUE;
 }
 
+/* upper limit for the number of remote bundles with cached metadata */
+#define REMOTE_BUNDLE_CACHE_MAX_ENTRIES 16
+
+/* Verified metadata of a remote bundle, which is revalidated using the
+ * strong entity tag reported by the server. Modification times are not
+ * used, as they only have a precision of one second. */
+typedef struct {
+	CheckBundleParams params;
+	gchar *etag;
+	gint64 last_used; /* monotonic time, to evict the least recently used entry */
+	guint64 data_size;
+	goffset size;
+	GBytes *sigdata;
+	GBytes *enveloped_data;
+	GBytes *manifest_bytes;
+	STACK_OF(X509) *verified_chain;
+} RemoteBundleCacheEntry;
+
+/* bundle URL -> RemoteBundleCacheEntry */
+static GHashTable *remote_bundle_cache = NULL;
+
+static void free_remote_bundle_cache_entry(gpointer data)
+{
+	RemoteBundleCacheEntry *entry = data;
+
+	g_free(entry->etag);
+	g_bytes_unref(entry->sigdata);
+	if (entry->enveloped_data)
+		g_bytes_unref(entry->enveloped_data);
+	g_bytes_unref(entry->manifest_bytes);
+	if (entry->verified_chain)
+		sk_X509_pop_free(entry->verified_chain, X509_free);
+	g_free(entry);
+}
+
+static RemoteBundleCacheEntry *lookup_remote_bundle_cache(const gchar *url, CheckBundleParams params)
+{
+	RemoteBundleCacheEntry *entry;
+
+	if (!remote_bundle_cache)
+		return NULL;
+
+	entry = g_hash_table_lookup(remote_bundle_cache, url);
+	/* a result obtained with different checks must not be reused */
+	if (!entry || entry->params != params)
+		return NULL;
+
+	entry->last_used = g_get_monotonic_time();
+
+	return entry;
+}
+
+static void remove_remote_bundle_cache(const gchar *url)
+{
+	if (remote_bundle_cache)
+		g_hash_table_remove(remote_bundle_cache, url);
+}
+
+void clear_remote_bundle_cache(void)
+{
+	g_clear_pointer(&remote_bundle_cache, g_hash_table_destroy);
+}
+
+/* Removes the least recently used entry if the cache is full. */
+static void evict_remote_bundle_cache(void)
+{
+	GHashTableIter iter;
+	const gchar *url, *oldest_url = NULL;
+	RemoteBundleCacheEntry *entry;
+	gint64 oldest = G_MAXINT64;
+
+	if (g_hash_table_size(remote_bundle_cache) < REMOTE_BUNDLE_CACHE_MAX_ENTRIES)
+		return;
+
+	g_hash_table_iter_init(&iter, remote_bundle_cache);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&url, (gpointer *)&entry)) {
+		if (entry->last_used < oldest) {
+			oldest = entry->last_used;
+			oldest_url = url;
+		}
+	}
+
+	if (oldest_url)
+		g_hash_table_remove(remote_bundle_cache, oldest_url);
+}
+
+static void update_remote_bundle_cache(const gchar *url, CheckBundleParams params, const RaucBundle *bundle, GBytes *manifest_bytes)
+{
+	RemoteBundleCacheEntry *entry;
+
+	/* only verified metadata which can be revalidated is useful, weak
+	 * entity tags may match a different file */
+	if (!bundle->signature_verified || !manifest_bytes ||
+	    !bundle->nbd_srv->etag || g_str_has_prefix(bundle->nbd_srv->etag, "W/")) {
+		remove_remote_bundle_cache(url);
+		return;
+	}
+
+	if (!remote_bundle_cache)
+		remote_bundle_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_remote_bundle_cache_entry);
+
+	remove_remote_bundle_cache(url);
+	evict_remote_bundle_cache();
+
+	entry = g_new0(RemoteBundleCacheEntry, 1);
+	entry->params = params;
+	entry->etag = g_strdup(bundle->nbd_srv->etag);
+	entry->last_used = g_get_monotonic_time();
+	entry->data_size = bundle->nbd_srv->data_size;
+	entry->size = bundle->size;
+	entry->sigdata = g_bytes_ref(bundle->sigdata);
+	if (bundle->enveloped_data)
+		entry->enveloped_data = g_bytes_ref(bundle->enveloped_data);
+	entry->manifest_bytes = g_bytes_ref(manifest_bytes);
+	if (bundle->verified_chain)
+		entry->verified_chain = X509_chain_up_ref(bundle->verified_chain);
+
+	g_hash_table_replace(remote_bundle_cache, g_strdup(url), entry);
+}
+
+static void restore_remote_bundle(RaucBundle *bundle, const RemoteBundleCacheEntry *entry, GBytes **manifest_bytes)
+{
+	bundle->size = entry->size;
+	bundle->sigdata = g_bytes_ref(entry->sigdata);
+	if (entry->enveloped_data) {
+		bundle->enveloped_data = g_bytes_ref(entry->enveloped_data);
+		bundle->was_encrypted = TRUE;
+	}
+	bundle->signature_verified = TRUE;
+	if (entry->verified_chain)
+		bundle->verified_chain = X509_chain_up_ref(entry->verified_chain);
+	*manifest_bytes = g_bytes_ref(entry->manifest_bytes);
+}
+
 gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleParams params, RaucBundleAccessArgs *access_args, GError **error)
 {
 	GError *ierror = NULL;
@@ -1899,6 +3099,8 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 	g_autoptr(RaucBundle) ibundle = g_new0(RaucBundle, 1);
 	g_autoptr(GBytes) manifest_bytes = NULL;
 	g_autofree gchar *bundlescheme = NULL;
+	RemoteBundleCacheEntry *cached = NULL;
+	CheckBundleParams cache_params = params & ~CHECK_BUNDLE_USE_CACHE;
 	gboolean detached;
 
 	g_return_val_if_fail(bundlename, FALSE);
@@ -1916,6 +3118,9 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 
 	ibundle->verification_disabled = !verify;
 
+	if (params & CHECK_BUNDLE_USE_CACHE)
+		cached = lookup_remote_bundle_cache(bundlename, cache_params);
+
 	/* Download Bundle to temporary location if remote URI is given */
 	bundlescheme = g_uri_parse_scheme(bundlename);
 	if (is_remote_scheme(bundlescheme)) {
@@ -1932,6 +3137,7 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 			ibundle->nbd_srv->tls_no_verify = access_args->tls_no_verify;
 			ibundle->nbd_srv->headers = g_strdupv(access_args->http_headers);
 			ibundle->nbd_srv->info_headers = g_strdupv(access_args->http_info_headers);
+			ibundle->nbd_srv->mirrors = g_strdupv(access_args->mirrors);
 		}
 		if (!ibundle->nbd_srv->tls_cert)
 			ibundle->nbd_srv->tls_cert = g_strdup(r_context()->config->streaming_tls_cert);
@@ -1939,6 +3145,26 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 			ibundle->nbd_srv->tls_key = g_strdup(r_context()->config->streaming_tls_key);
 		if (!ibundle->nbd_srv->tls_ca)
 			ibundle->nbd_srv->tls_ca = g_strdup(r_context()->config->streaming_tls_ca);
+		ibundle->nbd_srv->cache_size = r_context()->config->streaming_cache_size;
+		ibundle->nbd_srv->read_ahead = r_context()->config->streaming_read_ahead;
+		ibundle->nbd_srv->max_streams = r_context()->config->streaming_max_streams;
+		ibundle->nbd_srv->max_retries = r_context()->config->streaming_max_retries;
+		ibundle->nbd_srv->connect_timeout = r_context()->config->streaming_connect_timeout;
+		ibundle->nbd_srv->request_timeout = r_context()->config->streaming_request_timeout;
+		ibundle->nbd_srv->connections = r_context()->config->streaming_connections;
+		ibundle->nbd_srv->max_concurrency = r_context()->config->streaming_max_concurrency;
+		ibundle->nbd_srv->bandwidth_limit = r_context()->config->streaming_bandwidth_limit;
+		ibundle->nbd_srv->lan_cache = g_strdup(r_context()->config->streaming_lan_cache);
+		ibundle->nbd_srv->disk_cache_dir = g_strdup(r_context()->config->streaming_disk_cache_directory);
+		ibundle->nbd_srv->disk_cache_size = r_context()->config->streaming_disk_cache_size;
+		if (access_args && access_args->max_concurrency)
+			ibundle->nbd_srv->max_concurrency = access_args->max_concurrency;
+		if (access_args && access_args->bandwidth_limit)
+			ibundle->nbd_srv->bandwidth_limit = access_args->bandwidth_limit;
+		if (cached) {
+			ibundle->nbd_srv->if_none_match = g_strdup(cached->etag);
+			ibundle->nbd_srv->cached_size = cached->data_size;
+		}
 		res = r_nbd_start_server(ibundle->nbd_srv, &ierror);
 		if (!res) {
 			g_propagate_prefixed_error(error, ierror, "Failed to stream bundle %s: ", ibundle->path);
@@ -1986,6 +3212,20 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 
 	g_message("Reading bundle: %s", ibundle->path);
 
+	if (cached && ibundle->nbd_srv && ibundle->nbd_srv->not_modified) {
+		/* a server sending an entity tag must send the matched one */
+		if (ibundle->nbd_srv->etag && g_strcmp0(ibundle->nbd_srv->etag, cached->etag) != 0) {
+			remove_remote_bundle_cache(bundlename);
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_FORMAT,
+					"Server reported bundle as unchanged with a different entity tag");
+			res = FALSE;
+			goto out;
+		}
+		g_message("Bundle unchanged, using verified metadata from previous check");
+		restore_remote_bundle(ibundle, cached, &manifest_bytes);
+		goto manifest;
+	}
+
 	if (!ibundle->nbd_srv) { /* local or downloaded */
 		res = open_local_bundle(ibundle, &ierror);
 		if (!res) {
@@ -2118,6 +3358,7 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 		}
 	}
 
+manifest:
 	if (manifest_bytes) {
 		res = load_manifest_mem(manifest_bytes, &ibundle->manifest, &ierror);
 		if (!res) {
@@ -2142,6 +3383,9 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 		goto out;
 	}
 
+	if ((params & CHECK_BUNDLE_USE_CACHE) && ibundle->nbd_srv && !ibundle->nbd_srv->not_modified)
+		update_remote_bundle_cache(bundlename, cache_params, ibundle, manifest_bytes);
+
 	*bundle = g_steal_pointer(&ibundle);
 
 	res = TRUE;
@@ -2420,6 +3664,68 @@ out:
 	return res;
 }
 
+static gboolean extract_aligned_images(RaucBundle *bundle, const gchar *outputdir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *buf = NULL;
+	int in_fd;
+
+	g_return_val_if_fail(bundle != NULL, FALSE);
+	g_return_val_if_fail(outputdir != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!bundle->manifest)
+		return TRUE;
+
+	in_fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(bundle->stream));
+
+	for (GList *elem = bundle->manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		g_autofree gchar *imagepath = NULL;
+		goffset done = 0;
+		int out_fd;
+
+		if (!image->payload_offset)
+			continue;
+
+		/* deduplicated images share the stored data */
+		imagepath = g_build_filename(outputdir, image->filename, NULL);
+		if (g_file_test(imagepath, G_FILE_TEST_EXISTS))
+			continue;
+
+		out_fd = g_open(imagepath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (out_fd < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to create %s: %s", imagepath, g_strerror(err));
+			return FALSE;
+		}
+
+		if (!buf)
+			buf = g_malloc(1024*1024);
+
+		while (done < image->checksum.size) {
+			gsize len = MIN((goffset)1024*1024, image->checksum.size - done);
+
+			if (!r_pread_exact(in_fd, buf, len, image->payload_offset + done, &ierror) ||
+			    !r_write_exact(out_fd, buf, len, &ierror)) {
+				g_propagate_prefixed_error(error, ierror,
+						"Failed to extract aligned image %s: ", image->filename);
+				g_close(out_fd, NULL);
+				return FALSE;
+			}
+			done += len;
+		}
+
+		if (!g_close(out_fd, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 gboolean extract_bundle(RaucBundle *bundle, const gchar *outputdir, GError **error)
 {
 	GError *ierror = NULL;
@@ -2456,6 +3762,12 @@ gboolean extract_bundle(RaucBundle *bundle, const gchar *outputdir, GError **err
 		goto out;
 	}
 
+	res = extract_aligned_images(bundle, outputdir, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
 	res = TRUE;
 out:
 	r_context_end_step("extract_bundle", res);
@@ -2517,6 +3829,106 @@ out:
 	return res;
 }
 
+/* Releases the loop devices of aligned images set up by
+ * setup_aligned_images(). */
+static void clear_aligned_images(RaucBundle *bundle)
+{
+	g_return_if_fail(bundle);
+
+	if (!bundle->aligned_loopfds)
+		return;
+
+	for (guint i = 0; i < bundle->aligned_loopfds->len; i++)
+		g_close(g_array_index(bundle->aligned_loopfds, gint, i), NULL);
+	g_clear_pointer(&bundle->aligned_loopfds, g_array_unref);
+
+	if (bundle->manifest) {
+		for (GList *l = bundle->manifest->images; l != NULL; l = l->next) {
+			RaucImage *image = l->data;
+
+			g_clear_pointer(&image->payload_dev, g_free);
+		}
+	}
+}
+
+/* Sets up a read-only loop device for each aligned image on top of the
+ * verified (and decrypted) payload device. As the loop devices use
+ * autoclear, they (and the device mapper targets below them) are released
+ * once the file descriptors are closed by clear_aligned_images(). */
+static gboolean setup_aligned_images(RaucBundle *bundle, const gchar *payload_dev, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean res = FALSE;
+	goffset data_size;
+	int fd = -1;
+
+	g_return_val_if_fail(bundle != NULL, FALSE);
+	g_return_val_if_fail(bundle->manifest != NULL, FALSE);
+	g_return_val_if_fail(payload_dev != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	data_size = bundle->size - bundle->manifest->bundle_verity_size;
+
+	for (GList *elem = bundle->manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		g_autofree gchar *loopname = NULL;
+		gint loopfd = -1;
+
+		if (!image->payload_offset)
+			continue;
+
+		/* deduplicated images share the stored data */
+		for (GList *prev = bundle->manifest->images; prev != elem; prev = prev->next) {
+			RaucImage *first = prev->data;
+
+			if (first->payload_dev && first->payload_offset == image->payload_offset) {
+				image->payload_dev = g_strdup(first->payload_dev);
+				break;
+			}
+		}
+		if (image->payload_dev)
+			continue;
+
+		if (image->checksum.size <= 0 ||
+		    image->payload_offset > (guint64)data_size ||
+		    (guint64)image->checksum.size > data_size - image->payload_offset) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Aligned image %s is outside of the bundle payload", image->filename);
+			goto out;
+		}
+
+		if (fd < 0) {
+			fd = g_open(payload_dev, O_RDONLY | O_CLOEXEC, 0);
+			if (fd < 0) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to open %s: %s", payload_dev, g_strerror(err));
+				goto out;
+			}
+		}
+
+		res = r_setup_loop_offset(fd, image->payload_offset, &loopfd, &loopname, image->checksum.size, &ierror);
+		if (!res) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to set up loop device for aligned image %s: ", image->filename);
+			goto out;
+		}
+
+		if (!bundle->aligned_loopfds)
+			bundle->aligned_loopfds = g_array_new(FALSE, FALSE, sizeof(gint));
+		g_array_append_val(bundle->aligned_loopfds, loopfd);
+		image->payload_dev = g_steal_pointer(&loopname);
+	}
+
+	res = TRUE;
+out:
+	if (fd >= 0)
+		g_close(fd, NULL);
+	if (!res)
+		clear_aligned_images(bundle);
+	return res;
+}
+
 static gboolean read_complete_dm_device(gchar *dev, GError **error)
 {
 	int fd = -1;
@@ -2610,7 +4022,12 @@ static gboolean prepare_verity(RaucBundle *bundle, gchar *loopname, gchar* mount
 		}
 	}
 
-	res = r_mount_bundle(dm_verity->upper_dev, mount_point, &ierror);
+	res = setup_aligned_images(bundle, dm_verity->upper_dev, &ierror);
+	if (res) {
+		res = r_mount_bundle(dm_verity->upper_dev, mount_point, &ierror);
+		if (!res)
+			clear_aligned_images(bundle);
+	}
 
 	if (!r_dm_remove(dm_verity, TRUE, &ierror_dm)) {
 		g_warning("failed to mark dm verity device for removal: %s", ierror_dm->message);
@@ -2697,7 +4114,12 @@ static gboolean prepare_crypt(RaucBundle *bundle, gchar *loopname, gchar* mount_
 		}
 	}
 
-	res = r_mount_bundle(dm_crypt->upper_dev, mount_point, &ierror);
+	res = setup_aligned_images(bundle, dm_crypt->upper_dev, &ierror);
+	if (res) {
+		res = r_mount_bundle(dm_crypt->upper_dev, mount_point, &ierror);
+		if (!res)
+			clear_aligned_images(bundle);
+	}
 
 	if (!r_dm_remove(dm_crypt, TRUE, &ierror_dm)) {
 		g_warning("Failed to mark dm-crypt device for removal: %s", ierror_dm->message);
@@ -2754,13 +4176,18 @@ gboolean mount_bundle(RaucBundle *bundle, GError **error)
 	} else if (ENABLE_STREAMING && bundle->nbd_srv) { /* streaming bundle access */
 		bundle->nbd_dev = r_nbd_new_device();
 		bundle->nbd_dev->data_size = bundle->size;
+		bundle->nbd_dev->max_request = r_context()->config->streaming_device_max_request;
+		bundle->nbd_dev->read_ahead = r_context()->config->streaming_device_read_ahead;
 		bundle->nbd_dev->sock = bundle->nbd_srv->sock;
 		bundle->nbd_srv->sock = -1;
+		g_clear_pointer(&bundle->nbd_dev->extra_socks, g_array_unref);
+		bundle->nbd_dev->extra_socks = g_steal_pointer(&bundle->nbd_srv->extra_socks);
 		res = r_nbd_setup_device(bundle->nbd_dev, &ierror);
 		if (!res) {
-			/* The setup failed, so the socket still belongs to the nbd_srv. */
+			/* The setup failed, so the sockets still belong to the nbd_srv. */
 			bundle->nbd_srv->sock = bundle->nbd_dev->sock;
 			bundle->nbd_dev->sock = -1;
+			bundle->nbd_srv->extra_socks = g_steal_pointer(&bundle->nbd_dev->extra_socks);
 			g_propagate_error(error, ierror);
 			goto out;
 		}
@@ -2862,6 +4289,9 @@ gboolean umount_bundle(RaucBundle *bundle, GError **error)
 	g_rmdir(bundle->mount_point);
 	g_clear_pointer(&bundle->mount_point, g_free);
 
+	/* releases the device mapper targets of the payload */
+	clear_aligned_images(bundle);
+
 	if (ENABLE_STREAMING && bundle->nbd_dev) {
 		res = r_nbd_remove_device(bundle->nbd_dev, &ierror);
 		if (!res) {
@@ -2903,6 +4333,8 @@ void free_bundle(RaucBundle *bundle)
 	g_free(bundle->origpath);
 	g_free(bundle->storepath);
 
+	clear_aligned_images(bundle);
+
 	if (ENABLE_STREAMING && bundle->nbd_dev)
 		r_nbd_free_device(bundle->nbd_dev);
 	if (ENABLE_STREAMING && bundle->nbd_srv)
@@ -2929,6 +4361,7 @@ void clear_bundle_access_args(RaucBundleAccessArgs *access_args)
 		g_free(access_args->tls_ca);
 		g_strfreev(access_args->http_headers);
 		g_strfreev(access_args->http_info_headers);
+		g_strfreev(access_args->mirrors);
 	}
 
 	memset(access_args, 0, sizeof(*access_args));
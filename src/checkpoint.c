@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "utils.h"
+
+#define CHECKPOINT_GROUP "checkpoint"
+#define CHECKPOINT_BUFFER_SIZE (1024*1024)
+
+RaucCheckpoint *r_checkpoint_new(const RaucSlot *slot, const RaucImage *image, const gchar *bundle_hash)
+{
+	RaucCheckpoint *checkpoint;
+
+	g_return_val_if_fail(slot, NULL);
+	g_return_val_if_fail(image, NULL);
+
+	if (!slot->data_directory)
+		return NULL;
+
+	checkpoint = g_new0(RaucCheckpoint, 1);
+	checkpoint->filename = g_build_filename(slot->data_directory, "install-checkpoint", NULL);
+	checkpoint->bundle_hash = g_strdup(bundle_hash);
+	checkpoint->image_digest = g_strdup(image->checksum.digest);
+	checkpoint->image_size = image->checksum.size;
+	checkpoint->device = g_strdup(slot->device);
+	checkpoint->range_hashes = g_ptr_array_new_with_free_func(g_free);
+	checkpoint->range_checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+	return checkpoint;
+}
+
+static gboolean checkpoint_save(const RaucCheckpoint *checkpoint, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+
+	if (checkpoint->bundle_hash)
+		g_key_file_set_string(key_file, CHECKPOINT_GROUP, "bundle-hash", checkpoint->bundle_hash);
+	g_key_file_set_string(key_file, CHECKPOINT_GROUP, "image-digest", checkpoint->image_digest);
+	g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "image-size", checkpoint->image_size);
+	g_key_file_set_string(key_file, CHECKPOINT_GROUP, "device", checkpoint->device);
+	g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "offset", checkpoint->offset);
+	g_key_file_set_string_list(key_file, CHECKPOINT_GROUP, "range-hashes",
+			(const gchar * const *)checkpoint->range_hashes->pdata, checkpoint->range_hashes->len);
+
+	return g_key_file_save_to_file(key_file, checkpoint->filename, error);
+}
+
+/* Reads back the range at index from the device and compares it with the
+ * hash stored in the checkpoint. */
+static gboolean checkpoint_check_range(const RaucCheckpoint *checkpoint, int fd, guint index, guint8 *buffer, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	off_t offset = (off_t)index * R_CHECKPOINT_INTERVAL;
+
+	for (gsize done = 0; done < R_CHECKPOINT_INTERVAL; done += CHECKPOINT_BUFFER_SIZE) {
+		if (!r_pread_exact(fd, buffer, CHECKPOINT_BUFFER_SIZE, offset + done, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_checksum_update(checksum, buffer, CHECKPOINT_BUFFER_SIZE);
+	}
+
+	if (g_strcmp0(g_checksum_get_string(checksum), g_ptr_array_index(checkpoint->range_hashes, index)) != 0) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				"Data at offset %"G_GUINT64_FORMAT " does not match checkpoint", (guint64)offset);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean checkpoint_load(RaucCheckpoint *checkpoint, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *bundle_hash = NULL;
+	g_autofree gchar *image_digest = NULL;
+	g_autofree gchar *device = NULL;
+	g_auto(GStrv) range_hashes = NULL;
+	gsize range_count = 0;
+	gint64 image_size, offset;
+
+	if (!g_key_file_load_from_file(key_file, checkpoint->filename, G_KEY_FILE_NONE, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	bundle_hash = g_key_file_get_string(key_file, CHECKPOINT_GROUP, "bundle-hash", NULL);
+	image_digest = g_key_file_get_string(key_file, CHECKPOINT_GROUP, "image-digest", NULL);
+	image_size = g_key_file_get_int64(key_file, CHECKPOINT_GROUP, "image-size", NULL);
+	device = g_key_file_get_string(key_file, CHECKPOINT_GROUP, "device", NULL);
+	offset = g_key_file_get_int64(key_file, CHECKPOINT_GROUP, "offset", NULL);
+	range_hashes = g_key_file_get_string_list(key_file, CHECKPOINT_GROUP, "range-hashes", &range_count, NULL);
+
+	if (g_strcmp0(bundle_hash, checkpoint->bundle_hash) != 0 ||
+	    g_strcmp0(image_digest, checkpoint->image_digest) != 0 ||
+	    image_size != checkpoint->image_size ||
+	    g_strcmp0(device, checkpoint->device) != 0) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				"Checkpoint belongs to a different installation");
+		return FALSE;
+	}
+
+	if (offset <= 0 || offset > image_size ||
+	    (guint64)offset != (guint64)range_count * R_CHECKPOINT_INTERVAL) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				"Inconsistent checkpoint offset %"G_GINT64_FORMAT, offset);
+		return FALSE;
+	}
+
+	for (gsize i = 0; i < range_count; i++)
+		g_ptr_array_add(checkpoint->range_hashes, g_strdup(range_hashes[i]));
+	checkpoint->offset = offset;
+
+	return TRUE;
+}
+
+goffset r_checkpoint_resume(RaucCheckpoint *checkpoint)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *buffer = NULL;
+	int fd;
+
+	g_return_val_if_fail(checkpoint, 0);
+	g_return_val_if_fail(checkpoint->offset == 0, 0);
+
+	if (!g_file_test(checkpoint->filename, G_FILE_TEST_EXISTS))
+		return 0;
+
+	if (!checkpoint_load(checkpoint, &ierror)) {
+		g_message("Ignoring install checkpoint: %s", ierror->message);
+		g_clear_error(&ierror);
+		goto discard;
+	}
+
+	fd = g_open(checkpoint->device, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		int err = errno;
+		g_message("Ignoring install checkpoint: Failed to open %s: %s", checkpoint->device, g_strerror(err));
+		goto discard;
+	}
+
+	buffer = g_malloc(CHECKPOINT_BUFFER_SIZE);
+	for (guint i = 0; i < checkpoint->range_hashes->len; i++) {
+		if (!checkpoint_check_range(checkpoint, fd, i, buffer, &ierror)) {
+			g_message("Ignoring install checkpoint: %s", ierror->message);
+			g_clear_error(&ierror);
+			g_close(fd, NULL);
+			goto discard;
+		}
+	}
+	g_close(fd, NULL);
+
+	g_message("Resuming installation to %s at offset %"G_GOFFSET_FORMAT, checkpoint->device, checkpoint->offset);
+	return checkpoint->offset;
+
+discard:
+	g_ptr_array_set_size(checkpoint->range_hashes, 0);
+	checkpoint->offset = 0;
+	r_checkpoint_remove(checkpoint);
+	return 0;
+}
+
+gboolean r_checkpoint_update(RaucCheckpoint *checkpoint, int fd, const guint8 *data, gsize size, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(checkpoint, FALSE);
+	g_return_val_if_fail(data || size == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	while (size) {
+		gsize len = MIN(size, (gsize)(R_CHECKPOINT_INTERVAL - checkpoint->range_fill));
+
+		g_checksum_update(checkpoint->range_checksum, data, len);
+		checkpoint->range_fill += len;
+		data += len;
+		size -= len;
+
+		if (checkpoint->range_fill < R_CHECKPOINT_INTERVAL)
+			continue;
+
+		/* make sure the range is durable before recording it */
+		if (fsync(fd) == -1) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Syncing content to disk failed: %s", g_strerror(err));
+			return FALSE;
+		}
+
+		g_ptr_array_add(checkpoint->range_hashes, g_strdup(g_checksum_get_string(checkpoint->range_checksum)));
+		g_checksum_reset(checkpoint->range_checksum);
+		checkpoint->range_fill = 0;
+		checkpoint->offset += R_CHECKPOINT_INTERVAL;
+
+		if (!checkpoint_save(checkpoint, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to save install checkpoint: ");
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+void r_checkpoint_remove(RaucCheckpoint *checkpoint)
+{
+	g_return_if_fail(checkpoint);
+
+	if (g_unlink(checkpoint->filename) != 0 && errno != ENOENT) {
+		int err = errno;
+		g_warning("Failed to remove install checkpoint %s: %s", checkpoint->filename, g_strerror(err));
+	}
+}
+
+void r_checkpoint_free(RaucCheckpoint *checkpoint)
+{
+	if (!checkpoint)
+		return;
+
+	g_free(checkpoint->filename);
+	g_free(checkpoint->bundle_hash);
+	g_free(checkpoint->image_digest);
+	g_free(checkpoint->device);
+	g_ptr_array_unref(checkpoint->range_hashes);
+	g_checksum_free(checkpoint->range_checksum);
+	g_free(checkpoint);
+}
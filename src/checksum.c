@@ -16,13 +16,16 @@ G_STATIC_ASSERT(RAUC_DEFAULT_CHECKSUM != 0);
 
 G_DEFINE_QUARK(r-checksum-error-quark, r_checksum_error)
 
+/* Size of the buffer used to read files for checksumming */
+#define CHECKSUM_BUFFER_SIZE (1024*1024)
+
 static gboolean
-update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, GError **error)
+update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, RChecksumDataFunc func, gpointer user_data, GError **error)
 {
 	g_auto(filedesc) fd = -1;
+	g_autofree guchar *buf = g_malloc(CHECKSUM_BUFFER_SIZE);
 	goffset size = 0;
 	gssize r;
-	guchar buf[4096];
 
 	fd = open(filename, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
@@ -30,9 +33,13 @@ update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, GError *
 				"Failed to open file %s: %s", filename, strerror(errno));
 		return FALSE;
 	}
+	/* only a hint for read-ahead, failures are irrelevant */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 	while (1) {
-		r = read(fd, buf, sizeof(buf));
+		r = read(fd, buf, CHECKSUM_BUFFER_SIZE);
 		if (r < 0) {
+			if (errno == EINTR)
+				continue;
 			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
 					"Read from %s failed: %s", filename, strerror(errno));
 			return FALSE;
@@ -41,13 +48,15 @@ update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, GError *
 			break;
 		size += r;
 		g_checksum_update(ctx, buf, r);
+		if (func)
+			func(buf, r, user_data);
 	}
 	*total += size;
 
 	return TRUE;
 }
 
-gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError **error)
+gboolean compute_checksum_full(RaucChecksum *checksum, const gchar *filename, RChecksumDataFunc func, gpointer user_data, GError **error)
 {
 	g_autoptr(GChecksum) ctx = NULL;
 	GChecksumType type = checksum->type;
@@ -59,7 +68,7 @@ gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError
 		type = RAUC_DEFAULT_CHECKSUM;
 	ctx = g_checksum_new(type);
 
-	if (!update_from_file(ctx, filename, &total, error))
+	if (!update_from_file(ctx, filename, &total, func, user_data, error))
 		return FALSE;
 
 	g_clear_pointer(&checksum->digest, g_free);
@@ -70,6 +79,11 @@ gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError
 	return TRUE;
 }
 
+gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError **error)
+{
+	return compute_checksum_full(checksum, filename, NULL, NULL, error);
+}
+
 gboolean verify_checksum(const RaucChecksum *checksum, const gchar *filename, GError **error)
 {
 	gboolean res = FALSE;
@@ -7,6 +7,7 @@
 #include "install.h"
 #include "manifest.h"
 #include "mount.h"
+#include "resources.h"
 #include "utils.h"
 
 G_DEFINE_QUARK(r-config-error-quark, r_config_error)
@@ -20,6 +21,14 @@ void default_config(RaucConfig **config)
 
 	c->max_bundle_download_size = DEFAULT_MAX_BUNDLE_DOWNLOAD_SIZE;
 	c->mount_prefix = g_strdup("/mnt/rauc/");
+	c->streaming_cache_size = DEFAULT_STREAMING_CACHE_SIZE;
+	c->streaming_read_ahead = DEFAULT_STREAMING_READ_AHEAD;
+	c->streaming_max_retries = DEFAULT_STREAMING_MAX_RETRIES;
+	c->streaming_connect_timeout = DEFAULT_STREAMING_CONNECT_TIMEOUT;
+	c->streaming_connections = DEFAULT_STREAMING_CONNECTIONS;
+	c->streaming_max_concurrency = DEFAULT_STREAMING_MAX_CONCURRENCY;
+	c->streaming_disk_cache_size = DEFAULT_STREAMING_DISK_CACHE_SIZE;
+	r_resources_init(&c->resources);
 	/* When installing, we need a system.conf anyway, so this is used only
 	 * for info/convert/extract/...
 	 */
@@ -31,6 +40,35 @@ void default_config(RaucConfig **config)
 	*config = c;
 }
 
+/* Consumes an optional integer key which must be at least min, the
+ * default_value is used if the key is not set. */
+static gboolean consume_optional_uint(GKeyFile *key_file, const gchar *group, const gchar *key,
+		gint min, guint32 default_value, guint32 *value, GError **error)
+{
+	GError *ierror = NULL;
+	gint result;
+
+	result = key_file_consume_integer(key_file, group, key, &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		*value = default_value;
+		g_clear_error(&ierror);
+		return TRUE;
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (result < min) {
+		g_set_error(error, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT,
+				"Invalid value (%d) for key \"%s\" in system config", result, key);
+		return FALSE;
+	}
+
+	*value = result;
+	return TRUE;
+}
+
 static gboolean fix_grandparent_links(GHashTable *slots, GError **error)
 {
 	/* Every child slot in a group must refer to the same parent.
@@ -321,6 +359,16 @@ static GHashTable *parse_slots(const char *filename, const char *data_directory,
 			}
 			g_key_file_remove_key(key_file, groups[i], "resize", NULL);
 
+			slot->pre_discard = g_key_file_get_boolean(key_file, groups[i], "pre-discard", &ierror);
+			if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+				slot->pre_discard = FALSE;
+				g_clear_error(&ierror);
+			} else if (ierror) {
+				g_propagate_error(error, ierror);
+				return NULL;
+			}
+			g_key_file_remove_key(key_file, groups[i], "pre-discard", NULL);
+
 			if (g_strcmp0(slot->type, "boot-mbr-switch") == 0 ||
 			    g_strcmp0(slot->type, "boot-gpt-switch") == 0 ||
 			    g_strcmp0(slot->type, "boot-raw-fallback") == 0) {
@@ -429,6 +477,7 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	gboolean dtbvariant;
 	g_autofree gchar *variant_data = NULL;
 	g_autofree gchar *bundle_formats = NULL;
+	g_autofree gchar *io_class = NULL;
 	gsize entries;
 
 	g_return_val_if_fail(filename, FALSE);
@@ -587,6 +636,16 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	}
 	g_key_file_remove_key(key_file, "system", "activate-installed", NULL);
 
+	c->parallel_install = g_key_file_get_boolean(key_file, "system", "parallel-install", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->parallel_install = FALSE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_key_file_remove_key(key_file, "system", "parallel-install", NULL);
+
 	c->system_variant_type = R_CONFIG_SYS_VARIANT_NONE;
 
 	/* parse 'variant-dtb' key */
@@ -815,6 +874,7 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	c->streaming_tls_cert = key_file_consume_string(key_file, "streaming", "tls-cert", NULL);
 	c->streaming_tls_key = key_file_consume_string(key_file, "streaming", "tls-key", NULL);
 	c->streaming_tls_ca = key_file_consume_string(key_file, "streaming", "tls-ca", NULL);
+	c->streaming_lan_cache = key_file_consume_string(key_file, "streaming", "lan-cache", NULL);
 	c->enabled_headers = g_key_file_get_string_list(key_file, "streaming", "send-headers", &entries, &ierror);
 	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
 	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
@@ -832,12 +892,161 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 		}
 	}
 	g_key_file_remove_key(key_file, "streaming", "send-headers", NULL);
+	c->streaming_cache_size = key_file_consume_binary_suffixed_string(key_file, "streaming",
+			"cache-size", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_cache_size = DEFAULT_STREAMING_CACHE_SIZE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	c->streaming_read_ahead = key_file_consume_binary_suffixed_string(key_file, "streaming",
+			"read-ahead", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_read_ahead = DEFAULT_STREAMING_READ_AHEAD;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (!consume_optional_uint(key_file, "streaming", "max-streams", 1, 0,
+			&c->streaming_max_streams, error))
+		return FALSE;
+	if (!consume_optional_uint(key_file, "streaming", "max-retries", 0, DEFAULT_STREAMING_MAX_RETRIES,
+			&c->streaming_max_retries, error))
+		return FALSE;
+	if (!consume_optional_uint(key_file, "streaming", "connect-timeout", 1, DEFAULT_STREAMING_CONNECT_TIMEOUT,
+			&c->streaming_connect_timeout, error))
+		return FALSE;
+	if (!consume_optional_uint(key_file, "streaming", "request-timeout", 0, 0,
+			&c->streaming_request_timeout, error))
+		return FALSE;
+	if (!consume_optional_uint(key_file, "streaming", "connections", 1, DEFAULT_STREAMING_CONNECTIONS,
+			&c->streaming_connections, error))
+		return FALSE;
+	c->streaming_device_max_request = key_file_consume_binary_suffixed_string(key_file, "streaming",
+			"device-max-request", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_device_max_request = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	c->streaming_device_read_ahead = key_file_consume_binary_suffixed_string(key_file, "streaming",
+			"device-read-ahead", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_device_read_ahead = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (!consume_optional_uint(key_file, "streaming", "max-concurrency", 1, DEFAULT_STREAMING_MAX_CONCURRENCY,
+			&c->streaming_max_concurrency, error))
+		return FALSE;
+	c->streaming_bandwidth_limit = key_file_consume_binary_suffixed_string(key_file, "streaming",
+			"bandwidth-limit", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_bandwidth_limit = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	c->streaming_disk_cache_directory = key_file_consume_string(key_file, "streaming", "disk-cache-directory", NULL);
+	c->streaming_disk_cache_size = key_file_consume_binary_suffixed_string(key_file, "streaming",
+			"disk-cache-size", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_disk_cache_size = DEFAULT_STREAMING_DISK_CACHE_SIZE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
 	if (!check_remaining_keys(key_file, "streaming", &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
 	g_key_file_remove_group(key_file, "streaming", NULL);
 
+	/* parse [resources] section */
+	r_resources_init(&c->resources);
+	io_class = key_file_consume_string(key_file, "resources", "io-class", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	} else if (!r_resources_parse_io_class(io_class, &c->resources.io_class, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	c->resources.io_priority = key_file_consume_integer(key_file, "resources", "io-priority", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->resources.io_priority = -1;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	} else if (c->resources.io_priority < 0) {
+		/* -1 is only used internally for 'class default' */
+		g_set_error(error, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT,
+				"Invalid io-priority %d in [resources] (must be 0-7)", c->resources.io_priority);
+		return FALSE;
+	}
+	c->resources.write_bandwidth = key_file_consume_binary_suffixed_string(key_file, "resources",
+			"write-bandwidth", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->resources.write_bandwidth = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	c->resources.nice = key_file_consume_integer(key_file, "resources", "nice", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->resources.nice = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	} else {
+		c->resources.nice_set = TRUE;
+	}
+	c->resources.cpu_affinity = g_key_file_get_integer_list(key_file, "resources", "cpu-affinity",
+			&c->resources.cpu_affinity_len, &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_key_file_remove_key(key_file, "resources", "cpu-affinity", NULL);
+	if (!r_resources_check(&c->resources, &ierror)) {
+		g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+				"Invalid [resources] configuration: %s", ierror->message);
+		g_clear_error(&ierror);
+		return FALSE;
+	}
+	if (!check_remaining_keys(key_file, "resources", &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_key_file_remove_group(key_file, "resources", NULL);
+
 	/* parse [encryption] section */
 	c->encryption_key = resolve_path_take(filename,
 			key_file_consume_string(key_file, "encryption", "key", NULL));
@@ -935,9 +1144,12 @@ void free_config(RaucConfig *config)
 	g_free(config->streaming_tls_cert);
 	g_free(config->streaming_tls_key);
 	g_free(config->streaming_tls_ca);
+	g_free(config->streaming_lan_cache);
+	g_free(config->streaming_disk_cache_directory);
 	g_strfreev(config->enabled_headers);
 	g_free(config->encryption_key);
 	g_free(config->encryption_cert);
+	r_resources_clear(&config->resources);
 	g_clear_pointer(&config->slots, g_hash_table_destroy);
 	g_free(config->custom_bootloader_backend);
 	g_free(config->file_checksum);
@@ -2,6 +2,7 @@
 #include <gio/gio.h>
 #include <string.h>
 
+#include "bundle.h"
 #include "config_file.h"
 #include "context.h"
 #include "status_file.h"
@@ -12,6 +13,8 @@
 
 RaucContext *context = NULL;
 gboolean context_configuring = FALSE;
+/* progress updates from threads with this set are ignored */
+static GPrivate progress_muted;
 
 static gchar *regex_match(const gchar *pattern, const gchar *string)
 {
@@ -440,6 +443,8 @@ gboolean r_context_configure(GError **error)
 	g_assert_false(context->busy);
 
 	g_clear_pointer(&context->config, free_config);
+	/* remote bundles were verified with the previous keyring */
+	clear_remote_bundle_cache();
 	configmode = context->configmode;
 	if (context->configpath) {
 		/* explicitly set on the command line */
@@ -595,12 +600,17 @@ void r_context_begin_step(const gchar *name, const gchar *description,
 void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 		gint substeps, gint weight)
 {
-	RaucProgressStep *step = g_new0(RaucProgressStep, 1);
+	RaucProgressStep *step;
 	RaucProgressStep *parent;
 
 	g_return_if_fail(name);
 	g_return_if_fail(description);
 
+	if (g_private_get(&progress_muted))
+		return;
+
+	step = g_new0(RaucProgressStep, 1);
+
 	/* set properties */
 	step->name = g_strdup(name);
 	step->description = g_strdup(description);
@@ -677,6 +687,9 @@ void r_context_end_step(const gchar *name, gboolean success)
 
 	g_return_if_fail(name);
 
+	if (g_private_get(&progress_muted))
+		return;
+
 	/* "stack" should never be NULL at this point */
 	g_assert_nonnull(context->progress);
 
@@ -737,6 +750,9 @@ void r_context_set_step_percentage(const gchar *name, gint custom_percent)
 
 	g_return_if_fail(name);
 
+	if (g_private_get(&progress_muted))
+		return;
+
 	g_assert_nonnull(context->progress);
 
 	step = context->progress->data;
@@ -765,6 +781,11 @@ void r_context_set_step_percentage(const gchar *name, gint custom_percent)
 		r_context_send_progress(FALSE, FALSE);
 }
 
+void r_context_mute_progress(gboolean mute)
+{
+	g_private_set(&progress_muted, GINT_TO_POINTER(mute));
+}
+
 void r_context_free_progress_step(RaucProgressStep *step)
 {
 	if (!step)
@@ -849,6 +870,7 @@ void r_context_clean(void)
 		g_clear_pointer(&context->signing_keyringpath, g_free);
 		g_clear_pointer(&context->encryption_key, g_free);
 		g_clear_pointer(&context->mksquashfs_args, g_free);
+		g_clear_pointer(&context->build_cache_dir, g_free);
 		g_clear_pointer(&context->casync_args, g_free);
 		g_clear_pointer(&context->recipients, g_strfreev);
 		g_clear_pointer(&context->intermediatepaths, g_strfreev);
@@ -869,4 +891,7 @@ void r_context_clean(void)
 
 		g_clear_pointer(&context, g_free);
 	}
+
+	clear_remote_bundle_cache();
+	signature_cleanup();
 }
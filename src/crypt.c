@@ -1,12 +1,17 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <openssl/evp.h>
+#include <sys/stat.h>
 
 #include "crypt.h"
 #include "utils.h"
+#include "verity_hash.h"
 
 #define ENC_SEC_SIZE	4096
+/* Sectors processed by a worker at a time */
+#define ENC_CHUNK_SECTORS	256
 
 GQuark r_crypt_error_quark(void)
 {
@@ -25,40 +30,53 @@ static void iv_plain64(guint8 *iv, guint iv_size, guint64 sector)
 	memcpy(iv, &iv_val, sizeof(guint64));
 }
 
+/* State shared by all workers of a single encryption/decryption run */
+typedef struct {
+	int in_fd;
+	int out_fd;
+	const uint8_t *key;
+	gboolean encrypt;
+	guint64 sectors;
+	const guint8 *salt;
+	guint8 *digests; /* verity digests of the output, if set */
+	gint next_chunk; /* accessed atomically */
+	gint failed; /* accessed atomically */
+	GMutex lock; /* protects error */
+	GError *error;
+} RCryptJob;
+
+static void crypt_job_fail(RCryptJob *job, GError *ierror)
+{
+	g_atomic_int_set(&job->failed, 1);
+
+	g_mutex_lock(&job->lock);
+	if (!job->error)
+		job->error = ierror;
+	else
+		g_error_free(ierror);
+	g_mutex_unlock(&job->lock);
+}
+
 /*
- * Encrypts or decrypts image to be used with dm-verity in aes-cbc-plain64 mode.
- *
- * Actual operation is chosen by 'encrypt' argument.
- *
- * Meant for internal use only, use r_crypt_encrypt() or r_crypt_decrypt()
- * instead.
- *
- * @param fd input (source) FILE
- * @param out output (encrypted) FILE
- * @param key AES key to use for encryption/decryption
- * @param encrypt whether to encrypt (TRUE) or decrypt (FALSE)
- * @param maxsize limits decryption of input FILE to maxsize bytes.
+ * Worker thread for encrypt_or_decrypt().
  *
- * @return TRUE on success, FALSE on error
+ * Each worker has its own cipher context (the AES key schedule is set up only
+ * once) and claims chunks of ENC_CHUNK_SECTORS sectors until all sectors are
+ * processed or any worker failed. As plain64 IVs depend on the sector number
+ * only, chunks can be processed in any order.
  */
-static gboolean encrypt_or_decrypt(FILE *fd, FILE *out, const uint8_t *key, gboolean encrypt, goffset maxsize, GError **error)
+static gpointer crypt_worker_thread(gpointer data)
 {
-	/* Allow enough space in output buffer for additional block */
-	unsigned char inbuf[ENC_SEC_SIZE], outbuf[ENC_SEC_SIZE];
+	RCryptJob *job = data;
 	g_autoptr(EVP_CIPHER_CTX) ctx = NULL;
-	int ret;
-	const EVP_CIPHER *cipher = EVP_aes_256_cbc();
-	guint64 sector_count = 0;
+	g_autofree guint8 *inbuf = g_malloc(ENC_CHUNK_SECTORS * ENC_SEC_SIZE);
+	g_autofree guint8 *outbuf = g_malloc(ENC_CHUNK_SECTORS * ENC_SEC_SIZE);
+	GError *ierror = NULL;
 	guint8 iv[16];
-	goffset donesize = 0;
+	guint8 final[EVP_MAX_BLOCK_LENGTH];
 
-	g_return_val_if_fail(fd != NULL, FALSE);
-	g_return_val_if_fail(out != NULL, FALSE);
-
-	/* Don't set key or IV right away; we want to check lengths */
 	ctx = EVP_CIPHER_CTX_new();
-	ret = EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, encrypt ? 1 : 0);
-	if (!ret)
+	if (!EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, job->key, NULL, job->encrypt ? 1 : 0))
 		g_error("Error setting cipher");
 
 	/* disable padding as we expect to have only matching blocks*/
@@ -68,52 +86,160 @@ static gboolean encrypt_or_decrypt(FILE *fd, FILE *out, const uint8_t *key, gboo
 	g_assert(EVP_CIPHER_CTX_key_length(ctx) == 32);
 	g_assert(EVP_CIPHER_CTX_iv_length(ctx) == 16);
 
-	/* encrypt/decrypt in 4096 byte sectors */
-	for (;;) {
-		int inlen, outlen;
-
-		/* plain64 iv mode */
-		iv_plain64(iv, 16, sector_count++);
+	while (!g_atomic_int_get(&job->failed)) {
+		guint64 first = (guint64)g_atomic_int_add(&job->next_chunk, 1) * ENC_CHUNK_SECTORS;
+		guint64 count;
+		gsize len;
 
-		/* set up with key and iv for encryption/decryption */
-		ret = EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, encrypt ? 1 : 0);
-		if (!ret)
-			g_error("Error setting key and iv");
+		if (first >= job->sectors)
+			break;
+		count = MIN(ENC_CHUNK_SECTORS, job->sectors - first);
+		len = count * ENC_SEC_SIZE;
 
-		inlen = fread(inbuf, 1, ENC_SEC_SIZE, fd);
-		donesize += inlen;
-		/* image size must be multiple of 4096 */
-		if (inlen <= 0)
+		if (!r_pread_exact(job->in_fd, inbuf, len, first * ENC_SEC_SIZE, &ierror)) {
+			crypt_job_fail(job, ierror);
 			break;
-		if (inlen < ENC_SEC_SIZE) {
-			g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Incomplete read: Input size must be multiple of %d (got only %d bytes)", ENC_SEC_SIZE, inlen);
-			return FALSE;
 		}
 
-		/* limit decrypt size to maxsize if set */
-		if (maxsize && donesize > maxsize) {
-			return TRUE;
-		}
+		for (guint64 i = 0; i < count; i++) {
+			int outlen;
+
+			/* plain64 iv mode, the key is kept from the initial setup */
+			iv_plain64(iv, 16, first + i);
+			if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, job->encrypt ? 1 : 0))
+				g_error("Error setting key and iv");
+
+			if (!EVP_CipherUpdate(ctx, outbuf + i * ENC_SEC_SIZE, &outlen, inbuf + i * ENC_SEC_SIZE, ENC_SEC_SIZE) ||
+			    outlen != ENC_SEC_SIZE) {
+				crypt_job_fail(job, g_error_new(R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherUpdate() failed"));
+				return NULL;
+			}
 
-		if (!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, ENC_SEC_SIZE)) {
-			g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherUpdate() failed");
-			return FALSE;
+			if (!EVP_CipherFinal_ex(ctx, final, &outlen) || outlen != 0) {
+				crypt_job_fail(job, g_error_new(R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherFinal_ex() failed"));
+				return NULL;
+			}
 		}
 
-		fwrite(outbuf, 1, outlen, out);
+		if (job->digests &&
+		    r_verity_hash_data_blocks(outbuf, count, job->digests + first * R_VERITY_DIGEST_SIZE, job->salt) != 0) {
+			crypt_job_fail(job, g_error_new(R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Failed to hash sectors for verity"));
+			break;
+		}
 
-		if (!EVP_CipherFinal_ex(ctx, outbuf, &outlen)) {
-			g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherFinal_ex() failed");
-			return FALSE;
+		if (!r_pwrite_exact(job->out_fd, outbuf, len, first * ENC_SEC_SIZE, &ierror)) {
+			crypt_job_fail(job, ierror);
+			break;
 		}
 	}
 
+	return NULL;
+}
+
+/*
+ * Encrypts or decrypts image to be used with dm-verity in aes-cbc-plain64 mode.
+ *
+ * Actual operation is chosen by 'encrypt' argument.
+ *
+ * Sectors are independent in plain64 mode, so they are distributed to one
+ * worker thread per CPU, which read and write large chunks at their offsets.
+ *
+ * If a salt is given, the workers also hash the output sectors for dm-verity
+ * while they are still in memory and the hash tree is appended to the output
+ * afterwards.
+ *
+ * Meant for internal use only, use r_crypt_encrypt() or r_crypt_decrypt()
+ * instead.
+ *
+ * @param in_fd input (source) file descriptor
+ * @param out_fd output (encrypted) file descriptor
+ * @param key AES key to use for encryption/decryption
+ * @param encrypt whether to encrypt (TRUE) or decrypt (FALSE)
+ * @param maxsize limits decryption of input file to maxsize bytes.
+ * @param salt verity salt, or NULL to not create a hash tree
+ * @param root_hash return location for the verity root hash
+ * @param verity_size return location for the size of the hash tree
+ *
+ * @return TRUE on success, FALSE on error
+ */
+static gboolean encrypt_or_decrypt(int in_fd, int out_fd, const uint8_t *key, gboolean encrypt, goffset maxsize, const guint8 *salt, guint8 *root_hash, guint64 *verity_size, GError **error)
+{
+	RCryptJob job = {
+		.in_fd = in_fd,
+		.out_fd = out_fd,
+		.key = key,
+		.encrypt = encrypt,
+	};
+	g_autoptr(GPtrArray) threads = g_ptr_array_new();
+	g_autofree guint8 *digests = NULL;
+	guint64 combined_blocks = 0;
+	GStatBuf st;
+	goffset size;
+	guint n_threads;
+
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+
+	if (fstat(in_fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat input: %s", g_strerror(err));
+		return FALSE;
+	}
+	size = st.st_size;
+
+	/* limit decrypt size to maxsize (in complete sectors) if set */
+	if (maxsize && maxsize < size) {
+		size = maxsize - (maxsize % ENC_SEC_SIZE);
+	} else if (size % ENC_SEC_SIZE) {
+		/* image size must be multiple of 4096 */
+		g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Incomplete read: Input size must be multiple of %d (got only %d bytes)", ENC_SEC_SIZE, (int)(size % ENC_SEC_SIZE));
+		return FALSE;
+	}
+
+	job.sectors = size / ENC_SEC_SIZE;
+	if (job.sectors / ENC_CHUNK_SECTORS >= G_MAXINT) {
+		g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Input size %"G_GOFFSET_FORMAT " too large", size);
+		return FALSE;
+	}
+	if (salt) {
+		G_STATIC_ASSERT(ENC_SEC_SIZE == R_VERITY_BLOCK_SIZE);
+		digests = g_malloc(job.sectors * R_VERITY_DIGEST_SIZE);
+		job.salt = salt;
+		job.digests = digests;
+	}
+	g_mutex_init(&job.lock);
+
+	n_threads = MIN(g_get_num_processors(), (job.sectors + ENC_CHUNK_SECTORS - 1) / ENC_CHUNK_SECTORS);
+	n_threads = MAX(n_threads, 1);
+	for (guint i = 0; i < n_threads; i++)
+		g_ptr_array_add(threads, g_thread_new("crypt-worker", crypt_worker_thread, &job));
+	for (guint i = 0; i < threads->len; i++)
+		g_thread_join(g_ptr_array_index(threads, i));
+
+	g_mutex_clear(&job.lock);
+
+	if (job.error) {
+		g_propagate_error(error, job.error);
+		return FALSE;
+	}
+
+	if (!salt)
+		return TRUE;
+
+	if (job.sectors <= 1 ||
+	    r_verity_hash_create_from_digests(out_fd, job.sectors, digests, &combined_blocks, root_hash, salt) != 0) {
+		g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Failed to generate verity hash tree");
+		return FALSE;
+	}
+	*verity_size = (combined_blocks - job.sectors) * R_VERITY_BLOCK_SIZE;
+
 	return TRUE;
 }
 
-static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *outpath, const uint8_t *key, gboolean encrypt, goffset maxsize, GError **error)
+static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *outpath, const uint8_t *key, gboolean encrypt, goffset maxsize, const guint8 *salt, guint8 *root_hash, guint64 *verity_size, GError **error)
 {
-	FILE *infile = NULL, *outfile = NULL;
+	int infd = -1, outfd = -1;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 
@@ -122,8 +248,8 @@ static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *out
 	g_return_val_if_fail(key, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	infile = g_fopen(inpath, "r");
-	if (!infile) {
+	infd = g_open(inpath, O_RDONLY | O_CLOEXEC, 0);
+	if (infd < 0) {
 		int err = errno;
 		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 				"Failed opening %s for reading: %s", inpath, g_strerror(err));
@@ -131,8 +257,8 @@ static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *out
 		goto out;
 	}
 
-	outfile = g_fopen(outpath, "w");
-	if (!outfile) {
+	outfd = g_open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (outfd < 0) {
 		int err = errno;
 		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 				"Failed opening temporary file %s for writing: %s", outpath, g_strerror(err));
@@ -140,28 +266,46 @@ static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *out
 		goto out;
 	}
 
-	res = encrypt_or_decrypt(infile, outfile, key, encrypt, maxsize, &ierror);
+	res = encrypt_or_decrypt(infd, outfd, key, encrypt, maxsize, salt, root_hash, verity_size, &ierror);
 	if (!res) {
 		g_propagate_prefixed_error(error, ierror,
 				"Failed to %s image: ", encrypt ? "encrypt" : "decrypt");
 		goto out;
 	}
 
+	if (!g_close(outfd, &ierror)) {
+		outfd = -1;
+		g_propagate_prefixed_error(error, ierror,
+				"Failed to close %s: ", outpath);
+		res = FALSE;
+		goto out;
+	}
+	outfd = -1;
+
 	res = TRUE;
 out:
-	if (infile)
-		fclose(infile);
-	if (outfile)
-		fclose(outfile);
+	if (infd >= 0)
+		g_close(infd, NULL);
+	if (outfd >= 0)
+		g_close(outfd, NULL);
 	return res;
 }
 
 gboolean r_crypt_encrypt(const gchar *in, const gchar *out, const guint8 *key, GError **error)
 {
-	return r_crypt_encrypt_or_decrypt(in, out, key, TRUE, 0, error);
+	return r_crypt_encrypt_or_decrypt(in, out, key, TRUE, 0, NULL, NULL, NULL, error);
+}
+
+gboolean r_crypt_encrypt_verity(const gchar *in, const gchar *out, const guint8 *key, const guint8 *salt, guint8 *root_hash, guint64 *verity_size, GError **error)
+{
+	g_return_val_if_fail(salt, FALSE);
+	g_return_val_if_fail(root_hash, FALSE);
+	g_return_val_if_fail(verity_size, FALSE);
+
+	return r_crypt_encrypt_or_decrypt(in, out, key, TRUE, 0, salt, root_hash, verity_size, error);
 }
 
 gboolean r_crypt_decrypt(const gchar *in, const gchar *out, const guint8 *key, goffset maxsize, GError **error)
 {
-	return r_crypt_encrypt_or_decrypt(in, out, key, FALSE, maxsize, error);
+	return r_crypt_encrypt_or_decrypt(in, out, key, FALSE, maxsize, NULL, NULL, NULL, error);
 }
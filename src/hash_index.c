@@ -362,6 +362,70 @@ out:
 	return g_steal_pointer(&idx);
 }
 
+#if ENABLE_ZSTD == 1
+/*
+ * Opens the hash index of a seekable zstd image.
+ *
+ * The index file created with the bundle is required, as the chunks are
+ * hashed uncompressed and can only be read by decompressing their frame.
+ */
+static RaucHashIndex *open_zstd_image(const gchar *label, int data_fd, const gchar *hashes_filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucHashIndex) idx = g_new0(RaucHashIndex, 1);
+	g_autoptr(GMappedFile) mapped_file = NULL;
+	guint64 size;
+
+	idx->label = g_strdup(label);
+	/* the fd is only owned by idx on success */
+	idx->data_fd = -1;
+
+	idx->zstd = r_zstd_seekable_open(data_fd, &ierror);
+	if (!idx->zstd) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	size = r_zstd_seekable_get_size(idx->zstd);
+	if (size == 0 || size % 4096 || size / 4096 > G_MAXUINT32) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"uncompressed size (%"G_GUINT64_FORMAT ") is not a non-zero multiple of 4096 bytes",
+				size);
+		return NULL;
+	}
+	idx->count = size / 4096;
+
+	if (!g_file_test(hashes_filename, G_FILE_TEST_IS_REGULAR)) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_NOT_FOUND,
+				"missing hash index %s for seekable zstd image", hashes_filename);
+		return NULL;
+	}
+
+	mapped_file = g_mapped_file_new(hashes_filename, FALSE, &ierror);
+	if (!mapped_file) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	if (g_mapped_file_get_length(mapped_file) != (gsize)idx->count * SHA256_LEN) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"hash index %s does not match uncompressed image size", hashes_filename);
+		return NULL;
+	}
+	idx->hashes = g_mapped_file_get_bytes(mapped_file);
+
+	hash_index_prepare(idx);
+	idx->data_fd = data_fd;
+
+	return g_steal_pointer(&idx);
+}
+#endif
+
 RaucHashIndex *r_hash_index_open_image(const gchar *label, const RaucImage *image, GError **error)
 {
 	GError *ierror = NULL;
@@ -373,7 +437,7 @@ RaucHashIndex *r_hash_index_open_image(const gchar *label, const RaucImage *imag
 	g_return_val_if_fail(image, NULL);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	data_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC);
+	data_fd = g_open(r_image_get_data_path(image), O_RDONLY | O_CLOEXEC);
 	if (data_fd < 0) {
 		int err = errno;
 		g_set_error(error,
@@ -385,7 +449,18 @@ RaucHashIndex *r_hash_index_open_image(const gchar *label, const RaucImage *imag
 
 	index_filename = g_strdup_printf("%s.block-hash-index", image->filename);
 
-	idx = r_hash_index_open(label, data_fd, index_filename, &ierror);
+	if (image->seekable_zstd) {
+#if ENABLE_ZSTD == 1
+		idx = open_zstd_image(label, data_fd, index_filename, &ierror);
+#else
+		g_set_error(&ierror,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_NOT_FOUND,
+				"seekable zstd images are not supported by this build");
+#endif
+	} else {
+		idx = r_hash_index_open(label, data_fd, index_filename, &ierror);
+	}
 	if (!idx) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -526,6 +601,15 @@ gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, Ra
 	}
 
 	offset = ((off_t)(idx->lookup[middle])) * sizeof(chunk->data);
+#if ENABLE_ZSTD == 1
+	if (idx->zstd) {
+		if (!r_zstd_seekable_pread(idx->zstd, chunk->data, sizeof(chunk->data), offset, &ierror)) {
+			g_propagate_error(error, ierror);
+			ret = FALSE;
+			goto out;
+		}
+	} else
+#endif
 	if (!r_pread_exact(idx->data_fd, chunk->data, sizeof(chunk->data), offset, &ierror)) {
 		if (ierror) {
 			g_propagate_error(error, ierror);
@@ -566,7 +650,11 @@ void r_hash_index_free(RaucHashIndex *idx)
 
 	g_free(idx->label);
 
-	g_close(idx->data_fd, NULL);
+#if ENABLE_ZSTD == 1
+	r_zstd_seekable_free(idx->zstd);
+#endif
+	if (idx->data_fd >= 0)
+		g_close(idx->data_fd, NULL);
 
 	g_bytes_unref(idx->hashes);
 	g_free(idx->lookup);
@@ -575,3 +663,114 @@ void r_hash_index_free(RaucHashIndex *idx)
 
 	g_free(idx);
 }
+
+struct _RaucHashIndexBuilder {
+	GByteArray *hashes;
+	EVP_MD_CTX *mdctx;
+	guint8 partial[4096]; /* incomplete chunk from the last update */
+	gsize partial_len;
+	guint64 size;
+};
+
+RaucHashIndexBuilder *r_hash_index_builder_new(void)
+{
+	RaucHashIndexBuilder *builder = g_new0(RaucHashIndexBuilder, 1);
+
+	builder->hashes = g_byte_array_new();
+	builder->mdctx = EVP_MD_CTX_new();
+
+	return builder;
+}
+
+static void builder_hash_chunk(RaucHashIndexBuilder *builder, const guint8 *data)
+{
+	guint8 hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_size = 0;
+
+	if (EVP_DigestInit_ex(builder->mdctx, EVP_sha256(), NULL) != 1 ||
+	    EVP_DigestUpdate(builder->mdctx, data, sizeof(builder->partial)) != 1 ||
+	    EVP_DigestFinal_ex(builder->mdctx, hash, &hash_size) != 1)
+		g_error("failed to calculate OpenSSL EVP digest");
+
+	g_assert(hash_size == SHA256_LEN);
+
+	g_byte_array_append(builder->hashes, hash, SHA256_LEN);
+}
+
+void r_hash_index_builder_update(RaucHashIndexBuilder *builder, const guint8 *data, gsize len)
+{
+	g_return_if_fail(builder);
+	g_return_if_fail(data || !len);
+
+	builder->size += len;
+
+	/* complete a chunk left over from the last update */
+	if (builder->partial_len) {
+		gsize fill = MIN(len, sizeof(builder->partial) - builder->partial_len);
+
+		memcpy(builder->partial + builder->partial_len, data, fill);
+		builder->partial_len += fill;
+		data += fill;
+		len -= fill;
+
+		if (builder->partial_len < sizeof(builder->partial))
+			return;
+		builder_hash_chunk(builder, builder->partial);
+		builder->partial_len = 0;
+	}
+
+	while (len >= sizeof(builder->partial)) {
+		builder_hash_chunk(builder, data);
+		data += sizeof(builder->partial);
+		len -= sizeof(builder->partial);
+	}
+
+	memcpy(builder->partial, data, len);
+	builder->partial_len = len;
+}
+
+gboolean r_hash_index_builder_export(const RaucHashIndexBuilder *builder, const gchar *hashes_filename, GError **error)
+{
+	g_autoptr(GBytes) hashes = NULL;
+
+	g_return_val_if_fail(builder, FALSE);
+	g_return_val_if_fail(hashes_filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* same constraints as for r_hash_index_open() */
+	if (builder->size == 0) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"data file is empty");
+		return FALSE;
+	} else if ((builder->size / 4096) > G_MAXUINT32) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"data file size (%"G_GUINT64_FORMAT ") is too large",
+				builder->size);
+		return FALSE;
+	} else if (builder->partial_len) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"data file size (%"G_GUINT64_FORMAT ") is not a multiple of 4096 bytes",
+				builder->size);
+		return FALSE;
+	}
+
+	hashes = g_bytes_new_static(builder->hashes->data, builder->hashes->len);
+
+	return write_file(hashes_filename, hashes, error);
+}
+
+void r_hash_index_builder_free(RaucHashIndexBuilder *builder)
+{
+	if (!builder)
+		return;
+
+	g_byte_array_unref(builder->hashes);
+	EVP_MD_CTX_free(builder->mdctx);
+	g_free(builder);
+}
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 
 #include "bootchooser.h"
@@ -396,6 +397,16 @@ GHashTable* determine_target_install_group(void)
 	return targetgroup;
 }
 
+/* Waits until a discard started for the plan's target slot has finished. */
+static void wait_for_discard(RImageInstallPlan *plan)
+{
+	if (!plan->discard_thread)
+		return;
+
+	g_thread_join(plan->discard_thread);
+	plan->discard_thread = NULL;
+}
+
 void r_image_install_plan_free(gpointer value)
 {
 	RImageInstallPlan *plan = (RImageInstallPlan*)value;
@@ -403,6 +414,8 @@ void r_image_install_plan_free(gpointer value)
 	if (!plan)
 		return;
 
+	wait_for_discard(plan);
+
 	g_free(plan);
 }
 
@@ -927,7 +940,7 @@ static gboolean pre_install_checks(gchar* bundledir, GPtrArray *install_plans, G
 			plan->image->filename = filename;
 		}
 
-		if (!g_file_test(plan->image->filename, G_FILE_TEST_EXISTS)) {
+		if (!g_file_test(r_image_get_data_path(plan->image), G_FILE_TEST_EXISTS)) {
 			g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_NOSRC,
 					"Source image '%s' not found in bundle", plan->image->filename);
 			return FALSE;
@@ -949,6 +962,9 @@ skip_filename_checks:
 	return TRUE;
 }
 
+/* serializes slot status updates from parallel install workers */
+static GMutex slot_status_mutex;
+
 static void update_slot_status(RaucSlotStatus *slot_state, const gchar* status, const RaucManifest *manifest, const RImageInstallPlan *plan, const RaucInstallArgs *args)
 {
 	g_autoptr(GDateTime) now = NULL;
@@ -971,7 +987,44 @@ static void update_slot_status(RaucSlotStatus *slot_state, const gchar* status,
 	slot_state->installed_count++;
 }
 
-static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, const char *hook_name, GError **error)
+static gboolean update_and_save_slot_status(const gchar *status, const RaucManifest *manifest, const RImageInstallPlan *plan, const RaucInstallArgs *args, GError **error)
+{
+	gboolean res;
+
+	g_message("Updating slot %s status", plan->target_slot->name);
+
+	g_mutex_lock(&slot_status_mutex);
+	update_slot_status(plan->target_slot->status, status, manifest, plan, args);
+	res = r_slot_status_save(plan->target_slot, error);
+	g_mutex_unlock(&slot_status_mutex);
+
+	return res;
+}
+
+/* For global slot status: Clear checksum info and make status 'pending' to
+ * prevent the slot status from looking valid later in case we crash while
+ * installing. The per-slot status is stored on the slot itself and becomes
+ * invalid with its content. */
+static gboolean invalidate_slot_status(RImageInstallPlan *plan, GError **error)
+{
+	RaucSlotStatus *slot_state = plan->target_slot->status;
+	gboolean res;
+
+	if (g_strcmp0(r_context()->config->statusfile_path, "per-slot") == 0)
+		return TRUE;
+
+	g_mutex_lock(&slot_status_mutex);
+	g_clear_pointer(&slot_state->status, g_free);
+	slot_state->status = g_strdup("pending");
+	g_clear_pointer(&slot_state->checksum.digest, g_free);
+	slot_state->checksum.size = 0;
+	res = r_slot_status_save(plan->target_slot, error);
+	g_mutex_unlock(&slot_status_mutex);
+
+	return res;
+}
+
+static gboolean handle_slot_install_plan(const RaucManifest *manifest, RImageInstallPlan *plan, RaucInstallArgs *args, const char *hook_name, GError **error)
 {
 	GError *ierror = NULL;
 	RaucSlotStatus *slot_state = NULL;
@@ -980,7 +1033,9 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 
 	r_context_begin_step_weighted_formatted("check_slot", 0, 1, "Checking slot %s", plan->target_slot->name);
 
+	g_mutex_lock(&slot_status_mutex);
 	r_slot_status_load(plan->target_slot);
+	g_mutex_unlock(&slot_status_mutex);
 	slot_state = plan->target_slot->status;
 
 	/* In case we failed unmounting while reading per-slot status
@@ -992,20 +1047,10 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		return FALSE;
 	}
 
-	/* For global slot status: Clear checksum info and make status
-	 * 'pending' to prevent the slot status from looking valid later in
-	 * case we crash while installing. */
-	if (g_strcmp0(r_context()->config->statusfile_path, "per-slot") != 0) {
-		g_clear_pointer(&slot_state->status, g_free);
-		slot_state->status = g_strdup("pending");
-		g_clear_pointer(&slot_state->checksum.digest, g_free);
-		slot_state->checksum.size = 0;
-
-		if (!r_slot_status_save(plan->target_slot, &ierror)) {
-			g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
-			r_context_end_step("check_slot", FALSE);
-			return FALSE;
-		}
+	if (!invalidate_slot_status(plan, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
+		r_context_end_step("check_slot", FALSE);
+		return FALSE;
 	}
 
 	/* if explicitly enabled, skip update of up-to-date slots */
@@ -1018,9 +1063,7 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		r_context_begin_step("skip_image", "Copying image skipped", 0);
 
 		/* Update the status also for skipped slots */
-		g_message("Updating slot %s status", plan->target_slot->name);
-		update_slot_status(slot_state, "ok", manifest, plan, args);
-		if (!r_slot_status_save(plan->target_slot, &ierror)) {
+		if (!update_and_save_slot_status("ok", manifest, plan, args, &ierror)) {
 			g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
 			r_context_end_step("skip_image", FALSE);
 			return FALSE;
@@ -1032,8 +1075,10 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		return TRUE;
 	}
 
+	g_mutex_lock(&slot_status_mutex);
 	g_free(slot_state->status);
 	slot_state->status = g_strdup("update");
+	g_mutex_unlock(&slot_status_mutex);
 
 	r_context_end_step("check_slot", TRUE);
 
@@ -1051,6 +1096,8 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 
 	r_context_begin_step_weighted_formatted("copy_image", 0, 9, "Copying image to %s", plan->target_slot->name);
 
+	wait_for_discard(plan);
+
 	if (!plan->slot_handler(plan->image, plan->target_slot, hook_name, &ierror)) {
 		g_autoptr(GError) ierror_status = NULL;
 
@@ -1058,9 +1105,7 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 				"Failed updating slot %s: ", plan->target_slot->name);
 		r_context_end_step("copy_image", FALSE);
 
-		g_message("Updating slot %s status", plan->target_slot->name);
-		update_slot_status(slot_state, "failed", manifest, plan, args);
-		if (!r_slot_status_save(plan->target_slot, &ierror_status)) {
+		if (!update_and_save_slot_status("failed", manifest, plan, args, &ierror_status)) {
 			g_warning("Error while writing status file after slot update failure: %s", ierror_status->message);
 		}
 
@@ -1069,9 +1114,7 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 
 	r_context_end_step("copy_image", TRUE);
 
-	g_message("Updating slot %s status", plan->target_slot->name);
-	update_slot_status(slot_state, "ok", manifest, plan, args);
-	if (!r_slot_status_save(plan->target_slot, &ierror)) {
+	if (!update_and_save_slot_status("ok", manifest, plan, args, &ierror)) {
 		g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
 		return FALSE;
 	}
@@ -1080,6 +1123,146 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 	return TRUE;
 }
 
+/* Returns a key identifying the storage device the slot is located on.
+ *
+ * For partitions, this is the sysfs path of the parent disk. All slots which
+ * are not block devices (such as MTD or UBI volumes) share a common key, as we
+ * cannot reliably tell their underlying device apart. */
+static gchar *get_slot_storage_key(const RaucSlot *slot)
+{
+	struct stat st;
+	g_autofree gchar *sysfs_path = NULL;
+	g_autofree gchar *partition_path = NULL;
+	g_autofree gchar *real_path = NULL;
+
+	if (stat(slot->device, &st) != 0 || !S_ISBLK(st.st_mode))
+		return g_strdup("");
+
+	sysfs_path = g_strdup_printf("/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	real_path = r_realpath(sysfs_path);
+	if (!real_path)
+		return g_steal_pointer(&sysfs_path);
+
+	partition_path = g_build_filename(real_path, "partition", NULL);
+	if (g_file_test(partition_path, G_FILE_TEST_EXISTS))
+		return g_path_get_dirname(real_path);
+
+	return g_steal_pointer(&real_path);
+}
+
+typedef struct {
+	const RaucManifest *manifest;
+	RaucInstallArgs *args;
+	const gchar *hook_name;
+	/* plans for a single storage device in manifest order */
+	GPtrArray *plans;
+	GAsyncQueue *results;
+	gint *abort;
+	GThread *thread;
+	GError *error;
+} RInstallWorker;
+
+typedef struct {
+	RImageInstallPlan *plan;
+	/* FALSE if the plan was not started because of an earlier error */
+	gboolean started;
+	gboolean success;
+} RInstallWorkerResult;
+
+static gpointer install_worker_thread(gpointer data)
+{
+	RInstallWorker *worker = data;
+
+	/* progress is accounted by the installer thread */
+	r_context_mute_progress(TRUE);
+
+	for (guint i = 0; i < worker->plans->len; i++) {
+		RInstallWorkerResult *result = g_new0(RInstallWorkerResult, 1);
+
+		result->plan = g_ptr_array_index(worker->plans, i);
+		if (!g_atomic_int_get(worker->abort)) {
+			result->started = TRUE;
+			result->success = handle_slot_install_plan(worker->manifest, result->plan,
+					worker->args, worker->hook_name, &worker->error);
+			if (!result->success)
+				g_atomic_int_set(worker->abort, TRUE);
+		}
+		g_async_queue_push(worker->results, result);
+	}
+
+	return NULL;
+}
+
+/* Installs plans for different storage devices concurrently, using one worker
+ * thread per device. Plans for the same device are installed in order. */
+static gboolean install_plans_parallel(const RaucManifest *manifest, GPtrArray *install_plans, RaucInstallArgs *args, const gchar *hook_name, GError **error)
+{
+	g_autoptr(GHashTable) devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_autoptr(GPtrArray) workers = g_ptr_array_new();
+	g_autoptr(GAsyncQueue) results = g_async_queue_new_full(g_free);
+	gint aborted = FALSE;
+	gboolean res = TRUE;
+
+	for (guint i = 0; i < install_plans->len; i++) {
+		RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+		gchar *key = get_slot_storage_key(plan->target_slot);
+		RInstallWorker *worker = g_hash_table_lookup(devices, key);
+
+		if (!worker) {
+			worker = g_new0(RInstallWorker, 1);
+			worker->manifest = manifest;
+			worker->args = args;
+			worker->hook_name = hook_name;
+			worker->plans = g_ptr_array_new();
+			worker->results = results;
+			worker->abort = &aborted;
+			g_hash_table_insert(devices, key, worker);
+			g_ptr_array_add(workers, worker);
+		} else {
+			g_free(key);
+		}
+
+		g_ptr_array_add(worker->plans, plan);
+	}
+
+	g_message("Installing %u images to %u storage devices in parallel", install_plans->len, workers->len);
+
+	for (guint i = 0; i < workers->len; i++) {
+		RInstallWorker *worker = g_ptr_array_index(workers, i);
+		worker->thread = g_thread_new("install-worker", install_worker_thread, worker);
+	}
+
+	/* each worker reports exactly one result per plan */
+	for (guint i = 0; i < install_plans->len; i++) {
+		RInstallWorkerResult *result = g_async_queue_pop(results);
+
+		if (result->started) {
+			r_context_begin_step_weighted_formatted("install_slot", 0, 10, "Installing slot %s",
+					result->plan->target_slot->name);
+			r_context_end_step("install_slot", result->success);
+		}
+		g_free(result);
+	}
+
+	for (guint i = 0; i < workers->len; i++) {
+		RInstallWorker *worker = g_ptr_array_index(workers, i);
+
+		g_thread_join(worker->thread);
+		if (worker->error) {
+			/* report the first failure only */
+			if (res)
+				g_propagate_error(error, worker->error);
+			else
+				g_error_free(worker->error);
+			res = FALSE;
+		}
+		g_ptr_array_free(worker->plans, TRUE);
+		g_free(worker);
+	}
+
+	return res;
+}
+
 /* For each installation plan list, there should be one slot that we need to
  * mark bad and active for the bootloader.
  * In cases where we have only images for slots that are not part of the
@@ -1111,6 +1294,55 @@ static RaucSlot* get_boot_mark_slot(const GPtrArray *install_plans)
 	return bootslot;
 }
 
+static gpointer discard_thread_func(gpointer data)
+{
+	RImageInstallPlan *plan = data;
+	g_autoptr(GError) ierror = NULL;
+
+	if (!r_update_handler_discard_slot(plan->image, plan->target_slot, &ierror))
+		g_warning("Ignoring failed discard of slot %s: %s", plan->target_slot->name, ierror->message);
+
+	return NULL;
+}
+
+gboolean r_install_start_discards(GPtrArray *install_plans, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(install_plans, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (guint i = 0; i < install_plans->len; i++) {
+		RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+		RaucSlotStatus *slot_state;
+
+		if (!r_update_handler_can_discard(plan->slot_handler, plan->image, plan->target_slot))
+			continue;
+
+		/* load the status now, as it may be stored on the slot itself */
+		g_mutex_lock(&slot_status_mutex);
+		r_slot_status_load(plan->target_slot);
+		g_mutex_unlock(&slot_status_mutex);
+		slot_state = plan->target_slot->status;
+
+		/* slots which will be skipped must keep their content */
+		if (!plan->target_slot->install_same && g_strcmp0(plan->image->checksum.digest, slot_state->checksum.digest) == 0)
+			continue;
+		if (plan->target_slot->mount_point)
+			continue;
+
+		/* the slot content is gone as soon as the discard starts */
+		if (!invalidate_slot_status(plan, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
+			return FALSE;
+		}
+
+		plan->discard_thread = g_thread_new("discard", discard_thread_func, plan);
+	}
+
+	return TRUE;
+}
+
 static gboolean launch_and_wait_default_handler(RaucInstallArgs *args, gchar* bundledir, RaucManifest *manifest, GHashTable *target_group, GError **error)
 {
 	g_autofree gchar *hook_name = NULL;
@@ -1164,20 +1396,33 @@ static gboolean launch_and_wait_default_handler(RaucInstallArgs *args, gchar* bu
 		}
 	}
 
+	if (!r_install_start_discards(install_plans, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	if (manifest->hook_name)
 		hook_name = g_build_filename(bundledir, manifest->hook_name, NULL);
 
 	r_context_begin_step_weighted("update_slots", "Updating slots", install_plans->len * 10, 6);
 	install_args_update(args, "Updating slots...");
 
-	for (guint i = 0; i < install_plans->len; i++) {
-		const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
-
-		if (!handle_slot_install_plan(manifest, plan, args, hook_name, &ierror)) {
+	if (r_context()->config->parallel_install && install_plans->len > 1) {
+		if (!install_plans_parallel(manifest, install_plans, args, hook_name, &ierror)) {
 			g_propagate_error(error, ierror);
 			r_context_end_step("update_slots", FALSE);
 			return FALSE;
 		}
+	} else {
+		for (guint i = 0; i < install_plans->len; i++) {
+			RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+
+			if (!handle_slot_install_plan(manifest, plan, args, hook_name, &ierror)) {
+				g_propagate_error(error, ierror);
+				r_context_end_step("update_slots", FALSE);
+				return FALSE;
+			}
+		}
 	}
 
 	r_context_end_step("update_slots", TRUE);
@@ -1416,6 +1661,7 @@ static gpointer install_thread(gpointer data)
 {
 	GError *ierror = NULL;
 	RaucInstallArgs *args = data;
+	RaucResourceLimits limits;
 	gint result;
 
 	/* clear LastError property */
@@ -1424,7 +1670,17 @@ static gpointer install_thread(gpointer data)
 	g_debug("thread started for %s", args->name);
 	install_args_update(args, "started");
 
-	result = !do_install_bundle(args, &ierror);
+	/* Resource limits are applied to this thread only and inherited by all
+	 * helper processes spawned from it. */
+	r_resources_init(&limits);
+	r_resources_merge(&limits, &r_context()->config->resources);
+	r_resources_merge(&limits, &args->resources);
+	if (r_resources_apply(&limits, &ierror))
+		result = !do_install_bundle(args, &ierror);
+	else
+		result = 1;
+	r_resources_reset();
+	r_resources_clear(&limits);
 
 	if (result != 0) {
 		g_warning("%s", ierror->message);
@@ -1450,6 +1706,7 @@ RaucInstallArgs *install_args_new(void)
 	g_mutex_init(&args->status_mutex);
 	g_queue_init(&args->status_messages);
 	args->status_result = -2;
+	r_resources_init(&args->resources);
 
 	return args;
 }
@@ -1462,6 +1719,7 @@ void install_args_free(RaucInstallArgs *args)
 	g_assert_cmpint(args->status_result, >=, 0);
 	g_assert_true(g_queue_is_empty(&args->status_messages));
 	clear_bundle_access_args(&args->access_args);
+	r_resources_clear(&args->resources);
 	g_free(args);
 }
 
@@ -41,6 +41,7 @@ gchar *certpath = NULL;
 gchar **intermediate = NULL;
 gchar *signing_keyring = NULL;
 gchar *mksquashfs_args = NULL;
+gchar *build_cache_dir = NULL;
 gchar *casync_args = NULL;
 gchar **convert_ignore_images = NULL;
 gchar **recipients = NULL;
@@ -256,6 +257,8 @@ static gboolean install_start(int argc, char **argv)
 		args->access_args.tls_no_verify = access_args.tls_no_verify;
 	if (access_args.http_headers)
 		args->access_args.http_headers = g_strdupv(access_args.http_headers);
+	if (access_args.mirrors)
+		args->access_args.mirrors = g_strdupv(access_args.mirrors);
 
 	r_loop = g_main_loop_new(NULL, FALSE);
 	if (ENABLE_SERVICE) {
@@ -274,6 +277,8 @@ static gboolean install_start(int argc, char **argv)
 			g_variant_dict_insert(&dict, "tls-no-verify", "b", args->access_args.tls_no_verify);
 		if (args->access_args.http_headers)
 			g_variant_dict_insert(&dict, "http-headers", "^as", args->access_args.http_headers);
+		if (args->access_args.mirrors)
+			g_variant_dict_insert(&dict, "mirrors", "^as", args->access_args.mirrors);
 
 		installer = r_installer_proxy_new_for_bus_sync(bus_type,
 				G_DBUS_PROXY_FLAGS_GET_INVALIDATED_PROPERTIES,
@@ -2176,6 +2181,7 @@ static GOptionEntry entries_install[] = {
 static GOptionEntry entries_bundle[] = {
 	{"signing-keyring", '\0', 0, G_OPTION_ARG_FILENAME, &signing_keyring, "verification keyring file", "PEMFILE"},
 	{"mksquashfs-args", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_args, "mksquashfs extra args", "ARGS"},
+	{"build-cache", '\0', 0, G_OPTION_ARG_FILENAME, &build_cache_dir, "reuse image checksums and indexes from this directory", "DIRECTORY"},
 	{0}
 };
 
@@ -2253,6 +2259,7 @@ static GOptionEntry entries_bundle_access[] = {
 	{"tls-ca", '\0', 0, G_OPTION_ARG_FILENAME, &access_args.tls_ca, "TLS CA file", "PEMFILE"},
 	{"tls-no-verify", '\0', 0, G_OPTION_ARG_NONE, &access_args.tls_no_verify, "do not verify TLS server certificate", NULL},
 	{"http-header", 'H', 0, G_OPTION_ARG_STRING_ARRAY, &access_args.http_headers, "HTTP request header (multiple uses supported)", "'HEADER: VALUE'"},
+	{"mirror", '\0', 0, G_OPTION_ARG_STRING_ARRAY, &access_args.mirrors, "alternative URL of the bundle (multiple uses supported)", "URL"},
 	{0}
 };
 
@@ -2539,6 +2546,8 @@ static void cmdline_handler(int argc, char **argv)
 			r_context_conf()->signing_keyringpath = signing_keyring;
 		if (mksquashfs_args)
 			r_context_conf()->mksquashfs_args = mksquashfs_args;
+		if (build_cache_dir)
+			r_context_conf()->build_cache_dir = build_cache_dir;
 		if (casync_args)
 			r_context_conf()->casync_args = casync_args;
 		if (recipients)
@@ -2627,5 +2636,7 @@ int main(int argc, char **argv)
 	create_option_groups();
 	cmdline_handler(argc, argv);
 
+	signature_cleanup();
+
 	return r_exit_status;
 }
@@ -1,11 +1,17 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
 #include <string.h>
 
+#include "build_cache.h"
 #include "checksum.h"
 #include "config_file.h"
 #include "context.h"
+#include "hash_index.h"
 #include "manifest.h"
 #include "signature.h"
 #include "utils.h"
+#include "zstd_seekable.h"
 
 #define RAUC_IMAGE_PREFIX	"image"
 
@@ -91,6 +97,46 @@ static gboolean parse_image(GKeyFile *key_file, const gchar *group, RaucImage **
 	iimage->adaptive = g_key_file_get_string_list(key_file, group, "adaptive", NULL, NULL);
 	g_key_file_remove_key(key_file, group, "adaptive", NULL);
 
+	iimage->sparse = g_key_file_get_boolean(key_file, group, "sparse", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		iimage->sparse = FALSE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	g_key_file_remove_key(key_file, group, "sparse", NULL);
+
+	iimage->seekable_zstd = g_key_file_get_boolean(key_file, group, "seekable-zstd", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		iimage->seekable_zstd = FALSE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	g_key_file_remove_key(key_file, group, "seekable-zstd", NULL);
+
+	iimage->aligned = g_key_file_get_boolean(key_file, group, "aligned", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		iimage->aligned = FALSE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	g_key_file_remove_key(key_file, group, "aligned", NULL);
+
+	iimage->payload_offset = g_key_file_get_uint64(key_file, group, "payload-offset", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		iimage->payload_offset = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	g_key_file_remove_key(key_file, group, "payload-offset", NULL);
+
 	if (!check_remaining_keys(key_file, group, &ierror)) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -425,6 +471,31 @@ static gboolean check_manifest_common(const RaucManifest *mf, GError **error)
 				goto out;
 			}
 		}
+
+		if (image->sparse && image->adaptive) {
+			g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Adaptive updates are not supported for sparse image %s", image->filename);
+			goto out;
+		}
+
+		if (image->seekable_zstd && (image->sparse || image->aligned)) {
+			g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Seekable zstd image %s cannot be sparse or aligned", image->filename);
+			goto out;
+		}
+
+		if (image->aligned) {
+			if (mf->bundle_format == R_MANIFEST_FORMAT_PLAIN) {
+				g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Aligned image %s requires the 'verity' or 'crypt' bundle format", image->filename);
+				goto out;
+			}
+			if (image->checksum.size % 4096 != 0) {
+				g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Size of aligned image %s is not a multiple of 4096 bytes", image->filename);
+				goto out;
+			}
+		}
+		if (image->payload_offset % 4096 != 0) {
+			g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Payload offset of image %s is not a multiple of 4096 bytes", image->filename);
+			goto out;
+		}
 	}
 
 	/* Check for hook file set if hooks are enabled */
@@ -493,6 +564,14 @@ gboolean check_manifest_internal(const RaucManifest *mf, GError **error)
 				g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Unexpected hash for %s bundle in internal manifest", r_manifest_bundle_format_to_str(mf->bundle_format));
 				goto out;
 			}
+			for (GList *l = mf->images; l != NULL; l = l->next) {
+				RaucImage *image = l->data;
+
+				if (image->payload_offset) {
+					g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Unexpected payload offset for image %s in internal manifest", image->filename);
+					goto out;
+				}
+			}
 
 			break;
 		};
@@ -582,6 +661,15 @@ gboolean check_manifest_external(const RaucManifest *mf, GError **error)
 				goto out;
 			}
 
+			for (GList *l = mf->images; l != NULL; l = l->next) {
+				RaucImage *image = l->data;
+
+				if (image->aligned && !image->payload_offset) {
+					g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR, "Missing payload offset for aligned image %s", image->filename);
+					goto out;
+				}
+			}
+
 			break;
 		};
 		default: {
@@ -706,6 +794,18 @@ static GKeyFile *prepare_manifest(const RaucManifest *mf)
 		if (image->adaptive)
 			g_key_file_set_string_list(key_file, group, "adaptive",
 					(const gchar * const *)image->adaptive, g_strv_length(image->adaptive));
+
+		if (image->sparse)
+			g_key_file_set_boolean(key_file, group, "sparse", TRUE);
+
+		if (image->seekable_zstd)
+			g_key_file_set_boolean(key_file, group, "seekable-zstd", TRUE);
+
+		if (image->aligned)
+			g_key_file_set_boolean(key_file, group, "aligned", TRUE);
+
+		if (image->payload_offset)
+			g_key_file_set_uint64(key_file, group, "payload-offset", image->payload_offset);
 	}
 
 	if (mf->meta) {
@@ -880,6 +980,13 @@ GVariant* r_manifest_to_dict(const RaucManifest *manifest)
 	return g_variant_dict_end(&root_dict);
 }
 
+const gchar *r_image_get_data_path(const RaucImage *image)
+{
+	g_return_val_if_fail(image, NULL);
+
+	return image->payload_dev ? image->payload_dev : image->filename;
+}
+
 void r_free_image(gpointer data)
 {
 	RaucImage *image = (RaucImage*) data;
@@ -892,6 +999,7 @@ void r_free_image(gpointer data)
 	g_free(image->checksum.digest);
 	g_free(image->filename);
 	g_strfreev(image->adaptive);
+	g_free(image->payload_dev);
 	g_free(image);
 }
 
@@ -917,25 +1025,165 @@ void free_manifest(RaucManifest *manifest)
 	g_free(manifest);
 }
 
+/* Work item for updating the data of all images sharing a file */
+typedef struct {
+	GPtrArray *images; /* the checksum is calculated for the first one */
+	gchar *filename;
+	gchar *indexpath; /* block-hash-index to create, or NULL */
+	const gchar *cachedir; /* build cache directory, or NULL */
+	gboolean cached;
+	gboolean index_failed; /* set if error refers to the block-hash-index */
+	GError *error;
+} RImageUpdate;
+
+static void image_update_free(RImageUpdate *update)
+{
+	g_ptr_array_unref(update->images);
+	g_free(update->filename);
+	g_free(update->indexpath);
+	g_clear_error(&update->error);
+	g_free(update);
+}
+
+static void image_update_data(const guint8 *data, gsize len, gpointer user_data)
+{
+	RaucHashIndexBuilder *builder = user_data;
+
+	r_hash_index_builder_update(builder, data, len);
+}
+
+/*
+ * Feeds the uncompressed content of a seekable zstd image to a hash index
+ * builder, as the block-hash-index is used to compare with the target slot.
+ */
+static gboolean build_zstd_hash_index(RaucHashIndexBuilder *builder, const gchar *filename, GError **error)
+{
+#if ENABLE_ZSTD == 1
+	GError *ierror = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	g_autofree guint8 *buf = NULL;
+	gboolean res = FALSE;
+	guint64 size;
+	int fd;
+
+	fd = g_open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", filename, g_strerror(err));
+		return FALSE;
+	}
+
+	zs = r_zstd_seekable_open(fd, &ierror);
+	if (!zs) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	buf = g_malloc(R_ZSTD_FRAME_SIZE);
+	size = r_zstd_seekable_get_size(zs);
+	for (guint64 pos = 0; pos < size; pos += R_ZSTD_FRAME_SIZE) {
+		gsize len = MIN(R_ZSTD_FRAME_SIZE, size - pos);
+
+		if (!r_zstd_seekable_pread(zs, buf, len, pos, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+		r_hash_index_builder_update(builder, buf, len);
+	}
+
+	res = TRUE;
+out:
+	g_clear_pointer(&zs, r_zstd_seekable_free);
+	g_close(fd, NULL);
+	return res;
+#else
+	g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR,
+			"Seekable zstd images are not supported by this build");
+	return FALSE;
+#endif
+}
+
+/* Thread pool function for update_manifest_checksums() */
+static void image_update_func(gpointer data, gpointer user_data)
+{
+	RImageUpdate *update = data;
+	RaucImage *image = g_ptr_array_index(update->images, 0);
+	g_autoptr(RaucHashIndexBuilder) builder = NULL;
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *key = NULL;
+
+	if (update->cachedir) {
+		key = r_build_cache_key(update->filename, image->checksum.type, &ierror);
+		if (key && update->indexpath && image->seekable_zstd) {
+			/* the index of the uncompressed data differs from the one of the file */
+			gchar *zstd_key = g_strconcat(key, "-zstd", NULL);
+			g_free(key);
+			key = zstd_key;
+		}
+		if (!key) {
+			g_message("Not using build cache for %s: %s", image->filename, ierror->message);
+		} else if (r_build_cache_lookup(update->cachedir, key, &image->checksum, update->indexpath)) {
+			update->cached = TRUE;
+			return;
+		}
+	}
+
+	if (update->indexpath)
+		builder = r_hash_index_builder_new();
+
+	if (builder && image->seekable_zstd) {
+		if (!build_zstd_hash_index(builder, update->filename, &update->error)) {
+			g_prefix_error(&update->error, "Failed to read %s: ", image->filename);
+			return;
+		}
+		if (!compute_checksum(&image->checksum, update->filename, &update->error))
+			return;
+	} else if (!compute_checksum_full(&image->checksum, update->filename,
+			builder ? image_update_data : NULL, builder, &update->error)) {
+		return;
+	}
+
+	if (builder && !r_hash_index_builder_export(builder, update->indexpath, &update->error)) {
+		g_prefix_error(&update->error, "Failed to write hash index for %s: ", image->filename);
+		update->index_failed = TRUE;
+		return;
+	}
+
+	if (key)
+		r_build_cache_store(update->cachedir, key, &image->checksum, update->indexpath);
+}
+
 /**
  * Updates checksums for images listed in the manifest and found in
  * the bundle directory.
  *
+ * Image files are processed concurrently, each one once, even if it is
+ * shared by several images. For images using the 'block-hash-index'
+ * adaptive method, the <image>.block-hash-index file is created from the
+ * same read. If a build cache directory is configured, results for unchanged
+ * images are taken from there.
+ *
  * @param manifest pointer to the manifest
  * @param dir Directory with the bundle content
+ * @param stagingdir Directory with replacements for image files, or NULL
  * @param error return location for a GError, or NULL
  *
  * @return TRUE on success, FALSE if an error occurred
  */
-static gboolean update_manifest_checksums(RaucManifest *manifest, const gchar *dir, GError **error)
+static gboolean update_manifest_checksums(RaucManifest *manifest, const gchar *dir, const gchar *stagingdir, GError **error)
 {
 	GError *ierror = NULL;
 	gboolean res = TRUE;
 	gboolean had_errors = FALSE;
+	gboolean had_index_errors = FALSE;
+	g_autoptr(GPtrArray) updates = g_ptr_array_new_with_free_func((GDestroyNotify)image_update_free);
+	g_autoptr(GHashTable) files = g_hash_table_new(g_str_hash, g_str_equal);
+	GThreadPool *pool = NULL;
 
 	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
 		RaucImage *image = elem->data;
-		g_autofree gchar *filename = NULL;
+		RImageUpdate *update = NULL;
 
 		/* If no filename is set (valid for 'install' hook) explicitly set size to -1 */
 		if (!image->filename) {
@@ -943,25 +1191,88 @@ static gboolean update_manifest_checksums(RaucManifest *manifest, const gchar *d
 			continue;
 		}
 
-		filename = g_build_filename(dir, image->filename, NULL);
-		res = compute_checksum(&image->checksum, filename, &ierror);
-		if (!res) {
-			g_warning("Failed updating checksum: %s", ierror->message);
-			g_clear_error(&ierror);
+		update = g_hash_table_lookup(files, image->filename);
+		if (!update) {
+			update = g_new0(RImageUpdate, 1);
+			update->images = g_ptr_array_new();
+			if (stagingdir)
+				update->filename = g_build_filename(stagingdir, image->filename, NULL);
+			if (!update->filename || !g_file_test(update->filename, G_FILE_TEST_EXISTS)) {
+				g_free(update->filename);
+				update->filename = g_build_filename(dir, image->filename, NULL);
+			}
+			update->cachedir = r_context()->build_cache_dir;
+			g_hash_table_insert(files, image->filename, update);
+			g_ptr_array_add(updates, update);
+		}
+		g_ptr_array_add(update->images, image);
+
+		if (!update->indexpath && image->adaptive && g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index")) {
+			/* Use a filename of bundle/<image-name>.block-hash-index. */
+			g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
+			update->indexpath = g_build_filename(dir, indexname, NULL);
+		}
+	}
+
+	if (updates->len > 1) {
+		pool = g_thread_pool_new(image_update_func, NULL,
+				MIN(g_get_num_processors(), updates->len), TRUE, &ierror);
+		if (!pool) {
+			g_propagate_prefixed_error(error, ierror, "Failed to start checksum threads: ");
+			return FALSE;
+		}
+		for (guint i = 0; i < updates->len; i++)
+			g_thread_pool_push(pool, g_ptr_array_index(updates, i), NULL);
+		/* waits for all images */
+		g_thread_pool_free(pool, FALSE, TRUE);
+	} else if (updates->len) {
+		image_update_func(g_ptr_array_index(updates, 0), NULL);
+	}
+
+	for (guint i = 0; i < updates->len; i++) {
+		RImageUpdate *update = g_ptr_array_index(updates, i);
+		RaucImage *image = g_ptr_array_index(update->images, 0);
+
+		if (update->index_failed) {
+			g_warning("Failed creating block-hash-index: %s", update->error->message);
+			had_index_errors = TRUE;
+			continue;
+		}
+		if (update->error) {
+			g_warning("Failed updating checksum: %s", update->error->message);
 			had_errors = TRUE;
-			break;
+			continue;
+		}
+
+		if (update->cached) {
+			g_message("Using cached checksum%s for image %s", update->indexpath ? " and block-hash-index" : "", image->filename);
+		} else if (update->indexpath) {
+			g_debug("Created block-hash-index for image %s", image->filename);
+		}
+
+		/* images sharing the file get the same checksum */
+		for (guint j = 1; j < update->images->len; j++) {
+			RaucImage *other = g_ptr_array_index(update->images, j);
+
+			g_free(other->checksum.digest);
+			other->checksum.type = image->checksum.type;
+			other->checksum.digest = g_strdup(image->checksum.digest);
+			other->checksum.size = image->checksum.size;
 		}
 	}
 
 	if (had_errors) {
 		res = FALSE;
 		g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_ERROR_CHECKSUM, "Failed updating all checksums");
+	} else if (had_index_errors) {
+		res = FALSE;
+		g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_ERROR_CHECKSUM, "Failed creating all block-hash-index files");
 	}
 
 	return res;
 }
 
-gboolean sync_manifest_with_contentdir(RaucManifest *manifest, const gchar *dir, GError **error)
+gboolean sync_manifest_with_contentdir(RaucManifest *manifest, const gchar *dir, const gchar *stagingdir, GError **error)
 {
 	g_return_val_if_fail(manifest, FALSE);
 	g_return_val_if_fail(dir, FALSE);
@@ -987,5 +1298,5 @@ gboolean sync_manifest_with_contentdir(RaucManifest *manifest, const gchar *dir,
 		}
 	}
 
-	return update_manifest_checksums(manifest, dir, error);
+	return update_manifest_checksums(manifest, dir, stagingdir, error);
 }
@@ -112,6 +112,11 @@ out:
 }
 
 gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset size, GError **error)
+{
+	return r_setup_loop_offset(fd, 0, loopfd_out, loopname_out, size, error);
+}
+
+gboolean r_setup_loop_offset(gint fd, goffset offset, gint *loopfd_out, gchar **loopname_out, goffset size, GError **error)
 {
 	gboolean res = FALSE;
 	gint controlfd = -1;
@@ -121,6 +126,7 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 	struct loop_info64 loopinfo = {0};
 
 	g_return_val_if_fail(fd >= 0, FALSE);
+	g_return_val_if_fail(offset >= 0, FALSE);
 	g_return_val_if_fail(loopfd_out != NULL, FALSE);
 	g_return_val_if_fail(loopname_out != NULL && *loopname_out == NULL, FALSE);
 	g_return_val_if_fail(size > 0, FALSE);
@@ -199,6 +205,7 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 		goto out;
 	}
 
+	loopinfo.lo_offset = offset;
 	loopinfo.lo_sizelimit = size;
 	loopinfo.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
 
@@ -224,7 +231,10 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 				g_strerror(errno));
 	}
 
-	g_message("Configured loop device '%s' for %" G_GOFFSET_FORMAT " bytes", loopname, size);
+	if (offset)
+		g_message("Configured loop device '%s' for %" G_GOFFSET_FORMAT " bytes at offset %" G_GOFFSET_FORMAT, loopname, size, offset);
+	else
+		g_message("Configured loop device '%s' for %" G_GOFFSET_FORMAT " bytes", loopname, size);
 
 	*loopfd_out = loopfd;
 	loopfd = -1;
@@ -5,10 +5,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
 #include <pwd.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 #include <gio/gio.h>
@@ -31,6 +35,40 @@
 /* these are only used before passing the socket to the kernel */
 #define RAUC_NBD_CMD_CONFIGURE 0x1000
 #define RAUC_NBD_HANDLE "\x89\xce\x48\x24\x0c\xe4\x82\xce"
+/* internal request type for checking an additional source */
+#define RAUC_NBD_CMD_PROBE 0x1001
+
+/* granularity of the block cache and of range requests */
+#define RAUC_NBD_BLOCK_SIZE (64*1024)
+/* upper limit for coalesced range requests */
+#define RAUC_NBD_MAX_FETCH (4*1024*1024)
+/* number of idle curl handles kept for reuse */
+#define RAUC_NBD_MAX_IDLE_HANDLES 16
+/* buffers are pooled in power-of-two size classes from the block size up to
+ * the maximum fetch size */
+#define RAUC_NBD_POOL_CLASSES 7
+/* upper limit for the memory kept in the buffer pool */
+#define RAUC_NBD_POOL_SIZE (8*1024*1024)
+/* initial number of parallel range requests */
+#define RAUC_NBD_INITIAL_CONCURRENCY 4
+/* bounds for the backoff between retries (in microseconds) */
+#define RAUC_NBD_RETRY_DELAY_MIN (250*1000)
+#define RAUC_NBD_RETRY_DELAY_MAX (10*1000*1000)
+/* time a failed source is skipped (doubled on each consecutive failure, in µs) */
+#define RAUC_NBD_SOURCE_BACKOFF_MIN (1*1000*1000)
+#define RAUC_NBD_SOURCE_BACKOFF_MAX (60*1000*1000)
+/* data which may be received at once within the bandwidth limit (in µs of
+ * the limit) */
+#define RAUC_NBD_BANDWIDTH_BURST (100*1000)
+/* connect timeout for probing the LAN cache (in seconds) */
+#define RAUC_NBD_LAN_CONNECT_TIMEOUT 2
+/* timeout for probing an additional source (in seconds) */
+#define RAUC_NBD_PROBE_TIMEOUT 10
+/* upper limit for data waiting to be written to the persistent cache */
+#define RAUC_NBD_DISK_QUEUE_SIZE (16*1024*1024)
+/* end of the bundle fetched by the configure request, covering the largest
+ * allowed signature and its size */
+#define RAUC_NBD_TAIL_SIZE (64*1024 + 8)
 
 GQuark
 r_nbd_error_quark(void)
@@ -38,11 +76,30 @@ r_nbd_error_quark(void)
 	return g_quark_from_static_string("r-nbd-error-quark");
 }
 
+static void clear_sock(gpointer data)
+{
+	gint *sock = data;
+
+	if (*sock >= 0)
+		g_close(*sock, NULL);
+	*sock = -1;
+}
+
+static GArray *new_sock_array(void)
+{
+	GArray *socks = g_array_new(FALSE, FALSE, sizeof(gint));
+
+	g_array_set_clear_func(socks, clear_sock);
+
+	return socks;
+}
+
 RaucNBDDevice *r_nbd_new_device(void)
 {
 	RaucNBDDevice *nbd_dev = g_malloc0(sizeof(RaucNBDDevice));
 
 	nbd_dev->sock = -1;
+	nbd_dev->extra_socks = new_sock_array();
 
 	return nbd_dev;
 }
@@ -58,6 +115,7 @@ void r_nbd_free_device(RaucNBDDevice *nbd_dev)
 		}
 	}
 
+	g_clear_pointer(&nbd_dev->extra_socks, g_array_unref);
 	g_free(nbd_dev);
 }
 
@@ -66,6 +124,11 @@ RaucNBDServer *r_nbd_new_server(void)
 	RaucNBDServer *nbd_srv = g_malloc0(sizeof(RaucNBDServer));
 
 	nbd_srv->sock = -1;
+	nbd_srv->extra_socks = new_sock_array();
+	nbd_srv->connections = 1;
+	nbd_srv->max_concurrency = DEFAULT_STREAMING_MAX_CONCURRENCY;
+	nbd_srv->max_retries = DEFAULT_STREAMING_MAX_RETRIES;
+	nbd_srv->connect_timeout = DEFAULT_STREAMING_CONNECT_TIMEOUT;
 
 	return nbd_srv;
 }
@@ -87,6 +150,12 @@ void r_nbd_free_server(RaucNBDServer *nbd_srv)
 	g_free(nbd_srv->tls_ca);
 	g_strfreev(nbd_srv->headers);
 	g_strfreev(nbd_srv->info_headers);
+	g_strfreev(nbd_srv->mirrors);
+	g_free(nbd_srv->lan_cache);
+	g_free(nbd_srv->disk_cache_dir);
+	g_free(nbd_srv->if_none_match);
+	g_free(nbd_srv->etag);
+	g_clear_pointer(&nbd_srv->extra_socks, g_array_unref);
 	g_free(nbd_srv);
 }
 
@@ -139,6 +208,21 @@ out:
 	return nl;
 }
 
+/* Tunes the block queue of the device. Failures are not fatal, as the
+ * defaults work as well. */
+static void set_queue_attribute(RaucNBDDevice *nbd_dev, const gchar *attribute, guint64 value)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *contents = NULL;
+
+	path = g_strdup_printf("/sys/block/nbd%"G_GUINT32_FORMAT "/queue/%s", nbd_dev->index, attribute);
+	contents = g_strdup_printf("%"G_GUINT64_FORMAT, value);
+
+	if (!g_file_set_contents(path, contents, -1, &ierror))
+		g_message("failed to set %s for nbd%"G_GUINT32_FORMAT ": %s", attribute, nbd_dev->index, ierror->message);
+}
+
 gboolean r_nbd_setup_device(RaucNBDDevice *nbd_dev, GError **error)
 {
 	GError *ierror = NULL;
@@ -173,7 +257,10 @@ gboolean r_nbd_setup_device(RaucNBDDevice *nbd_dev, GError **error)
 	/* do not set NBD_ATTR_INDEX to let nbd return a free nbd device index */
 	NLA_PUT_U64(msg, NBD_ATTR_SIZE_BYTES, nbd_dev->data_size);
 	NLA_PUT_U64(msg, NBD_ATTR_BLOCK_SIZE_BYTES, 4096);
-	NLA_PUT_U64(msg, NBD_ATTR_SERVER_FLAGS, 0);
+	/* all connections are served by the same process, so they are
+	 * consistent with each other */
+	NLA_PUT_U64(msg, NBD_ATTR_SERVER_FLAGS,
+			nbd_dev->extra_socks->len ? NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN : 0);
 	NLA_PUT_U64(msg, NBD_ATTR_CLIENT_FLAGS,
 			NBD_CFLAG_DISCONNECT_ON_CLOSE
 			);
@@ -187,6 +274,13 @@ gboolean r_nbd_setup_device(RaucNBDDevice *nbd_dev, GError **error)
 		g_error("failed to allocate nested NBD_SOCK_ITEM netlink message");
 	NLA_PUT_U32(msg, NBD_SOCK_FD, nbd_dev->sock);
 	nla_nest_end(msg, attr_item);
+	for (guint i = 0; i < nbd_dev->extra_socks->len; i++) {
+		attr_item = nla_nest_start(msg, NBD_SOCK_ITEM);
+		if (!attr_item)
+			g_error("failed to allocate nested NBD_SOCK_ITEM netlink message");
+		NLA_PUT_U32(msg, NBD_SOCK_FD, g_array_index(nbd_dev->extra_socks, gint, i));
+		nla_nest_end(msg, attr_item);
+	}
 	nla_nest_end(msg, attr_sockets);
 
 	nl_socket_modify_cb(nl, NL_CB_VALID, NL_CB_CUSTOM, netlink_connect_cb, nbd_dev);
@@ -200,7 +294,12 @@ gboolean r_nbd_setup_device(RaucNBDDevice *nbd_dev, GError **error)
 
 	nbd_dev->dev = g_strdup_printf("/dev/nbd%"G_GUINT32_FORMAT, nbd_dev->index);
 
-	g_message("setup done for %s", nbd_dev->dev);
+	if (nbd_dev->max_request)
+		set_queue_attribute(nbd_dev, "max_sectors_kb", nbd_dev->max_request / 1024);
+	if (nbd_dev->read_ahead)
+		set_queue_attribute(nbd_dev, "read_ahead_kb", nbd_dev->read_ahead / 1024);
+
+	g_message("setup done for %s (%u connections)", nbd_dev->dev, nbd_dev->extra_socks->len + 1);
 
 	res = TRUE;
 	goto out;
@@ -259,6 +358,7 @@ gboolean r_nbd_remove_device(RaucNBDDevice *nbd_dev, GError **error)
 	/* maybe reuse the socket to get final statistics/error message? */
 	g_close(nbd_dev->sock, NULL);
 	nbd_dev->sock = -1;
+	g_array_set_size(nbd_dev->extra_socks, 0);
 	g_clear_pointer(&nbd_dev->dev, g_free);
 
 	res = TRUE;
@@ -287,17 +387,140 @@ struct RaucNBDContext {
 	gchar *tls_ca; /* local file */
 	gboolean tls_no_verify;
 	GStrv headers; /* array of strings such as 'Foo: bar' */
+	guint64 cache_size; /* block cache budget in bytes, 0 disables the cache */
+	guint64 read_ahead; /* maximum read-ahead window in bytes */
+	guint32 max_streams; /* maximum concurrent HTTP/2 streams, 0 for the curl default */
+	guint32 max_retries; /* retries for each failed request */
+	guint32 connect_timeout; /* seconds */
+	guint32 request_timeout; /* seconds, 0 for none */
+	GPtrArray *conns; /* struct RaucNBDConnection from the kernel, starting with sock */
+	guint32 max_concurrency; /* upper limit for parallel range requests */
+	guint64 bandwidth_limit; /* bytes/s over all range requests, 0 for none */
+	GStrv mirrors; /* alternative URLs of the same bundle */
+	gchar *lan_cache; /* URL prefix of a local cache */
+	gchar *disk_cache_dir; /* persistent block cache, NULL if disabled */
+	guint64 disk_cache_size; /* size budget of the persistent cache in bytes */
+	gchar *if_none_match; /* revalidate a previously checked bundle */
+	guint64 if_modified_since;
+	guint64 cached_size; /* size of the previously checked bundle */
 
 	/* runtime state */
+	GPtrArray *sources; /* struct RaucNBDSource serving identical data */
 	CURLM *multi;
+	CURLSH *share; /* DNS and TLS session cache */
+	GQueue idle_handles; /* CURL easy handles for reuse */
+	GQueue retry_queue; /* struct RaucNBDTransfer ordered by retry_at */
+	GPtrArray *buffer_pool[RAUC_NBD_POOL_CLASSES]; /* unused buffers per size class */
+	gsize buffer_pool_size;
+
+	/* concurrency control */
+	gdouble concurrency; /* number of parallel range requests allowed */
+	guint active_fetches; /* range requests started (including retries) */
+	guint completed_since_decrease;
+	gdouble min_starttransfer; /* lowest observed time to the first byte */
+	GQueue waiting_fetches; /* struct RaucNBDTransfer not started yet */
+
+	/* bandwidth limit (token bucket shared by all range requests) */
+	gdouble bandwidth_tokens; /* bytes which may be received now, negative if exceeded */
+	gint64 bandwidth_time; /* monotonic time of the last refill */
+	GQueue throttled; /* struct RaucNBDTransfer paused until tokens are available */
 	gboolean done;
 	struct curl_slist *headers_slist;
 	struct curl_slist *initial_headers_slist;
 
+	/* block cache */
+	GHashTable *cache; /* block index -> struct RaucNBDBlock */
+	GQueue cache_lru; /* most recently used first */
+	guint64 cache_used;
+	GHashTable *inflight; /* block index -> struct RaucNBDTransfer fetching it */
+	GArray *planned; /* struct RaucNBDPlanned entries to fetch */
+	guint64 seq_next; /* end of the current sequential stream */
+	guint64 window; /* current read-ahead window */
+	guint8 *tail; /* end of the bundle from the configure request */
+	guint64 tail_from; /* offset of tail */
+	guint64 modified_time; /* last-modified header of the bundle, to compare sources */
+
+	/* persistent block cache */
+	gchar *disk_cache_path; /* directory for the blocks of this bundle, NULL if unused */
+	GHashTable *disk_blocks; /* block index -> struct RaucNBDDiskEntry of this bundle */
+	GQueue disk_lru; /* struct RaucNBDDiskEntry of all bundles, least recently used first */
+	guint64 disk_used;
+	GThreadPool *disk_pool; /* single worker for all file system updates (struct RaucNBDDiskJob) */
+	gint disk_queued; /* bytes waiting to be written (atomic) */
+
 	/* statistics */
 	RaucStats *dl_size, *dl_speed, *namelookup, *connect, *starttransfer, *total;
+	guint64 cache_hits, cache_misses, disk_hits;
+};
+
+/* a connection from the kernel, each one has its own ordered reply stream */
+struct RaucNBDConnection {
+	gint sock;
+	gboolean connected; /* FALSE after it was shut down */
+	struct RaucNBDRead *stream_owner; /* read with a partially sent reply */
+	GQueue deferred_replies; /* struct RaucNBDRead waiting for stream_owner */
+};
+
+/* a server providing the bundle (original URL, mirror or LAN cache) */
+struct RaucNBDSource {
+	gchar *url;
+	gboolean lan; /* preferred while it is healthy */
+	gdouble latency; /* smoothed time to the first byte in seconds */
+	guint active; /* range requests in progress */
+	guint failures; /* consecutive failed requests */
+	gint64 disabled_until; /* monotonic time until the source is skipped */
+};
+
+/* a file system update of the persistent cache, done in order by
+ * disk_cache_worker() */
+typedef enum {
+	R_NBD_DISK_WRITE,
+	R_NBD_DISK_REMOVE,
+	R_NBD_DISK_REMOVE_OTHER, /* also removes the directory of another bundle once it is empty */
+	R_NBD_DISK_TOUCH,
+} RaucNBDDiskOp;
+
+struct RaucNBDDiskJob {
+	RaucNBDDiskOp op;
+	gchar *path;
+	guint8 *data; /* for R_NBD_DISK_WRITE */
+	gsize len;
+};
+
+/* a block file in the persistent cache */
+struct RaucNBDDiskEntry {
+	gchar *path;
+	gboolean current; /* belongs to the bundle being streamed */
+	guint64 index; /* block index, only valid if current */
+	gsize len;
+	gint64 mtime; /* last use, only used for sorting when loading */
+	GList link; /* in disk_lru */
+};
+
+struct RaucNBDBlock {
+	guint64 index;
+	guint8 *data;
+	gsize len;
+	GList link; /* in cache_lru */
+};
+
+/* a read request from the kernel, waiting for blocks */
+struct RaucNBDRead {
+	struct RaucNBDConnection *conn; /* connection to reply on */
+	struct nbd_request request;
+	struct nbd_reply reply;
+	guint8 *buffer;
+	guint pending; /* number of blocks not yet available */
+	gboolean streaming; /* reply is sent while the data arrives */
+	guint32 sent; /* bytes of the reply body already sent */
+};
+
+struct RaucNBDPlanned {
+	guint64 index;
+	struct RaucNBDRead *read; /* NULL for read-ahead */
 };
 
+/* a HTTP transfer (configuration or range request) */
 struct RaucNBDTransfer {
 	struct RaucNBDContext *ctx;
 
@@ -309,17 +532,303 @@ struct RaucNBDTransfer {
 	struct nbd_reply reply;
 	gboolean done;
 	guint errors;
+	gint64 retry_at; /* monotonic time of the next attempt */
 
 	guint8 *buffer;
 	curl_off_t buffer_size;
 	curl_off_t buffer_pos;
 
+	/* range request */
+	struct RaucNBDSource *source; /* server used for the current attempt */
+	GPtrArray *reads; /* struct RaucNBDRead waiting for this range */
+	struct RaucNBDRead *stream_read; /* read served completely by this range */
+	gboolean range_valid; /* response headers match the requested range */
+	gboolean throttled; /* paused by the bandwidth limit */
+
 	/* configure request */
+	guint64 range_from; /* start of the received range */
 	guint64 content_size;
 	guint64 current_time; /* date header from server */
 	guint64 modified_time; /* last-modified header from server */
+	gchar *etag; /* entity tag header from server */
 };
 
+static guint buffer_class(gsize size)
+{
+	guint cls = 0;
+
+	while (cls < RAUC_NBD_POOL_CLASSES && ((gsize)RAUC_NBD_BLOCK_SIZE << cls) < size)
+		cls++;
+
+	return cls;
+}
+
+static guint8 *buffer_get(struct RaucNBDContext *ctx, gsize size)
+{
+	guint cls = buffer_class(size);
+
+	if (cls >= RAUC_NBD_POOL_CLASSES)
+		return g_malloc(size);
+
+	if (ctx->buffer_pool[cls]->len) {
+		ctx->buffer_pool_size -= (gsize)RAUC_NBD_BLOCK_SIZE << cls;
+		return g_ptr_array_remove_index_fast(ctx->buffer_pool[cls], ctx->buffer_pool[cls]->len - 1);
+	}
+
+	return g_malloc((gsize)RAUC_NBD_BLOCK_SIZE << cls);
+}
+
+/* Returns a buffer obtained by buffer_get() for the same size to the pool. */
+static void buffer_put(struct RaucNBDContext *ctx, guint8 *buffer, gsize size)
+{
+	guint cls = buffer_class(size);
+	gsize capacity = (gsize)RAUC_NBD_BLOCK_SIZE << cls;
+
+	if (!buffer)
+		return;
+
+	if (cls >= RAUC_NBD_POOL_CLASSES || ctx->buffer_pool_size + capacity > RAUC_NBD_POOL_SIZE) {
+		g_free(buffer);
+		return;
+	}
+
+	g_ptr_array_add(ctx->buffer_pool[cls], buffer);
+	ctx->buffer_pool_size += capacity;
+}
+
+static struct RaucNBDConnection *new_connection(gint sock)
+{
+	struct RaucNBDConnection *conn = g_new0(struct RaucNBDConnection, 1);
+
+	conn->sock = sock;
+	conn->connected = TRUE;
+	g_queue_init(&conn->deferred_replies);
+
+	return conn;
+}
+
+static void free_connection(gpointer data)
+{
+	struct RaucNBDConnection *conn = data;
+
+	g_queue_clear(&conn->deferred_replies);
+	g_free(conn);
+}
+
+/* Shuts down a connection from the kernel, if a reply on it cannot be
+ * completed. The kernel then fails the requests sent on this connection (or
+ * resends them on another one), while the other connections keep working.
+ * Replies for requests from this connection are dropped afterwards. */
+static void disconnect_client(struct RaucNBDContext *ctx, struct RaucNBDConnection *conn)
+{
+	if (!conn->connected)
+		return;
+
+	g_message("shutting down nbd connection on fd %d", conn->sock);
+	shutdown(conn->sock, SHUT_RDWR);
+	conn->connected = FALSE;
+
+	for (guint i = 0; i < ctx->conns->len; i++) {
+		struct RaucNBDConnection *other = g_ptr_array_index(ctx->conns, i);
+
+		if (other->connected)
+			return;
+	}
+
+	ctx->done = TRUE;
+}
+
+static void send_reply(struct RaucNBDContext *ctx, struct RaucNBDRead *client_read)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = &client_read->reply, .iov_len = sizeof(client_read->reply) },
+		{ .iov_base = client_read->buffer, .iov_len = client_read->request.len },
+	};
+	int iovcnt = client_read->reply.error ? 1 : 2;
+	gsize remaining = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+	struct iovec *pos = iov;
+
+	if (!client_read->conn->connected)
+		return;
+
+	/* send header and body with as few syscalls as possible */
+	while (remaining) {
+		ssize_t ret = writev(client_read->conn->sock, pos, iovcnt);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			g_message("failed to send nbd read reply: %s", g_strerror(errno));
+			disconnect_client(ctx, client_read->conn);
+			return;
+		}
+
+		remaining -= ret;
+		while (iovcnt && (gsize)ret >= pos->iov_len) {
+			ret -= pos->iov_len;
+			pos++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			pos->iov_base = (guint8*)pos->iov_base + ret;
+			pos->iov_len -= ret;
+		}
+	}
+}
+
+static void free_client_read(struct RaucNBDContext *ctx, struct RaucNBDRead *client_read)
+{
+	buffer_put(ctx, client_read->buffer, client_read->request.len);
+	g_free(client_read);
+}
+
+static void flush_deferred_replies(struct RaucNBDContext *ctx, struct RaucNBDConnection *conn)
+{
+	struct RaucNBDRead *client_read;
+
+	while ((client_read = g_queue_pop_head(&conn->deferred_replies))) {
+		send_reply(ctx, client_read);
+		free_client_read(ctx, client_read);
+	}
+}
+
+/* Allows other replies on the connection again after a streamed reply ended. */
+static void end_stream(struct RaucNBDContext *ctx, struct RaucNBDConnection *conn)
+{
+	conn->stream_owner = NULL;
+	flush_deferred_replies(ctx, conn);
+}
+
+static void finish_client_read(struct RaucNBDContext *ctx, struct RaucNBDRead *client_read)
+{
+	struct RaucNBDConnection *conn = client_read->conn;
+
+	if (client_read->streaming) {
+		/* The header was already sent without an error, so the failed
+		 * read can only be reported by closing the connection. */
+		if (client_read->sent != client_read->request.len) {
+			g_message("failed to complete streamed nbd read reply");
+			disconnect_client(ctx, conn);
+			if (conn->stream_owner == client_read)
+				end_stream(ctx, conn);
+		}
+		free_client_read(ctx, client_read);
+		return;
+	}
+
+	/* replies must not be interleaved with a partially sent one on the
+	 * same connection */
+	if (conn->stream_owner) {
+		g_queue_push_tail(&conn->deferred_replies, client_read);
+		return;
+	}
+
+	send_reply(ctx, client_read);
+	free_client_read(ctx, client_read);
+}
+
+/* Sends the newly received part of a range to the kernel, so that the reply
+ * for the read is sent while the transfer is still running. */
+static void stream_read_data(struct RaucNBDTransfer *xfer)
+{
+	struct RaucNBDContext *ctx = xfer->ctx;
+	struct RaucNBDRead *client_read = xfer->stream_read;
+	struct RaucNBDConnection *conn;
+	guint64 start, available;
+
+	if (!client_read || client_read->sent == client_read->request.len)
+		return;
+	conn = client_read->conn;
+	if (conn->stream_owner && conn->stream_owner != client_read)
+		return;
+	if (!conn->connected)
+		return;
+
+	start = client_read->request.from + client_read->sent;
+	available = MIN(xfer->request.from + xfer->buffer_pos,
+			client_read->request.from + client_read->request.len);
+	if (available <= start)
+		return;
+
+	if (!client_read->streaming) {
+		client_read->streaming = TRUE;
+		conn->stream_owner = client_read;
+		if (!r_write_exact(conn->sock, (guint8*)&client_read->reply, sizeof(client_read->reply), NULL)) {
+			g_message("failed to send nbd read reply header");
+			goto fail;
+		}
+	}
+
+	if (!r_write_exact(conn->sock, xfer->buffer + (start - xfer->request.from), available - start, NULL)) {
+		g_message("failed to send nbd read reply body");
+		goto fail;
+	}
+	client_read->sent += available - start;
+
+	if (client_read->sent == client_read->request.len)
+		end_stream(ctx, conn);
+
+	return;
+
+fail:
+	disconnect_client(ctx, conn);
+	end_stream(ctx, conn);
+}
+
+static void refill_bandwidth(struct RaucNBDContext *ctx)
+{
+	gint64 now = g_get_monotonic_time();
+	gdouble burst = (gdouble)ctx->bandwidth_limit * RAUC_NBD_BANDWIDTH_BURST / G_USEC_PER_SEC;
+
+	ctx->bandwidth_tokens += (gdouble)ctx->bandwidth_limit * (now - ctx->bandwidth_time) / G_USEC_PER_SEC;
+	ctx->bandwidth_tokens = MIN(ctx->bandwidth_tokens, burst);
+	ctx->bandwidth_time = now;
+}
+
+/* Takes received data from the bandwidth budget shared by all range
+ * requests. When it is exhausted, the transfer is paused until
+ * resume_throttled() finds the budget refilled, so that the limit holds
+ * independently of the number of parallel requests. */
+static void throttle_transfer(struct RaucNBDTransfer *xfer, gsize len)
+{
+	struct RaucNBDContext *ctx = xfer->ctx;
+
+	if (!ctx->bandwidth_limit || xfer->request.type != NBD_CMD_READ)
+		return;
+
+	refill_bandwidth(ctx);
+	ctx->bandwidth_tokens -= len;
+	if (ctx->bandwidth_tokens >= 0 || xfer->throttled)
+		return;
+
+	if (curl_easy_pause(xfer->easy, CURLPAUSE_RECV) != CURLE_OK)
+		g_error("unexpected error from curl_easy_pause in %s", G_STRFUNC);
+	xfer->throttled = TRUE;
+	g_queue_push_tail(&ctx->throttled, xfer);
+}
+
+/* Continues the paused transfers once the bandwidth budget is positive. */
+static void resume_throttled(struct RaucNBDContext *ctx)
+{
+	GQueue resume = G_QUEUE_INIT;
+	struct RaucNBDTransfer *xfer;
+
+	if (g_queue_is_empty(&ctx->throttled))
+		return;
+
+	refill_bandwidth(ctx);
+	if (ctx->bandwidth_tokens < 0)
+		return;
+
+	/* continuing a transfer may deliver data and pause it again */
+	resume = ctx->throttled;
+	g_queue_init(&ctx->throttled);
+	while ((xfer = g_queue_pop_head(&resume))) {
+		xfer->throttled = FALSE;
+		if (curl_easy_pause(xfer->easy, CURLPAUSE_CONT) != CURLE_OK)
+			g_error("unexpected error from curl_easy_pause in %s", G_STRFUNC);
+	}
+}
+
 static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	struct RaucNBDTransfer *xfer = userdata;
@@ -327,6 +836,12 @@ static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 
 	g_assert_cmpint(size, ==, 1); /* according to the docs, size is always 1 */
 
+	/* abort instead of streaming data from an unexpected response */
+	if (xfer->request.type == NBD_CMD_READ && !xfer->range_valid) {
+		g_message("received data without a valid content-range");
+		return 0;
+	}
+
 	remaining = xfer->buffer_size - xfer->buffer_pos;
 	if (remaining < nmemb) {
 		return 0;
@@ -334,9 +849,58 @@ static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 	memcpy(xfer->buffer + xfer->buffer_pos, ptr, nmemb);
 	xfer->buffer_pos += nmemb;
 
+	stream_read_data(xfer);
+	throttle_transfer(xfer, nmemb);
+
 	return nmemb;
 }
 
+/* Parses the value of a content-range header ('bytes <start>-<end>/<size>'). */
+static gboolean parse_content_range(const gchar *value, guint64 *start, guint64 *end, guint64 *size)
+{
+	g_auto(GStrv) h_elements = NULL;
+	g_auto(GStrv) h_range = NULL;
+	g_auto(GStrv) h_bounds = NULL;
+	gchar *endptr = NULL;
+
+	h_elements = g_strsplit(value, " ", 2);
+	if (g_strv_length(h_elements) != 2) {
+		g_message("failed to parse content-range header");
+		return FALSE;
+	}
+
+	h_range = g_strsplit(h_elements[1], "/", 2);
+	if (g_strv_length(h_range) != 2) {
+		g_message("failed to split content-range value");
+		return FALSE;
+	}
+
+	h_bounds = g_strsplit(h_range[0], "-", 2);
+	if (g_strv_length(h_bounds) != 2 || g_str_equal(h_range[1], "*")) {
+		g_message("invalid content-range value");
+		return FALSE;
+	}
+
+	errno = 0;
+	*size = g_ascii_strtoull(h_range[1], &endptr, 10);
+	if (errno != 0 || endptr[0] != '\0') {
+		g_message("failed to parse content-range size");
+		return FALSE;
+	}
+	*start = g_ascii_strtoull(h_bounds[0], &endptr, 10);
+	if (errno != 0 || endptr[0] != '\0') {
+		g_message("failed to parse content-range start");
+		return FALSE;
+	}
+	*end = g_ascii_strtoull(h_bounds[1], &endptr, 10);
+	if (errno != 0 || endptr[0] != '\0') {
+		g_message("failed to parse content-range end");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
 {
 	struct RaucNBDTransfer *xfer = userdata;
@@ -353,35 +917,21 @@ static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata
 		return nitems;
 
 	if (g_str_equal(h_pair[0], "content-range")) {
-		g_auto(GStrv) h_elements = NULL;
-		g_auto(GStrv) h_range = NULL;
-		gchar *endptr = NULL;
 		guint64 range_size = 0;
+		guint64 range_start = 0, range_end = 0;
 
-		h_elements = g_strsplit(h_pair[1], " ", 2);
-		if (g_strv_length(h_elements) != 2) {
-			g_message("failed to parse content-range header");
-			return 0;
-		}
-
-		h_range = g_strsplit(h_elements[1], "/", 2);
-		if (g_strv_length(h_range) != 2) {
-			g_message("failed to split content-range value");
+		if (!parse_content_range(h_pair[1], &range_start, &range_end, &range_size))
 			return 0;
-		}
-
-		if (!g_str_equal(h_range[0], "0-3") || g_str_equal(h_range[1], "*")) {
-			g_message("invalid content-range value");
-			return 0;
-		}
 
-		errno = 0;
-		range_size = g_ascii_strtoull(h_range[1], &endptr, 10);
-		if (errno != 0 || endptr[0] != '\0') {
-			g_message("failed to parse content-range size");
+		/* we requested the end of the file, which is shorter for small files */
+		if (range_start > range_end || range_end + 1 != range_size ||
+		    range_end - range_start + 1 > (guint64)xfer->buffer_size) {
+			g_message("unexpected content-range value");
 			return 0;
 		}
 
+		xfer->range_from = range_start;
+		xfer->buffer_size = range_end - range_start + 1;
 		xfer->content_size = range_size;
 
 		g_message("total size %"G_GUINT64_FORMAT, range_size);
@@ -397,8 +947,62 @@ static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata
 			xfer->modified_time = date;
 			g_message("file date %"G_GUINT64_FORMAT, xfer->modified_time);
 		}
+	} else if (g_str_equal(h_pair[0], "etag")) {
+		/* entity tags are case-sensitive */
+		g_autofree gchar *original = g_strchomp(g_strndup(buffer, nitems));
+
+		g_free(xfer->etag);
+		xfer->etag = g_strdup(original + strlen(h_pair[0]) + 2);
+	}
+
+	return nitems;
+}
+
+/* Checks the response to a range request before any of its data arrives.
+ * Only data from a partial response for exactly the requested range is
+ * accepted by write_cb(), as it is streamed to the kernel immediately. */
+static size_t read_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	struct RaucNBDTransfer *xfer = userdata;
+	g_autofree gchar *header = NULL;
+	g_auto(GStrv) h_pair = NULL;
+	guint64 range_size = 0;
+	guint64 range_start = 0, range_end = 0;
+	long response_code = 0;
+
+	g_assert_cmpint(size, ==, 1); /* according to the docs, size is always 1 */
+
+	/* make sure we have a 0-terminated lowercase string */
+	header = g_strchomp(g_ascii_strdown(buffer, nitems));
+
+	/* each response (such as a redirect) starts with a status line */
+	if (g_str_has_prefix(header, "http/")) {
+		xfer->range_valid = FALSE;
+		return nitems;
+	}
+
+	h_pair = g_strsplit(header, ": ", 2);
+	if (g_strv_length(h_pair) < 2 || !g_str_equal(h_pair[0], "content-range"))
+		return nitems;
+
+	if (curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &response_code) != CURLE_OK ||
+	    response_code != 206) {
+		g_message("unexpected HTTP response code %ld for range request", response_code);
+		return 0;
+	}
+
+	if (!parse_content_range(h_pair[1], &range_start, &range_end, &range_size))
+		return 0;
+
+	if (range_start != xfer->request.from ||
+	    range_end != xfer->request.from + xfer->request.len - 1 ||
+	    range_size != xfer->ctx->data_size) {
+		g_message("unexpected content-range value for range request");
+		return 0;
 	}
 
+	xfer->range_valid = TRUE;
+
 	return nitems;
 }
 
@@ -408,16 +1012,23 @@ static void prepare_curl(struct RaucNBDTransfer *xfer)
 	CURLcode tunnel_code = 0;
 	g_assert_null(xfer->easy);
 
-	xfer->easy = curl_easy_init();
+	/* Reusing a handle keeps its TLS session and connection, all options
+	 * are set again after the reset. */
+	xfer->easy = g_queue_pop_head(&xfer->ctx->idle_handles);
+	if (xfer->easy)
+		curl_easy_reset(xfer->easy);
+	else
+		xfer->easy = curl_easy_init();
 	if (!xfer->easy)
 		g_error("unexpected error from curl_easy_init in %s", G_STRFUNC);
 
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_ERRORBUFFER, xfer->errbuf);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_SHARE, xfer->ctx->share);
 
 	if (g_getenv("RAUC_CURL_VERBOSE"))
 		code |= curl_easy_setopt(xfer->easy, CURLOPT_VERBOSE, 1L);
 
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_URL, xfer->ctx->url);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_URL, xfer->source ? xfer->source->url : xfer->ctx->url);
 	if (xfer->ctx->tls_cert)
 		code |= curl_easy_setopt(xfer->easy, CURLOPT_SSLCERT, xfer->ctx->tls_cert);
 	if (xfer->ctx->tls_key)
@@ -442,7 +1053,15 @@ static void prepare_curl(struct RaucNBDTransfer *xfer)
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
 	/* use a shorter timeout instead of the 5 minute default */
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_CONNECTTIMEOUT, 20L);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_CONNECTTIMEOUT, (long)xfer->ctx->connect_timeout);
+	if (xfer->ctx->request_timeout)
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_TIMEOUT, (long)xfer->ctx->request_timeout);
+
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+	/* multiplex range requests over a single HTTP/2 connection if possible */
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_PIPEWAIT, 1L);
+#endif
 
 	/* a proxy may be configured using .netrc */
 	tunnel_code = curl_easy_setopt(xfer->easy, CURLOPT_HTTPPROXYTUNNEL, 1L);
@@ -501,17 +1120,123 @@ static void collect_curl_stats(struct RaucNBDContext *ctx, struct RaucNBDTransfe
 	}
 }
 
+static void free_source(gpointer data)
+{
+	struct RaucNBDSource *source = data;
+
+	g_free(source->url);
+	g_free(source);
+}
+
+static gdouble source_weight(const struct RaucNBDSource *source)
+{
+	return 1.0 / (MAX(source->latency, 0.001) * (source->active + 1));
+}
+
+/* Returns TRUE if a source is available for the next request. */
+static gboolean source_available(struct RaucNBDContext *ctx)
+{
+	gint64 now = g_get_monotonic_time();
+
+	for (guint i = 0; i < ctx->sources->len; i++) {
+		struct RaucNBDSource *source = g_ptr_array_index(ctx->sources, i);
+
+		if (source->disabled_until <= now)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Selects the source for the next range request. A healthy LAN cache is
+ * always preferred. Otherwise, a source is chosen randomly, weighted by its
+ * latency and the number of requests already running on it. If all sources
+ * failed recently, the one which is skipped for the shortest time is used. */
+static struct RaucNBDSource *select_source(struct RaucNBDContext *ctx)
+{
+	gint64 now = g_get_monotonic_time();
+	struct RaucNBDSource *selected = NULL;
+	gdouble total = 0, pick;
+
+	for (guint i = 0; i < ctx->sources->len; i++) {
+		struct RaucNBDSource *source = g_ptr_array_index(ctx->sources, i);
+
+		if (source->disabled_until > now) {
+			if (!selected || source->disabled_until < selected->disabled_until)
+				selected = source;
+			continue;
+		}
+		if (source->lan)
+			return source;
+		total += source_weight(source);
+	}
+
+	if (total == 0)
+		return selected;
+
+	pick = g_random_double_range(0, total);
+	for (guint i = 0; i < ctx->sources->len; i++) {
+		struct RaucNBDSource *source = g_ptr_array_index(ctx->sources, i);
+
+		if (source->disabled_until > now)
+			continue;
+		selected = source;
+		pick -= source_weight(source);
+		if (pick < 0)
+			break;
+	}
+
+	return selected;
+}
+
+/* Updates the statistics of the source used by a finished attempt. A failed
+ * source is skipped for a time growing with the number of consecutive
+ * failures, so that requests fail over to the other sources. */
+static void update_source(struct RaucNBDTransfer *xfer, gboolean success)
+{
+	struct RaucNBDSource *source = xfer->source;
+	double starttransfer = 0;
+	gint64 backoff;
+
+	if (!source)
+		return;
+
+	source->active--;
+
+	if (success) {
+		source->failures = 0;
+		if (curl_easy_getinfo(xfer->easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer) == CURLE_OK)
+			source->latency = source->latency ? 0.8 * source->latency + 0.2 * starttransfer : starttransfer;
+		return;
+	}
+
+	backoff = (gint64)RAUC_NBD_SOURCE_BACKOFF_MIN << MIN(source->failures, 6);
+	source->failures++;
+	source->disabled_until = g_get_monotonic_time() + MIN(backoff, RAUC_NBD_SOURCE_BACKOFF_MAX);
+	if (xfer->ctx->sources->len > 1)
+		g_message("skipping %s after %u failed requests", source->url, source->failures);
+}
+
 static void start_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
 	CURLcode code = 0;
 	CURLMcode mcode = 0;
 	g_autofree gchar *range = NULL;
 
-	xfer->buffer = g_malloc(xfer->request.len);
+	xfer->buffer = buffer_get(ctx, xfer->request.len);
 	xfer->buffer_size = xfer->request.len;
 	xfer->buffer_pos = 0;
 
+	/* a retry may use a different source */
+	xfer->source = select_source(ctx);
+	if (xfer->source)
+		xfer->source->active++;
+
+	xfer->range_valid = FALSE;
+
 	prepare_curl(xfer);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERFUNCTION, read_header_cb);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERDATA, xfer);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, xfer);
 	range = g_strdup_printf("%"G_GUINT64_FORMAT "-%"G_GUINT64_FORMAT,
@@ -551,6 +1276,28 @@ static struct curl_slist *gstrv_add_to_slist(struct curl_slist *initial_list, co
 	return slist;
 }
 
+/* Sets up a request for the end of the bundle. This checks that range
+ * requests work, returns the size and already contains the signature, which
+ * is read next by the client. */
+static void prepare_tail_request(struct RaucNBDTransfer *xfer)
+{
+	g_autofree gchar *range = g_strdup_printf("-%d", RAUC_NBD_TAIL_SIZE);
+	CURLcode code = 0;
+
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERFUNCTION, header_cb);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERDATA, xfer);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, xfer);
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, range);
+	if (code)
+		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
+
+	g_free(xfer->buffer);
+	xfer->buffer = g_malloc(RAUC_NBD_TAIL_SIZE);
+	xfer->buffer_size = RAUC_NBD_TAIL_SIZE;
+	xfer->buffer_pos = 0;
+}
+
 static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
 	gboolean res = FALSE;
@@ -563,6 +1310,7 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 	/* only read from the client on the first try */
 	if (!ctx->url) {
 		GStrv info_headers; /* array of strings such as 'Foo: bar' */
+		guint32 connections;
 
 		res = r_read_exact(ctx->sock, (guint8*)data, xfer->request.len, NULL);
 		g_assert_true(res);
@@ -586,8 +1334,38 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		g_variant_dict_lookup(&dict, "no-verify", "b", &ctx->tls_no_verify);
 		g_variant_dict_lookup(&dict, "headers", "^as", &ctx->headers);
 		g_variant_dict_lookup(&dict, "info-headers", "^as", &info_headers);
+		g_variant_dict_lookup(&dict, "cache-size", "t", &ctx->cache_size);
+		g_variant_dict_lookup(&dict, "read-ahead", "t", &ctx->read_ahead);
+		g_variant_dict_lookup(&dict, "max-streams", "u", &ctx->max_streams);
+		g_variant_dict_lookup(&dict, "max-retries", "u", &ctx->max_retries);
+		g_variant_dict_lookup(&dict, "connect-timeout", "u", &ctx->connect_timeout);
+		g_variant_dict_lookup(&dict, "request-timeout", "u", &ctx->request_timeout);
+		g_variant_dict_lookup(&dict, "max-concurrency", "u", &ctx->max_concurrency);
+		g_variant_dict_lookup(&dict, "bandwidth-limit", "t", &ctx->bandwidth_limit);
+		g_variant_dict_lookup(&dict, "mirrors", "^as", &ctx->mirrors);
+		g_variant_dict_lookup(&dict, "lan-cache", "s", &ctx->lan_cache);
+		g_variant_dict_lookup(&dict, "disk-cache-directory", "s", &ctx->disk_cache_dir);
+		g_variant_dict_lookup(&dict, "disk-cache-size", "t", &ctx->disk_cache_size);
+		g_variant_dict_lookup(&dict, "if-none-match", "s", &ctx->if_none_match);
+		g_variant_dict_lookup(&dict, "if-modified-since", "t", &ctx->if_modified_since);
+		g_variant_dict_lookup(&dict, "cached-size", "t", &ctx->cached_size);
+		ctx->concurrency = MIN(RAUC_NBD_INITIAL_CONCURRENCY, ctx->max_concurrency);
+		if (g_variant_dict_lookup(&dict, "connections", "u", &connections)) {
+			/* additional connections are passed on the following fds */
+			for (guint32 i = 1; i < connections; i++) {
+				g_ptr_array_add(ctx->conns, new_connection(ctx->sock + i));
+			}
+		}
 		g_assert_nonnull(ctx->url);
 
+#if LIBCURL_VERSION_NUM >= 0x074300 /* 7.67.0 */
+		if (ctx->max_streams) {
+			CURLMcode mcode = curl_multi_setopt(ctx->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)ctx->max_streams);
+			if (mcode != CURLM_OK)
+				g_error("unexpected error from curl_multi_setopt in %s", G_STRFUNC);
+		}
+#endif
+
 		if (ctx->headers) {
 			ctx->headers_slist = gstrv_add_to_slist(NULL, ctx->headers);
 			ctx->initial_headers_slist = gstrv_add_to_slist(NULL, ctx->headers);
@@ -595,6 +1373,14 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		if (info_headers) {
 			ctx->initial_headers_slist = gstrv_add_to_slist(ctx->initial_headers_slist, info_headers);
 		}
+		if (ctx->if_none_match) {
+			g_autofree gchar *header = g_strdup_printf("If-None-Match: %s", ctx->if_none_match);
+			struct curl_slist *temp = curl_slist_append(ctx->initial_headers_slist, header);
+
+			if (!temp)
+				g_error("unexpected error from curl_slist_append in %s (out of memory?)", G_STRFUNC);
+			ctx->initial_headers_slist = temp;
+		}
 	}
 
 	g_message("configuring for URL: %s", ctx->url);
@@ -605,19 +1391,16 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		code |= curl_easy_setopt(xfer->easy, CURLOPT_HTTPHEADER, ctx->initial_headers_slist);
 	}
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_USERAGENT, PACKAGE_NAME "/" PACKAGE_VERSION);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERFUNCTION, header_cb);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERDATA, xfer);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, xfer);
-	/* we could try a HEAD request, but prefer to check if range requests work */
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, "0-3"); /* get the "sqsh" magic */
-
+	/* the server replies with 304 if the bundle was not modified */
+	if (ctx->if_modified_since) {
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_TIMEVALUE, (long)ctx->if_modified_since);
+	}
 	if (code)
 		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
 
-	xfer->buffer = g_malloc(4);
-	xfer->buffer_size = 4;
-	xfer->buffer_pos = 0;
+	/* we could try a HEAD request, but prefer to check if range requests work */
+	prepare_tail_request(xfer);
 
 	mcode = curl_multi_add_handle(ctx->multi, xfer->easy);
 	if (mcode != CURLM_OK)
@@ -631,11 +1414,6 @@ static void start_request(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xf
 			start_read(ctx, xfer);
 			break;
 		}
-		case NBD_CMD_DISC: {
-			g_message("disconnect");
-			ctx->done = TRUE;
-			break;
-		}
 		case RAUC_NBD_CMD_CONFIGURE: {
 			start_configure(ctx, xfer);
 			break;
@@ -647,48 +1425,736 @@ static void start_request(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xf
 	}
 }
 
+static void free_block(gpointer data)
+{
+	struct RaucNBDBlock *block = data;
+
+	g_free(block->data);
+	g_free(block);
+}
+
+static void cache_touch(struct RaucNBDContext *ctx, struct RaucNBDBlock *block)
+{
+	g_queue_unlink(&ctx->cache_lru, &block->link);
+	g_queue_push_head_link(&ctx->cache_lru, &block->link);
+}
+
+static void cache_insert(struct RaucNBDContext *ctx, guint64 index, const guint8 *data, gsize len)
+{
+	struct RaucNBDBlock *block;
+
+	if (!ctx->cache_size || g_hash_table_contains(ctx->cache, &index))
+		return;
+
+	block = g_new0(struct RaucNBDBlock, 1);
+	block->index = index;
+	block->data = buffer_get(ctx, len);
+	memcpy(block->data, data, len);
+	block->len = len;
+	block->link.data = block;
+
+	g_queue_push_head_link(&ctx->cache_lru, &block->link);
+	g_hash_table_insert(ctx->cache, &block->index, block);
+	ctx->cache_used += len;
+}
+
+/* Drops the least recently used blocks until the cache fits its budget. */
+static void cache_evict(struct RaucNBDContext *ctx)
+{
+	while (ctx->cache_used > ctx->cache_size) {
+		struct RaucNBDBlock *block = g_queue_peek_tail(&ctx->cache_lru);
+
+		g_queue_unlink(&ctx->cache_lru, &block->link);
+		ctx->cache_used -= block->len;
+		g_hash_table_steal(ctx->cache, &block->index);
+		buffer_put(ctx, block->data, block->len);
+		g_free(block);
+	}
+}
+
+/* Copies the part of [from, from+len) which overlaps the read into its buffer. */
+static void copy_to_read(struct RaucNBDRead *client_read, guint64 from, const guint8 *data, guint64 len)
+{
+	guint64 start = MAX(from, client_read->request.from);
+	guint64 end = MIN(from + len, client_read->request.from + client_read->request.len);
+
+	if (start >= end)
+		return;
+
+	memcpy(client_read->buffer + (start - client_read->request.from), data + (start - from), end - start);
+}
+
+/* Returns the number of blocks shared by the read and [from, from+len). */
+static guint overlapping_blocks(struct RaucNBDRead *client_read, guint64 from, guint64 len)
+{
+	guint64 start = MAX(from, client_read->request.from);
+	guint64 end = MIN(from + len, client_read->request.from + client_read->request.len);
+
+	if (start >= end)
+		return 0;
+
+	return (end - 1) / RAUC_NBD_BLOCK_SIZE - start / RAUC_NBD_BLOCK_SIZE + 1;
+}
+
+/* Returns the expected size of a block, which is smaller only at the end. */
+static gsize block_len(struct RaucNBDContext *ctx, guint64 index)
+{
+	return MIN(RAUC_NBD_BLOCK_SIZE, ctx->data_size - index * RAUC_NBD_BLOCK_SIZE);
+}
+
+static void free_disk_entry(struct RaucNBDDiskEntry *entry)
+{
+	g_free(entry->path);
+	g_free(entry);
+}
+
+static gint compare_disk_mtime(gconstpointer a, gconstpointer b)
+{
+	const struct RaucNBDDiskEntry *ea = *(struct RaucNBDDiskEntry * const *)a;
+	const struct RaucNBDDiskEntry *eb = *(struct RaucNBDDiskEntry * const *)b;
+
+	if (ea->mtime < eb->mtime)
+		return -1;
+	return ea->mtime > eb->mtime;
+}
+
+static void disk_cache_worker(gpointer data, gpointer user_data)
+{
+	struct RaucNBDDiskJob *job = data;
+	struct RaucNBDContext *ctx = user_data;
+	g_autoptr(GError) ierror = NULL;
+
+	switch (job->op) {
+		case R_NBD_DISK_WRITE: {
+			/* the file is replaced atomically, so a concurrent load
+			 * never sees partial data */
+			if (!g_file_set_contents(job->path, (const gchar *)job->data, job->len, &ierror))
+				g_message("failed to write to the persistent cache: %s", ierror->message);
+			g_atomic_int_add(&ctx->disk_queued, -(gint)job->len);
+			break;
+		}
+		case R_NBD_DISK_REMOVE:
+		case R_NBD_DISK_REMOVE_OTHER: {
+			if (g_unlink(job->path) == -1 && errno != ENOENT)
+				g_message("failed to remove %s: %s", job->path, g_strerror(errno));
+			if (job->op == R_NBD_DISK_REMOVE_OTHER) {
+				g_autofree gchar *dir = g_path_get_dirname(job->path);
+				g_rmdir(dir);
+			}
+			break;
+		}
+		case R_NBD_DISK_TOUCH: {
+			g_utime(job->path, NULL);
+			break;
+		}
+	}
+
+	g_free(job->path);
+	g_free(job->data);
+	g_free(job);
+}
+
+/* Queues a file system update of the persistent cache, so that the event
+ * loop does not wait for the disk. As all updates are done in order by a
+ * single worker, a file is never written after its removal was queued. */
+static void disk_cache_queue(struct RaucNBDContext *ctx, RaucNBDDiskOp op, const gchar *path, const guint8 *data, gsize len)
+{
+	struct RaucNBDDiskJob *job = g_new0(struct RaucNBDDiskJob, 1);
+
+	job->op = op;
+	job->path = g_strdup(path);
+	if (data) {
+		job->data = g_malloc(len);
+		memcpy(job->data, data, len);
+		job->len = len;
+		g_atomic_int_add(&ctx->disk_queued, (gint)len);
+	}
+
+	g_thread_pool_push(ctx->disk_pool, job, NULL);
+}
+
+/* Removes the least recently used block files until the persistent cache
+ * fits its budget. */
+static void disk_cache_evict(struct RaucNBDContext *ctx)
+{
+	while (ctx->disk_used > ctx->disk_cache_size && !g_queue_is_empty(&ctx->disk_lru)) {
+		GList *link = g_queue_pop_head_link(&ctx->disk_lru);
+		struct RaucNBDDiskEntry *entry = link->data;
+
+		if (entry->current) {
+			disk_cache_queue(ctx, R_NBD_DISK_REMOVE, entry->path, NULL, 0);
+			g_hash_table_remove(ctx->disk_blocks, &entry->index);
+		} else {
+			disk_cache_queue(ctx, R_NBD_DISK_REMOVE_OTHER, entry->path, NULL, 0);
+		}
+		ctx->disk_used -= entry->len;
+		free_disk_entry(entry);
+	}
+}
+
+/* Collects the block files of a single bundle directory. */
+static void disk_cache_scan_dir(struct RaucNBDContext *ctx, const gchar *dirpath, gboolean current, GPtrArray *entries)
+{
+	g_autoptr(GDir) dir = g_dir_open(dirpath, 0, NULL);
+	const gchar *name;
+
+	if (!dir)
+		return;
+
+	while ((name = g_dir_read_name(dir))) {
+		g_autofree gchar *path = g_build_filename(dirpath, name, NULL);
+		struct RaucNBDDiskEntry *entry;
+		GStatBuf st;
+		gchar *endptr = NULL;
+		guint64 index;
+
+		index = g_ascii_strtoull(name, &endptr, 16);
+		if (g_stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		/* incomplete files left from an interrupted write are removed */
+		if (endptr == name || endptr[0] != '\0' ||
+		    (current && (index * RAUC_NBD_BLOCK_SIZE >= ctx->data_size ||
+		                 (gsize)st.st_size != block_len(ctx, index)))) {
+			g_unlink(path);
+			continue;
+		}
+
+		entry = g_new0(struct RaucNBDDiskEntry, 1);
+		entry->path = g_steal_pointer(&path);
+		entry->current = current;
+		entry->index = index;
+		entry->len = st.st_size;
+		entry->mtime = st.st_mtime;
+		entry->link.data = entry;
+		g_ptr_array_add(entries, entry);
+	}
+}
+
+/* Opens the persistent cache for the configured bundle. Blocks are stored in
+ * one directory per bundle, identified by its URL, size and validators, so
+ * that a changed bundle never uses stale data. The usage of all bundles in the
+ * cache directory counts against the budget. */
+static void disk_cache_open(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	g_autofree gchar *id = NULL;
+	g_autofree gchar *key = NULL;
+	g_autoptr(GPtrArray) entries = g_ptr_array_new();
+	g_autoptr(GDir) dir = NULL;
+	const gchar *name;
+
+	if (!xfer->modified_time && !xfer->etag) {
+		g_message("not using the persistent cache, as the server sends neither last-modified nor etag");
+		return;
+	}
+
+	id = g_strdup_printf("%s\n%"G_GUINT64_FORMAT "\n%"G_GUINT64_FORMAT "\n%s",
+			ctx->url, xfer->content_size, xfer->modified_time, xfer->etag ? xfer->etag : "");
+	key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, id, -1);
+	ctx->disk_cache_path = g_build_filename(ctx->disk_cache_dir, key, NULL);
+
+	if (g_mkdir_with_parents(ctx->disk_cache_path, 0700) != 0) {
+		g_message("not using the persistent cache: failed to create %s: %s",
+				ctx->disk_cache_path, g_strerror(errno));
+		g_clear_pointer(&ctx->disk_cache_path, g_free);
+		return;
+	}
+
+	ctx->disk_pool = g_thread_pool_new(disk_cache_worker, ctx, 1, FALSE, NULL);
+
+	/* This scan is done once before the configure reply. As the cache is
+	 * kept within its budget, the number of files is bounded as well. */
+	dir = g_dir_open(ctx->disk_cache_dir, 0, NULL);
+	while (dir && (name = g_dir_read_name(dir))) {
+		g_autofree gchar *path = g_build_filename(ctx->disk_cache_dir, name, NULL);
+
+		disk_cache_scan_dir(ctx, path, g_str_equal(name, key), entries);
+	}
+
+	g_ptr_array_sort(entries, compare_disk_mtime);
+	for (guint i = 0; i < entries->len; i++) {
+		struct RaucNBDDiskEntry *entry = g_ptr_array_index(entries, i);
+
+		g_queue_push_tail_link(&ctx->disk_lru, &entry->link);
+		ctx->disk_used += entry->len;
+		if (entry->current)
+			g_hash_table_insert(ctx->disk_blocks, &entry->index, entry);
+	}
+
+	g_message("persistent cache: %u blocks of this bundle, %"G_GUINT64_FORMAT " bytes used",
+			g_hash_table_size(ctx->disk_blocks), ctx->disk_used);
+
+	disk_cache_evict(ctx);
+}
+
+/* Serves a block from the persistent cache, returns FALSE if not available.
+ * Only a single block file is read here, all updates are left to the
+ * worker. A block which is still queued for writing is treated as a miss. */
+static gboolean disk_cache_load(struct RaucNBDContext *ctx, guint64 index, struct RaucNBDRead *client_read)
+{
+	struct RaucNBDDiskEntry *entry = g_hash_table_lookup(ctx->disk_blocks, &index);
+	g_autofree gchar *data = NULL;
+	gsize len = 0;
+
+	if (!entry)
+		return FALSE;
+
+	if (!g_file_get_contents(entry->path, &data, &len, NULL) || len != entry->len) {
+		g_queue_unlink(&ctx->disk_lru, &entry->link);
+		g_hash_table_remove(ctx->disk_blocks, &index);
+		disk_cache_queue(ctx, R_NBD_DISK_REMOVE, entry->path, NULL, 0);
+		ctx->disk_used -= entry->len;
+		free_disk_entry(entry);
+		return FALSE;
+	}
+
+	/* keep the order of use for the next run */
+	disk_cache_queue(ctx, R_NBD_DISK_TOUCH, entry->path, NULL, 0);
+	g_queue_unlink(&ctx->disk_lru, &entry->link);
+	g_queue_push_tail_link(&ctx->disk_lru, &entry->link);
+
+	ctx->disk_hits++;
+	copy_to_read(client_read, index * RAUC_NBD_BLOCK_SIZE, (guint8 *)data, len);
+	cache_insert(ctx, index, (guint8 *)data, len);
+	cache_evict(ctx);
+
+	return TRUE;
+}
+
+/* Queues a block for writing to the persistent cache. If the disk cannot
+ * keep up with the download, blocks are skipped instead of queuing
+ * unbounded amounts of data. */
+static void disk_cache_store(struct RaucNBDContext *ctx, guint64 index, const guint8 *data, gsize len)
+{
+	struct RaucNBDDiskEntry *entry;
+	g_autofree gchar *path = NULL;
+
+	if (!ctx->disk_cache_path || g_hash_table_contains(ctx->disk_blocks, &index))
+		return;
+
+	if ((gsize)g_atomic_int_get(&ctx->disk_queued) + len > RAUC_NBD_DISK_QUEUE_SIZE)
+		return;
+
+	path = g_strdup_printf("%s/%016"G_GINT64_MODIFIER "x", ctx->disk_cache_path, index);
+	disk_cache_queue(ctx, R_NBD_DISK_WRITE, path, data, len);
+
+	entry = g_new0(struct RaucNBDDiskEntry, 1);
+	entry->path = g_steal_pointer(&path);
+	entry->current = TRUE;
+	entry->index = index;
+	entry->len = len;
+	entry->link.data = entry;
+	g_queue_push_tail_link(&ctx->disk_lru, &entry->link);
+	g_hash_table_insert(ctx->disk_blocks, &entry->index, entry);
+	ctx->disk_used += len;
+
+	disk_cache_evict(ctx);
+}
+
+static void plan_block(struct RaucNBDContext *ctx, guint64 index, struct RaucNBDRead *client_read)
+{
+	struct RaucNBDPlanned planned = {
+		.index = index,
+		.read = client_read,
+	};
+
+	g_array_append_val(ctx->planned, planned);
+}
+
+/* Extends sequential streams by a growing read-ahead window. */
+static void plan_read_ahead(struct RaucNBDContext *ctx, struct RaucNBDRead *client_read)
+{
+	guint64 end = client_read->request.from + client_read->request.len;
+	guint64 max_window = MIN(ctx->read_ahead, ctx->cache_size / 2);
+
+	if (!max_window)
+		return;
+
+	/* the kernel may reorder parallel reads of a sequential stream */
+	if (client_read->request.from <= ctx->seq_next &&
+	    ctx->seq_next - client_read->request.from <= ctx->window + RAUC_NBD_BLOCK_SIZE) {
+		ctx->window = MIN(MAX(ctx->window * 2, 2 * RAUC_NBD_BLOCK_SIZE), max_window);
+		ctx->seq_next = MAX(ctx->seq_next, end);
+	} else {
+		ctx->window = 0;
+		ctx->seq_next = end;
+		return;
+	}
+
+	for (guint64 index = (ctx->seq_next - 1) / RAUC_NBD_BLOCK_SIZE + 1;
+	     index * RAUC_NBD_BLOCK_SIZE < MIN(ctx->seq_next + ctx->window, ctx->data_size);
+	     index++) {
+		if (g_hash_table_contains(ctx->cache, &index) || g_hash_table_contains(ctx->inflight, &index) ||
+		    g_hash_table_contains(ctx->disk_blocks, &index))
+			continue;
+		plan_block(ctx, index, NULL);
+	}
+}
+
+static void handle_read(struct RaucNBDContext *ctx, struct RaucNBDRead *client_read)
+{
+	guint64 first = client_read->request.from / RAUC_NBD_BLOCK_SIZE;
+	guint64 last = (client_read->request.from + client_read->request.len - 1) / RAUC_NBD_BLOCK_SIZE;
+
+	client_read->buffer = buffer_get(ctx, client_read->request.len);
+
+	if (ctx->tail && client_read->request.from >= ctx->tail_from &&
+	    client_read->request.from + client_read->request.len <= ctx->data_size) {
+		ctx->cache_hits++;
+		memcpy(client_read->buffer, ctx->tail + (client_read->request.from - ctx->tail_from),
+				client_read->request.len);
+		finish_client_read(ctx, client_read);
+		return;
+	}
+
+	for (guint64 index = first; index <= last; index++) {
+		struct RaucNBDBlock *block = g_hash_table_lookup(ctx->cache, &index);
+		struct RaucNBDTransfer *xfer = NULL;
+
+		if (block) {
+			ctx->cache_hits++;
+			cache_touch(ctx, block);
+			copy_to_read(client_read, index * RAUC_NBD_BLOCK_SIZE, block->data, block->len);
+			continue;
+		}
+
+		if (disk_cache_load(ctx, index, client_read))
+			continue;
+
+		ctx->cache_misses++;
+		client_read->pending++;
+		xfer = g_hash_table_lookup(ctx->inflight, &index);
+		if (xfer) {
+			if (!g_ptr_array_find(xfer->reads, client_read, NULL))
+				g_ptr_array_add(xfer->reads, client_read);
+		} else {
+			plan_block(ctx, index, client_read);
+		}
+	}
+
+	plan_read_ahead(ctx, client_read);
+
+	if (!client_read->pending)
+		finish_client_read(ctx, client_read);
+}
+
+static gint compare_planned(gconstpointer a, gconstpointer b)
+{
+	const struct RaucNBDPlanned *pa = a;
+	const struct RaucNBDPlanned *pb = b;
+
+	if (pa->index < pb->index)
+		return -1;
+	return pa->index > pb->index;
+}
+
+/* Starts waiting range requests as allowed by the concurrency limit. */
+static void start_waiting_fetches(struct RaucNBDContext *ctx)
+{
+	while (!g_queue_is_empty(&ctx->waiting_fetches) &&
+	       ctx->active_fetches < MAX((guint)ctx->concurrency, 1)) {
+		ctx->active_fetches++;
+		start_request(ctx, g_queue_pop_head(&ctx->waiting_fetches));
+	}
+}
+
+static void decrease_concurrency(struct RaucNBDContext *ctx)
+{
+	/* react only once per window of requests to a single congestion event */
+	if (ctx->completed_since_decrease < (guint)ctx->concurrency)
+		return;
+
+	ctx->concurrency = MAX(ctx->concurrency / 2, 1.0);
+	ctx->completed_since_decrease = 0;
+	g_debug("decreased concurrency to %.1f", ctx->concurrency);
+}
+
+/* Adapts the number of parallel range requests (AIMD). It grows by one for
+ * each window of successful requests and is halved on errors or when the time
+ * to the first byte rises well above the best observed value, which indicates
+ * queuing on the path to the server. */
+static void update_concurrency(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	double starttransfer = 0;
+
+	ctx->completed_since_decrease++;
+
+	if (xfer->reply.error) {
+		decrease_concurrency(ctx);
+		return;
+	}
+
+	if (curl_easy_getinfo(xfer->easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer) != CURLE_OK)
+		return;
+
+	if (ctx->min_starttransfer == 0 || starttransfer < ctx->min_starttransfer)
+		ctx->min_starttransfer = starttransfer;
+
+	if (starttransfer > 2 * ctx->min_starttransfer + 0.05)
+		decrease_concurrency(ctx);
+	else
+		ctx->concurrency = MIN(ctx->concurrency + 1 / ctx->concurrency, ctx->max_concurrency);
+}
+
+/* Coalesces all planned blocks into as few range requests as possible. */
+static void start_planned_reads(struct RaucNBDContext *ctx)
+{
+	guint i = 0;
+
+	g_array_sort(ctx->planned, compare_planned);
+
+	while (i < ctx->planned->len) {
+		struct RaucNBDTransfer *xfer = g_malloc0(sizeof(struct RaucNBDTransfer));
+		guint64 first = g_array_index(ctx->planned, struct RaucNBDPlanned, i).index;
+		guint64 last = first;
+		guint64 end;
+
+		xfer->ctx = ctx;
+		xfer->reads = g_ptr_array_new();
+
+		for (; i < ctx->planned->len; i++) {
+			struct RaucNBDPlanned *planned = &g_array_index(ctx->planned, struct RaucNBDPlanned, i);
+
+			if (planned->index > last + 1)
+				break;
+			if ((planned->index - first + 1) * RAUC_NBD_BLOCK_SIZE > RAUC_NBD_MAX_FETCH)
+				break;
+
+			last = planned->index;
+			if (planned->read && !g_ptr_array_find(xfer->reads, planned->read, NULL))
+				g_ptr_array_add(xfer->reads, planned->read);
+		}
+
+		for (guint64 index = first; index <= last; index++) {
+			guint64 *key = g_new(guint64, 1);
+			*key = index;
+			g_hash_table_insert(ctx->inflight, key, xfer);
+		}
+
+		end = MIN((last + 1) * RAUC_NBD_BLOCK_SIZE, ctx->data_size);
+		xfer->request.type = NBD_CMD_READ;
+		xfer->request.from = first * RAUC_NBD_BLOCK_SIZE;
+		xfer->request.len = end - xfer->request.from;
+
+		/* the reply for a read with all of its data in this range can be
+		 * streamed */
+		for (guint j = 0; j < xfer->reads->len; j++) {
+			struct RaucNBDRead *client_read = g_ptr_array_index(xfer->reads, j);
+			guint blocks = overlapping_blocks(client_read, client_read->request.from, client_read->request.len);
+
+			if (client_read->pending == blocks &&
+			    overlapping_blocks(client_read, xfer->request.from, xfer->request.len) == blocks) {
+				xfer->stream_read = client_read;
+				break;
+			}
+		}
+
+		g_queue_push_tail(&ctx->waiting_fetches, xfer);
+	}
+
+	g_array_set_size(ctx->planned, 0);
+
+	start_waiting_fetches(ctx);
+}
+
 static gboolean finish_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
 	gboolean res = FALSE;
 	CURLcode code;
 	long response_code = 0;
+	guint64 first, last;
 
 	if (!xfer->done) { /* retry */
+		ctx->completed_since_decrease++;
+		decrease_concurrency(ctx);
 		res = TRUE;
 		goto out;
 	}
 
-	code = curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &response_code);
-	if (code != CURLE_OK)
-		g_error("unexpected error from curl_easy_getinfo in %s", G_STRFUNC);
-	if (response_code != 206)
-		g_error("unexpected HTTP response code %ld from curl_easy_getinfo in %s", response_code, G_STRFUNC);
+	ctx->active_fetches--;
+	update_concurrency(ctx, xfer);
 
-	if (!r_write_exact(ctx->sock, (guint8*)&xfer->reply, sizeof(xfer->reply), NULL))
-		g_error("failed to send nbd read reply header");
 	if (xfer->reply.error == 0) {
-		if (xfer->buffer_size != xfer->buffer_pos)
-			g_error("incomplete data received from server");
+		code = curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &response_code);
+		if (code != CURLE_OK)
+			g_error("unexpected error from curl_easy_getinfo in %s", G_STRFUNC);
+		if (response_code != 206 || !xfer->range_valid) {
+			g_message("unexpected HTTP response code %ld for range request", response_code);
+			xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
+		} else if (xfer->buffer_size != xfer->buffer_pos) {
+			g_message("incomplete data received from server");
+			xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
+		}
+	}
+
+	first = xfer->request.from / RAUC_NBD_BLOCK_SIZE;
+	last = (xfer->request.from + xfer->request.len - 1) / RAUC_NBD_BLOCK_SIZE;
+	for (guint64 index = first; index <= last; index++) {
+		g_hash_table_remove(ctx->inflight, &index);
+		if (xfer->reply.error == 0) {
+			guint64 offset = index * RAUC_NBD_BLOCK_SIZE - xfer->request.from;
+			gsize len = MIN(RAUC_NBD_BLOCK_SIZE, xfer->request.len - offset);
 
-		if (!r_write_exact(ctx->sock, xfer->buffer, xfer->buffer_size, NULL))
-			g_error("failed to send nbd read reply body");
+			cache_insert(ctx, index, xfer->buffer + offset, len);
+			disk_cache_store(ctx, index, xfer->buffer + offset, len);
+		}
 	}
 
+	for (guint i = 0; i < xfer->reads->len; i++) {
+		struct RaucNBDRead *client_read = g_ptr_array_index(xfer->reads, i);
+
+		if (xfer->reply.error)
+			client_read->reply.error = xfer->reply.error;
+		else if (!client_read->streaming)
+			copy_to_read(client_read, xfer->request.from, xfer->buffer, xfer->request.len);
+
+		client_read->pending -= overlapping_blocks(client_read, xfer->request.from, xfer->request.len);
+		if (!client_read->pending)
+			finish_client_read(ctx, client_read);
+	}
+
+	xfer->stream_read = NULL;
+
+	cache_evict(ctx);
+
 	collect_curl_stats(ctx, xfer);
 
 	res = TRUE;
 out:
-	g_clear_pointer(&xfer->buffer, g_free);
+	buffer_put(ctx, xfer->buffer, xfer->request.len);
+	xfer->buffer = NULL;
 
 	return res;
 }
 
+static void release_handle(struct RaucNBDContext *ctx, CURL *easy)
+{
+	if (g_queue_get_length(&ctx->idle_handles) < RAUC_NBD_MAX_IDLE_HANDLES)
+		g_queue_push_head(&ctx->idle_handles, easy);
+	else
+		curl_easy_cleanup(easy);
+}
+
+/* Returns the URL of the bundle on the LAN cache, which is the cache prefix
+ * followed by the path of the bundle URL. */
+static gchar *get_lan_cache_url(const gchar *prefix, const gchar *url)
+{
+	const gchar *path = strstr(url, "://");
+
+	path = path ? strchr(path + 3, '/') : NULL;
+	if (!path)
+		return NULL;
+
+	if (g_str_has_suffix(prefix, "/"))
+		path++;
+
+	return g_strconcat(prefix, path, NULL);
+}
+
+/* Starts checking that an additional source serves the same file as the
+ * bundle URL by requesting the same range as the configure request. All
+ * sources are probed in parallel on the multi handle, while range requests
+ * already use the bundle URL. */
+static void start_probe(struct RaucNBDContext *ctx, const gchar *url, gboolean lan)
+{
+	struct RaucNBDTransfer *xfer = g_malloc0(sizeof(struct RaucNBDTransfer));
+	struct RaucNBDSource *source = g_new0(struct RaucNBDSource, 1);
+	CURLcode code = 0;
+	CURLMcode mcode = 0;
+
+	source->url = g_strdup(url);
+	source->lan = lan;
+
+	xfer->ctx = ctx;
+	xfer->request.type = RAUC_NBD_CMD_PROBE;
+	xfer->source = source;
+
+	prepare_curl(xfer);
+	prepare_tail_request(xfer);
+	/* do not delay the installation if a source is not reachable */
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_TIMEOUT, (long)RAUC_NBD_PROBE_TIMEOUT);
+	if (lan)
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_CONNECTTIMEOUT, (long)RAUC_NBD_LAN_CONNECT_TIMEOUT);
+	if (code)
+		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
+
+	mcode = curl_multi_add_handle(ctx->multi, xfer->easy);
+	if (mcode != CURLM_OK)
+		g_error("unexpected error from curl_multi_add_handle in %s", G_STRFUNC);
+}
+
+/* Adds a probed source if it served the same tail as the bundle URL. Sources
+ * which fail or differ in size, modification time or content are ignored. */
+static gboolean finish_probe(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	struct RaucNBDSource *source = g_steal_pointer(&xfer->source);
+	CURLcode code;
+	long response_code = 0;
+	double starttransfer = 0;
+	guint64 tail_len = ctx->data_size - ctx->tail_from;
+
+	if (xfer->reply.error) {
+		g_message("ignoring source %s: %s", source->url, xfer->errbuf);
+		goto out;
+	}
+
+	code = curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &response_code);
+	if (code != CURLE_OK || response_code != 206) {
+		g_message("ignoring source %s: range requests not supported", source->url);
+		goto out;
+	}
+
+	/* the tail contains the signature, so this also compares the content */
+	if (!ctx->tail || (guint64)xfer->buffer_pos != tail_len ||
+	    xfer->range_from != ctx->tail_from ||
+	    memcmp(xfer->buffer, ctx->tail, tail_len) != 0 ||
+	    xfer->content_size != ctx->data_size ||
+	    xfer->modified_time != ctx->modified_time) {
+		g_message("ignoring source %s: bundle size, date or content differs", source->url);
+		goto out;
+	}
+
+	if (curl_easy_getinfo(xfer->easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer) == CURLE_OK)
+		source->latency = starttransfer;
+
+	g_ptr_array_add(ctx->sources, g_steal_pointer(&source));
+	g_message("using %u sources for range requests", ctx->sources->len);
+
+out:
+	g_clear_pointer(&source, free_source);
+	g_clear_pointer(&xfer->buffer, g_free);
+	g_clear_pointer(&xfer->etag, g_free);
+
+	return TRUE;
+}
+
+/* Sets up the list of sources for range requests from the bundle URL and
+ * starts probing the LAN cache and the mirrors. */
+static void add_sources(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer, const gchar *lan_url)
+{
+	struct RaucNBDSource *source = g_new0(struct RaucNBDSource, 1);
+	double starttransfer = 0;
+
+	source->url = g_strdup(ctx->url);
+	if (curl_easy_getinfo(xfer->easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer) == CURLE_OK)
+		source->latency = starttransfer;
+	g_ptr_array_add(ctx->sources, source);
+
+	if (lan_url)
+		start_probe(ctx, lan_url, TRUE);
+
+	for (GStrv mirror = ctx->mirrors; mirror && *mirror; mirror++)
+		start_probe(ctx, *mirror, FALSE);
+}
+
 static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
 	gboolean res = FALSE;
 	CURLcode code;
 	long response_code = 0;
 	const char *effective_url = NULL;
+	g_autofree gchar *lan_url = NULL;
+	const guint64 superblock = 0;
+	gboolean not_modified = FALSE;
 	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
 	g_autoptr(GVariant) v = NULL;
 	guint32 reply_size;
@@ -705,7 +2171,11 @@ static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTrans
 	if (code != CURLE_OK)
 		g_error("unexpected error from curl_easy_getinfo in %s", G_STRFUNC);
 
-	if (response_code != 206) {
+	if (response_code == 304 && ctx->cached_size) {
+		/* the client has checked this bundle before and knows its size */
+		not_modified = TRUE;
+		xfer->content_size = ctx->cached_size;
+	} else if (response_code != 206) {
 		g_autofree gchar *error = NULL;
 		switch (response_code) {
 			case 0:
@@ -723,7 +2193,7 @@ static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTrans
 		goto reply;
 	}
 
-	if (xfer->buffer_size != xfer->buffer_pos) {
+	if (!not_modified && xfer->buffer_size != xfer->buffer_pos) {
 		g_variant_dict_insert(&dict, "error", "s", "incomplete HTTP response");
 		res = FALSE;
 		goto reply;
@@ -736,6 +2206,16 @@ static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTrans
 		goto reply;
 	}
 
+	ctx->data_size = xfer->content_size;
+
+	/* additional sources are validated against the tail, which a 304
+	 * response does not contain */
+	if (not_modified)
+		g_clear_pointer(&ctx->mirrors, g_strfreev);
+	/* the LAN cache mirrors the original location, not redirect targets */
+	else if (ctx->lan_cache)
+		lan_url = get_lan_cache_url(ctx->lan_cache, ctx->url);
+
 	code = curl_easy_getinfo(xfer->easy, CURLINFO_EFFECTIVE_URL, &effective_url);
 	if (code == CURLE_OK) {
 		if (!g_str_equal(ctx->url, effective_url))
@@ -744,6 +2224,31 @@ static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTrans
 		ctx->url = g_strdup(effective_url);
 	}
 
+	if (ctx->disk_cache_dir)
+		disk_cache_open(ctx, xfer);
+
+	/* keep the tail to serve the signature reads without further requests */
+	if (!not_modified) {
+		ctx->tail_from = xfer->range_from;
+		ctx->tail = g_steal_pointer(&xfer->buffer);
+		for (guint64 index = (ctx->tail_from + RAUC_NBD_BLOCK_SIZE - 1) / RAUC_NBD_BLOCK_SIZE;
+		     index * RAUC_NBD_BLOCK_SIZE < ctx->data_size; index++)
+			cache_insert(ctx, index, ctx->tail + (index * RAUC_NBD_BLOCK_SIZE - ctx->tail_from),
+					block_len(ctx, index));
+	}
+
+	ctx->modified_time = xfer->modified_time;
+	add_sources(ctx, xfer, lan_url);
+
+	/* Mounting the payload starts with the superblock at the beginning,
+	 * so fetch it while the client checks the signature. A client
+	 * revalidating its metadata usually needs nothing else. */
+	if (!not_modified && !g_hash_table_contains(ctx->cache, &superblock) &&
+	    !g_hash_table_contains(ctx->disk_blocks, &superblock)) {
+		plan_block(ctx, 0, NULL);
+		start_planned_reads(ctx);
+	}
+
 	collect_curl_stats(ctx, xfer);
 
 	res = TRUE;
@@ -761,6 +2266,10 @@ reply:
 		g_variant_dict_insert(&dict, "current-time", "t", xfer->current_time);
 	if (xfer->modified_time)
 		g_variant_dict_insert(&dict, "modified-time", "t", xfer->modified_time);
+	if (xfer->etag)
+		g_variant_dict_insert(&dict, "etag", "s", xfer->etag);
+	if (not_modified)
+		g_variant_dict_insert(&dict, "not-modified", "b", TRUE);
 
 	v = g_variant_dict_end(&dict);
 	reply_size = g_variant_get_size(v);
@@ -772,6 +2281,7 @@ reply:
 
 out:
 	g_clear_pointer(&xfer->buffer, g_free);
+	g_clear_pointer(&xfer->etag, g_free);
 
 	return res;
 }
@@ -789,27 +2299,169 @@ static gboolean finish_request(struct RaucNBDContext *ctx, struct RaucNBDTransfe
 			res = finish_configure(ctx, xfer);
 			break;
 		}
+		case RAUC_NBD_CMD_PROBE: {
+			res = finish_probe(ctx, xfer);
+			break;
+		}
 		default: {
 			g_message("bad request type");
 			break;
 		}
 	}
 
+	/* a paused transfer can still fail, for example by a timeout */
+	if (xfer->throttled) {
+		g_queue_remove(&ctx->throttled, xfer);
+		xfer->throttled = FALSE;
+	}
+
 	if (xfer->easy) {
 		curl_multi_remove_handle(ctx->multi, xfer->easy);
-		curl_easy_cleanup(xfer->easy);
+		release_handle(ctx, xfer->easy);
 		xfer->easy = NULL;
 	}
 
 	return res;
 }
 
+static gint compare_retry_at(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const struct RaucNBDTransfer *xa = a;
+	const struct RaucNBDTransfer *xb = b;
+
+	if (xa->retry_at < xb->retry_at)
+		return -1;
+	return xa->retry_at > xb->retry_at;
+}
+
+/* Queues a failed transfer for another attempt. The delay grows
+ * exponentially with the number of errors and is randomized, so that
+ * transfers which failed together do not retry in lockstep. */
+static void schedule_retry(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	gint64 delay = (gint64)RAUC_NBD_RETRY_DELAY_MIN << MIN(xfer->errors - 1, 10);
+
+	/* fail over to another source without delay */
+	if (xfer->source && source_available(ctx)) {
+		xfer->retry_at = g_get_monotonic_time();
+		g_queue_insert_sorted(&ctx->retry_queue, xfer, compare_retry_at, NULL);
+		return;
+	}
+
+	delay = MIN(delay, RAUC_NBD_RETRY_DELAY_MAX);
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	xfer->retry_at = g_get_monotonic_time() + delay;
+
+	g_queue_insert_sorted(&ctx->retry_queue, xfer, compare_retry_at, NULL);
+}
+
+static void start_due_retries(struct RaucNBDContext *ctx)
+{
+	gint64 now = g_get_monotonic_time();
+
+	while (!g_queue_is_empty(&ctx->retry_queue)) {
+		struct RaucNBDTransfer *xfer = g_queue_peek_head(&ctx->retry_queue);
+
+		if (xfer->retry_at > now)
+			break;
+
+		g_queue_pop_head(&ctx->retry_queue);
+		start_request(ctx, xfer);
+	}
+}
+
+/* Returns the time to wait for events in ms, limited by the next retry and
+ * by the time until throttled transfers can continue. */
+static int get_wait_timeout(struct RaucNBDContext *ctx)
+{
+	struct RaucNBDTransfer *xfer = g_queue_peek_head(&ctx->retry_queue);
+	gint64 remaining = 1000 * 1000;
+
+	if (xfer)
+		remaining = MIN(remaining, xfer->retry_at - g_get_monotonic_time());
+
+	if (!g_queue_is_empty(&ctx->throttled)) {
+		refill_bandwidth(ctx);
+		if (ctx->bandwidth_tokens < 0)
+			remaining = MIN(remaining, (gint64)(-ctx->bandwidth_tokens * G_USEC_PER_SEC / ctx->bandwidth_limit));
+		else
+			remaining = 0;
+	}
+
+	return CLAMP((remaining + 999) / 1000, 0, 1000);
+}
+
+static gboolean client_has_request(gint sock)
+{
+	struct pollfd pfd = {
+		.fd = sock,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+static gboolean handle_client_request(struct RaucNBDContext *ctx, struct RaucNBDConnection *conn, GError **error)
+{
+	GError *ierror = NULL;
+	struct nbd_request request;
+	struct nbd_reply reply = {0};
+
+	if (!r_read_exact(conn->sock, (guint8*)&request, sizeof(request), &ierror)) {
+		if (ierror)
+			g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	g_assert(request.magic == GUINT32_TO_BE(NBD_REQUEST_MAGIC));
+	request.type = GUINT32_FROM_BE(request.type);
+	request.from = GUINT64_FROM_BE(request.from);
+	request.len = GUINT32_FROM_BE(request.len);
+	//g_message("type 0x%x: from 0x%llx+0x%x", request.type, request.from, request.len);
+
+	reply.magic = GUINT32_TO_BE(NBD_REPLY_MAGIC);
+	memcpy(reply.handle, request.handle, sizeof(reply.handle));
+
+	switch (request.type) {
+		case NBD_CMD_READ: {
+			struct RaucNBDRead *client_read = g_new0(struct RaucNBDRead, 1);
+			client_read->conn = conn;
+			client_read->request = request;
+			client_read->reply = reply;
+			handle_read(ctx, client_read);
+			break;
+		}
+		case NBD_CMD_DISC: {
+			g_message("disconnect");
+			ctx->done = TRUE;
+			break;
+		}
+		case RAUC_NBD_CMD_CONFIGURE: {
+			struct RaucNBDTransfer *xfer = NULL;
+			g_assert(conn->sock == ctx->sock);
+			xfer = g_malloc0(sizeof(struct RaucNBDTransfer));
+			xfer->ctx = ctx;
+			xfer->request = request;
+			xfer->reply = reply;
+			start_request(ctx, xfer);
+			break;
+		}
+		default: {
+			g_error("bad request type");
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
 gboolean r_nbd_run_server(gint sock, GError **error)
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 	struct RaucNBDContext ctx = {0};
-	struct curl_waitfd waitfd = {0};
+	g_autofree struct curl_waitfd *waitfds = NULL;
+	g_autofree struct RaucNBDConnection **waitconns = NULL;
 
 	g_return_val_if_fail(sock >= 0, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
@@ -833,47 +2485,101 @@ gboolean r_nbd_run_server(gint sock, GError **error)
 
 	ctx.sock = sock;
 	ctx.multi = curl_multi_init();
-
-	waitfd.fd = sock;
-	waitfd.events = CURL_WAIT_POLLIN;
+#if LIBCURL_VERSION_NUM >= 0x072b00 /* 7.43.0 */
+	if (curl_multi_setopt(ctx.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX) != CURLM_OK)
+		g_error("unexpected error from curl_multi_setopt in %s", G_STRFUNC);
+#endif
+
+	/* all transfers run in this thread, so no lock functions are needed */
+	ctx.share = curl_share_init();
+	if (!ctx.share)
+		g_error("unexpected error from curl_share_init in %s", G_STRFUNC);
+	if (curl_share_setopt(ctx.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+	    curl_share_setopt(ctx.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK)
+		g_error("unexpected error from curl_share_setopt in %s", G_STRFUNC);
+	g_queue_init(&ctx.idle_handles);
+	g_queue_init(&ctx.retry_queue);
+	for (guint i = 0; i < RAUC_NBD_POOL_CLASSES; i++)
+		ctx.buffer_pool[i] = g_ptr_array_new_with_free_func(g_free);
+	ctx.max_retries = DEFAULT_STREAMING_MAX_RETRIES;
+	ctx.connect_timeout = DEFAULT_STREAMING_CONNECT_TIMEOUT;
+	ctx.max_concurrency = DEFAULT_STREAMING_MAX_CONCURRENCY;
+	ctx.concurrency = RAUC_NBD_INITIAL_CONCURRENCY;
+	g_queue_init(&ctx.waiting_fetches);
+	g_queue_init(&ctx.throttled);
+
+	ctx.cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free_block);
+	g_queue_init(&ctx.cache_lru);
+	ctx.inflight = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	ctx.planned = g_array_new(FALSE, FALSE, sizeof(struct RaucNBDPlanned));
+
+	ctx.conns = g_ptr_array_new_with_free_func(free_connection);
+	g_ptr_array_add(ctx.conns, new_connection(sock));
+	ctx.sources = g_ptr_array_new_with_free_func(free_source);
+	ctx.disk_blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+	g_queue_init(&ctx.disk_lru);
 
 	while (!ctx.done) {
 		int numfds = 0;
+		guint nsocks = 0;
 		int still_running = 0;
-		CURLMcode mcode = curl_multi_wait(ctx.multi, &waitfd, 1, 1000, &numfds);
+		gboolean client_event = FALSE;
+		CURLMcode mcode;
+
+		/* connections are added by the configure request and removed when
+		 * a reply cannot be completed */
+		waitfds = g_renew(struct curl_waitfd, waitfds, ctx.conns->len);
+		waitconns = g_renew(struct RaucNBDConnection *, waitconns, ctx.conns->len);
+		for (guint i = 0; i < ctx.conns->len; i++) {
+			struct RaucNBDConnection *conn = g_ptr_array_index(ctx.conns, i);
+
+			if (!conn->connected)
+				continue;
+			waitfds[nsocks].fd = conn->sock;
+			waitfds[nsocks].events = CURL_WAIT_POLLIN;
+			waitfds[nsocks].revents = 0;
+			waitconns[nsocks] = conn;
+			nsocks++;
+		}
+
+		mcode = curl_multi_wait(ctx.multi, waitfds, nsocks, get_wait_timeout(&ctx), &numfds);
 		if (mcode != CURLM_OK)
 			g_error("unexpected error from curl_multi_wait in %s", G_STRFUNC);
 
-		if ((numfds > 0) && (waitfd.revents & CURL_WAIT_POLLIN)) { /* new event from the client */
-			struct RaucNBDTransfer *xfer = g_malloc0(sizeof(struct RaucNBDTransfer));
-			xfer->ctx = &ctx;
+		for (guint i = 0; numfds > 0 && i < nsocks && !ctx.done; i++) {
+			if (!(waitfds[i].revents & CURL_WAIT_POLLIN) || !waitconns[i]->connected)
+				continue;
 
-			res = r_read_exact(sock, (guint8*)&xfer->request, sizeof(xfer->request), &ierror);
-			if (!res) {
-				if (!ierror) { /* disconnected */
-					ctx.done = TRUE;
-					break;
-				} else {
-					g_propagate_prefixed_error(
-							error,
-							ierror,
-							"failed to read request from client: ");
-					res = FALSE;
-					goto out;
+			/* new event from the client, collect all queued requests
+			 * to coalesce their range requests */
+			client_event = TRUE;
+			do {
+				res = handle_client_request(&ctx, waitconns[i], &ierror);
+				if (!res) {
+					if (!ierror) { /* disconnected */
+						ctx.done = TRUE;
+						break;
+					} else {
+						g_propagate_prefixed_error(
+								error,
+								ierror,
+								"failed to read request from client: ");
+						res = FALSE;
+						goto out;
+					}
 				}
-			}
+			} while (!ctx.done && waitconns[i]->connected && client_has_request(waitfds[i].fd));
+		}
 
-			g_assert(xfer->request.magic == GUINT32_TO_BE(NBD_REQUEST_MAGIC));
-			xfer->request.type = GUINT32_FROM_BE(xfer->request.type);
-			xfer->request.from = GUINT64_FROM_BE(xfer->request.from);
-			xfer->request.len = GUINT32_FROM_BE(xfer->request.len);
-			//g_message("type 0x%x: from 0x%llx+0x%x", xfer->request.type, xfer->request.from, xfer->request.len);
+		if (ctx.done)
+			break;
 
-			xfer->reply.magic = GUINT32_TO_BE(NBD_REPLY_MAGIC);
-			memcpy(xfer->reply.handle, xfer->request.handle, sizeof(xfer->reply.handle));
+		if (client_event)
+			start_planned_reads(&ctx);
 
-			start_request(&ctx, xfer);
-		}
+		start_due_retries(&ctx);
+		start_waiting_fetches(&ctx);
+		resume_throttled(&ctx);
 
 		mcode = curl_multi_perform(ctx.multi, &still_running);
 		g_assert(mcode == CURLM_OK);
@@ -899,21 +2605,29 @@ gboolean r_nbd_run_server(gint sock, GError **error)
 			if (code != CURLE_OK)
 				g_error("unexpected error from curl_easy_getinfo in %s", G_STRFUNC);
 
+			if (xfer->request.type != RAUC_NBD_CMD_PROBE)
+				update_source(xfer, msg->data.result == CURLE_OK);
+
 			if (msg->data.result == CURLE_OK) {
 				g_debug("request done");
 				xfer->reply.error = 0;
 				xfer->done = TRUE;
-			} else if (response_code == 404) {
+			} else if (xfer->request.type == RAUC_NBD_CMD_PROBE) {
+				/* an unavailable source is not retried */
+				xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
+				xfer->done = TRUE;
+			} else if (response_code == 404 && !source_available(&ctx)) {
 				g_message("request failed (not found)");
 				xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
 				xfer->done = TRUE;
-			} else if (xfer->errors >= 5) {
+			} else if (xfer->errors >= ctx.max_retries) {
 				g_message("request failed (no more retries)");
 				xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
 				xfer->done = TRUE;
 			} else {
-				g_message("request failed: %s (retrying)", curl_easy_strerror(msg->data.result));
 				xfer->errors++;
+				g_message("request failed: %s (retry %u of %u)", curl_easy_strerror(msg->data.result),
+						xfer->errors, ctx.max_retries);
 			}
 
 			res = finish_request(&ctx, xfer);
@@ -926,11 +2640,10 @@ gboolean r_nbd_run_server(gint sock, GError **error)
 			}
 
 			if (xfer->done) {
+				g_clear_pointer(&xfer->reads, g_ptr_array_unref);
 				g_free(xfer);
 			} else {
-				/* retry */
-				sleep(1);
-				start_request(&ctx, xfer);
+				schedule_retry(&ctx, xfer);
 			}
 		}
 	}
@@ -941,6 +2654,9 @@ gboolean r_nbd_run_server(gint sock, GError **error)
 	r_stats_show(ctx.connect, NULL);
 	r_stats_show(ctx.starttransfer, NULL);
 	r_stats_show(ctx.total, NULL);
+	g_message("nbd cache: %"G_GUINT64_FORMAT " block hits, %"G_GUINT64_FORMAT " block misses, %"G_GUINT64_FORMAT " persistent hits",
+			ctx.cache_hits, ctx.cache_misses, ctx.disk_hits);
+	g_message("nbd concurrency: %.1f parallel requests", ctx.concurrency);
 
 	res = TRUE;
 out:
@@ -950,9 +2666,30 @@ out:
 	g_clear_pointer(&ctx.connect, r_stats_free);
 	g_clear_pointer(&ctx.starttransfer, r_stats_free);
 	g_clear_pointer(&ctx.total, r_stats_free);
+	while (!g_queue_is_empty(&ctx.idle_handles))
+		curl_easy_cleanup(g_queue_pop_head(&ctx.idle_handles));
 	curl_multi_cleanup(ctx.multi);
+	curl_share_cleanup(ctx.share);
+	g_queue_clear(&ctx.retry_queue);
+	g_queue_clear(&ctx.waiting_fetches);
+	g_queue_clear(&ctx.throttled);
+	g_clear_pointer(&ctx.conns, g_ptr_array_unref);
+	g_clear_pointer(&ctx.sources, g_ptr_array_unref);
+	/* finish all queued updates of the persistent cache */
+	if (ctx.disk_pool)
+		g_thread_pool_free(ctx.disk_pool, FALSE, TRUE);
+	while (!g_queue_is_empty(&ctx.disk_lru))
+		free_disk_entry(g_queue_pop_head_link(&ctx.disk_lru)->data);
+	g_clear_pointer(&ctx.disk_blocks, g_hash_table_destroy);
+	g_clear_pointer(&ctx.disk_cache_path, g_free);
+	g_clear_pointer(&ctx.tail, g_free);
+	for (guint i = 0; i < RAUC_NBD_POOL_CLASSES; i++)
+		g_clear_pointer(&ctx.buffer_pool[i], g_ptr_array_unref);
 	g_clear_pointer(&ctx.headers_slist, curl_slist_free_all);
 	g_clear_pointer(&ctx.initial_headers_slist, curl_slist_free_all);
+	g_clear_pointer(&ctx.cache, g_hash_table_destroy);
+	g_clear_pointer(&ctx.inflight, g_hash_table_destroy);
+	g_clear_pointer(&ctx.planned, g_array_unref);
 	g_message("exiting nbd server");
 	return res;
 }
@@ -994,6 +2731,37 @@ static gboolean nbd_configure(RaucNBDServer *nbd_srv, GError **error)
 		g_variant_dict_insert(&dict, "headers", "^as", nbd_srv->headers);
 	if (nbd_srv->info_headers)
 		g_variant_dict_insert(&dict, "info-headers", "^as", nbd_srv->info_headers);
+	if (nbd_srv->cache_size)
+		g_variant_dict_insert(&dict, "cache-size", "t", nbd_srv->cache_size);
+	if (nbd_srv->read_ahead)
+		g_variant_dict_insert(&dict, "read-ahead", "t", nbd_srv->read_ahead);
+	if (nbd_srv->max_streams)
+		g_variant_dict_insert(&dict, "max-streams", "u", nbd_srv->max_streams);
+	g_variant_dict_insert(&dict, "max-retries", "u", nbd_srv->max_retries);
+	if (nbd_srv->connect_timeout)
+		g_variant_dict_insert(&dict, "connect-timeout", "u", nbd_srv->connect_timeout);
+	if (nbd_srv->request_timeout)
+		g_variant_dict_insert(&dict, "request-timeout", "u", nbd_srv->request_timeout);
+	if (nbd_srv->extra_socks->len)
+		g_variant_dict_insert(&dict, "connections", "u", nbd_srv->extra_socks->len + 1);
+	g_variant_dict_insert(&dict, "max-concurrency", "u", nbd_srv->max_concurrency);
+	if (nbd_srv->bandwidth_limit)
+		g_variant_dict_insert(&dict, "bandwidth-limit", "t", nbd_srv->bandwidth_limit);
+	if (nbd_srv->mirrors)
+		g_variant_dict_insert(&dict, "mirrors", "^as", nbd_srv->mirrors);
+	if (nbd_srv->lan_cache)
+		g_variant_dict_insert(&dict, "lan-cache", "s", nbd_srv->lan_cache);
+	if (nbd_srv->disk_cache_dir) {
+		g_variant_dict_insert(&dict, "disk-cache-directory", "s", nbd_srv->disk_cache_dir);
+		g_variant_dict_insert(&dict, "disk-cache-size", "t", nbd_srv->disk_cache_size);
+	}
+	if (nbd_srv->cached_size && (nbd_srv->if_none_match || nbd_srv->if_modified_since)) {
+		if (nbd_srv->if_none_match)
+			g_variant_dict_insert(&dict, "if-none-match", "s", nbd_srv->if_none_match);
+		if (nbd_srv->if_modified_since)
+			g_variant_dict_insert(&dict, "if-modified-since", "t", nbd_srv->if_modified_since);
+		g_variant_dict_insert(&dict, "cached-size", "t", nbd_srv->cached_size);
+	}
 	v = g_variant_dict_end(&dict);
 	{
 		g_autofree gchar *tmp = g_variant_print(v, TRUE);
@@ -1067,6 +2835,10 @@ static gboolean nbd_configure(RaucNBDServer *nbd_srv, GError **error)
 	g_message("received current time %"G_GUINT64_FORMAT, nbd_srv->current_time);
 	g_variant_dict_lookup(&dict, "modified-time", "t", &nbd_srv->modified_time);
 	g_message("received modified time %"G_GUINT64_FORMAT, nbd_srv->modified_time);
+	g_variant_dict_lookup(&dict, "etag", "s", &nbd_srv->etag);
+	g_variant_dict_lookup(&dict, "not-modified", "b", &nbd_srv->not_modified);
+	if (nbd_srv->not_modified)
+		g_message("bundle not modified since the previous check");
 
 	return TRUE;
 }
@@ -1151,8 +2923,10 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 	gint sockets[2] = {-1, -1};
+	g_autoptr(GArray) server_socks = NULL;
 
 	g_return_val_if_fail(nbd_srv != NULL, FALSE);
+	g_return_val_if_fail(nbd_srv->connections >= 1, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
@@ -1165,6 +2939,24 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 		goto out;
 	}
 
+	/* server sides of the additional connections */
+	server_socks = new_sock_array();
+	for (guint32 i = 1; i < nbd_srv->connections; i++) {
+		gint extra[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, extra) < 0) {
+			g_set_error(
+					error,
+					G_IO_ERROR, g_io_error_from_errno(errno),
+					"failed to create unix socket pair: %s",
+					g_strerror(errno));
+			res = FALSE;
+			goto out;
+		}
+		g_array_append_val(server_socks, extra[0]);
+		g_array_append_val(nbd_srv->extra_socks, extra[1]);
+	}
+
 	if (1) { /* subprocess */
 		struct child_setup_args child_args = {0};
 		g_autofree gchar *executable = NULL;
@@ -1191,6 +2983,10 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 		g_subprocess_launcher_set_child_setup(launcher, nbd_server_child_setup, &child_args, NULL);
 		g_subprocess_launcher_setenv(launcher, "RAUC_NBD_SERVER", "", TRUE);
 		g_subprocess_launcher_take_fd(launcher, sockets[0], RAUC_SOCKET_FD);
+		for (guint i = 0; i < server_socks->len; i++) {
+			g_subprocess_launcher_take_fd(launcher, g_array_index(server_socks, gint, i), RAUC_SOCKET_FD + 1 + i);
+			g_array_index(server_socks, gint, i) = -1; /* GSubprocessLauncher takes ownership */
+		}
 
 		nbd_srv->sproc = r_subprocess_launcher_spawnv(launcher, args, &ierror);
 		if (nbd_srv->sproc == NULL) {
@@ -1203,6 +2999,7 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 		}
 	} else { /* thread for testing */
 		gint *sockp = g_malloc(sizeof(gint));
+		g_assert(nbd_srv->connections == 1);
 		*sockp = sockets[0];
 		g_thread_new("nbd", nbd_server_thread, sockp);
 	}
@@ -1227,6 +3024,8 @@ out:
 		g_close(sockets[0], NULL);
 	if (sockets[1] >= 0)
 		g_close(sockets[1], NULL);
+	if (!res)
+		g_array_set_size(nbd_srv->extra_socks, 0);
 	return res;
 }
 
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <glib.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "resources.h"
+
+G_DEFINE_QUARK(r-resources-error-quark, r_resources_error)
+
+/* see linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_BE_DEFAULT 4
+
+/* the token bucket may accumulate at most 100ms worth of writes */
+#define THROTTLE_BURST_US (100 * 1000)
+
+static GMutex throttle_mutex;
+static guint64 throttle_rate = 0;
+static gdouble throttle_tokens = 0.0;
+static gint64 throttle_last = 0;
+
+void r_resources_init(RaucResourceLimits *limits)
+{
+	g_return_if_fail(limits);
+
+	limits->io_class = R_IO_CLASS_NONE;
+	limits->io_priority = -1;
+	limits->write_bandwidth = 0;
+	limits->nice_set = FALSE;
+	limits->nice = 0;
+	limits->cpu_affinity = NULL;
+	limits->cpu_affinity_len = 0;
+}
+
+void r_resources_clear(RaucResourceLimits *limits)
+{
+	g_return_if_fail(limits);
+
+	g_free(limits->cpu_affinity);
+	r_resources_init(limits);
+}
+
+void r_resources_merge(RaucResourceLimits *dest, const RaucResourceLimits *src)
+{
+	g_return_if_fail(dest);
+	g_return_if_fail(src);
+
+	if (src->io_class != R_IO_CLASS_NONE)
+		dest->io_class = src->io_class;
+	if (src->io_priority >= 0)
+		dest->io_priority = src->io_priority;
+	if (src->write_bandwidth)
+		dest->write_bandwidth = src->write_bandwidth;
+	if (src->nice_set) {
+		dest->nice_set = TRUE;
+		dest->nice = src->nice;
+	}
+	if (src->cpu_affinity) {
+		g_free(dest->cpu_affinity);
+		dest->cpu_affinity = g_new(gint, src->cpu_affinity_len);
+		memcpy(dest->cpu_affinity, src->cpu_affinity, src->cpu_affinity_len * sizeof(gint));
+		dest->cpu_affinity_len = src->cpu_affinity_len;
+	}
+}
+
+gboolean r_resources_parse_io_class(const gchar *name, RIOClass *io_class, GError **error)
+{
+	g_return_val_if_fail(name, FALSE);
+	g_return_val_if_fail(io_class, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (g_strcmp0(name, "none") == 0) {
+		*io_class = R_IO_CLASS_NONE;
+	} else if (g_strcmp0(name, "realtime") == 0) {
+		*io_class = R_IO_CLASS_REALTIME;
+	} else if (g_strcmp0(name, "best-effort") == 0) {
+		*io_class = R_IO_CLASS_BEST_EFFORT;
+	} else if (g_strcmp0(name, "idle") == 0) {
+		*io_class = R_IO_CLASS_IDLE;
+	} else {
+		g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID,
+				"Unsupported I/O class '%s'", name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_resources_check(const RaucResourceLimits *limits, GError **error)
+{
+	g_return_val_if_fail(limits, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (limits->io_priority < -1 || limits->io_priority > 7) {
+		g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID,
+				"Invalid I/O priority %d (must be 0-7)", limits->io_priority);
+		return FALSE;
+	}
+
+	if (limits->nice_set && (limits->nice < -20 || limits->nice > 19)) {
+		g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID,
+				"Invalid nice value %d (must be -20-19)", limits->nice);
+		return FALSE;
+	}
+
+	for (gsize i = 0; i < limits->cpu_affinity_len; i++) {
+		if (limits->cpu_affinity[i] < 0 || limits->cpu_affinity[i] >= CPU_SETSIZE) {
+			g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID,
+					"Invalid CPU number %d in affinity list", limits->cpu_affinity[i]);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean r_resources_apply(const RaucResourceLimits *limits, GError **error)
+{
+	GError *ierror = NULL;
+	pid_t tid = syscall(SYS_gettid);
+
+	g_return_val_if_fail(limits, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_resources_check(limits, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (limits->io_class != R_IO_CLASS_NONE) {
+		gint prio = limits->io_priority;
+
+		if (limits->io_class == R_IO_CLASS_IDLE)
+			prio = 0;
+		else if (prio < 0)
+			prio = IOPRIO_BE_DEFAULT;
+
+		/* ioprio_set() with 'who' 0 refers to the calling thread */
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		            IOPRIO_PRIO_VALUE(limits->io_class, prio)) == -1) {
+			int err = errno;
+			g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_IOPRIO,
+					"Failed to set I/O priority: %s", g_strerror(err));
+			return FALSE;
+		}
+		g_debug("Set I/O class %d with priority %d", limits->io_class, prio);
+	}
+
+	if (limits->nice_set) {
+		/* the nice value is a per-thread attribute on Linux */
+		if (setpriority(PRIO_PROCESS, tid, limits->nice) == -1) {
+			int err = errno;
+			g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_NICE,
+					"Failed to set nice value: %s", g_strerror(err));
+			return FALSE;
+		}
+		g_debug("Set nice value %d", limits->nice);
+	}
+
+	if (limits->cpu_affinity) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		for (gsize i = 0; i < limits->cpu_affinity_len; i++)
+			CPU_SET(limits->cpu_affinity[i], &set);
+
+		if (sched_setaffinity(tid, sizeof(set), &set) == -1) {
+			int err = errno;
+			g_set_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_AFFINITY,
+					"Failed to set CPU affinity: %s", g_strerror(err));
+			return FALSE;
+		}
+		g_debug("Set CPU affinity to %"G_GSIZE_FORMAT " CPUs", limits->cpu_affinity_len);
+	}
+
+	g_mutex_lock(&throttle_mutex);
+	throttle_rate = limits->write_bandwidth;
+	throttle_tokens = 0.0;
+	throttle_last = g_get_monotonic_time();
+	g_mutex_unlock(&throttle_mutex);
+	if (limits->write_bandwidth)
+		g_debug("Limiting write bandwidth to %"G_GUINT64_FORMAT " bytes/s", limits->write_bandwidth);
+
+	return TRUE;
+}
+
+void r_resources_reset(void)
+{
+	g_mutex_lock(&throttle_mutex);
+	throttle_rate = 0;
+	g_mutex_unlock(&throttle_mutex);
+}
+
+void r_resources_throttle_write(gsize size)
+{
+	gint64 now, wait = 0;
+	gdouble burst;
+
+	g_mutex_lock(&throttle_mutex);
+	if (!throttle_rate) {
+		g_mutex_unlock(&throttle_mutex);
+		return;
+	}
+
+	/* refill the bucket for the time elapsed since the last write */
+	now = g_get_monotonic_time();
+	throttle_tokens += (gdouble)(now - throttle_last) * throttle_rate / G_USEC_PER_SEC;
+	throttle_last = now;
+	burst = (gdouble)throttle_rate * THROTTLE_BURST_US / G_USEC_PER_SEC;
+	if (throttle_tokens > burst)
+		throttle_tokens = burst;
+
+	/* writes larger than the available tokens go into debt, which we sleep off */
+	throttle_tokens -= size;
+	if (throttle_tokens < 0)
+		wait = -throttle_tokens * G_USEC_PER_SEC / throttle_rate;
+	g_mutex_unlock(&throttle_mutex);
+
+	if (wait > 0)
+		g_usleep(wait);
+}
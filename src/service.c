@@ -10,6 +10,7 @@
 #include "install.h"
 #include "mark.h"
 #include "rauc-installer-generated.h"
+#include "resources.h"
 #include "service.h"
 #include "status_file.h"
 #include "utils.h"
@@ -72,6 +73,58 @@ static void convert_dict_to_bundle_access_args(
 		g_variant_dict_remove(dict, "tls-no-verify");
 	if (g_variant_dict_lookup(dict, "http-headers", "^as", &access_args->http_headers))
 		g_variant_dict_remove(dict, "http-headers");
+	if (g_variant_dict_lookup(dict, "max-concurrency", "u", &access_args->max_concurrency))
+		g_variant_dict_remove(dict, "max-concurrency");
+	if (g_variant_dict_lookup(dict, "bandwidth-limit", "t", &access_args->bandwidth_limit))
+		g_variant_dict_remove(dict, "bandwidth-limit");
+	if (g_variant_dict_lookup(dict, "mirrors", "^as", &access_args->mirrors))
+		g_variant_dict_remove(dict, "mirrors");
+}
+
+/*
+ * Constructs RaucResourceLimits from a GVariant dictionary.
+ */
+static gboolean convert_dict_to_resource_limits(
+		GVariantDict *dict,
+		RaucResourceLimits *limits,
+		GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *io_class = NULL;
+	g_autoptr(GVariant) cpus = NULL;
+
+	g_return_val_if_fail(dict, FALSE);
+	g_return_val_if_fail(limits, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (g_variant_dict_lookup(dict, "io-class", "s", &io_class)) {
+		g_variant_dict_remove(dict, "io-class");
+		if (!r_resources_parse_io_class(io_class, &limits->io_class, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+	if (g_variant_dict_lookup(dict, "io-priority", "i", &limits->io_priority))
+		g_variant_dict_remove(dict, "io-priority");
+	if (g_variant_dict_lookup(dict, "write-bandwidth", "t", &limits->write_bandwidth))
+		g_variant_dict_remove(dict, "write-bandwidth");
+	if (g_variant_dict_lookup(dict, "nice", "i", &limits->nice)) {
+		g_variant_dict_remove(dict, "nice");
+		limits->nice_set = TRUE;
+	}
+	cpus = g_variant_dict_lookup_value(dict, "cpu-affinity", G_VARIANT_TYPE("ai"));
+	if (cpus) {
+		gsize n_cpus;
+		const gint32 *elements = g_variant_get_fixed_array(cpus, &n_cpus, sizeof(gint32));
+
+		g_variant_dict_remove(dict, "cpu-affinity");
+		limits->cpu_affinity = g_new(gint, n_cpus);
+		limits->cpu_affinity_len = n_cpus;
+		for (gsize i = 0; i < n_cpus; i++)
+			limits->cpu_affinity[i] = elements[i];
+	}
+
+	return r_resources_check(limits, error);
 }
 
 static gboolean r_on_handle_install_bundle(
@@ -80,6 +133,7 @@ static gboolean r_on_handle_install_bundle(
 		const gchar *source,
 		GVariant *arg_args)
 {
+	GError *ierror = NULL;
 	RaucInstallArgs *args = install_args_new();
 	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(arg_args);
 	g_autoptr(GVariant) dict_rest = NULL;
@@ -109,6 +163,14 @@ static gboolean r_on_handle_install_bundle(
 
 	convert_dict_to_bundle_access_args(&dict, &args->access_args);
 
+	if (!convert_dict_to_resource_limits(&dict, &args->resources, &ierror)) {
+		message = g_strdup(ierror->message);
+		g_clear_error(&ierror);
+		res = FALSE;
+		args->status_result = 2;
+		goto out;
+	}
+
 	/* Check for unhandled keys */
 	dict_rest = g_variant_dict_end(&dict);
 	g_variant_iter_init(&iter, dict_rest);
@@ -190,7 +252,9 @@ static gboolean r_on_handle_inspect_bundle(RInstaller *interface,
 		goto out;
 	}
 
-	res = check_bundle(arg_bundle, &bundle, CHECK_BUNDLE_DEFAULT, &access_args, &error);
+	/* repeated inspection of an unchanged remote bundle is answered from
+	 * the previous result */
+	res = check_bundle(arg_bundle, &bundle, CHECK_BUNDLE_USE_CACHE, &access_args, &error);
 	if (!res) {
 		message = g_strdup(error->message);
 		g_clear_error(&error);
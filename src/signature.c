@@ -7,10 +7,17 @@
 #include <openssl/crypto.h>
 #include <openssl/engine.h>
 #include <openssl/x509.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "context.h"
 #include "signature.h"
+#include "utils.h"
+
+/* Buffer size for reading the content of detached signatures */
+#define CMS_VERIFY_CHUNK_SIZE (4*1024*1024)
 
 GQuark r_signature_error_quark(void)
 {
@@ -1245,11 +1252,14 @@ out:
 	return res;
 }
 
-gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
+/*
+ * Verifies a detached signature against incontent or an inline signature if
+ * incontent is NULL.
+ */
+static gboolean cms_verify_bio(BIO *incontent, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
 {
 	GError *ierror = NULL;
 	g_autoptr(CMS_ContentInfo) icms = NULL;
-	BIO *incontent = NULL;
 	BIO *insig = BIO_new_mem_buf((void *)g_bytes_get_data(sig, NULL),
 			g_bytes_get_size(sig));
 	BIO *outcontent = BIO_new(BIO_s_mem());
@@ -1279,7 +1289,7 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 
 	detached = CMS_is_detached(icms);
 	if (detached) {
-		if (content == NULL) {
+		if (incontent == NULL) {
 			/* we have a detached signature but no content to verify */
 			g_set_error(
 					error,
@@ -1297,10 +1307,8 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 					"unexpected manifest output location for detached signature");
 			goto out;
 		}
-		incontent = BIO_new_mem_buf((void *)g_bytes_get_data(content, NULL),
-				g_bytes_get_size(content));
 	} else {
-		if (content != NULL) {
+		if (incontent != NULL) {
 			/* we have an inline signature but some content to verify */
 			g_set_error(
 					error,
@@ -1390,13 +1398,33 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 	res = TRUE;
 out:
 	ERR_print_errors_fp(stdout);
-	BIO_free_all(incontent);
 	BIO_free_all(insig);
 	BIO_free_all(outcontent);
 	r_context_end_step("cms_verify", res);
 	return res;
 }
 
+gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
+{
+	BIO *incontent = NULL;
+	gboolean res;
+
+	g_return_val_if_fail(sig != NULL, FALSE);
+	g_return_val_if_fail(store != NULL, FALSE);
+	g_return_val_if_fail(cms == NULL || *cms == NULL, FALSE);
+	g_return_val_if_fail(manifest == NULL || *manifest == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (content)
+		incontent = BIO_new_mem_buf((void *)g_bytes_get_data(content, NULL),
+				g_bytes_get_size(content));
+
+	res = cms_verify_bio(incontent, sig, store, cms, manifest, error);
+
+	BIO_free_all(incontent);
+	return res;
+}
+
 GBytes *cms_sign_file(const gchar *filename, const gchar *certfile, const gchar *keyfile, gchar **interfiles, GError **error)
 {
 	GError *ierror = NULL;
@@ -1456,11 +1484,104 @@ out:
 	return sig;
 }
 
+/* State of a BIO reading the content to verify from a file descriptor */
+typedef struct {
+	int fd;
+	goffset pos; /* file offset of the next refill */
+	goffset size;
+	guint8 *buf;
+	gsize buf_len;
+	gsize buf_pos;
+	GError *error; /* set if reading failed */
+} RFdContent;
+
+static int fd_content_read(BIO *bio, char *out, int outl)
+{
+	RFdContent *content = BIO_get_data(bio);
+	gsize len;
+
+	if (content->error)
+		return -1;
+
+	if (content->buf_pos == content->buf_len) {
+		len = MIN(CMS_VERIFY_CHUNK_SIZE, content->size - content->pos);
+		if (len == 0)
+			return 0;
+
+		/* let the kernel read the next chunk while the current one is hashed */
+		if (content->pos + (goffset)len < content->size)
+			posix_fadvise(content->fd, content->pos + len, CMS_VERIFY_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+
+		if (!r_pread_exact(content->fd, content->buf, len, content->pos, &content->error))
+			return -1;
+		content->pos += len;
+		content->buf_len = len;
+		content->buf_pos = 0;
+	}
+
+	len = MIN((gsize)outl, content->buf_len - content->buf_pos);
+	memcpy(out, content->buf + content->buf_pos, len);
+	content->buf_pos += len;
+
+	return len;
+}
+
+static long fd_content_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+	RFdContent *content = BIO_get_data(bio);
+
+	switch (cmd) {
+		case BIO_CTRL_EOF:
+			return content->pos == content->size && content->buf_pos == content->buf_len;
+		case BIO_CTRL_PENDING:
+			return content->buf_len - content->buf_pos;
+		case BIO_CTRL_FLUSH:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* OpenSSL has only a small pool of indexes for custom BIO types (see
+ * BIO_get_new_index()), so the method is created once and shared. */
+static GMutex fd_content_method_mutex;
+static BIO_METHOD *fd_content_method = NULL;
+
+static const BIO_METHOD *get_fd_content_method(void)
+{
+	const BIO_METHOD *method;
+
+	g_mutex_lock(&fd_content_method_mutex);
+	if (!fd_content_method) {
+		BIO_METHOD *new_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "rauc fd content");
+
+		if (new_method &&
+		    BIO_meth_set_read(new_method, fd_content_read) &&
+		    BIO_meth_set_ctrl(new_method, fd_content_ctrl))
+			fd_content_method = new_method;
+		else
+			BIO_meth_free(new_method);
+	}
+	method = fd_content_method;
+	g_mutex_unlock(&fd_content_method_mutex);
+
+	return method;
+}
+
+void signature_cleanup(void)
+{
+	g_mutex_lock(&fd_content_method_mutex);
+	g_clear_pointer(&fd_content_method, BIO_meth_free);
+	g_mutex_unlock(&fd_content_method_mutex);
+}
+
 gboolean cms_verify_fd(gint fd, GBytes *sig, goffset limit, X509_STORE *store, CMS_ContentInfo **cms, GError **error)
 {
 	GError *ierror = NULL;
-	g_autoptr(GMappedFile) file = NULL;
-	g_autoptr(GBytes) content = NULL;
+	RFdContent content = {.fd = fd};
+	const BIO_METHOD *method = NULL;
+	BIO *incontent = NULL;
+	struct stat st;
 	gboolean res = FALSE;
 
 	g_return_val_if_fail(fd >= 0, FALSE);
@@ -1469,41 +1590,56 @@ gboolean cms_verify_fd(gint fd, GBytes *sig, goffset limit, X509_STORE *store, C
 	g_return_val_if_fail(cms == NULL || *cms == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	file = g_mapped_file_new_from_fd(fd, FALSE, &ierror);
-	if (file == NULL) {
-		g_propagate_error(error, ierror);
-		goto out;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat bundle: %s", g_strerror(err));
+		return FALSE;
 	}
-	content = g_mapped_file_get_bytes(file);
-
-	/* On 32 bit systems, G_MAXSIZE will be only 32 bit (unsigned) while
-	 * 'limit' is 64 bit (signed). Thus we must take care of not passing
-	 * 'limit' values exceeding G_MAXSIZE to g_bytes_new_from_bytes.
-	 * However, mmapping for large limit values will cause problems,
-	 * anyway.
-	 */
-	if ((guint64)limit > (guint64)G_MAXSIZE) {
+	content.size = limit ? limit : st.st_size;
+	if (content.size > st.st_size) {
 		g_set_error(
 				error,
 				R_SIGNATURE_ERROR,
 				R_SIGNATURE_ERROR_PARSE,
-				"Bundle size exceeds maximum size!");
-		goto out;
+				"Signed size (%"G_GOFFSET_FORMAT ") exceeds bundle size", content.size);
+		return FALSE;
 	}
 
-	if (limit) {
-		GBytes *tmp = g_bytes_new_from_bytes(content, 0, limit);
-		g_bytes_unref(content);
-		content = tmp;
+	/* The content is streamed through a fixed size buffer instead of
+	 * mapping it completely, which works for large bundles on 32 bit
+	 * systems as well. */
+	posix_fadvise(fd, 0, content.size, POSIX_FADV_SEQUENTIAL);
+	content.buf = g_malloc(CMS_VERIFY_CHUNK_SIZE);
+
+	method = get_fd_content_method();
+	if (!method || !(incontent = BIO_new(method))) {
+		g_set_error(
+				error,
+				R_SIGNATURE_ERROR,
+				R_SIGNATURE_ERROR_UNKNOWN,
+				"Failed to set up content BIO: %s", get_openssl_err_string());
+		goto out;
 	}
+	BIO_set_data(incontent, &content);
+	BIO_set_init(incontent, 1);
 
-	res = cms_verify_bytes(content, sig, store, cms, NULL, &ierror);
+	res = cms_verify_bio(incontent, sig, store, cms, NULL, &ierror);
 	if (!res) {
-		g_propagate_error(error, ierror);
+		/* a read error is more useful than the resulting digest mismatch */
+		if (content.error) {
+			g_clear_error(&ierror);
+			g_propagate_prefixed_error(error, g_steal_pointer(&content.error), "Failed to read bundle: ");
+		} else {
+			g_propagate_error(error, ierror);
+		}
 		goto out;
 	}
 
 out:
+	BIO_free_all(incontent);
+	g_clear_error(&content.error);
+	g_free(content.buf);
 	return res;
 }
 
@@ -0,0 +1,451 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "resources.h"
+#include "sparse.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-sparse-error-quark, r_sparse_error)
+
+/* see libsparse/sparse_format.h from AOSP */
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define SPARSE_MAJOR_VERSION 1
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32 0xCAC4
+
+#define SPARSE_BUFFER_SIZE (1024*1024)
+
+/* all fields are little endian */
+typedef struct {
+	guint32 magic;
+	guint16 major_version;
+	guint16 minor_version;
+	guint16 file_hdr_sz;
+	guint16 chunk_hdr_sz;
+	guint32 blk_sz;
+	guint32 total_blks;
+	guint32 total_chunks;
+	guint32 image_checksum;
+} SparseHeader;
+G_STATIC_ASSERT(sizeof(SparseHeader) == 28);
+
+typedef struct {
+	guint16 chunk_type;
+	guint16 reserved1;
+	guint32 chunk_sz;
+	guint32 total_sz;
+} SparseChunkHeader;
+G_STATIC_ASSERT(sizeof(SparseChunkHeader) == 12);
+
+gboolean r_sparse_is_sparse(int fd)
+{
+	guint32 magic = 0;
+
+	if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+		return FALSE;
+
+	return GUINT32_FROM_LE(magic) == SPARSE_HEADER_MAGIC;
+}
+
+gboolean r_sparse_read_header(int fd, RaucSparseHeader *header, GError **error)
+{
+	GError *ierror = NULL;
+	SparseHeader raw;
+
+	g_return_val_if_fail(header, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_pread_exact(fd, (guint8 *)&raw, sizeof(raw), 0, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read sparse image header: ");
+		return FALSE;
+	}
+
+	if (GUINT32_FROM_LE(raw.magic) != SPARSE_HEADER_MAGIC) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Invalid sparse image magic 0x%08x", GUINT32_FROM_LE(raw.magic));
+		return FALSE;
+	}
+
+	if (GUINT16_FROM_LE(raw.major_version) != SPARSE_MAJOR_VERSION) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Unsupported sparse image version %u", GUINT16_FROM_LE(raw.major_version));
+		return FALSE;
+	}
+
+	header->block_size = GUINT32_FROM_LE(raw.blk_sz);
+	header->total_blocks = GUINT32_FROM_LE(raw.total_blks);
+	header->total_chunks = GUINT32_FROM_LE(raw.total_chunks);
+	header->file_header_size = GUINT16_FROM_LE(raw.file_hdr_sz);
+	header->chunk_header_size = GUINT16_FROM_LE(raw.chunk_hdr_sz);
+
+	if (header->file_header_size < sizeof(SparseHeader) ||
+	    header->chunk_header_size < sizeof(SparseChunkHeader)) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Invalid sparse image header sizes");
+		return FALSE;
+	}
+
+	if (header->block_size == 0 || header->block_size % 4 != 0) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Invalid sparse image block size %u", header->block_size);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+goffset r_sparse_get_size(const RaucSparseHeader *header)
+{
+	g_return_val_if_fail(header, 0);
+
+	return (goffset)header->total_blocks * header->block_size;
+}
+
+static gboolean skip_input(int fd, gsize size, GError **error)
+{
+	if (!size)
+		return TRUE;
+
+	if (lseek(fd, size, SEEK_CUR) == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to seek in sparse image: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean write_raw_chunk(int in_fd, int out_fd, goffset offset, goffset size, guint8 *buffer, GError **error)
+{
+	GError *ierror = NULL;
+
+	while (size) {
+		gsize len = MIN(size, SPARSE_BUFFER_SIZE);
+
+		if (!r_read_exact(in_fd, buffer, len, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		r_resources_throttle_write(len);
+		if (!r_pwrite_exact(out_fd, buffer, len, offset, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		offset += len;
+		size -= len;
+	}
+
+	return TRUE;
+}
+
+static gboolean write_fill_chunk(int out_fd, goffset offset, goffset size, const guint8 *pattern, guint8 *buffer, GError **error)
+{
+	GError *ierror = NULL;
+	static const guint8 zero[4] = {0};
+
+	if (memcmp(pattern, zero, sizeof(zero)) == 0) {
+		guint64 range[2] = {offset, size};
+
+		/* let the device zero the range, falls back to writing for
+		 * regular files or unaligned ranges */
+		if (ioctl(out_fd, BLKZEROOUT, &range) == 0)
+			return TRUE;
+	}
+
+	for (gsize i = 0; i < SPARSE_BUFFER_SIZE; i += 4)
+		memcpy(buffer + i, pattern, 4);
+
+	while (size) {
+		gsize len = MIN(size, SPARSE_BUFFER_SIZE);
+
+		r_resources_throttle_write(len);
+		if (!r_pwrite_exact(out_fd, buffer, len, offset, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		offset += len;
+		size -= len;
+	}
+
+	return TRUE;
+}
+
+gboolean r_sparse_write(int in_fd, int out_fd, GError **error)
+{
+	GError *ierror = NULL;
+	RaucSparseHeader header;
+	g_autofree guint8 *buffer = NULL;
+	guint64 block = 0;
+	gint last_percent = -1;
+
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_sparse_read_header(in_fd, &header, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (lseek(in_fd, header.file_header_size, SEEK_SET) == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to seek in sparse image: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	buffer = g_malloc(SPARSE_BUFFER_SIZE);
+
+	for (guint32 i = 0; i < header.total_chunks; i++) {
+		SparseChunkHeader chunk;
+		guint8 pattern[4];
+		goffset offset = (goffset)block * header.block_size;
+		goffset size;
+		guint64 total_size;
+		gboolean res = TRUE;
+		gint percent;
+
+		if (!r_read_exact(in_fd, (guint8 *)&chunk, sizeof(chunk), &ierror) ||
+		    !skip_input(in_fd, header.chunk_header_size - sizeof(chunk), &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read chunk %u: ", i);
+			return FALSE;
+		}
+
+		chunk.chunk_type = GUINT16_FROM_LE(chunk.chunk_type);
+		chunk.chunk_sz = GUINT32_FROM_LE(chunk.chunk_sz);
+		total_size = GUINT32_FROM_LE(chunk.total_sz);
+		size = (goffset)chunk.chunk_sz * header.block_size;
+
+		if (block + chunk.chunk_sz > header.total_blocks) {
+			g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+					"Chunk %u exceeds sparse image size", i);
+			return FALSE;
+		}
+
+		switch (chunk.chunk_type) {
+			case CHUNK_TYPE_RAW:
+				if (total_size != header.chunk_header_size + (guint64)size)
+					goto invalid_size;
+				res = write_raw_chunk(in_fd, out_fd, offset, size, buffer, &ierror);
+				break;
+			case CHUNK_TYPE_FILL:
+				if (total_size != header.chunk_header_size + sizeof(pattern))
+					goto invalid_size;
+				res = r_read_exact(in_fd, pattern, sizeof(pattern), &ierror) &&
+				      write_fill_chunk(out_fd, offset, size, pattern, buffer, &ierror);
+				break;
+			case CHUNK_TYPE_DONT_CARE:
+				if (total_size != header.chunk_header_size)
+					goto invalid_size;
+				break;
+			case CHUNK_TYPE_CRC32:
+				/* the bundle signature already protects the image */
+				if (total_size != header.chunk_header_size + 4)
+					goto invalid_size;
+				res = skip_input(in_fd, 4, &ierror);
+				break;
+			default:
+				g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+						"Unsupported sparse chunk type 0x%04x", chunk.chunk_type);
+				return FALSE;
+		}
+
+		if (!res) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write chunk %u: ", i);
+			return FALSE;
+		}
+
+		block += chunk.chunk_sz;
+
+		percent = header.total_blocks ? block * 100 / header.total_blocks : 100;
+		/* emit progress info (but only when in progress context) */
+		if (r_context()->progress && percent != last_percent) {
+			last_percent = percent;
+			r_context_set_step_percentage("copy_image", percent);
+		}
+		continue;
+
+invalid_size:
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Invalid size of chunk %u", i);
+		return FALSE;
+	}
+
+	if (block != header.total_blocks) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Sparse image chunks cover %"G_GUINT64_FORMAT " of %u blocks", block, header.total_blocks);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* State for the chunk currently being collected by r_sparse_create() */
+typedef struct {
+	int fd;
+	guint16 type;
+	guint8 pattern[4];
+	guint32 blocks;
+	guint8 *data;
+	guint32 total_chunks;
+} SparseWriter;
+
+static gboolean writer_flush(SparseWriter *writer, GError **error)
+{
+	GError *ierror = NULL;
+	SparseChunkHeader chunk;
+	gsize data_size;
+
+	if (!writer->blocks)
+		return TRUE;
+
+	data_size = writer->type == CHUNK_TYPE_RAW ?
+	            (gsize)writer->blocks * R_SPARSE_DEFAULT_BLOCK_SIZE : sizeof(writer->pattern);
+
+	chunk.chunk_type = GUINT16_TO_LE(writer->type);
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = GUINT32_TO_LE(writer->blocks);
+	chunk.total_sz = GUINT32_TO_LE(sizeof(chunk) + data_size);
+
+	if (!r_write_exact(writer->fd, (const guint8 *)&chunk, sizeof(chunk), &ierror) ||
+	    !r_write_exact(writer->fd, writer->type == CHUNK_TYPE_RAW ? writer->data : writer->pattern,
+			    data_size, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	writer->total_chunks++;
+	writer->blocks = 0;
+
+	return TRUE;
+}
+
+gboolean r_sparse_create(const gchar *inpath, const gchar *outpath, GError **error)
+{
+	GError *ierror = NULL;
+	SparseWriter writer = {.fd = -1};
+	SparseHeader header = {0};
+	g_autofree guint8 *block = NULL;
+	const guint32 max_raw_blocks = SPARSE_BUFFER_SIZE / R_SPARSE_DEFAULT_BLOCK_SIZE;
+	guint64 total_blocks;
+	struct stat st;
+	gboolean res = FALSE;
+	int in_fd;
+
+	g_return_val_if_fail(inpath, FALSE);
+	g_return_val_if_fail(outpath, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	in_fd = g_open(inpath, O_RDONLY | O_CLOEXEC);
+	if (in_fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", inpath, g_strerror(err));
+		return FALSE;
+	}
+
+	if (fstat(in_fd, &st) == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", inpath, g_strerror(err));
+		goto out;
+	}
+
+	total_blocks = st.st_size / R_SPARSE_DEFAULT_BLOCK_SIZE;
+	if (st.st_size % R_SPARSE_DEFAULT_BLOCK_SIZE != 0) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"Size of %s is not a multiple of the sparse block size %d", inpath, R_SPARSE_DEFAULT_BLOCK_SIZE);
+		goto out;
+	}
+	if (total_blocks > G_MAXUINT32) {
+		g_set_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID,
+				"%s is too large for a sparse image", inpath);
+		goto out;
+	}
+
+	writer.fd = g_open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (writer.fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create %s: %s", outpath, g_strerror(err));
+		goto out;
+	}
+	writer.data = g_malloc(SPARSE_BUFFER_SIZE);
+	block = g_malloc(R_SPARSE_DEFAULT_BLOCK_SIZE);
+
+	/* the header is written last, once the chunk count is known */
+	if (lseek(writer.fd, sizeof(header), SEEK_SET) == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to seek in %s: %s", outpath, g_strerror(err));
+		goto out;
+	}
+
+	for (guint64 i = 0; i < total_blocks; i++) {
+		if (!r_read_exact(in_fd, block, R_SPARSE_DEFAULT_BLOCK_SIZE, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read %s: ", inpath);
+			goto out;
+		}
+
+		/* a block equal to itself shifted by 4 bytes repeats a 32 bit pattern */
+		if (memcmp(block, block + 4, R_SPARSE_DEFAULT_BLOCK_SIZE - 4) == 0) {
+			if (writer.type != CHUNK_TYPE_FILL || memcmp(writer.pattern, block, 4) != 0) {
+				if (!writer_flush(&writer, &ierror))
+					goto write_error;
+				writer.type = CHUNK_TYPE_FILL;
+				memcpy(writer.pattern, block, 4);
+			}
+		} else {
+			if (writer.type != CHUNK_TYPE_RAW || writer.blocks == max_raw_blocks) {
+				if (!writer_flush(&writer, &ierror))
+					goto write_error;
+				writer.type = CHUNK_TYPE_RAW;
+			}
+			memcpy(writer.data + (gsize)writer.blocks * R_SPARSE_DEFAULT_BLOCK_SIZE,
+					block, R_SPARSE_DEFAULT_BLOCK_SIZE);
+		}
+		writer.blocks++;
+	}
+
+	if (!writer_flush(&writer, &ierror))
+		goto write_error;
+
+	header.magic = GUINT32_TO_LE(SPARSE_HEADER_MAGIC);
+	header.major_version = GUINT16_TO_LE(SPARSE_MAJOR_VERSION);
+	header.minor_version = 0;
+	header.file_hdr_sz = GUINT16_TO_LE(sizeof(SparseHeader));
+	header.chunk_hdr_sz = GUINT16_TO_LE(sizeof(SparseChunkHeader));
+	header.blk_sz = GUINT32_TO_LE(R_SPARSE_DEFAULT_BLOCK_SIZE);
+	header.total_blks = GUINT32_TO_LE(total_blocks);
+	header.total_chunks = GUINT32_TO_LE(writer.total_chunks);
+
+	if (!r_pwrite_exact(writer.fd, (const guint8 *)&header, sizeof(header), 0, &ierror))
+		goto write_error;
+
+	res = TRUE;
+	goto out;
+
+write_error:
+	g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", outpath);
+out:
+	g_close(in_fd, NULL);
+	if (writer.fd != -1)
+		g_close(writer.fd, NULL);
+	g_free(writer.data);
+	if (!res && writer.fd != -1)
+		g_unlink(outpath);
+	return res;
+}
@@ -4,6 +4,7 @@
 #include <glib/gstdio.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
+#include <linux/fs.h>
 #include <mtd/ubi-user.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -20,6 +21,10 @@
 #include "gpt.h"
 #include "utils.h"
 #include "hash_index.h"
+#include "checkpoint.h"
+#include "resources.h"
+#include "sparse.h"
+#include "zstd_seekable.h"
 
 #define R_SLOT_HOOK_PRE_INSTALL "slot-pre-install"
 #define R_SLOT_HOOK_POST_INSTALL "slot-post-install"
@@ -32,12 +37,11 @@ GQuark r_update_error_quark(void)
 	return g_quark_from_static_string("r_update_error_quark");
 }
 
-static gboolean check_image_size(int fd, const RaucImage *image, GError **error)
+static gboolean check_device_size(int fd, goffset size, GError **error)
 {
 	GError *ierror = NULL;
 	goffset dev_size;
 
-	g_return_val_if_fail(image, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	dev_size = get_device_size(fd, &ierror);
@@ -47,13 +51,13 @@ static gboolean check_image_size(int fd, const RaucImage *image, GError **error)
 		return TRUE;
 	}
 
-	if (dev_size < image->checksum.size) {
+	if (dev_size < size) {
 		if (ierror) {
 			g_propagate_error(error, ierror);
 		} else {
 			g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 					"Slot (%"G_GOFFSET_FORMAT " bytes) is too small for image (%"G_GOFFSET_FORMAT " bytes).",
-					dev_size, image->checksum.size);
+					dev_size, size);
 		}
 		return FALSE;
 	}
@@ -61,6 +65,13 @@ static gboolean check_image_size(int fd, const RaucImage *image, GError **error)
 	return TRUE;
 }
 
+static gboolean check_image_size(int fd, const RaucImage *image, GError **error)
+{
+	g_return_val_if_fail(image, FALSE);
+
+	return check_device_size(fd, image->checksum.size, error);
+}
+
 /* the fd will only live as long as the returned output stream */
 static GUnixOutputStream* open_slot_device(RaucSlot *slot, int *fd, GError **error)
 {
@@ -270,6 +281,7 @@ static gboolean splice_with_progress(GUnixInputStream *image_stream,
 		}
 
 		sum_size += out_size;
+		r_resources_throttle_write(out_size);
 
 		percent = sum_size * 100 / stat.st_size;
 		/* emit progress info (but only when in progress context) */
@@ -334,7 +346,7 @@ static gboolean splice_file_to_process_stdin(const gchar *filename, GSubprocess
 	return splice_file_to_outstream(filename, out_stream, error);
 }
 
-static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, gsize len_header_last, GError **error)
+static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, gsize len_header_last, RaucCheckpoint *checkpoint, GError **error)
 {
 	GError *ierror = NULL;
 	goffset seeksize;
@@ -346,9 +358,10 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 	g_return_val_if_fail(image, FALSE);
 	g_return_val_if_fail(image->checksum.size >= 0, FALSE);
 	g_return_val_if_fail(outstream, FALSE);
+	g_return_val_if_fail(!(checkpoint && len_header_last), FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	srcimagefile = g_file_new_for_path(image->filename);
+	srcimagefile = g_file_new_for_path(r_image_get_data_path(image));
 	out_fd = g_unix_output_stream_get_fd(outstream);
 
 	instream = G_INPUT_STREAM(g_file_read(srcimagefile, NULL, &ierror));
@@ -381,7 +394,27 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 		}
 	}
 
-	if (!r_copy_stream_with_progress(instream, G_OUTPUT_STREAM(outstream), image->checksum.size, &ierror)) {
+	if (checkpoint) {
+		goffset resume = r_checkpoint_resume(checkpoint);
+
+		if (resume > 0) {
+			if (!g_seekable_seek(G_SEEKABLE(instream), resume, G_SEEK_SET, NULL, &ierror)) {
+				g_propagate_prefixed_error(error, ierror,
+						"Failed to seek to checkpoint: ");
+				return FALSE;
+			}
+			if (lseek(out_fd, resume, SEEK_SET) == -1) {
+				g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Failed to seek to checkpoint: %s", strerror(errno));
+				return FALSE;
+			}
+		}
+
+		if (!r_copy_stream_with_checkpoint(instream, G_OUTPUT_STREAM(outstream), image->checksum.size, checkpoint, out_fd, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to copy data: ");
+			return FALSE;
+		}
+	} else if (!r_copy_stream_with_progress(instream, G_OUTPUT_STREAM(outstream), image->checksum.size, &ierror)) {
 		g_propagate_prefixed_error(error, ierror,
 				"Failed to copy data: ");
 		return FALSE;
@@ -471,7 +504,7 @@ static gboolean write_boot_switch_partition(RaucImage *image, const gchar *devic
 		goto out;
 	}
 
-	res = copy_raw_image(image, outstream, len_header_last, &ierror);
+	res = copy_raw_image(image, outstream, len_header_last, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -689,9 +722,21 @@ unmount_out:
 	return res;
 }
 
+/* Creates a checkpoint for resuming an interrupted write of image to slot. */
+static RaucCheckpoint *new_install_checkpoint(const RaucSlot *slot, const RaucImage *image)
+{
+	const RaucBundle *bundle = NULL;
+
+	if (r_context()->install_info)
+		bundle = r_context()->install_info->mounted_bundle;
+
+	return r_checkpoint_new(slot, image, (bundle && bundle->manifest) ? bundle->manifest->hash : NULL);
+}
+
 static gboolean copy_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
 {
 	g_autoptr(GUnixOutputStream) outstream = NULL;
+	g_autoptr(RaucCheckpoint) checkpoint = NULL;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 
@@ -713,7 +758,8 @@ static gboolean copy_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError *
 
 	/* copy */
 	g_message("writing data to device %s", slot->device);
-	res = copy_raw_image(image, outstream, 0, &ierror);
+	checkpoint = new_install_checkpoint(slot, image);
+	res = copy_raw_image(image, outstream, 0, checkpoint, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -725,6 +771,9 @@ static gboolean copy_raw_image_to_dev(RaucImage *image, RaucSlot *slot, GError *
 		goto out;
 	}
 
+	if (checkpoint)
+		r_checkpoint_remove(checkpoint);
+
 out:
 	return res;
 }
@@ -742,6 +791,8 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	off_t offset = 0;
 	int target_fd = -1;
 	g_autoptr(RaucStats) zero_stats = NULL;
+	g_autoptr(RaucCheckpoint) checkpoint = NULL;
+	guint32 first_chunk = 0;
 
 	g_return_val_if_fail(image, FALSE);
 	g_return_val_if_fail(slot, FALSE);
@@ -790,6 +841,12 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	}
 	/* The bundle data is read-only and authenticated. */
 	tmp->skip_hash_check = TRUE;
+	/* For compressed images, only the index knows the size required in the slot */
+	if (tmp->zstd && !check_device_size(((RaucHashIndex*)g_ptr_array_index(sources, 0))->data_fd, (goffset)tmp->count * 4096, &ierror)) {
+		g_propagate_error(error, ierror);
+		res = FALSE;
+		goto out;
+	}
 	g_ptr_array_add(sources, g_steal_pointer(&tmp));
 
 	/* Open source index and target fd for lower range (reuse written chunks). */
@@ -837,8 +894,20 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	/* Temporary data storage */
 	chunk = g_new0(RaucHashIndexChunk, 1);
 
+	/* Skip chunks already written by an interrupted installation */
+	checkpoint = new_install_checkpoint(slot, image);
+	if (checkpoint) {
+		first_chunk = r_checkpoint_resume(checkpoint) / sizeof(chunk->data);
+		if (first_chunk) {
+			RaucHashIndex *target_written = g_ptr_array_index(sources, 0);
+			RaucHashIndex *target_old = g_ptr_array_index(sources, 1);
+			target_written->invalid_from = first_chunk;
+			target_old->invalid_below = first_chunk - 1;
+		}
+	}
+
 	/* Iterate over chunks in source image */
-	for (guint32 c = 0; c < chunk_count; c++) {
+	for (guint32 c = first_chunk; c < chunk_count; c++) {
 		gboolean found = FALSE;
 
 		if (memcmp(chunk_hashes[c], R_HASH_INDEX_ZERO_CHUNK, 32) == 0) {
@@ -880,12 +949,19 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 		 * in the correct location, we could skip the write.
 		 */
 		offset = (off_t)c * sizeof(chunk->data);
+		r_resources_throttle_write(sizeof(chunk->data));
 		if (!r_pwrite_lazy(target_fd, chunk->data, sizeof(chunk->data), offset, &ierror)) {
 			g_propagate_error(error, ierror);
 			res = FALSE;
 			goto out;
 		}
 
+		if (checkpoint && !r_checkpoint_update(checkpoint, target_fd, chunk->data, sizeof(chunk->data), &ierror)) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+
 		/* Update limits */
 		{
 			RaucHashIndex *target_written = g_ptr_array_index(sources, 0);
@@ -911,6 +987,9 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 		goto out;
 	}
 
+	if (checkpoint)
+		r_checkpoint_remove(checkpoint);
+
 	/* Write new index to slot data dir. */
 	{
 		const RaucHashIndex *source = g_ptr_array_index(sources, sources->len-1);
@@ -957,6 +1036,140 @@ static gboolean copy_adaptive_image_to_dev(RaucImage *image, RaucSlot *slot, GEr
 	return FALSE;
 }
 
+static gboolean copy_sparse_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
+{
+	g_autoptr(GUnixOutputStream) outstream = NULL;
+	GError *ierror = NULL;
+	RaucSparseHeader header;
+	gboolean res = FALSE;
+	int in_fd = -1, out_fd = -1;
+
+	in_fd = g_open(r_image_get_data_path(image), O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to open file %s: %s", image->filename, g_strerror(err));
+		return FALSE;
+	}
+
+	res = r_sparse_read_header(in_fd, &header, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* open */
+	g_message("opening slot device %s", slot->device);
+	outstream = open_slot_device(slot, &out_fd, &ierror);
+	if (outstream == NULL) {
+		res = FALSE;
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* check size */
+	res = check_device_size(out_fd, r_sparse_get_size(&header), &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* copy */
+	g_message("writing sparse image (%"G_GOFFSET_FORMAT " bytes) to device %s", r_sparse_get_size(&header), slot->device);
+	res = r_sparse_write(in_fd, out_fd, &ierror);
+	if (!res) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write sparse image: ");
+		goto out;
+	}
+
+	/* Flush to block device before closing to assure content is written to disk */
+	if (fsync(out_fd) == -1) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to slot failed: %s", strerror(errno));
+		res = FALSE;
+		goto out;
+	}
+
+	res = g_output_stream_close(G_OUTPUT_STREAM(outstream), NULL, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+out:
+	g_close(in_fd, NULL);
+	return res;
+}
+
+static gboolean copy_zstd_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
+{
+#if ENABLE_ZSTD == 1
+	g_autoptr(GUnixOutputStream) outstream = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	GError *ierror = NULL;
+	gboolean res = FALSE;
+	int in_fd = -1, out_fd = -1;
+
+	in_fd = g_open(r_image_get_data_path(image), O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to open file %s: %s", image->filename, g_strerror(err));
+		return FALSE;
+	}
+
+	zs = r_zstd_seekable_open(in_fd, &ierror);
+	if (!zs) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* open */
+	g_message("opening slot device %s", slot->device);
+	outstream = open_slot_device(slot, &out_fd, &ierror);
+	if (outstream == NULL) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* check size */
+	res = check_device_size(out_fd, r_zstd_seekable_get_size(zs), &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* copy */
+	g_message("writing seekable zstd image (%"G_GUINT64_FORMAT " bytes) to device %s", r_zstd_seekable_get_size(zs), slot->device);
+	res = r_zstd_seekable_write(zs, out_fd, &ierror);
+	if (!res) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write seekable zstd image: ");
+		goto out;
+	}
+
+	/* Flush to block device before closing to assure content is written to disk */
+	if (fsync(out_fd) == -1) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to slot failed: %s", strerror(errno));
+		res = FALSE;
+		goto out;
+	}
+
+	res = g_output_stream_close(G_OUTPUT_STREAM(outstream), NULL, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+out:
+	g_clear_pointer(&zs, r_zstd_seekable_free);
+	g_close(in_fd, NULL);
+	return res;
+#else
+	g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+			"Cannot install seekable zstd image %s: zstd support is not enabled", image->filename);
+	return FALSE;
+#endif
+}
+
 static gboolean write_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
 {
 	GError *ierror = NULL;
@@ -973,6 +1186,15 @@ static gboolean write_image_to_dev(RaucImage *image, RaucSlot *slot, GError **er
 		return TRUE;
 	}
 
+	/* Handle sparse images, which only contain the used ranges */
+	if (image->sparse) {
+		if (!copy_sparse_image_to_dev(image, slot, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
 	/* Try adaptive mode */
 	if (image->adaptive) {
 		if (!slot->data_directory) {
@@ -994,6 +1216,15 @@ static gboolean write_image_to_dev(RaucImage *image, RaucSlot *slot, GError **er
 	}
 
 raw_copy:
+	/* Seekable zstd images are decompressed in parallel */
+	if (image->seekable_zstd) {
+		if (!copy_zstd_image_to_dev(image, slot, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
 	/* Finally, try a raw copy */
 	if (!copy_raw_image_to_dev(image, slot, &ierror)) {
 		g_propagate_error(error, ierror);
@@ -1003,6 +1234,145 @@ raw_copy:
 	return TRUE;
 }
 
+static gboolean img_to_fs_handler(RaucImage *image, RaucSlot *dest_slot, const gchar *hook_name, GError **error);
+static gboolean img_to_raw_handler(RaucImage *image, RaucSlot *dest_slot, const gchar *hook_name, GError **error);
+
+gboolean r_update_handler_can_discard(img_to_slot_handler handler, const RaucImage *image, const RaucSlot *slot)
+{
+	g_autoptr(RaucCheckpoint) checkpoint = NULL;
+
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+
+	if (!slot->pre_discard)
+		return FALSE;
+
+	/* only handlers writing the image via write_image_to_dev() */
+	if (handler != img_to_raw_handler && handler != img_to_fs_handler)
+		return FALSE;
+
+	/* hooks may depend on the previous slot content */
+	if (image->hooks.pre_install || image->hooks.install)
+		return FALSE;
+
+	/* casync and adaptive updates use the previous slot content as seed */
+	if (g_str_has_suffix(image->filename, ".caibx"))
+		return FALSE;
+	if (image->adaptive && slot->data_directory)
+		return FALSE;
+
+	/* do not destroy data of an interrupted installation we could resume */
+	checkpoint = r_checkpoint_new(slot, image, NULL);
+	if (checkpoint && g_file_test(checkpoint->filename, G_FILE_TEST_EXISTS))
+		return FALSE;
+
+	return TRUE;
+}
+
+/* Determines the number of bytes written to the slot for the image, which
+ * differs from the file size for sparse and seekable zstd images. */
+static gboolean get_image_slot_size(const RaucImage *image, guint64 *size, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean res = FALSE;
+	int fd;
+
+	if (!image->sparse && !image->seekable_zstd) {
+		*size = image->checksum.size;
+		return TRUE;
+	}
+
+	fd = g_open(r_image_get_data_path(image), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open file %s: %s", image->filename, g_strerror(err));
+		return FALSE;
+	}
+
+	if (image->sparse) {
+		RaucSparseHeader header;
+
+		res = r_sparse_read_header(fd, &header, &ierror);
+		if (res)
+			*size = r_sparse_get_size(&header);
+		else
+			g_propagate_error(error, ierror);
+	} else {
+#if ENABLE_ZSTD == 1
+		g_autoptr(RaucZstdSeekable) zs = r_zstd_seekable_open(fd, &ierror);
+
+		res = zs != NULL;
+		if (res)
+			*size = r_zstd_seekable_get_size(zs);
+		else
+			g_propagate_error(error, ierror);
+#else
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Seekable zstd images are not supported by this build");
+#endif
+	}
+
+	g_close(fd, NULL);
+	return res;
+}
+
+gboolean r_update_handler_discard_slot(const RaucImage *image, const RaucSlot *slot, GError **error)
+{
+	GError *ierror = NULL;
+	guint64 range[2] = {0, 0};
+	guint64 size;
+	guint sector_size;
+	int fd;
+
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!get_image_slot_size(image, &size, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to determine size of image: ");
+		return FALSE;
+	}
+
+	fd = g_open(slot->device, O_WRONLY | O_EXCL | O_CLOEXEC);
+	if (fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Opening device %s failed: %s", slot->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!check_device_size(fd, size, &ierror)) {
+		g_propagate_error(error, ierror);
+		g_close(fd, NULL);
+		return FALSE;
+	}
+
+	/* only discard what the image will overwrite completely */
+	sector_size = get_sectorsize(fd);
+	range[1] = size / sector_size * sector_size;
+	if (!range[1]) {
+		g_close(fd, NULL);
+		return TRUE;
+	}
+
+	g_message("Discarding %"G_GUINT64_FORMAT " bytes on %s", range[1], slot->device);
+	if (ioctl(fd, BLKDISCARD, &range) != 0) {
+		int err = errno;
+		g_close(fd, NULL);
+		if (err == EOPNOTSUPP || err == ENOTTY) {
+			g_info("Device %s does not support discard, skipping", slot->device);
+			return TRUE;
+		}
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Discarding %s failed: %s", slot->device, g_strerror(err));
+		return FALSE;
+	}
+
+	g_close(fd, NULL);
+	return TRUE;
+}
+
 static gboolean ubifs_format_slot(RaucSlot *dest_slot, GError **error)
 {
 	g_autoptr(GSubprocess) sproc = NULL;
@@ -1449,6 +1819,8 @@ static gboolean run_slot_hook_extra_env(const gchar *hook_name, const gchar *hoo
 	if (image) {
 		image_size = g_strdup_printf("%" G_GOFFSET_FORMAT, image->checksum.size);
 		g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_NAME", image->filename ? image->filename : "", TRUE);
+		if (image->payload_dev)
+			g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_DEVICE", image->payload_dev, TRUE);
 		g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_SIZE", image_size, TRUE);
 		g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_DIGEST", image->checksum.digest ? image->checksum.digest : "", TRUE);
 		g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_CLASS", image->slotclass, TRUE);
@@ -1610,7 +1982,7 @@ static gboolean img_to_ubivol_handler(RaucImage *image, RaucSlot *dest_slot, con
 		}
 	} else {
 		/* copy */
-		res = copy_raw_image(image, outstream, 0, &ierror);
+		res = copy_raw_image(image, outstream, 0, NULL, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
@@ -1679,7 +2051,7 @@ static gboolean img_to_ubifs_handler(RaucImage *image, RaucSlot *dest_slot, cons
 		}
 	} else {
 		/* copy */
-		res = copy_raw_image(image, outstream, 0, &ierror);
+		res = copy_raw_image(image, outstream, 0, NULL, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
@@ -2001,7 +2373,7 @@ static gboolean img_to_nor_handler(RaucImage *image, RaucSlot *dest_slot, const
 
 	/* write */
 	g_message("writing slot device %s", dest_slot->device);
-	res = nor_write_slot(image->filename, dest_slot->device, &ierror);
+	res = nor_write_slot(r_image_get_data_path(image), dest_slot->device, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2044,7 +2416,7 @@ static gboolean img_to_nand_handler(RaucImage *image, RaucSlot *dest_slot, const
 
 	/* write */
 	g_message("writing slot device %s", dest_slot->device);
-	res = nand_write_slot(image->filename, dest_slot->device, &ierror);
+	res = nand_write_slot(r_image_get_data_path(image), dest_slot->device, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2387,7 +2759,7 @@ static gboolean img_to_boot_emmc_handler(RaucImage *image, RaucSlot *dest_slot,
 	/* copy */
 	g_message("Copying image to slot device partition %s",
 			part_slot->device);
-	res = copy_raw_image(image, outstream, 0, &ierror);
+	res = copy_raw_image(image, outstream, 0, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2787,6 +3159,20 @@ img_to_slot_handler get_update_handler(RaucImage *mfimage, RaucSlot *dest_slot,
 		goto out;
 	}
 
+	if (mfimage->sparse && handler != img_to_raw_handler && handler != img_to_fs_handler) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_NO_HANDLER, "Sparse image %s is not supported for slot type %s",
+				mfimage->filename, dest);
+		handler = NULL;
+		goto out;
+	}
+
+	if (mfimage->seekable_zstd && handler != img_to_raw_handler && handler != img_to_fs_handler) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_NO_HANDLER, "Seekable zstd image %s is not supported for slot type %s",
+				mfimage->filename, dest);
+		handler = NULL;
+		goto out;
+	}
+
 out:
 	return handler;
 }
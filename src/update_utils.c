@@ -7,23 +7,20 @@
 #include <unistd.h>
 
 #include "update_utils.h"
+#include "checkpoint.h"
 #include "context.h"
+#include "resources.h"
 
-gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
-		goffset size, GError **error)
+static gboolean copy_stream(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, RaucCheckpoint *checkpoint, int fd, GError **error)
 {
 	GError *ierror = NULL;
 	gsize out_size = 0;
-	goffset sum_size = 0;
+	goffset sum_size = checkpoint ? checkpoint->offset : 0;
 	gint last_percent = -1, percent;
 	gchar buffer[8192];
 	gssize in_size;
 
-	g_return_val_if_fail(in_stream, FALSE);
-	g_return_val_if_fail(out_stream, FALSE);
-	g_return_val_if_fail(size >= 0, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
 	/* no-op for zero-sized images */
 	if (size == 0)
 		return TRUE;
@@ -37,6 +34,7 @@ gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out
 			g_propagate_error(error, ierror);
 			return FALSE;
 		}
+		r_resources_throttle_write(in_size);
 		ret = g_output_stream_write_all(out_stream, buffer,
 				in_size, &out_size, NULL, &ierror);
 		if (!ret) {
@@ -44,6 +42,11 @@ gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out
 			return FALSE;
 		}
 
+		if (checkpoint && !r_checkpoint_update(checkpoint, fd, (const guint8 *)buffer, out_size, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
 		sum_size += out_size;
 
 		percent = sum_size * 100 / size;
@@ -56,3 +59,27 @@ gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out
 
 	return TRUE;
 }
+
+gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, GError **error)
+{
+	g_return_val_if_fail(in_stream, FALSE);
+	g_return_val_if_fail(out_stream, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	return copy_stream(in_stream, out_stream, size, NULL, -1, error);
+}
+
+gboolean r_copy_stream_with_checkpoint(GInputStream *in_stream, GOutputStream *out_stream,
+		goffset size, RaucCheckpoint *checkpoint, int fd, GError **error)
+{
+	g_return_val_if_fail(in_stream, FALSE);
+	g_return_val_if_fail(out_stream, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(checkpoint, FALSE);
+	g_return_val_if_fail(fd >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	return copy_stream(in_stream, out_stream, size, checkpoint, fd, error);
+}
@@ -31,9 +31,13 @@
 #include <openssl/evp.h>
 #include <openssl/objects.h>
 
+#include "utils.h"
 #include "verity_hash.h"
 
 #define VERITY_MAX_LEVELS	63
+/* data blocks hashed by one thread at a time, a multiple of the digests per
+ * hash block */
+#define VERITY_TASK_BLOCKS	1024
 
 const size_t data_block_size = 4096;
 const size_t hash_block_size = 4096;
@@ -56,37 +60,18 @@ static unsigned get_bits_down(size_t u)
 	return i;
 }
 
-static int verify_zero(FILE *wr, size_t bytes)
-{
-	uint8_t block[bytes];
-	size_t i;
-
-	if (fread(block, bytes, 1, wr) != 1) {
-		g_debug("EIO while reading spare area.");
-		return -EIO;
-	}
-	for (i = 0; i < bytes; i++)
-		if (block[i]) {
-			g_message("Spare area is not zeroed at position %" PRIu64 ".",
-					ftello(wr) - bytes);
-			return -EPERM;
-		}
-	return 0;
-}
-
 static int verify_hash_block(
+		EVP_MD_CTX *mdctx,
 		uint8_t *hash,
 		const uint8_t *data,
 		const uint8_t *salt)
 {
 	/* SHA256, version 1 only */
-	EVP_MD_CTX *mdctx;
 	uint8_t tmp[EVP_MAX_MD_SIZE];
 	unsigned int tmp_size = 0;
 	int r = 0;
 
-	mdctx = EVP_MD_CTX_new();
-	if (EVP_DigestInit(mdctx, EVP_sha256()) != 1) {
+	if (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1) {
 		g_message("init failed");
 		r = -EINVAL;
 		goto out;
@@ -104,7 +89,7 @@ static int verify_hash_block(
 		goto out;
 	}
 
-	if (EVP_DigestFinal(mdctx, tmp, &tmp_size) != 1) {
+	if (EVP_DigestFinal_ex(mdctx, tmp, &tmp_size) != 1) {
 		g_message("final failed");
 		r = -EINVAL;
 		goto out;
@@ -117,7 +102,6 @@ static int verify_hash_block(
 out:
 	if (r)
 		ERR_print_errors_fp(stderr);
-	EVP_MD_CTX_free(mdctx);
 	return r;
 }
 
@@ -170,109 +154,169 @@ static int hash_levels(
 	return 0;
 }
 
-static int create_or_verify(FILE *rd, FILE *wr,
+/* One level of the hash tree, processed by several threads. Each task hashes
+ * VERITY_TASK_BLOCKS input blocks and writes (or compares) the resulting
+ * complete hash blocks. */
+struct verity_level {
+	int fd;
+	uint64_t data_block; /* first input block */
+	uint64_t hash_block; /* first output block */
+	uint64_t blocks; /* number of input blocks */
+	int verify;
+	const uint8_t *salt;
+	gint error; /* first error of any task, accessed atomically */
+};
+
+static void set_level_error(struct verity_level *level, int r)
+{
+	g_atomic_int_compare_and_exchange(&level->error, 0, r);
+}
+
+static void hash_level_task(gpointer data, gpointer user_data)
+{
+	struct verity_level *level = user_data;
+	uint64_t first = (GPOINTER_TO_SIZE(data) - 1) * (uint64_t)VERITY_TASK_BLOCKS;
+	uint64_t count = MIN(VERITY_TASK_BLOCKS, level->blocks - first);
+	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
+	size_t digest_size_full = 1 << get_bits_up(digest_size);
+	uint64_t out_blocks = (count + hash_per_block - 1) / hash_per_block;
+	g_autofree uint8_t *in = NULL;
+	g_autofree uint8_t *out = NULL;
+	g_autofree uint8_t *expected = NULL;
+	g_autoptr(GError) ierror = NULL;
+	EVP_MD_CTX *mdctx = NULL;
+	off_t seek_rd, seek_wr;
+
+	/* another task failed already */
+	if (g_atomic_int_get(&level->error))
+		return;
+
+	seek_rd = (level->data_block + first) * data_block_size;
+	seek_wr = (level->hash_block + first / hash_per_block) * hash_block_size;
+
+	in = g_malloc(count * data_block_size);
+	out = g_malloc0(out_blocks * hash_block_size);
+
+	if (!r_pread_exact(level->fd, in, count * data_block_size, seek_rd, &ierror)) {
+		g_debug("Cannot read data device block: %s", ierror->message);
+		set_level_error(level, -EIO);
+		return;
+	}
+
+	mdctx = EVP_MD_CTX_new();
+	for (uint64_t i = 0; i < count; i++) {
+		uint8_t *digest = out + (i / hash_per_block) * hash_block_size +
+		                  (i % hash_per_block) * digest_size_full;
+
+		if (verify_hash_block(mdctx, digest, in + i * data_block_size, level->salt)) {
+			EVP_MD_CTX_free(mdctx);
+			set_level_error(level, -EINVAL);
+			return;
+		}
+	}
+	EVP_MD_CTX_free(mdctx);
+
+	if (!level->verify) {
+		/* the spare area after the digests is zeroed */
+		if (!r_pwrite_exact(level->fd, out, out_blocks * hash_block_size, seek_wr, &ierror)) {
+			g_debug("Cannot write digest to hash device: %s", ierror->message);
+			set_level_error(level, -EIO);
+		}
+		return;
+	}
+
+	expected = g_malloc(out_blocks * hash_block_size);
+	if (!r_pread_exact(level->fd, expected, out_blocks * hash_block_size, seek_wr, &ierror)) {
+		g_debug("Cannot read digest from hash device: %s", ierror->message);
+		set_level_error(level, -EIO);
+		return;
+	}
+	for (uint64_t i = 0; i < out_blocks * hash_block_size; i += digest_size_full) {
+		if (memcmp(out + i, expected + i, digest_size_full) == 0)
+			continue;
+		if (i / digest_size_full < count)
+			g_message("Verification failed at position %" PRIu64 ".",
+					(uint64_t)seek_rd + (i / hash_block_size * hash_per_block +
+					                     i % hash_block_size / digest_size_full) * data_block_size);
+		else
+			g_message("Spare area is not zeroed at position %" PRIu64 ".", (uint64_t)seek_wr + i);
+		set_level_error(level, -EPERM);
+		return;
+	}
+}
+
+static int create_or_verify_level(int fd,
 		uint64_t data_block,
 		uint64_t hash_block,
 		uint64_t blocks,
 		int verify,
-		uint8_t *calculated_digest,
 		const uint8_t *salt)
 {
-	uint8_t left_block[hash_block_size];
-	uint8_t data_buffer[data_block_size];
-	uint8_t read_digest[digest_size];
-	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
-	size_t digest_size_full = 1 << get_bits_up(digest_size);
-	uint64_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
+	struct verity_level level = {
+		.fd = fd,
+		.data_block = data_block,
+		.hash_block = hash_block,
+		.blocks = blocks,
+		.verify = verify,
+		.salt = salt,
+	};
+	uint64_t tasks = (blocks + VERITY_TASK_BLOCKS - 1) / VERITY_TASK_BLOCKS;
+	g_autoptr(GError) ierror = NULL;
+	GThreadPool *pool = NULL;
 	uint64_t seek_rd, seek_wr;
-	size_t left_bytes;
-	unsigned i;
-	int r;
 
-	if (uint64_mult_overflow(&seek_rd, data_block, data_block_size) ||
+	if (uint64_mult_overflow(&seek_rd, data_block + blocks, data_block_size) ||
 	    uint64_mult_overflow(&seek_wr, hash_block, hash_block_size)) {
 		g_message("Device offset overflow.");
 		return -EINVAL;
 	}
 
-	if (fseeko(rd, seek_rd, SEEK_SET)) {
-		g_debug("Cannot seek to requested position in data device.");
-		return -EIO;
+	/* upper levels are small, avoid the thread overhead */
+	if (tasks == 1) {
+		hash_level_task(GSIZE_TO_POINTER(1), &level);
+		return level.error;
 	}
 
-	if (wr && fseeko(wr, seek_wr, SEEK_SET)) {
-		g_debug("Cannot seek to requested position in hash device.");
-		return -EIO;
+	pool = g_thread_pool_new(hash_level_task, &level, MIN(g_get_num_processors(), tasks), TRUE, &ierror);
+	if (!pool) {
+		g_message("Cannot start hash threads: %s", ierror->message);
+		return -EINVAL;
 	}
+	/* task numbers start at 1, as NULL cannot be queued */
+	for (uint64_t task = 1; task <= tasks; task++)
+		g_thread_pool_push(pool, GSIZE_TO_POINTER(task), NULL);
+	/* waits for all tasks */
+	g_thread_pool_free(pool, FALSE, TRUE);
 
-	memset(left_block, 0, hash_block_size);
-	while (blocks_to_write--) {
-		left_bytes = hash_block_size;
-		for (i = 0; i < hash_per_block; i++) {
-			if (!blocks)
-				break;
-			blocks--;
-			if (fread(data_buffer, data_block_size, 1, rd) != 1) {
-				g_debug("Cannot read data device block.");
-				return -EIO;
-			}
+	return g_atomic_int_get(&level.error);
+}
 
-			if (verify_hash_block(
-					calculated_digest,
-					data_buffer,
-					salt))
-				return -EINVAL;
-
-			if (!wr)
-				break;
-			if (verify) {
-				if (fread(read_digest, digest_size, 1, wr) != 1) {
-					g_debug("Cannot read digest from hash device.");
-					return -EIO;
-				}
-				if (memcmp(read_digest, calculated_digest, digest_size)) {
-					g_message("Verification failed at position %" PRIu64 ".",
-							ftello(rd) - data_block_size);
-					return -EPERM;
-				}
-			} else {
-				if (fwrite(calculated_digest, digest_size, 1, wr) != 1) {
-					g_debug("Cannot write digest to hash device.");
-					return -EIO;
-				}
-			}
-			{ /* version 1 */
-				if (digest_size_full - digest_size) {
-					if (verify) {
-						r = verify_zero(wr, digest_size_full - digest_size);
-						if (r)
-							return r;
-					} else if (fwrite(left_block, digest_size_full - digest_size, 1, wr) != 1) {
-						g_debug("Cannot write spare area to hash device.");
-						return -EIO;
-					}
-				}
-				left_bytes -= digest_size_full;
-			}
-		}
-		if (wr && left_bytes) {
-			if (verify) {
-				r = verify_zero(wr, left_bytes);
-				if (r)
-					return r;
-			} else if (fwrite(left_block, left_bytes, 1, wr) != 1) {
-				g_debug("Cannot write remaining spare area to hash device.");
-				return -EIO;
-			}
-		}
+/* Computes the root hash from the single block of the top level. */
+static int hash_root_block(int fd, uint64_t block, uint8_t *calculated_digest, const uint8_t *salt)
+{
+	g_autofree uint8_t *buffer = g_malloc(data_block_size);
+	g_autoptr(GError) ierror = NULL;
+	EVP_MD_CTX *mdctx = NULL;
+	int r;
+
+	if (!r_pread_exact(fd, buffer, data_block_size, block * data_block_size, &ierror)) {
+		g_debug("Cannot read top level block: %s", ierror->message);
+		return -EIO;
 	}
 
-	return 0;
+	mdctx = EVP_MD_CTX_new();
+	r = verify_hash_block(mdctx, calculated_digest, buffer, salt);
+	EVP_MD_CTX_free(mdctx);
+
+	return r ? -EINVAL : 0;
 }
 
 /*
  * Verifies or creates a dm-verity hash (tree)
  *
+ * Each level is split into ranges which are hashed in parallel, the levels
+ * themselves are processed in order, as each depends on the one below.
+ *
  * @param verify 0 -> create hash, 1 -> verify hash
  * @param fd file descriptor (FD) of file to create verity hash tree for (verify=0) or FD of file to verify (verify=1)
  * @param data_blocks number of data blocks (of size 4096 bytes)
@@ -290,15 +334,12 @@ static int verity_create_or_verify_hash(
 		uint8_t *root_hash,
 		const uint8_t *salt)
 {
-	g_autofree gchar *file = NULL;
 	uint64_t hash_position = data_blocks;
 	uint8_t calculated_digest[digest_size];
-	FILE *data_file = NULL;
-	FILE *hash_file = NULL, *hash_file_2;
 	uint64_t hash_level_block[VERITY_MAX_LEVELS];
 	uint64_t hash_level_size[VERITY_MAX_LEVELS];
 	uint64_t data_device_size = 0, hash_device_size = 0;
-	int levels, i, r;
+	int levels, i, r = 0;
 
 	g_debug("Hash %s %s, data blocks %" PRIu64 ".",
 			verify ? "verification" : "creation", "SHA256",
@@ -324,71 +365,32 @@ static int verity_create_or_verify_hash(
 	if (combined_blocks)
 		*combined_blocks = hash_position;
 
-	file = g_strdup_printf("/proc/self/fd/%d", fd);
-
 	g_debug("Data size: %" PRIu64 " bytes.",
 			data_device_size);
-	data_file = fopen(file, "r");
-	if (!data_file) {
-		g_message("Cannot open file %s.",
-				file
-				);
-		r = -EIO;
-		goto out;
-	}
-
 	g_debug("Hashed size: %" PRIu64 " bytes.",
 			hash_device_size);
-	hash_file = fopen(file, verify ? "r" : "r+");
-	if (!hash_file) {
-		g_message("Cannot open file %s.",
-				file);
-		r = -EIO;
-		goto out;
-	}
 
 	memset(calculated_digest, 0, digest_size);
 
 	for (i = 0; i < levels; i++) {
-		if (!i) {
-			r = create_or_verify(data_file, hash_file,
+		if (!i)
+			r = create_or_verify_level(fd,
 					0,
 					hash_level_block[i],
-					data_blocks, verify,
-					calculated_digest, salt);
-			if (r)
-				goto out;
-		} else {
-			hash_file_2 = fopen(file, "r");
-			if (!hash_file_2) {
-				g_message("Cannot open device %s.",
-						file);
-				r = -EIO;
-				goto out;
-			}
-			r = create_or_verify(hash_file_2, hash_file,
+					data_blocks, verify, salt);
+		else
+			r = create_or_verify_level(fd,
 					hash_level_block[i - 1],
 					hash_level_block[i],
-					hash_level_size[i - 1], verify,
-					calculated_digest, salt);
-			fclose(hash_file_2);
-			if (r)
-				goto out;
-		}
+					hash_level_size[i - 1], verify, salt);
+		if (r)
+			goto out;
 	}
 
 	if (levels)
-		r = create_or_verify(hash_file, NULL,
-				hash_level_block[levels - 1],
-				0,
-				1, verify,
-				calculated_digest, salt);
+		r = hash_root_block(fd, hash_level_block[levels - 1], calculated_digest, salt);
 	else
-		r = create_or_verify(data_file, NULL,
-				0,
-				0,
-				data_blocks, verify,
-				calculated_digest, salt);
+		r = hash_root_block(fd, 0, calculated_digest, salt);
 out:
 	if (verify) {
 		if (r)
@@ -411,10 +413,6 @@ out:
 		}
 	}
 
-	if (data_file)
-		fclose(data_file);
-	if (hash_file)
-		fclose(hash_file);
 	return r;
 }
 
@@ -436,3 +434,102 @@ int r_verity_hash_verify(
 {
 	return verity_create_or_verify_hash(1, fd, data_blocks, NULL, root_hash, salt);
 }
+
+int r_verity_hash_data_blocks(
+		const uint8_t *data,
+		uint64_t count,
+		uint8_t *digests,
+		const uint8_t *salt)
+{
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+	int r = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		r = verify_hash_block(mdctx, digests + i * digest_size, data + i * data_block_size, salt);
+		if (r)
+			break;
+	}
+
+	EVP_MD_CTX_free(mdctx);
+
+	return r;
+}
+
+int r_verity_hash_create_from_digests(
+		int fd,
+		uint64_t data_blocks,
+		const uint8_t *digests,
+		uint64_t *combined_blocks,
+		uint8_t *root_hash,
+		const uint8_t *salt)
+{
+	uint64_t hash_position = data_blocks;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
+	size_t digest_size_full = 1 << get_bits_up(digest_size);
+	g_autofree uint8_t *below = NULL;
+	g_autoptr(GError) ierror = NULL;
+	EVP_MD_CTX *mdctx = NULL;
+	int levels, r = 0;
+
+	g_debug("Hash creation %s from digests, data blocks %" PRIu64 ".",
+			"SHA256", data_blocks);
+
+	if (hash_levels(data_blocks, &hash_position,
+			&levels, &hash_level_block[0], &hash_level_size[0])) {
+		g_message("Hash area overflow.");
+		return -EINVAL;
+	}
+
+	g_debug("Using %d hash levels.", levels);
+
+	if (combined_blocks)
+		*combined_blocks = hash_position;
+
+	/* the root hash of a single block is its digest */
+	if (!levels) {
+		memcpy(root_hash, digests, digest_size);
+		return 0;
+	}
+
+	/* each level is built in memory from the one below, the lowest one
+	 * from the digests of the data blocks */
+	mdctx = EVP_MD_CTX_new();
+	for (int i = 0; i < levels; i++) {
+		uint64_t entries = i ? hash_level_size[i - 1] : data_blocks;
+		g_autofree uint8_t *level = g_malloc0(hash_level_size[i] * hash_block_size);
+
+		for (uint64_t j = 0; j < entries; j++) {
+			uint8_t *digest = level + (j / hash_per_block) * hash_block_size +
+			                  (j % hash_per_block) * digest_size_full;
+
+			if (!i) {
+				memcpy(digest, digests + j * digest_size, digest_size);
+				continue;
+			}
+			if (verify_hash_block(mdctx, digest, below + j * hash_block_size, salt)) {
+				r = -EINVAL;
+				goto out;
+			}
+		}
+
+		if (!r_pwrite_exact(fd, level, hash_level_size[i] * hash_block_size,
+				hash_level_block[i] * hash_block_size, &ierror)) {
+			g_message("Cannot write hash level %d: %s", i, ierror->message);
+			r = -EIO;
+			goto out;
+		}
+
+		g_free(below);
+		below = g_steal_pointer(&level);
+	}
+
+	if (verify_hash_block(mdctx, root_hash, below, salt))
+		r = -EINVAL;
+
+out:
+	EVP_MD_CTX_free(mdctx);
+
+	return r;
+}
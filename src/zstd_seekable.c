@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "context.h"
+#include "resources.h"
+#include "utils.h"
+#include "zstd_seekable.h"
+
+G_DEFINE_QUARK(r-zstd-error-quark, r_zstd_error)
+
+/* see contrib/seekable_format/zstd_seekable_compression_format.md from zstd */
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_FOOTER_MAGIC 0x8F92EAB1
+#define SEEKABLE_HEADER_SIZE 8
+#define SEEKABLE_FOOTER_SIZE 9
+#define SEEKABLE_CHECKSUM_FLAG 0x80
+#define SEEKABLE_RESERVED_BITS 0x7c
+
+struct _RaucZstdSeekable {
+	int fd;
+	guint32 n_frames;
+	/* n_frames + 1 entries, the last one being the total size */
+	guint64 *c_offsets;
+	guint64 *d_offsets;
+
+	/* single frame cache for r_zstd_seekable_pread() */
+	ZSTD_DCtx *dctx;
+	guint8 *cbuf;
+	guint8 *frame;
+	gint64 cached_frame;
+};
+
+static guint32 get_le32(const guint8 *data)
+{
+	guint32 value;
+
+	memcpy(&value, data, sizeof(value));
+	return GUINT32_FROM_LE(value);
+}
+
+static void put_le32(guint8 *data, guint32 value)
+{
+	value = GUINT32_TO_LE(value);
+	memcpy(data, &value, sizeof(value));
+}
+
+gboolean r_zstd_is_seekable(int fd)
+{
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+
+	/* the footer magic alone could be part of arbitrary data */
+	zs = r_zstd_seekable_open(fd, NULL);
+
+	return zs != NULL;
+}
+
+RaucZstdSeekable *r_zstd_seekable_open(int fd, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	g_autofree guint8 *table = NULL;
+	guint8 footer[SEEKABLE_FOOTER_SIZE];
+	guint8 header[SEEKABLE_HEADER_SIZE];
+	guint64 table_size, data_size;
+	gsize entry_size;
+	struct stat st;
+
+	g_return_val_if_fail(fd >= 0, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat image: %s", g_strerror(err));
+		return NULL;
+	}
+	if (st.st_size < SEEKABLE_HEADER_SIZE + SEEKABLE_FOOTER_SIZE) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Image too small for a seekable zstd image");
+		return NULL;
+	}
+
+	if (!r_pread_exact(fd, footer, sizeof(footer), st.st_size - sizeof(footer), &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read seek table footer: ");
+		return NULL;
+	}
+	if (get_le32(footer + 5) != SEEKABLE_FOOTER_MAGIC) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Invalid seek table magic 0x%08x", get_le32(footer + 5));
+		return NULL;
+	}
+	if (footer[4] & SEEKABLE_RESERVED_BITS) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Unsupported seek table descriptor 0x%02x", footer[4]);
+		return NULL;
+	}
+
+	zs = g_new0(RaucZstdSeekable, 1);
+	zs->fd = fd;
+	zs->cached_frame = -1;
+	zs->n_frames = get_le32(footer);
+
+	/* the table is bounded by the file size, so it can be read at once */
+	entry_size = (footer[4] & SEEKABLE_CHECKSUM_FLAG) ? 12 : 8;
+	table_size = (guint64)zs->n_frames * entry_size;
+	if (table_size + SEEKABLE_HEADER_SIZE + SEEKABLE_FOOTER_SIZE > (guint64)st.st_size) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Seek table with %u frames exceeds image size", zs->n_frames);
+		return NULL;
+	}
+	data_size = st.st_size - table_size - SEEKABLE_HEADER_SIZE - SEEKABLE_FOOTER_SIZE;
+
+	if (!r_pread_exact(fd, header, sizeof(header), data_size, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read seek table header: ");
+		return NULL;
+	}
+	if (get_le32(header) != SEEKABLE_SKIPPABLE_MAGIC ||
+	    get_le32(header + 4) != table_size + SEEKABLE_FOOTER_SIZE) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Invalid seek table frame header");
+		return NULL;
+	}
+
+	table = g_malloc(table_size ? table_size : 1);
+	if (!r_pread_exact(fd, table, table_size, data_size + SEEKABLE_HEADER_SIZE, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read seek table: ");
+		return NULL;
+	}
+
+	zs->c_offsets = g_new0(guint64, zs->n_frames + 1);
+	zs->d_offsets = g_new0(guint64, zs->n_frames + 1);
+	for (guint32 i = 0; i < zs->n_frames; i++) {
+		guint32 c_size = get_le32(table + i * entry_size);
+		guint32 d_size = get_le32(table + i * entry_size + 4);
+
+		if (c_size == 0 || c_size > ZSTD_compressBound(R_ZSTD_MAX_FRAME_SIZE) ||
+		    d_size > R_ZSTD_MAX_FRAME_SIZE) {
+			g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+					"Invalid size of frame %u", i);
+			return NULL;
+		}
+		zs->c_offsets[i + 1] = zs->c_offsets[i] + c_size;
+		zs->d_offsets[i + 1] = zs->d_offsets[i] + d_size;
+	}
+
+	if (zs->c_offsets[zs->n_frames] != data_size) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Seek table covers %"G_GUINT64_FORMAT " of %"G_GUINT64_FORMAT " compressed bytes",
+				zs->c_offsets[zs->n_frames], data_size);
+		return NULL;
+	}
+
+	/* the data must start with a zstd frame */
+	if (zs->n_frames) {
+		guint8 magic[4];
+
+		if (!r_pread_exact(fd, magic, sizeof(magic), 0, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read first frame: ");
+			return NULL;
+		}
+		if (get_le32(magic) != ZSTD_MAGICNUMBER) {
+			g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+					"Invalid zstd frame magic 0x%08x", get_le32(magic));
+			return NULL;
+		}
+	}
+
+	return g_steal_pointer(&zs);
+}
+
+guint64 r_zstd_seekable_get_size(const RaucZstdSeekable *zs)
+{
+	g_return_val_if_fail(zs, 0);
+
+	return zs->d_offsets[zs->n_frames];
+}
+
+/*
+ * Reads and decompresses a single frame into 'out', which must be large
+ * enough for the uncompressed frame size.
+ */
+static gboolean decompress_frame(const RaucZstdSeekable *zs, ZSTD_DCtx *dctx, guint32 frame, guint8 *cbuf, guint8 *out, GError **error)
+{
+	GError *ierror = NULL;
+	gsize c_size = zs->c_offsets[frame + 1] - zs->c_offsets[frame];
+	gsize d_size = zs->d_offsets[frame + 1] - zs->d_offsets[frame];
+	gsize res;
+
+	if (!r_pread_exact(zs->fd, cbuf, c_size, zs->c_offsets[frame], &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read frame %u: ", frame);
+		return FALSE;
+	}
+
+	res = ZSTD_decompressDCtx(dctx, out, d_size, cbuf, c_size);
+	if (ZSTD_isError(res)) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Failed to decompress frame %u: %s", frame, ZSTD_getErrorName(res));
+		return FALSE;
+	}
+	if (res != d_size) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Frame %u decompressed to %"G_GSIZE_FORMAT " instead of %"G_GSIZE_FORMAT " bytes",
+				frame, res, d_size);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Returns the index of the frame containing the uncompressed offset. */
+static guint32 find_frame(const RaucZstdSeekable *zs, guint64 offset)
+{
+	guint32 lo = 0, hi = zs->n_frames;
+
+	while (hi - lo > 1) {
+		guint32 mid = lo + (hi - lo) / 2;
+
+		if (zs->d_offsets[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+gboolean r_zstd_seekable_pread(RaucZstdSeekable *zs, guint8 *data, gsize size, guint64 offset, GError **error)
+{
+	g_return_val_if_fail(zs, FALSE);
+	g_return_val_if_fail(data || size == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (offset > r_zstd_seekable_get_size(zs) || size > r_zstd_seekable_get_size(zs) - offset) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_FAILED,
+				"Read of %"G_GSIZE_FORMAT " bytes at %"G_GUINT64_FORMAT " exceeds image size", size, offset);
+		return FALSE;
+	}
+
+	if (!zs->dctx) {
+		zs->dctx = ZSTD_createDCtx();
+		if (!zs->dctx)
+			g_error("Failed to allocate zstd decompression context");
+		zs->cbuf = g_malloc(ZSTD_compressBound(R_ZSTD_MAX_FRAME_SIZE));
+		zs->frame = g_malloc(R_ZSTD_MAX_FRAME_SIZE);
+	}
+
+	while (size) {
+		guint32 frame = find_frame(zs, offset);
+		gsize skip, len;
+
+		if (zs->cached_frame != frame) {
+			zs->cached_frame = -1;
+			if (!decompress_frame(zs, zs->dctx, frame, zs->cbuf, zs->frame, error))
+				return FALSE;
+			zs->cached_frame = frame;
+		}
+
+		skip = offset - zs->d_offsets[frame];
+		len = MIN(size, zs->d_offsets[frame + 1] - offset);
+		memcpy(data, zs->frame + skip, len);
+
+		data += len;
+		offset += len;
+		size -= len;
+	}
+
+	return TRUE;
+}
+
+/* State shared by all workers of r_zstd_seekable_write() */
+typedef struct {
+	const RaucZstdSeekable *zs;
+	int out_fd;
+	gint next_frame; /* accessed atomically */
+	gint failed; /* accessed atomically */
+	GMutex lock; /* protects the fields below */
+	GCond cond;
+	guint32 done_frames;
+	guint running;
+	GError *error;
+} RZstdJob;
+
+static void zstd_job_fail(RZstdJob *job, GError *ierror)
+{
+	g_atomic_int_set(&job->failed, 1);
+
+	g_mutex_lock(&job->lock);
+	if (!job->error)
+		job->error = ierror;
+	else
+		g_error_free(ierror);
+	g_mutex_unlock(&job->lock);
+}
+
+/*
+ * Worker thread for r_zstd_seekable_write().
+ *
+ * Frames are independent, so each worker claims the next one, decompresses
+ * it with its own context and writes it at its uncompressed offset.
+ */
+static gpointer zstd_worker_thread(gpointer data)
+{
+	RZstdJob *job = data;
+	const RaucZstdSeekable *zs = job->zs;
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	g_autofree guint8 *cbuf = g_malloc(ZSTD_compressBound(R_ZSTD_MAX_FRAME_SIZE));
+	g_autofree guint8 *out = g_malloc(R_ZSTD_MAX_FRAME_SIZE);
+	GError *ierror = NULL;
+
+	if (!dctx)
+		g_error("Failed to allocate zstd decompression context");
+
+	while (!g_atomic_int_get(&job->failed)) {
+		guint32 frame = g_atomic_int_add(&job->next_frame, 1);
+		gsize d_size;
+
+		if (frame >= zs->n_frames)
+			break;
+		d_size = zs->d_offsets[frame + 1] - zs->d_offsets[frame];
+
+		if (!decompress_frame(zs, dctx, frame, cbuf, out, &ierror)) {
+			zstd_job_fail(job, ierror);
+			break;
+		}
+
+		r_resources_throttle_write(d_size);
+
+		if (!r_pwrite_exact(job->out_fd, out, d_size, zs->d_offsets[frame], &ierror)) {
+			zstd_job_fail(job, ierror);
+			break;
+		}
+
+		g_mutex_lock(&job->lock);
+		job->done_frames++;
+		g_cond_signal(&job->cond);
+		g_mutex_unlock(&job->lock);
+	}
+
+	ZSTD_freeDCtx(dctx);
+
+	g_mutex_lock(&job->lock);
+	job->running--;
+	g_cond_signal(&job->cond);
+	g_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+gboolean r_zstd_seekable_write(RaucZstdSeekable *zs, int out_fd, GError **error)
+{
+	RZstdJob job = {0};
+	g_autoptr(GPtrArray) threads = g_ptr_array_new();
+	gint last_percent = -1;
+	guint n_threads;
+
+	g_return_val_if_fail(zs, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (zs->n_frames >= G_MAXINT) {
+		g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID,
+				"Too many frames (%u)", zs->n_frames);
+		return FALSE;
+	}
+
+	job.zs = zs;
+	job.out_fd = out_fd;
+	g_mutex_init(&job.lock);
+	g_cond_init(&job.cond);
+
+	n_threads = MIN((guint32)g_get_num_processors(), zs->n_frames);
+	n_threads = MAX(n_threads, 1);
+	job.running = n_threads;
+	for (guint i = 0; i < n_threads; i++)
+		g_ptr_array_add(threads, g_thread_new("zstd-worker", zstd_worker_thread, &job));
+
+	/* progress is reported from this thread, as the progress state is not shared with the workers */
+	g_mutex_lock(&job.lock);
+	while (job.running) {
+		gint percent;
+
+		g_cond_wait(&job.cond, &job.lock);
+		percent = zs->n_frames ? (guint64)job.done_frames * 100 / zs->n_frames : 100;
+		g_mutex_unlock(&job.lock);
+
+		/* emit progress info (but only when in progress context) */
+		if (r_context()->progress && percent != last_percent) {
+			last_percent = percent;
+			r_context_set_step_percentage("copy_image", percent);
+		}
+
+		g_mutex_lock(&job.lock);
+	}
+	g_mutex_unlock(&job.lock);
+
+	for (guint i = 0; i < threads->len; i++)
+		g_thread_join(g_ptr_array_index(threads, i));
+
+	g_cond_clear(&job.cond);
+	g_mutex_clear(&job.lock);
+
+	if (job.error) {
+		g_propagate_error(error, job.error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void r_zstd_seekable_free(RaucZstdSeekable *zs)
+{
+	if (!zs)
+		return;
+
+	if (zs->dctx)
+		ZSTD_freeDCtx(zs->dctx);
+	g_free(zs->cbuf);
+	g_free(zs->frame);
+	g_free(zs->c_offsets);
+	g_free(zs->d_offsets);
+	g_free(zs);
+}
+
+gboolean r_zstd_seekable_create(const gchar *inpath, const gchar *outpath, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GByteArray) table = g_byte_array_new();
+	g_autofree guint8 *in = NULL;
+	g_autofree guint8 *out = NULL;
+	ZSTD_CCtx *cctx = NULL;
+	gsize out_size = ZSTD_compressBound(R_ZSTD_FRAME_SIZE);
+	guint8 entry[8];
+	guint32 n_frames = 0;
+	struct stat st;
+	gboolean res = FALSE;
+	int in_fd, out_fd = -1;
+
+	g_return_val_if_fail(inpath, FALSE);
+	g_return_val_if_fail(outpath, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	in_fd = g_open(inpath, O_RDONLY | O_CLOEXEC);
+	if (in_fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", inpath, g_strerror(err));
+		return FALSE;
+	}
+
+	if (fstat(in_fd, &st) == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", inpath, g_strerror(err));
+		goto out;
+	}
+
+	out_fd = g_open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out_fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create %s: %s", outpath, g_strerror(err));
+		goto out;
+	}
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		g_error("Failed to allocate zstd compression context");
+	in = g_malloc(R_ZSTD_FRAME_SIZE);
+	out = g_malloc(out_size);
+
+	/* skippable frame header, the size is filled in once the frame count is known */
+	put_le32(entry, SEEKABLE_SKIPPABLE_MAGIC);
+	g_byte_array_append(table, entry, 4);
+	g_byte_array_append(table, entry, 4);
+
+	for (goffset pos = 0; pos < st.st_size; pos += R_ZSTD_FRAME_SIZE) {
+		gsize len = MIN(R_ZSTD_FRAME_SIZE, st.st_size - pos);
+		gsize c_size;
+
+		if (!r_read_exact(in_fd, in, len, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read %s: ", inpath);
+			goto out;
+		}
+
+		c_size = ZSTD_compressCCtx(cctx, out, out_size, in, len, ZSTD_CLEVEL_DEFAULT);
+		if (ZSTD_isError(c_size)) {
+			g_set_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_FAILED,
+					"Failed to compress %s: %s", inpath, ZSTD_getErrorName(c_size));
+			goto out;
+		}
+
+		if (!r_write_exact(out_fd, out, c_size, &ierror))
+			goto write_error;
+
+		put_le32(entry, c_size);
+		put_le32(entry + 4, len);
+		g_byte_array_append(table, entry, 8);
+		n_frames++;
+	}
+
+	/* footer without per-frame checksums, the bundle signature already protects the image */
+	put_le32(entry, n_frames);
+	g_byte_array_append(table, entry, 4);
+	entry[0] = 0;
+	g_byte_array_append(table, entry, 1);
+	put_le32(entry, SEEKABLE_FOOTER_MAGIC);
+	g_byte_array_append(table, entry, 4);
+	put_le32(table->data + 4, table->len - SEEKABLE_HEADER_SIZE);
+
+	if (!r_write_exact(out_fd, table->data, table->len, &ierror))
+		goto write_error;
+
+	res = TRUE;
+	goto out;
+
+write_error:
+	g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", outpath);
+out:
+	if (cctx)
+		ZSTD_freeCCtx(cctx);
+	g_close(in_fd, NULL);
+	if (out_fd != -1)
+		g_close(out_fd, NULL);
+	if (!res && out_fd != -1)
+		g_unlink(outpath);
+	return res;
+}
@@ -0,0 +1,115 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+#include "build_cache.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *cachedir;
+	gchar *imagepath;
+	gchar *indexpath;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->cachedir = g_build_filename(fixture->tmpdir, "cache", NULL);
+	fixture->imagepath = g_build_filename(fixture->tmpdir, "image.img", NULL);
+	fixture->indexpath = g_build_filename(fixture->tmpdir, "image.img.block-hash-index", NULL);
+
+	g_assert_true(g_file_set_contents(fixture->imagepath, "image", -1, NULL));
+	g_assert_true(g_file_set_contents(fixture->indexpath, "index", -1, NULL));
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tmpdir);
+	g_free(fixture->cachedir);
+	g_free(fixture->imagepath);
+	g_free(fixture->indexpath);
+}
+
+static void test_store_lookup(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *key = NULL;
+	g_autofree gchar *contents = NULL;
+	RaucChecksum checksum = {
+		.type = G_CHECKSUM_SHA256,
+		.digest = (gchar *)"6105d6cc76af400325e94d588ce511be5bfdbb73b437dc51eca43917d7a43e3d",
+		.size = 5,
+	};
+	RaucChecksum cached = {0};
+
+	key = r_build_cache_key(fixture->imagepath, G_CHECKSUM_SHA256, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(key);
+
+	/* nothing cached yet */
+	g_assert_false(r_build_cache_lookup(fixture->cachedir, key, &cached, NULL));
+
+	r_build_cache_store(fixture->cachedir, key, &checksum, fixture->indexpath);
+	g_assert_true(g_file_test(fixture->cachedir, G_FILE_TEST_IS_DIR));
+
+	/* the index is restored from the cache */
+	g_assert_cmpint(g_unlink(fixture->indexpath), ==, 0);
+	g_assert_true(r_build_cache_lookup(fixture->cachedir, key, &cached, fixture->indexpath));
+	g_assert_cmpstr(cached.digest, ==, checksum.digest);
+	g_assert_cmpint(cached.size, ==, checksum.size);
+	g_assert_cmpint(cached.type, ==, checksum.type);
+	g_assert_true(g_file_get_contents(fixture->indexpath, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "index");
+
+	g_free(cached.digest);
+}
+
+static void test_key_changes(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *key = NULL;
+	g_autofree gchar *same = NULL;
+	g_autofree gchar *other_type = NULL;
+	g_autofree gchar *modified = NULL;
+
+	key = r_build_cache_key(fixture->imagepath, G_CHECKSUM_SHA256, &error);
+	g_assert_no_error(error);
+	same = r_build_cache_key(fixture->imagepath, G_CHECKSUM_SHA256, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(key, ==, same);
+
+	other_type = r_build_cache_key(fixture->imagepath, G_CHECKSUM_SHA512, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(key, !=, other_type);
+
+	/* rewriting the file changes at least the change time */
+	g_usleep(10000);
+	g_assert_true(g_file_set_contents(fixture->imagepath, "IMAGE", -1, NULL));
+	modified = r_build_cache_key(fixture->imagepath, G_CHECKSUM_SHA256, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(key, !=, modified);
+
+	g_assert_null(r_build_cache_key("/nonexistent/image.img", G_CHECKSUM_SHA256, &error));
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/build_cache/store-lookup", Fixture, NULL, fixture_set_up, test_store_lookup, fixture_tear_down);
+	g_test_add("/build_cache/key-changes", Fixture, NULL, fixture_set_up, test_key_changes, fixture_tear_down);
+
+	return g_test_run();
+}
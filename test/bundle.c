@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <locale.h>
 #include <glib.h>
@@ -8,7 +9,9 @@
 #include <context.h>
 #include <manifest.h>
 #include <signature.h>
+#include <sparse.h>
 #include <utils.h>
+#include <verity_hash.h>
 
 #include "common.h"
 
@@ -396,6 +399,685 @@ static void bundle_test_check_casync_new(BundleFixture *fixture, gconstpointer u
 // Hack to pull-in context for testing modification
 extern RaucContext *context;
 
+static const gchar *dedup_manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs-a.img\n\
+\n\
+[image.appfs]\n\
+filename=appfs.img\n\
+\n\
+[image.bootloader]\n\
+filename=rootfs-b.img\n\
+";
+
+/* rootfs-a.img and rootfs-b.img have the same content */
+static void prepare_dedup_content(BundleFixture *fixture)
+{
+	g_autofree gchar *pathname = NULL;
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	pathname = write_random_file(fixture->contentdir, "rootfs-a.img", 64*1024, 42);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_random_file(fixture->contentdir, "rootfs-b.img", 64*1024, 42);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_random_file(fixture->contentdir, "appfs.img", 64*1024, 23);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", dedup_manifest_file, NULL);
+	g_assert_nonnull(pathname);
+}
+
+/* Creates a bundle from fixture->contentdir. */
+static void create_content_bundle(BundleFixture *fixture, const gchar *bundlename)
+{
+	r_context()->config->keyring_check_crl = FALSE;
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+			"Detected CRL but CRL checking is disabled!");
+	test_create_bundle(fixture->contentdir, bundlename);
+	r_context()->config->keyring_check_crl = TRUE;
+}
+
+static void bundle_test_dedup_images(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *filepath = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res = FALSE;
+
+	prepare_dedup_content(fixture);
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	/* the content directory itself is left untouched */
+	filepath = g_build_filename(fixture->contentdir, "rootfs-b.img", NULL);
+	g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+	g_clear_pointer(&filepath, g_free);
+
+	/* the source manifest keeps the original filenames */
+	filepath = g_build_filename(fixture->contentdir, "manifest.raucm", NULL);
+	res = load_manifest_file(filepath, &manifest, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (g_str_equal(image->slotclass, "bootloader"))
+			g_assert_cmpstr(image->filename, ==, "rootfs-b.img");
+	}
+	g_clear_pointer(&manifest, free_manifest);
+	g_clear_pointer(&filepath, g_free);
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	filepath = g_build_filename(outputdir, "rootfs-a.img", NULL);
+	g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+	g_clear_pointer(&filepath, g_free);
+
+	filepath = g_build_filename(outputdir, "appfs.img", NULL);
+	g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+	g_clear_pointer(&filepath, g_free);
+
+	filepath = g_build_filename(outputdir, "rootfs-b.img", NULL);
+	g_assert_false(g_file_test(filepath, G_FILE_TEST_EXISTS));
+	g_clear_pointer(&filepath, g_free);
+
+	/* both images refer to the single stored file */
+	filepath = g_build_filename(outputdir, "manifest.raucm", NULL);
+	res = load_manifest_file(filepath, &manifest, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpuint(g_list_length(manifest->images), ==, 3);
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (g_str_equal(image->slotclass, "appfs"))
+			g_assert_cmpstr(image->filename, ==, "appfs.img");
+		else
+			g_assert_cmpstr(image->filename, ==, "rootfs-a.img");
+	}
+}
+
+/* Tests that identical images with different extensions or with slot hooks
+ * keep their own files, as the extension selects the update handler and hooks
+ * get the filename. */
+static void bundle_test_dedup_images_keep_names(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *pathname = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res = FALSE;
+	const gchar *files[] = {"boot.vfat", "boot.img", "rootfs-a.img", "rootfs-b.img", NULL};
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[hooks]\n\
+filename=hook.sh\n\
+\n\
+[image.bootloader]\n\
+filename=boot.vfat\n\
+\n\
+[image.rescue]\n\
+filename=boot.img\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs-a.img\n\
+\n\
+[image.appfs]\n\
+filename=rootfs-b.img\n\
+hooks=post-install\n\
+";
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	for (const gchar **file = files; *file != NULL; file++) {
+		pathname = write_random_file(fixture->contentdir, *file, 64*1024, 42);
+		g_assert_nonnull(pathname);
+		g_clear_pointer(&pathname, g_free);
+	}
+	pathname = write_tmp_file(fixture->contentdir, "hook.sh", "#!/bin/sh\n", NULL);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	for (GList *l = bundle->manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (g_str_equal(image->slotclass, "bootloader"))
+			g_assert_cmpstr(image->filename, ==, "boot.vfat");
+		else if (g_str_equal(image->slotclass, "rescue"))
+			g_assert_cmpstr(image->filename, ==, "boot.img");
+		else if (g_str_equal(image->slotclass, "rootfs"))
+			g_assert_cmpstr(image->filename, ==, "rootfs-a.img");
+		else
+			g_assert_cmpstr(image->filename, ==, "rootfs-b.img");
+	}
+
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	for (const gchar **file = files; *file != NULL; file++) {
+		g_autofree gchar *filepath = g_build_filename(outputdir, *file, NULL);
+		g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+	}
+}
+
+/* Tests that a changed duplicate is stored again when rebuilding from the
+ * same content directory. */
+static void bundle_test_dedup_images_rebuild(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *rebuiltname = NULL;
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *filepath = NULL;
+	g_autofree gchar *pathname = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GError) ierror = NULL;
+	const gchar *rootfs_digest = NULL;
+	gboolean res = FALSE;
+
+	prepare_dedup_content(fixture);
+	rebuiltname = g_build_filename(fixture->tmpdir, "rebuilt.raucb", NULL);
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	/* rootfs-b.img is no longer a duplicate */
+	pathname = write_random_file(fixture->contentdir, "rootfs-b.img", 64*1024, 7);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, rebuiltname);
+
+	res = check_bundle(rebuiltname, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	filepath = g_build_filename(outputdir, "rootfs-b.img", NULL);
+	g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+	g_clear_pointer(&filepath, g_free);
+
+	filepath = g_build_filename(outputdir, "manifest.raucm", NULL);
+	res = load_manifest_file(filepath, &manifest, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (g_str_equal(image->slotclass, "rootfs")) {
+			g_assert_cmpstr(image->filename, ==, "rootfs-a.img");
+			rootfs_digest = image->checksum.digest;
+		}
+	}
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (g_str_equal(image->slotclass, "bootloader")) {
+			g_assert_cmpstr(image->filename, ==, "rootfs-b.img");
+			g_assert_cmpstr(image->checksum.digest, !=, rootfs_digest);
+		}
+	}
+}
+
+/* Tests that sparse images are converted without modifying the content
+ * directory. */
+static void bundle_test_sparse_staging(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *pathname = NULL;
+	g_autofree gchar *filepath = NULL;
+	g_autofree gchar *original = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gsize original_len, len;
+	gboolean res = FALSE;
+	int fd;
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n\
+sparse=true\n\
+";
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	pathname = write_random_file(fixture->contentdir, "rootfs.img", 64*1024, 42);
+	g_assert_nonnull(pathname);
+	g_assert_true(g_file_get_contents(pathname, &original, &original_len, NULL));
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	/* the image in the content directory is left untouched */
+	filepath = g_build_filename(fixture->contentdir, "rootfs.img", NULL);
+	g_assert_true(g_file_get_contents(filepath, &contents, &len, NULL));
+	g_assert_cmpmem(contents, len, original, original_len);
+	g_clear_pointer(&filepath, g_free);
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* the bundle contains the converted image */
+	filepath = g_build_filename(outputdir, "rootfs.img", NULL);
+	fd = g_open(filepath, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_true(r_sparse_is_sparse(fd));
+	g_close(fd, NULL);
+}
+
+/* Checks that the verity parameters in the manifest match a hash tree
+ * created by r_verity_hash_create() for the final payload. */
+static void assert_verity_payload(BundleFixture *fixture)
+{
+	g_autofree gchar *payloadpath = g_build_filename(fixture->tmpdir, "payload", NULL);
+	g_autofree gchar *bundle_data = NULL;
+	g_autofree gchar *payload_data = NULL;
+	g_autofree gchar *root_hash = NULL;
+	g_autofree guint8 *salt = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	guint8 hash[32] = {0};
+	uint64_t combined_blocks = 0;
+	gsize bundle_len, payload_len;
+	goffset data_size;
+	gboolean res = FALSE;
+	int fd;
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(bundle->manifest->bundle_verity_hash);
+	data_size = bundle->size - bundle->manifest->bundle_verity_size;
+	g_assert_cmpint(data_size % 4096, ==, 0);
+
+	/* keep the squashfs only and create the hash tree again */
+	g_assert_true(g_file_get_contents(fixture->bundlename, &bundle_data, &bundle_len, NULL));
+	g_assert_cmpint(bundle_len, >=, bundle->size);
+	g_assert_true(g_file_set_contents(payloadpath, bundle_data, data_size, NULL));
+
+	salt = r_hex_decode(bundle->manifest->bundle_verity_salt, 32);
+	g_assert_nonnull(salt);
+	fd = g_open(payloadpath, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >, 0);
+	g_assert_cmpint(r_verity_hash_create(fd, data_size / 4096, &combined_blocks, hash, salt), ==, 0);
+	g_close(fd, NULL);
+
+	root_hash = r_hex_encode(hash, sizeof(hash));
+	g_assert_cmpstr(root_hash, ==, bundle->manifest->bundle_verity_hash);
+	g_assert_cmpint(combined_blocks * 4096, ==, bundle->size);
+
+	g_assert_true(g_file_get_contents(payloadpath, &payload_data, &payload_len, NULL));
+	g_assert_cmpmem(payload_data, payload_len, bundle_data, bundle->size);
+}
+
+/* Tests that the hash tree created while mksquashfs writes the payload
+ * matches the one created afterwards. */
+static void bundle_test_verity_tail(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *pathname = NULL;
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n\
+\n\
+[image.appfs]\n\
+filename=appfs.img\n\
+";
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	/* more than one chunk of the verity tail hasher */
+	pathname = write_random_file(fixture->contentdir, "rootfs.img", 2*1024*1024, 42);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_random_file(fixture->contentdir, "appfs.img", 64*1024, 23);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	assert_verity_payload(fixture);
+}
+
+/* Tests the hash tree for a payload with duplicate files, which mksquashfs
+ * may rewind over. */
+static void bundle_test_verity_tail_duplicates(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *pathname = NULL;
+	g_autofree gchar *subdir = NULL;
+
+	prepare_dedup_content(fixture);
+
+	/* files not referenced by the manifest are not deduplicated by rauc */
+	pathname = write_random_file(fixture->contentdir, "data-a.bin", 1024*1024, 7);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	subdir = g_build_filename(fixture->contentdir, "extra", NULL);
+	g_assert_cmpint(g_mkdir(subdir, 0777), ==, 0);
+	pathname = write_random_file(subdir, "data-b.bin", 1024*1024, 7);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	assert_verity_payload(fixture);
+}
+
+/* Tests the hash tree for a payload with identical image files, which are
+ * stored separately due to their different extensions. */
+static void bundle_test_verity_tail_duplicate_images(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *pathname = NULL;
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.bootloader]\n\
+filename=boot.vfat\n\
+\n\
+[image.rescue]\n\
+filename=boot.img\n\
+";
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	pathname = write_random_file(fixture->contentdir, "boot.vfat", 1024*1024, 42);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_random_file(fixture->contentdir, "boot.img", 1024*1024, 42);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	assert_verity_payload(fixture);
+}
+
+/* Tests that an image file shared by several images is hashed once, with a
+ * single block-hash-index. */
+static void bundle_test_shared_image_file(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *pathname = NULL;
+	g_autofree gchar *filepath = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	RaucImage *rootfs, *appfs;
+	gboolean res = FALSE;
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=shared.img\n\
+adaptive=block-hash-index\n\
+\n\
+[image.appfs]\n\
+filename=shared.img\n\
+adaptive=block-hash-index\n\
+";
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	pathname = write_random_file(fixture->contentdir, "shared.img", 64*1024, 42);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	g_assert_cmpuint(g_list_length(bundle->manifest->images), ==, 2);
+	rootfs = g_list_nth_data(bundle->manifest->images, 0);
+	appfs = g_list_nth_data(bundle->manifest->images, 1);
+	g_assert_cmpstr(rootfs->filename, ==, "shared.img");
+	g_assert_cmpstr(appfs->filename, ==, "shared.img");
+	g_assert_nonnull(rootfs->checksum.digest);
+	g_assert_cmpstr(rootfs->checksum.digest, ==, appfs->checksum.digest);
+	g_assert_cmpint(rootfs->checksum.size, ==, 64*1024);
+	g_assert_cmpint(appfs->checksum.size, ==, 64*1024);
+
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	filepath = g_build_filename(outputdir, "shared.img.block-hash-index", NULL);
+	g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+}
+
+/* Checks that the aligned image extracted to outputdir has the original
+ * content. */
+static void assert_aligned_image_extracted(RaucBundle *bundle, const gchar *outputdir, const gchar *original, gsize original_len)
+{
+	g_autofree gchar *filepath = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res = FALSE;
+	gsize len;
+
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	filepath = g_build_filename(outputdir, "rootfs.img", NULL);
+	g_assert_true(g_file_get_contents(filepath, &contents, &len, NULL));
+	g_assert_cmpmem(contents, len, original, original_len);
+	g_clear_pointer(&filepath, g_free);
+
+	filepath = g_build_filename(outputdir, "appfs.img", NULL);
+	g_assert_true(g_file_test(filepath, G_FILE_TEST_IS_REGULAR));
+}
+
+/* Tests creating, mounting, extracting and resigning a bundle with an
+ * aligned image. */
+static void bundle_test_aligned_images(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *resignbundle = NULL;
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *pathname = NULL;
+	g_autofree gchar *original = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	RaucImage *rootfs = NULL;
+	gsize original_len;
+	gboolean res = FALSE;
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n\
+aligned=true\n\
+\n\
+[image.appfs]\n\
+filename=appfs.img\n\
+";
+
+	replace_strdup(&r_context_conf()->certpath, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	replace_strdup(&r_context_conf()->keypath, "test/openssl-ca/dev/private/autobuilder-1.pem");
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	resignbundle = g_build_filename(fixture->tmpdir, "resigned-bundle.raucb", NULL);
+	g_assert_cmpint(g_mkdir(fixture->contentdir, 0777), ==, 0);
+
+	pathname = write_random_file(fixture->contentdir, "rootfs.img", 256*1024, 42);
+	g_assert_nonnull(pathname);
+	g_assert_true(g_file_get_contents(pathname, &original, &original_len, NULL));
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_random_file(fixture->contentdir, "appfs.img", 64*1024, 23);
+	g_assert_nonnull(pathname);
+	g_clear_pointer(&pathname, g_free);
+	pathname = write_tmp_file(fixture->contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(pathname);
+
+	create_content_bundle(fixture, fixture->bundlename);
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	for (GList *l = bundle->manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (g_str_equal(image->slotclass, "rootfs"))
+			rootfs = image;
+		else
+			g_assert_false(image->aligned);
+	}
+	g_assert_nonnull(rootfs);
+	g_assert_true(rootfs->aligned);
+	g_assert_cmpuint(rootfs->payload_offset, >, 0);
+	g_assert_cmpuint(rootfs->payload_offset % 4096, ==, 0);
+
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+	assert_aligned_image_extracted(bundle, outputdir, original, original_len);
+	g_clear_pointer(&outputdir, g_free);
+
+	/* mount needs to run as root */
+	if (test_running_as_root()) {
+		g_autofree gchar *contents = NULL;
+		gsize len;
+
+		res = mount_bundle(bundle, &ierror);
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+
+		/* the image is provided by a loop device instead of the squashfs */
+		g_assert_nonnull(rootfs->payload_dev);
+		g_assert_cmpstr(r_image_get_data_path(rootfs), ==, rootfs->payload_dev);
+		g_assert_true(g_file_get_contents(rootfs->payload_dev, &contents, &len, NULL));
+		g_assert_cmpmem(contents, len, original, original_len);
+
+		res = umount_bundle(bundle, &ierror);
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+		g_assert_null(rootfs->payload_dev);
+	}
+
+	/* the appended image and its offset are kept when resigning */
+	res = resign_bundle(bundle, resignbundle, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	res = check_bundle(resignbundle, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	outputdir = g_build_filename(fixture->tmpdir, "output-resigned", NULL);
+	assert_aligned_image_extracted(bundle, outputdir, original, original_len);
+}
+
 static void bundle_test_replace_signature(BundleFixture *fixture,
 		gconstpointer user_data)
 {
@@ -854,6 +1536,51 @@ int main(int argc, char *argv[])
 				bundle_fixture_tear_down);
 	}
 
+	g_test_add("/bundle/dedup_images",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_dedup_images,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/dedup_images/keep_names",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_dedup_images_keep_names,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/dedup_images/rebuild",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_dedup_images_rebuild,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/sparse_staging",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_sparse_staging,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/verity_tail",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_verity_tail,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/verity_tail/duplicates",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_verity_tail_duplicates,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/verity_tail/duplicate_images",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_verity_tail_duplicate_images,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/shared_image_file",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_shared_image_file,
+			bundle_fixture_tear_down);
+
+	g_test_add("/bundle/aligned_images",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_aligned_images,
+			bundle_fixture_tear_down);
+
 	/* test casync manifest contents */
 	g_test_add("/bundle/check_casync/old",
 			BundleFixture, bundle_data,
@@ -0,0 +1,138 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+	RaucSlot *slot;
+	RaucImage *image;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->slot = g_new0(RaucSlot, 1);
+	fixture->slot->name = g_strdup("rootfs.0");
+	fixture->slot->device = g_build_filename(fixture->tmpdir, "slot.img", NULL);
+	fixture->slot->data_directory = g_strdup(fixture->tmpdir);
+
+	fixture->image = g_new0(RaucImage, 1);
+	fixture->image->filename = g_strdup("rootfs.img");
+	fixture->image->checksum.type = G_CHECKSUM_SHA256;
+	fixture->image->checksum.digest = g_strdup("0b7e3c0bf5bdd84e3c1d6cbb1d5c3e3a0c6e49fb4ac2bf4a2c1e4c2d1f3e6a0b");
+	fixture->image->checksum.size = R_CHECKPOINT_INTERVAL + 4096;
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	r_slot_free(fixture->slot);
+	r_free_image(fixture->image);
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tmpdir);
+}
+
+/* Writes a zero-filled interval to the slot device and records it. */
+static void write_first_interval(Fixture *fixture, RaucCheckpoint *checkpoint)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree guint8 *buffer = g_malloc0(1024*1024);
+	int fd;
+
+	fd = g_open(fixture->slot->device, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_cmpint(ftruncate(fd, fixture->image->checksum.size), ==, 0);
+
+	for (guint i = 0; i < R_CHECKPOINT_INTERVAL / (1024*1024); i++) {
+		g_assert_true(r_checkpoint_update(checkpoint, fd, buffer, 1024*1024, &error));
+		g_assert_no_error(error);
+	}
+	/* partial range is not recorded */
+	g_assert_true(r_checkpoint_update(checkpoint, fd, buffer, 4096, &error));
+	g_assert_no_error(error);
+
+	g_close(fd, NULL);
+}
+
+static void test_resume(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(RaucCheckpoint) checkpoint = NULL;
+	g_autoptr(RaucCheckpoint) resumed = NULL;
+
+	checkpoint = r_checkpoint_new(fixture->slot, fixture->image, "bundlehash");
+	g_assert_nonnull(checkpoint);
+	g_assert_cmpint(r_checkpoint_resume(checkpoint), ==, 0);
+
+	write_first_interval(fixture, checkpoint);
+	g_assert_cmpint(checkpoint->offset, ==, R_CHECKPOINT_INTERVAL);
+	g_assert_true(g_file_test(checkpoint->filename, G_FILE_TEST_IS_REGULAR));
+
+	resumed = r_checkpoint_new(fixture->slot, fixture->image, "bundlehash");
+	g_assert_cmpint(r_checkpoint_resume(resumed), ==, R_CHECKPOINT_INTERVAL);
+	g_assert_cmpuint(resumed->range_hashes->len, ==, 1);
+
+	r_checkpoint_remove(resumed);
+	g_assert_false(g_file_test(checkpoint->filename, G_FILE_TEST_EXISTS));
+}
+
+static void test_resume_mismatch(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(RaucCheckpoint) checkpoint = NULL;
+	g_autoptr(RaucCheckpoint) other = NULL;
+	g_autoptr(RaucCheckpoint) modified = NULL;
+	g_autoptr(GError) error = NULL;
+	int fd;
+
+	checkpoint = r_checkpoint_new(fixture->slot, fixture->image, "bundlehash");
+	write_first_interval(fixture, checkpoint);
+
+	/* a checkpoint of a different bundle is discarded */
+	other = r_checkpoint_new(fixture->slot, fixture->image, "otherhash");
+	g_assert_cmpint(r_checkpoint_resume(other), ==, 0);
+	g_assert_false(g_file_test(checkpoint->filename, G_FILE_TEST_EXISTS));
+
+	/* modified data on the device must not resume */
+	g_clear_pointer(&checkpoint, r_checkpoint_free);
+	checkpoint = r_checkpoint_new(fixture->slot, fixture->image, "bundlehash");
+	write_first_interval(fixture, checkpoint);
+
+	fd = g_open(fixture->slot->device, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_true(r_pwrite_exact(fd, (const guint8 *)"x", 1, 4096, &error));
+	g_assert_no_error(error);
+	g_close(fd, NULL);
+
+	modified = r_checkpoint_new(fixture->slot, fixture->image, "bundlehash");
+	g_assert_cmpint(r_checkpoint_resume(modified), ==, 0);
+	g_assert_false(g_file_test(checkpoint->filename, G_FILE_TEST_EXISTS));
+}
+
+static void test_no_data_directory(Fixture *fixture, gconstpointer user_data)
+{
+	g_clear_pointer(&fixture->slot->data_directory, g_free);
+
+	g_assert_null(r_checkpoint_new(fixture->slot, fixture->image, NULL));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/checkpoint/resume", Fixture, NULL, fixture_set_up, test_resume, fixture_tear_down);
+	g_test_add("/checkpoint/resume-mismatch", Fixture, NULL, fixture_set_up, test_resume_mismatch, fixture_tear_down);
+	g_test_add("/checkpoint/no-data-directory", Fixture, NULL, fixture_set_up, test_no_data_directory, fixture_tear_down);
+
+	return g_test_run();
+}
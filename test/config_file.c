@@ -1203,6 +1203,96 @@ send-headers=boot-id;uptime";
 	g_assert_true(res);
 	g_assert_nonnull(config);
 	g_assert_cmpint(g_strv_length(config->enabled_headers), ==, 2);
+	g_assert_cmpuint(config->streaming_cache_size, ==, DEFAULT_STREAMING_CACHE_SIZE);
+	g_assert_cmpuint(config->streaming_read_ahead, ==, DEFAULT_STREAMING_READ_AHEAD);
+	g_assert_cmpuint(config->streaming_connections, ==, 1);
+}
+
+static void config_file_resources(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[resources]\n\
+io-class=best-effort\n\
+io-priority=6\n\
+write-bandwidth=4M\n\
+nice=10\n\
+cpu-affinity=0;1";
+
+	pathname = write_tmp_file(fixture->tmpdir, "resources.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpint(config->resources.io_class, ==, R_IO_CLASS_BEST_EFFORT);
+	g_assert_cmpint(config->resources.io_priority, ==, 6);
+	g_assert_cmpuint(config->resources.write_bandwidth, ==, 4*1024*1024);
+	g_assert_true(config->resources.nice_set);
+	g_assert_cmpint(config->resources.nice, ==, 10);
+	g_assert_cmpuint(config->resources.cpu_affinity_len, ==, 2);
+	g_assert_cmpint(config->resources.cpu_affinity[1], ==, 1);
+}
+
+static void config_file_resources_invalid(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[resources]\n\
+io-class=background";
+
+	pathname = write_tmp_file(fixture->tmpdir, "resources.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
+static void config_file_resources_invalid_priority(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[resources]\n\
+io-class=best-effort\n\
+io-priority=-2";
+
+	pathname = write_tmp_file(fixture->tmpdir, "resources.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT);
+	g_assert_false(res);
+	g_assert_null(config);
 }
 
 static void config_file_send_headers_invalid_item(ConfigFileFixture *fixture,
@@ -1230,6 +1320,55 @@ send-headers=transaction-id;invalid-key";
 	g_assert_null(config);
 }
 
+static void config_file_streaming_options(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[streaming]\n\
+cache-size=8M\n\
+read-ahead=512K\n\
+max-streams=8\n\
+max-retries=0\n\
+request-timeout=30\n\
+connections=2\n\
+device-read-ahead=1M\n\
+bandwidth-limit=2M\n\
+lan-cache=http://cache.local:8080\n\
+disk-cache-directory=/data/rauc-cache\n\
+disk-cache-size=64M";
+
+	pathname = write_tmp_file(fixture->tmpdir, "streaming.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpuint(config->streaming_cache_size, ==, 8*1024*1024);
+	g_assert_cmpuint(config->streaming_read_ahead, ==, 512*1024);
+	g_assert_cmpuint(config->streaming_max_streams, ==, 8);
+	g_assert_cmpuint(config->streaming_max_retries, ==, 0);
+	g_assert_cmpuint(config->streaming_connect_timeout, ==, DEFAULT_STREAMING_CONNECT_TIMEOUT);
+	g_assert_cmpuint(config->streaming_request_timeout, ==, 30);
+	g_assert_cmpuint(config->streaming_connections, ==, 2);
+	g_assert_cmpuint(config->streaming_device_max_request, ==, 0);
+	g_assert_cmpuint(config->streaming_device_read_ahead, ==, 1024*1024);
+	g_assert_cmpuint(config->streaming_max_concurrency, ==, DEFAULT_STREAMING_MAX_CONCURRENCY);
+	g_assert_cmpuint(config->streaming_bandwidth_limit, ==, 2*1024*1024);
+	g_assert_cmpstr(config->streaming_lan_cache, ==, "http://cache.local:8080");
+	g_assert_cmpstr(config->streaming_disk_cache_directory, ==, "/data/rauc-cache");
+	g_assert_cmpuint(config->streaming_disk_cache_size, ==, 64*1024*1024);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -1333,6 +1472,18 @@ int main(int argc, char *argv[])
 	g_test_add("/config-file/send-headers-invalid-value", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_send_headers_invalid_item,
 			config_file_fixture_tear_down);
+	g_test_add("/config-file/streaming-options", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_streaming_options,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/resources", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_resources,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/resources-invalid", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_resources_invalid,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/resources-invalid-priority", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_resources_invalid_priority,
+			config_file_fixture_tear_down);
 
 	return g_test_run();
 }
@@ -339,6 +339,51 @@ static void crypt_decrypt_test(DMFixture *fixture,
 	g_close(fd, NULL);
 }
 
+/* Tests that r_crypt_encrypt_verity() produces the same encrypted payload
+ * and hash tree as r_crypt_encrypt() followed by r_verity_hash_create().
+ */
+static void crypt_encrypt_verity_test(DMFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *fused = NULL;
+	g_autofree gchar *separate = NULL;
+	g_autofree gchar *fused_data = NULL;
+	g_autofree gchar *separate_data = NULL;
+	g_autofree guint8 *key = r_hex_decode("761305cf2de9a8ff1708eac74676c606630425b22bb8212e5e2314e3e61e8ab5", 32);
+	g_autofree guint8 *salt = random_bytes(32, 0x5a17b33f);
+	guint8 fused_hash[32] = {0};
+	guint8 separate_hash[32] = {0};
+	guint64 verity_size = 0;
+	uint64_t combined_size = 0;
+	gsize fused_len, separate_len;
+	int fd;
+
+	/* more than one chunk per worker and more than one hash level */
+	filename = write_random_file(fixture->tmpdir, "data", 4096*2000, 0x0fdfc761);
+	g_assert_nonnull(filename);
+	fused = g_build_filename(fixture->tmpdir, "fused", NULL);
+	separate = g_build_filename(fixture->tmpdir, "separate", NULL);
+
+	g_assert_true(r_crypt_encrypt_verity(filename, fused, key, salt, fused_hash, &verity_size, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(r_crypt_encrypt(filename, separate, key, &error));
+	g_assert_no_error(error);
+	fd = g_open(separate, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >, 0);
+	g_assert_cmpint(r_verity_hash_create(fd, 2000, &combined_size, separate_hash, salt), ==, 0);
+	g_close(fd, NULL);
+
+	g_assert_cmpuint(verity_size, ==, (combined_size - 2000) * 4096);
+	g_assert_cmpmem(fused_hash, 32, separate_hash, 32);
+
+	g_assert_true(g_file_get_contents(fused, &fused_data, &fused_len, NULL));
+	g_assert_true(g_file_get_contents(separate, &separate_data, &separate_len, NULL));
+	g_assert_cmpmem(fused_data, fused_len, separate_data, separate_len);
+}
+
 static void verity_hash_create(DMFixture *fixture,
 		gconstpointer user_data)
 {
@@ -550,6 +595,8 @@ int main(int argc, char *argv[])
 	valid_key = FALSE;
 	g_test_add("/dm/crypt_encrypt/invalid_key", DMFixture, &valid_key, dm_fixture_set_up, crypt_encrypt_test, dm_fixture_tear_down);
 
+	g_test_add("/dm/crypt_encrypt_verity", DMFixture, NULL, dm_fixture_set_up, crypt_encrypt_verity_test, dm_fixture_tear_down);
+
 	g_test_add("/dm/crypt_create", DMFixture, NULL, dm_fixture_set_up, crypt_create, dm_fixture_tear_down);
 
 	return g_test_run();
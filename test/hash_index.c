@@ -282,6 +282,56 @@ static void test_ranges(Fixture *fixture, gconstpointer user_data)
 	g_clear_pointer(&hash, g_free);
 }
 
+/* The builder must produce the same file as exporting an opened index, for
+ * any split of the input data. */
+static void test_builder(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autoptr(RaucHashIndexBuilder) builder = NULL;
+	g_autoptr(RaucHashIndexBuilder) unaligned = NULL;
+	g_autofree gchar *data = NULL;
+	g_autofree gchar *expected = NULL;
+	g_autofree gchar *built = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_autofree gchar *builder_filename = NULL;
+	gsize data_len, expected_len, built_len;
+	gsize offset = 0;
+	int datafd = -1;
+
+	datafd = g_open("test/dummy.verity", O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	index = r_hash_index_open("test", datafd, NULL, &error);
+	g_assert_no_error(error);
+	index_filename = g_build_filename(fixture->tmpdir, "index", NULL);
+	g_assert_true(r_hash_index_export(index, index_filename, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(g_file_get_contents("test/dummy.verity", &data, &data_len, NULL));
+
+	/* feed the data in odd-sized pieces */
+	builder = r_hash_index_builder_new();
+	for (gsize step = 1; offset < data_len; step = step * 3 + 7) {
+		gsize len = MIN(step, data_len - offset);
+
+		r_hash_index_builder_update(builder, (const guint8 *)data + offset, len);
+		offset += len;
+	}
+	builder_filename = g_build_filename(fixture->tmpdir, "builder", NULL);
+	g_assert_true(r_hash_index_builder_export(builder, builder_filename, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(g_file_get_contents(index_filename, &expected, &expected_len, NULL));
+	g_assert_true(g_file_get_contents(builder_filename, &built, &built_len, NULL));
+	g_assert_cmpmem(built, built_len, expected, expected_len);
+
+	/* incomplete chunks are rejected */
+	unaligned = r_hash_index_builder_new();
+	r_hash_index_builder_update(unaligned, (const guint8 *)data, 4097);
+	g_assert_false(r_hash_index_builder_export(unaligned, builder_filename, &error));
+	g_assert_error(error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_SIZE);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -290,6 +340,7 @@ int main(int argc, char *argv[])
 
 	g_test_add("/hash_index/basic", Fixture, NULL, fixture_set_up, test_basic, fixture_tear_down);
 	g_test_add("/hash_index/ranges", Fixture, NULL, fixture_set_up, test_ranges, fixture_tear_down);
+	g_test_add("/hash_index/builder", Fixture, NULL, fixture_set_up, test_builder, fixture_tear_down);
 
 	return g_test_run();
 }
@@ -176,6 +176,30 @@ adaptive=adaptive-test-method;block-hash-index";
 	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
 }
 
+static void install_fixture_set_up_bundle_aligned(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	InstallData *data = (InstallData*) user_data;
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.ext4\n\
+aligned=true\n\
+\n\
+[image.appfs]\n\
+filename=appfs.ext4";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	fixture_helper_set_up_system(fixture->tmpdir, NULL);
+	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
+}
+
 static void install_fixture_set_up_system_conf(InstallFixture *fixture,
 		gconstpointer user_data)
 {
@@ -1019,6 +1043,106 @@ device=/dev/null\n\
 	g_assert_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED);
 }
 
+/* Test that the slot status is invalidated before the target slot is
+ * discarded, as its content is lost as soon as the discard starts. */
+static void test_install_discard_status(void)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *sysconfpath = NULL;
+	g_autofree gchar *statuspath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *system_conf = NULL;
+	g_autoptr(GBytes) data = NULL;
+	g_autoptr(RaucManifest) rm = NULL;
+	g_autoptr(GHashTable) tgrp = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) install_plans = NULL;
+	g_autoptr(GKeyFile) key_file = NULL;
+	g_autofree gchar *status = NULL;
+	gboolean res;
+
+#define MANIFEST_DISCARD "\
+[update]\n\
+compatible=foo\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n\
+sha256=b5bb9d8014a0f9b1d61e21e796d78dccdf1352f23cd32812f4850b878ae4944c\n\
+size=4\n\
+"
+
+	const gchar *status_file = "\
+[slot.rootfs.0]\n\
+status=ok\n\
+sha256=7d865e959b2466918c9863afca942d0fb89d7c9ac0c99bafc3749504ded97730\n\
+size=4\n\
+";
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	system_conf = g_strdup_printf("\
+[system]\n\
+compatible=foo\n\
+bootloader=barebox\n\
+statusfile=status.raucs\n\
+\n\
+[slot.rootfs.0]\n\
+bootname=system0\n\
+device=%s/rootfs-0\n\
+type=raw\n\
+pre-discard=true\n\
+\n\
+[slot.rootfs.1]\n\
+bootname=system1\n\
+device=%s/rootfs-1\n\
+type=raw\n\
+", tmpdir, tmpdir);
+	sysconfpath = write_tmp_file(tmpdir, "test.conf", system_conf, NULL);
+	g_assert_nonnull(sysconfpath);
+	statuspath = write_tmp_file(tmpdir, "status.raucs", status_file, NULL);
+	g_assert_nonnull(statuspath);
+	slotpath = write_tmp_file(tmpdir, "rootfs-0", "old\n", NULL);
+	g_assert_nonnull(slotpath);
+
+	/* Set up context */
+	replace_strdup(&r_context_conf()->configpath, sysconfpath);
+	replace_strdup(&r_context_conf()->bootslot, "system1");
+	r_context();
+
+	data = g_bytes_new_static(MANIFEST_DISCARD, sizeof(MANIFEST_DISCARD));
+	res = load_manifest_mem(data, &rm, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	res = determine_slot_states(&error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	tgrp = determine_target_install_group();
+	g_assert_nonnull(tgrp);
+
+	install_plans = r_install_make_plans(rm, tgrp, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(install_plans);
+	g_assert_cmpint(install_plans->len, ==, 1);
+
+	res = r_install_start_discards(install_plans, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	/* the saved status must not describe the old content anymore */
+	key_file = g_key_file_new();
+	res = g_key_file_load_from_file(key_file, statuspath, G_KEY_FILE_NONE, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	status = g_key_file_get_string(key_file, "slot.rootfs.0", "status", NULL);
+	g_assert_cmpstr(status, ==, "pending");
+	g_assert_false(g_key_file_has_key(key_file, "slot.rootfs.0", "sha256", NULL));
+
+	g_clear_pointer(&install_plans, g_ptr_array_unref);
+	g_assert_true(test_rm_tree(tmpdir, ""));
+}
+
 static gboolean r_quit(gpointer data)
 {
 	g_assert_nonnull(r_loop);
@@ -1471,6 +1595,8 @@ int main(int argc, char *argv[])
 
 	g_test_add_func("/install/image-mapping/variants", test_install_image_variants);
 
+	g_test_add_func("/install/discard-status", test_install_discard_status);
+
 	g_test_add("/install/external_mounts", InstallFixture, NULL,
 			install_fixture_set_up_system_user, install_test_external_mount_points,
 			install_fixture_tear_down);
@@ -1586,5 +1712,15 @@ int main(int argc, char *argv[])
 			install_fixture_set_up_bundle_adaptive, install_test_bundle,
 			install_fixture_tear_down);
 
+	install_data = dup_test_data(ptrs, (&(InstallData) {
+		.manifest_test_options = {
+		        .format = R_MANIFEST_FORMAT_VERITY,
+		},
+	}));
+	g_test_add("/install/aligned",
+			InstallFixture, install_data,
+			install_fixture_set_up_bundle_aligned, install_test_bundle,
+			install_fixture_tear_down);
+
 	return g_test_run();
 }
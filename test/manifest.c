@@ -371,6 +371,67 @@ adaptive=invalid-method;another-invalid-method\n\
 	free_manifest(rm);
 }
 
+static void test_manifest_load_aligned(void)
+{
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *manifestpath = NULL;
+	g_autoptr(RaucManifest) rm = NULL;
+	g_autoptr(GError) error = NULL;
+	RaucImage *test_img = NULL;
+	gboolean res;
+	const gchar *mffile = "\
+[update]\n\
+compatible=FooCorp Super BarBazzer\n\
+version=2015.04-1\n\
+\n\
+[bundle]\n\
+format=verity\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs-default.ext4\n\
+sha256=0b7e3c0bf5bdd84e3c1d6cbb1d5c3e3a0c6e49fb4ac2bf4a2c1e4c2d1f3e6a0b\n\
+size=8192\n\
+aligned=true\n\
+payload-offset=12288\n\
+";
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+
+	manifestpath = write_tmp_file(tmpdir, "manifest.raucm", mffile, NULL);
+	g_assert_nonnull(manifestpath);
+
+	res = load_manifest_file(manifestpath, &rm, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	test_img = (RaucImage*)g_list_nth_data(rm->images, 0);
+	g_assert_nonnull(test_img);
+	g_assert_true(test_img->aligned);
+	g_assert_cmpuint(test_img->payload_offset, ==, 12288);
+	g_assert_cmpstr(r_image_get_data_path(test_img), ==, "rootfs-default.ext4");
+
+	/* offsets are only valid in the signed manifest */
+	res = check_manifest_internal(rm, &error);
+	g_assert_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR);
+	g_assert_false(res);
+	g_clear_error(&error);
+
+	test_img->payload_offset = 0;
+	res = check_manifest_internal(rm, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	/* aligned images need a verity protected payload */
+	rm->bundle_format = R_MANIFEST_FORMAT_PLAIN;
+	res = check_manifest_internal(rm, &error);
+	g_assert_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR);
+	g_assert_false(res);
+	g_clear_error(&error);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 static void test_manifest_load_meta(void)
 {
 	gchar *tmpdir;
@@ -739,6 +800,7 @@ int main(int argc, char *argv[])
 	g_test_add_func("/manifest/load_mem", test_load_manifest_mem);
 	g_test_add_func("/manifest/load_variants", test_manifest_load_variants);
 	g_test_add_func("/manifest/load_adaptive", test_manifest_load_adaptive);
+	g_test_add_func("/manifest/load_aligned", test_manifest_load_aligned);
 	g_test_add_func("/manifest/load_meta", test_manifest_load_meta);
 	g_test_add_func("/manifest/load_details", test_manifest_load_details);
 	g_test_add_func("/manifest/invalid_hook_name", test_manifest_invalid_hook_name);
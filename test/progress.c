@@ -162,6 +162,41 @@ static void progress_test_weighted_steps(void)
 	g_assert_cmpint(callback_counter, ==, 13);
 }
 
+static gpointer progress_muted_thread(gpointer data)
+{
+	r_context_mute_progress(TRUE);
+
+	/* none of these may touch the step stack of the main thread */
+	r_context_begin_step("test_thread", "testing step in thread", 0);
+	r_context_set_step_percentage("test_thread", 50);
+	r_context_end_step("test_thread", TRUE);
+
+	return NULL;
+}
+
+static void progress_test_muted_thread(void)
+{
+	GThread *thread;
+
+	/* reset global state */
+	callback_counter = 0;
+	last_percentage = 0;
+
+	r_context_begin_step("test_1", "testing step 1", 1);
+
+	thread = g_thread_new("muted", progress_muted_thread, NULL);
+	g_thread_join(thread);
+
+	g_assert_cmpint(g_list_length(r_context()->progress), ==, 1);
+	g_assert_cmpint(callback_counter, ==, 1);
+
+	r_context_begin_step("test_1.1", "testing step 1.1", 0);
+	r_context_end_step("test_1.1", TRUE);
+	r_context_end_step("test_1", TRUE);
+	g_assert_cmpint(last_percentage, ==, 100);
+	g_assert_cmpint(callback_counter, ==, 4);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -180,6 +215,7 @@ int main(int argc, char *argv[])
 	g_test_add_func("/progress/test_unsuccessful_substep", progress_test_unsuccessful_substep);
 	g_test_add_func("/progress/test_explicit_percentage", progress_test_explicit_percentage);
 	g_test_add_func("/progress/test_weighted_steps", progress_test_weighted_steps);
+	g_test_add_func("/progress/test_muted_thread", progress_test_muted_thread);
 
 	return g_test_run();
 }
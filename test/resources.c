@@ -0,0 +1,159 @@
+#include <locale.h>
+#include <glib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "resources.h"
+
+/* see linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static void resources_test_check(void)
+{
+	RaucResourceLimits limits;
+	g_autoptr(GError) error = NULL;
+
+	r_resources_init(&limits);
+	g_assert_true(r_resources_check(&limits, &error));
+	g_assert_no_error(error);
+
+	limits.io_priority = 7;
+	g_assert_true(r_resources_check(&limits, &error));
+	g_assert_no_error(error);
+
+	limits.io_priority = 8;
+	g_assert_false(r_resources_check(&limits, &error));
+	g_assert_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID);
+	g_clear_error(&error);
+
+	limits.io_priority = -2;
+	g_assert_false(r_resources_check(&limits, &error));
+	g_assert_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID);
+	g_clear_error(&error);
+
+	r_resources_init(&limits);
+	limits.nice_set = TRUE;
+	limits.nice = 20;
+	g_assert_false(r_resources_check(&limits, &error));
+	g_assert_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID);
+	g_clear_error(&error);
+
+	r_resources_clear(&limits);
+}
+
+static void resources_test_merge(void)
+{
+	RaucResourceLimits dest, src;
+
+	r_resources_init(&dest);
+	r_resources_init(&src);
+
+	dest.io_class = R_IO_CLASS_BEST_EFFORT;
+	dest.io_priority = 6;
+	dest.write_bandwidth = 1024;
+
+	/* unset values must not override anything */
+	r_resources_merge(&dest, &src);
+	g_assert_cmpint(dest.io_class, ==, R_IO_CLASS_BEST_EFFORT);
+	g_assert_cmpint(dest.io_priority, ==, 6);
+	g_assert_cmpuint(dest.write_bandwidth, ==, 1024);
+	g_assert_false(dest.nice_set);
+
+	src.io_priority = 0;
+	src.nice_set = TRUE;
+	src.nice = 5;
+	src.cpu_affinity = g_new0(gint, 1);
+	src.cpu_affinity_len = 1;
+	r_resources_merge(&dest, &src);
+	g_assert_cmpint(dest.io_priority, ==, 0);
+	g_assert_true(dest.nice_set);
+	g_assert_cmpint(dest.nice, ==, 5);
+	g_assert_cmpuint(dest.cpu_affinity_len, ==, 1);
+	g_assert_true(dest.cpu_affinity != src.cpu_affinity);
+
+	r_resources_clear(&dest);
+	r_resources_clear(&src);
+}
+
+static void resources_test_parse_io_class(void)
+{
+	g_autoptr(GError) error = NULL;
+	RIOClass io_class = R_IO_CLASS_NONE;
+
+	g_assert_true(r_resources_parse_io_class("idle", &io_class, &error));
+	g_assert_no_error(error);
+	g_assert_cmpint(io_class, ==, R_IO_CLASS_IDLE);
+
+	g_assert_false(r_resources_parse_io_class("background", &io_class, &error));
+	g_assert_error(error, R_RESOURCES_ERROR, R_RESOURCES_ERROR_INVALID);
+	g_assert_cmpint(io_class, ==, R_IO_CLASS_IDLE);
+}
+
+static gpointer apply_priority_thread(gpointer data)
+{
+	RaucResourceLimits limits;
+	GError *error = NULL;
+
+	r_resources_init(&limits);
+	/* lowering the best-effort priority is allowed without privileges */
+	limits.io_class = R_IO_CLASS_BEST_EFFORT;
+	limits.io_priority = 7;
+	g_assert_true(r_resources_apply(&limits, &error));
+	g_assert_no_error(error);
+
+	return GINT_TO_POINTER(syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0));
+}
+
+static void resources_test_apply_priority(void)
+{
+	GThread *thread;
+	gint prio;
+
+	/* the I/O priority is per-thread, so keep it away from the test runner */
+	thread = g_thread_new("apply-priority", apply_priority_thread, NULL);
+	prio = GPOINTER_TO_INT(g_thread_join(thread));
+
+	g_assert_cmpint(prio, ==, (R_IO_CLASS_BEST_EFFORT << IOPRIO_CLASS_SHIFT) | 7);
+}
+
+static void resources_test_throttle(void)
+{
+	RaucResourceLimits limits;
+	g_autoptr(GError) error = NULL;
+	gint64 start, elapsed;
+
+	r_resources_init(&limits);
+	limits.write_bandwidth = 1024 * 1024;
+	g_assert_true(r_resources_apply(&limits, &error));
+	g_assert_no_error(error);
+
+	/* 256 KiB at 1 MiB/s take 250ms, as the bucket starts empty */
+	start = g_get_monotonic_time();
+	for (guint i = 0; i < 4; i++)
+		r_resources_throttle_write(64 * 1024);
+	elapsed = g_get_monotonic_time() - start;
+	g_assert_cmpint(elapsed, >=, 200 * 1000);
+
+	/* without a limit, writes must not be delayed */
+	r_resources_reset();
+	start = g_get_monotonic_time();
+	r_resources_throttle_write(64 * 1024 * 1024);
+	elapsed = g_get_monotonic_time() - start;
+	g_assert_cmpint(elapsed, <, 100 * 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/resources/check", resources_test_check);
+	g_test_add_func("/resources/merge", resources_test_merge);
+	g_test_add_func("/resources/parse-io-class", resources_test_parse_io_class);
+	g_test_add_func("/resources/apply-priority", resources_test_apply_priority);
+	g_test_add_func("/resources/throttle", resources_test_throttle);
+
+	return g_test_run();
+}
@@ -16,6 +16,7 @@ typedef struct {
 	CMS_ContentInfo *cms;
 	X509_STORE *store;
 	STACK_OF(X509) *verified_chain;
+	gchar *tmpdir;
 } SignatureFixture;
 
 static void signature_set_up(SignatureFixture *fixture,
@@ -34,6 +35,7 @@ static void signature_set_up(SignatureFixture *fixture,
 	g_assert_true(X509_STORE_load_locations(fixture->store, "test/openssl-ca/dev-ca.pem", NULL));
 
 	fixture->verified_chain = NULL;
+	fixture->tmpdir = NULL;
 }
 
 static void signature_tear_down(SignatureFixture *fixture,
@@ -48,6 +50,10 @@ static void signature_tear_down(SignatureFixture *fixture,
 	if (fixture->verified_chain)
 		sk_X509_pop_free(fixture->verified_chain, X509_free);
 
+	if (fixture->tmpdir)
+		g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_clear_pointer(&fixture->tmpdir, g_free);
+
 	r_context_clean();
 }
 
@@ -275,6 +281,102 @@ static void signature_verify_file(SignatureFixture *fixture,
 	g_clear_error(&fixture->error);
 }
 
+static void signature_verify_file_large(SignatureFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *filename = NULL;
+	g_autofree guint8 *data = NULL;
+	/* spans multiple read chunks, with a partial one at the end */
+	gsize size = 9 * 1024 * 1024 + 1234;
+	gint fd;
+	gboolean res;
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	filename = g_build_filename(fixture->tmpdir, "content", NULL);
+
+	data = g_malloc(size + 4096);
+	for (gsize i = 0; i < size + 4096; i++)
+		data[i] = i % 253;
+	g_assert_true(g_file_set_contents(filename, (gchar *)data, size, NULL));
+
+	fixture->sig = cms_sign_file(filename,
+			"test/openssl-ca/rel/release-1.cert.pem",
+			"test/openssl-ca/rel/private/release-1.pem",
+			NULL,
+			&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_nonnull(fixture->sig);
+
+	/* data after the limit (such as the signature) is ignored */
+	g_assert_true(g_file_set_contents(filename, (gchar *)data, size + 4096, NULL));
+	fd = g_open(filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	res = cms_verify_fd(fd,
+			fixture->sig,
+			size,
+			fixture->store,
+			&fixture->cms,
+			&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_true(res);
+	g_assert_nonnull(fixture->cms);
+
+	g_clear_pointer(&fixture->cms, CMS_ContentInfo_free);
+
+	/* a limit beyond the end of the file must fail */
+	res = cms_verify_fd(fd,
+			fixture->sig,
+			size + 8192,
+			fixture->store,
+			&fixture->cms,
+			&fixture->error);
+	g_close(fd, NULL);
+	g_assert_false(res);
+	g_assert_error(fixture->error, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_PARSE);
+	g_assert_null(fixture->cms);
+
+	g_clear_error(&fixture->error);
+}
+
+/* Verifies more often than OpenSSL has indexes for custom BIO types. */
+static void signature_verify_file_repeated(SignatureFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *filename = NULL;
+	gint fd;
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	filename = g_build_filename(fixture->tmpdir, "content", NULL);
+	g_assert_true(g_file_set_contents(filename,
+			g_bytes_get_data(fixture->content, NULL),
+			g_bytes_get_size(fixture->content), NULL));
+
+	fixture->sig = cms_sign_file(filename,
+			"test/openssl-ca/rel/release-1.cert.pem",
+			"test/openssl-ca/rel/private/release-1.pem",
+			NULL,
+			&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_nonnull(fixture->sig);
+
+	fd = g_open(filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	for (guint i = 0; i < 300; i++) {
+		gboolean res = cms_verify_fd(fd,
+				fixture->sig,
+				0,
+				fixture->store,
+				&fixture->cms,
+				&fixture->error);
+		g_assert_no_error(fixture->error);
+		g_assert_true(res);
+		g_clear_pointer(&fixture->cms, CMS_ContentInfo_free);
+	}
+	g_close(fd, NULL);
+}
+
 static void signature_loopback_detached(SignatureFixture *fixture,
 		gconstpointer user_data)
 {
@@ -829,6 +931,8 @@ int main(int argc, char *argv[])
 	g_test_add("/signature/verify_valid", SignatureFixture, NULL, signature_set_up, signature_verify_valid, signature_tear_down);
 	g_test_add("/signature/verify_invalid", SignatureFixture, NULL, signature_set_up, signature_verify_invalid, signature_tear_down);
 	g_test_add("/signature/verify_file", SignatureFixture, NULL, signature_set_up, signature_verify_file, signature_tear_down);
+	g_test_add("/signature/verify_file_large", SignatureFixture, NULL, signature_set_up, signature_verify_file_large, signature_tear_down);
+	g_test_add("/signature/verify_file_repeated", SignatureFixture, NULL, signature_set_up, signature_verify_file_repeated, signature_tear_down);
 	g_test_add("/signature/loopback_detached", SignatureFixture, NULL, signature_set_up, signature_loopback_detached, signature_tear_down);
 	g_test_add("/signature/loopback_inline", SignatureFixture, NULL, signature_set_up, signature_loopback_inline, signature_tear_down);
 	g_test_add("/signature/get_cert_chain", SignatureFixture, NULL, signature_set_up, signature_get_cert_chain, signature_tear_down);
@@ -0,0 +1,141 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "sparse.h"
+#include "utils.h"
+
+#include "common.h"
+
+#define BLOCK R_SPARSE_DEFAULT_BLOCK_SIZE
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *imagepath;
+	gchar *sparsepath;
+	gchar *outpath;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->imagepath = g_build_filename(fixture->tmpdir, "image.img", NULL);
+	fixture->sparsepath = g_build_filename(fixture->tmpdir, "image.simg", NULL);
+	fixture->outpath = g_build_filename(fixture->tmpdir, "out.img", NULL);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tmpdir);
+	g_free(fixture->imagepath);
+	g_free(fixture->sparsepath);
+	g_free(fixture->outpath);
+}
+
+/* Creates an image with zero, data and pattern blocks. */
+static GBytes *prepare_image(Fixture *fixture)
+{
+	guint8 *data = g_malloc0(16 * BLOCK);
+
+	/* blocks 0-3 zero, 4-6 data, 7-10 pattern, 11 data, 12-15 zero */
+	for (gsize i = 4 * BLOCK; i < 7 * BLOCK; i++)
+		data[i] = i % 251;
+	for (gsize i = 7 * BLOCK; i < 11 * BLOCK; i += 4)
+		memcpy(data + i, "RAUC", 4);
+	memset(data + 11 * BLOCK, 0x5a, BLOCK);
+	data[11 * BLOCK] = 0;
+
+	g_assert_true(g_file_set_contents(fixture->imagepath, (gchar *)data, 16 * BLOCK, NULL));
+
+	return g_bytes_new_take(data, 16 * BLOCK);
+}
+
+static void test_roundtrip(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GBytes) image = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *contents = NULL;
+	RaucSparseHeader header;
+	gsize length;
+	int in_fd, out_fd;
+
+	image = prepare_image(fixture);
+
+	g_assert_true(r_sparse_create(fixture->imagepath, fixture->sparsepath, &error));
+	g_assert_no_error(error);
+
+	in_fd = g_open(fixture->sparsepath, O_RDONLY | O_CLOEXEC);
+	g_assert_cmpint(in_fd, >=, 0);
+	g_assert_true(r_sparse_is_sparse(in_fd));
+	g_assert_true(r_sparse_read_header(in_fd, &header, &error));
+	g_assert_no_error(error);
+	g_assert_cmpuint(header.block_size, ==, BLOCK);
+	g_assert_cmpuint(header.total_blocks, ==, 16);
+	g_assert_cmpuint(header.total_chunks, ==, 5);
+	g_assert_cmpint(r_sparse_get_size(&header), ==, 16 * BLOCK);
+
+	/* stale content in the target must be overwritten by fills */
+	g_assert_true(g_file_set_contents(fixture->outpath, "stale", -1, NULL));
+	out_fd = g_open(fixture->outpath, O_WRONLY | O_CLOEXEC);
+	g_assert_cmpint(out_fd, >=, 0);
+	g_assert_true(r_sparse_write(in_fd, out_fd, &error));
+	g_assert_no_error(error);
+	g_close(in_fd, NULL);
+	g_close(out_fd, NULL);
+
+	g_assert_true(g_file_get_contents(fixture->outpath, &contents, &length, NULL));
+	g_assert_cmpmem(contents, length, g_bytes_get_data(image, NULL), g_bytes_get_size(image));
+}
+
+static void test_not_sparse(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GBytes) image = NULL;
+	g_autoptr(GError) error = NULL;
+	RaucSparseHeader header;
+	int fd;
+
+	image = prepare_image(fixture);
+
+	fd = g_open(fixture->imagepath, O_RDONLY | O_CLOEXEC);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_false(r_sparse_is_sparse(fd));
+	g_assert_false(r_sparse_read_header(fd, &header, &error));
+	g_assert_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID);
+	g_close(fd, NULL);
+}
+
+static void test_unaligned(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+
+	g_assert_true(g_file_set_contents(fixture->imagepath, "short", -1, NULL));
+
+	g_assert_false(r_sparse_create(fixture->imagepath, fixture->sparsepath, &error));
+	g_assert_error(error, R_SPARSE_ERROR, R_SPARSE_ERROR_INVALID);
+	g_assert_false(g_file_test(fixture->sparsepath, G_FILE_TEST_EXISTS));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	r_context_conf()->configpath = g_strdup("test/test.conf");
+	r_context();
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/sparse/roundtrip", Fixture, NULL, fixture_set_up, test_roundtrip, fixture_tear_down);
+	g_test_add("/sparse/not-sparse", Fixture, NULL, fixture_set_up, test_not_sparse, fixture_tear_down);
+	g_test_add("/sparse/unaligned", Fixture, NULL, fixture_set_up, test_unaligned, fixture_tear_down);
+
+	return g_test_run();
+}
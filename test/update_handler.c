@@ -103,6 +103,52 @@ static void test_get_custom_update_handler(UpdateHandlerFixture *fixture, gconst
 	g_assert_nonnull(handler);
 }
 
+/* Test update_handler/discard:
+ *
+ * Tests that only images written completely by RAUC allow discarding the
+ * target slot, and that discarding a device without support succeeds.
+ */
+static void test_discard(void)
+{
+	g_autoptr(RaucImage) image = NULL;
+	g_autoptr(RaucSlot) targetslot = NULL;
+	img_to_slot_handler handler;
+	GError *ierror = NULL;
+
+	image = g_new0(RaucImage, 1);
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup("rootfs.img");
+	image->checksum.size = 8192;
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup("/dev/null");
+	targetslot->type = g_strdup("raw");
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	g_assert_false(r_update_handler_can_discard(handler, image, targetslot));
+	targetslot->pre_discard = TRUE;
+	g_assert_true(r_update_handler_can_discard(handler, image, targetslot));
+
+	image->hooks.pre_install = TRUE;
+	g_assert_false(r_update_handler_can_discard(handler, image, targetslot));
+	image->hooks.pre_install = FALSE;
+
+	/* not a block device, so discard is skipped */
+	g_assert_true(r_update_handler_discard_slot(image, targetslot, &ierror));
+	g_assert_no_error(ierror);
+
+	g_free(image->filename);
+	image->filename = g_strdup("rootfs.img.caibx");
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_false(r_update_handler_can_discard(handler, image, targetslot));
+}
+
 #define SLOT_SIZE (10*1024*1024)
 #define IMAGE_SIZE (10*1024*1024)
 #define FILE_SIZE (10*1024)
@@ -1135,5 +1181,7 @@ int main(int argc, char *argv[])
 			test_update_handler,
 			update_handler_fixture_tear_down);
 
+	g_test_add_func("/update_handler/discard", test_discard);
+
 	return g_test_run();
 }
@@ -0,0 +1,200 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "utils.h"
+#include "zstd_seekable.h"
+
+#include "common.h"
+
+/* a partial last frame is included */
+#define IMAGE_SIZE (3 * R_ZSTD_FRAME_SIZE + 4096)
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *imagepath;
+	gchar *zstdpath;
+	gchar *outpath;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+
+	fixture->imagepath = g_build_filename(fixture->tmpdir, "image.img", NULL);
+	fixture->zstdpath = g_build_filename(fixture->tmpdir, "image.img.zst", NULL);
+	fixture->outpath = g_build_filename(fixture->tmpdir, "out.img", NULL);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tmpdir);
+	g_free(fixture->imagepath);
+	g_free(fixture->zstdpath);
+	g_free(fixture->outpath);
+}
+
+/* Creates an image with zero and data ranges. */
+static GBytes *prepare_image(Fixture *fixture)
+{
+	guint8 *data = g_malloc0(IMAGE_SIZE);
+
+	for (gsize i = R_ZSTD_FRAME_SIZE / 2; i < 2 * R_ZSTD_FRAME_SIZE; i++)
+		data[i] = (i * 7) % 251;
+	memset(data + IMAGE_SIZE - 4096, 0x5a, 4096);
+
+	g_assert_true(g_file_set_contents(fixture->imagepath, (gchar *)data, IMAGE_SIZE, NULL));
+
+	return g_bytes_new_take(data, IMAGE_SIZE);
+}
+
+static void test_roundtrip(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GBytes) image = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *contents = NULL;
+	const guint8 *expected;
+	guint8 buf[8192];
+	gsize length;
+	int in_fd, out_fd;
+
+	image = prepare_image(fixture);
+	expected = g_bytes_get_data(image, NULL);
+
+	g_assert_true(r_zstd_seekable_create(fixture->imagepath, fixture->zstdpath, &error));
+	g_assert_no_error(error);
+
+	in_fd = g_open(fixture->zstdpath, O_RDONLY | O_CLOEXEC);
+	g_assert_cmpint(in_fd, >=, 0);
+	g_assert_true(r_zstd_is_seekable(in_fd));
+	zs = r_zstd_seekable_open(in_fd, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(zs);
+	g_assert_cmpuint(r_zstd_seekable_get_size(zs), ==, IMAGE_SIZE);
+
+	/* reads crossing a frame boundary and at the end of the image */
+	g_assert_true(r_zstd_seekable_pread(zs, buf, sizeof(buf), R_ZSTD_FRAME_SIZE - 4096, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(buf, sizeof(buf), expected + R_ZSTD_FRAME_SIZE - 4096, sizeof(buf));
+	g_assert_true(r_zstd_seekable_pread(zs, buf, 4096, IMAGE_SIZE - 4096, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(buf, 4096, expected + IMAGE_SIZE - 4096, 4096);
+	g_assert_false(r_zstd_seekable_pread(zs, buf, sizeof(buf), IMAGE_SIZE - 4096, &error));
+	g_assert_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_FAILED);
+
+	/* stale content in the target must be overwritten */
+	g_assert_true(g_file_set_contents(fixture->outpath, "stale", -1, NULL));
+	out_fd = g_open(fixture->outpath, O_WRONLY | O_CLOEXEC);
+	g_assert_cmpint(out_fd, >=, 0);
+	g_assert_true(r_zstd_seekable_write(zs, out_fd, &error));
+	g_assert_no_error(error);
+	g_clear_pointer(&zs, r_zstd_seekable_free);
+	g_close(in_fd, NULL);
+	g_close(out_fd, NULL);
+
+	g_assert_true(g_file_get_contents(fixture->outpath, &contents, &length, NULL));
+	g_assert_cmpmem(contents, length, expected, IMAGE_SIZE);
+}
+
+static void test_not_seekable(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GBytes) image = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	g_autoptr(GError) error = NULL;
+	int fd;
+
+	image = prepare_image(fixture);
+
+	fd = g_open(fixture->imagepath, O_RDONLY | O_CLOEXEC);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_false(r_zstd_is_seekable(fd));
+	zs = r_zstd_seekable_open(fd, &error);
+	g_assert_null(zs);
+	g_assert_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID);
+	g_close(fd, NULL);
+}
+
+static void test_truncated(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GBytes) image = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *contents = NULL;
+	gsize length;
+	int fd;
+
+	image = prepare_image(fixture);
+	g_assert_true(r_zstd_seekable_create(fixture->imagepath, fixture->zstdpath, &error));
+	g_assert_no_error(error);
+
+	/* drop the first byte, so the seek table no longer matches */
+	g_assert_true(g_file_get_contents(fixture->zstdpath, &contents, &length, NULL));
+	g_assert_true(g_file_set_contents(fixture->zstdpath, contents + 1, length - 1, NULL));
+
+	/* the footer magic is still present */
+	fd = g_open(fixture->zstdpath, O_RDONLY | O_CLOEXEC);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_false(r_zstd_is_seekable(fd));
+	zs = r_zstd_seekable_open(fd, &error);
+	g_assert_null(zs);
+	g_assert_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID);
+	g_close(fd, NULL);
+}
+
+static void test_corrupt_table(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GBytes) image = NULL;
+	g_autoptr(RaucZstdSeekable) zs = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *contents = NULL;
+	guint32 n_frames;
+	gsize length;
+	int fd;
+
+	image = prepare_image(fixture);
+	g_assert_true(r_zstd_seekable_create(fixture->imagepath, fixture->zstdpath, &error));
+	g_assert_no_error(error);
+
+	/* clear the compressed size of the first frame (entries without
+	 * checksums are 8 bytes, the footer is 9 bytes) */
+	g_assert_true(g_file_get_contents(fixture->zstdpath, &contents, &length, NULL));
+	memcpy(&n_frames, contents + length - 9, sizeof(n_frames));
+	n_frames = GUINT32_FROM_LE(n_frames);
+	g_assert_cmpuint(n_frames, ==, 4);
+	memset(contents + length - 9 - n_frames * 8, 0, 4);
+	g_assert_true(g_file_set_contents(fixture->zstdpath, contents, length, NULL));
+
+	fd = g_open(fixture->zstdpath, O_RDONLY | O_CLOEXEC);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_false(r_zstd_is_seekable(fd));
+	zs = r_zstd_seekable_open(fd, &error);
+	g_assert_null(zs);
+	g_assert_error(error, R_ZSTD_ERROR, R_ZSTD_ERROR_INVALID);
+	g_close(fd, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	r_context_conf()->configpath = g_strdup("test/test.conf");
+	r_context();
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/zstd_seekable/roundtrip", Fixture, NULL, fixture_set_up, test_roundtrip, fixture_tear_down);
+	g_test_add("/zstd_seekable/not-seekable", Fixture, NULL, fixture_set_up, test_not_seekable, fixture_tear_down);
+	g_test_add("/zstd_seekable/truncated", Fixture, NULL, fixture_set_up, test_truncated, fixture_tear_down);
+	g_test_add("/zstd_seekable/corrupt-table", Fixture, NULL, fixture_set_up, test_corrupt_table, fixture_tear_down);
+
+	return g_test_run();
+}